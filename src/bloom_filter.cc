@@ -0,0 +1,73 @@
+#include <algorithm>
+#include <cmath>
+
+#include <glog/logging.h>
+
+#include "bloom_filter.h"
+
+using namespace std;
+
+namespace diodb {
+
+BloomFilter::BloomFilter() : num_probes_(0) {}
+
+BloomFilter::BloomFilter(const vector<uint64_t>& hashes,
+                         const int bits_per_key) {
+  CHECK_GT(bits_per_key, 0);
+
+  // The false positive rate is lowest with bits_per_key * ln(2) probes.
+  num_probes_ = min(max(static_cast<int>(bits_per_key * 0.69), 1), 30);
+
+  // Tiny filters have a high false positive rate, so use a minimum size.
+  const size_t num_bits = max<size_t>(hashes.size() * bits_per_key, 64);
+  bits_.resize((num_bits + 7) / 8, 0);
+
+  // Double hashing generates the probes from two halves of the hash, as
+  // described in "Less Hashing, Same Performance" (Kirsch & Mitzenmacher).
+  const uint64_t total_bits = bits_.size() * 8;
+  for (const uint64_t hash : hashes) {
+    uint32_t h = static_cast<uint32_t>(hash);
+    const uint32_t delta = static_cast<uint32_t>(hash >> 32);
+    for (int ii = 0; ii < num_probes_; ++ii) {
+      const uint64_t bit = h % total_bits;
+      bits_[bit / 8] |= 1 << (bit % 8);
+      h += delta;
+    }
+  }
+}
+
+uint64_t BloomFilter::Hash(const Buffer& key) {
+  // 64-bit FNV-1a, followed by a finalizer to spread the bits of short keys.
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char c : key) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1099511628211ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+bool BloomFilter::MayContain(const Buffer& key) const {
+  if (bits_.empty()) {
+    return true;
+  }
+
+  const uint64_t hash = Hash(key);
+  uint32_t h = static_cast<uint32_t>(hash);
+  const uint32_t delta = static_cast<uint32_t>(hash >> 32);
+  const uint64_t total_bits = bits_.size() * 8;
+  for (int ii = 0; ii < num_probes_; ++ii) {
+    const uint64_t bit = h % total_bits;
+    if ((bits_[bit / 8] & (1 << (bit % 8))) == 0) {
+      return false;
+    }
+    h += delta;
+  }
+  return true;
+}
+
+}  // namespace diodb
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "buffer.h"
+
+namespace diodb {
+
+// A Bloom filter over a set of keys. MayContain never returns false for a key
+// that was added, and returns true for a key that wasn't with a probability
+// that shrinks as 'bits_per_key' grows (about 1% at 10 bits per key).
+class BloomFilter {
+ public:
+  // An empty filter, which may contain anything.
+  BloomFilter();
+
+  // Builds a filter from the hashes of the keys it holds, as computed by Hash.
+  BloomFilter(const std::vector<uint64_t>& hashes, int bits_per_key);
+
+  // Hashes a key for the filter.
+  static uint64_t Hash(const Buffer& key);
+
+  // Returns false if the key is definitely not in the filter.
+  bool MayContain(const Buffer& key) const;
+
+  // Accessors.
+  bool empty() const { return bits_.empty(); }
+  size_t num_bits() const { return bits_.size() * 8; }
+
+ private:
+  // The filter bits.
+  std::vector<uint8_t> bits_;
+
+  // Number of bits set for each key.
+  int num_probes_;
+};
+
+}  // namespace diodb
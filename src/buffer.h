@@ -1,6 +1,8 @@
 #pragma once
 
 #include <algorithm>
+#include <cstdint>
+#include <limits>
 #include <string>
 #include <vector>
 
@@ -11,47 +13,99 @@ namespace diodb {
 // have a better handle on this.
 typedef std::vector<char> Buffer;
 
+// Every write is stamped with a sequence number that is larger than that of
+// any write before it. When a key has several versions, the one with the
+// highest sequence number is the newest.
+typedef uint64_t SequenceNumber;
+
+// Reading at this sequence number sees every version.
+constexpr SequenceNumber kMaxSequenceNumber =
+    std::numeric_limits<SequenceNumber>::max();
+
 struct Segment {
-  Segment(Buffer&& key_buf, Buffer&& val_buf, const bool del = false)
+  Segment(Buffer&& key_buf, Buffer&& val_buf, const bool del = false,
+          const SequenceNumber sequence = 0)
       : key_size(key_buf.size()),
         val_size(val_buf.size()),
         key(std::move(key_buf)),
         val(std::move(val_buf)),
-        delete_entry(del) {}
+        delete_entry(del),
+        value_ref(false),
+        range_delete(false),
+        merge_operand(false),
+        seq(sequence) {}
 
-  Segment(const Buffer& key_buf, const Buffer& val_buf, const bool del = false)
+  Segment(const Buffer& key_buf, const Buffer& val_buf, const bool del = false,
+          const SequenceNumber sequence = 0)
       : key_size(key_buf.size()),
         val_size(val_buf.size()),
         key(key_buf),
         val(val_buf),
-        delete_entry(del) {}
+        delete_entry(del),
+        value_ref(false),
+        range_delete(false),
+        merge_operand(false),
+        seq(sequence) {}
 
   Segment(const std::string& key_buf, const std::string& val_buf,
-          const bool del = false)
+          const bool del = false, const SequenceNumber sequence = 0)
       : key_size(key_buf.size()),
         val_size(val_buf.size()),
         key(key_buf.begin(), key_buf.end()),
         val(val_buf.begin(), val_buf.end()),
-        delete_entry(del) {}
+        delete_entry(del),
+        value_ref(false),
+        range_delete(false),
+        merge_operand(false),
+        seq(sequence) {}
 
-  Segment() : key_size(0), val_size(0), key(), val(), delete_entry(false) {}
+  Segment()
+      : key_size(0),
+        val_size(0),
+        key(),
+        val(),
+        delete_entry(false),
+        value_ref(false),
+        range_delete(false),
+        merge_operand(false),
+        seq(0) {}
 
   std::string DebugString() const {
     std::string k(key.begin(), key.end());
     std::string v(val.begin(), val.end());
     return "{ key_size=" + std::to_string(key_size) +
            ", val_size=" + std::to_string(val_size) + ", key=" + k +
-           ", val=" + v + ", delete=" + std::to_string(delete_entry) + " }";
+           ", val=" + v + ", delete=" + std::to_string(delete_entry) +
+           ", seq=" + std::to_string(seq) + " }";
   }
 
-  bool operator>(Segment other) const { return key > other.key; }
-  bool operator<(Segment other) const { return key < other.key; }
+  // Segments are ordered by key, and versions of the same key from newest to
+  // oldest.
+  bool operator<(const Segment& other) const {
+    return key < other.key || (key == other.key && seq > other.seq);
+  }
+  bool operator>(const Segment& other) const { return other < *this; }
 
   uint32_t key_size;
   uint32_t val_size;
   Buffer key;
   Buffer val;
   bool delete_entry;
+
+  // True if 'val' is a reference into the value log rather than the value
+  // itself. See ValueLog.
+  bool value_ref;
+
+  // True if the segment deletes every key in ['key', 'val') rather than
+  // writing a single one. Range deletes only travel through write batches and
+  // the write-ahead log; the tables keep them as RangeTombstones.
+  bool range_delete;
+
+  // True if 'val' is an operand for the MergeOperator, to be applied to the
+  // older version of the key, rather than a value.
+  bool merge_operand;
+
+  SequenceNumber seq;
 };
 typedef struct Segment Segment;
 
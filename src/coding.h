@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <boost/crc.hpp>
+
+#include "buffer.h"
+
+namespace diodb {
+namespace coding {
+
+// Fixed-width integers are stored in host byte order, which matches the way
+// IOHandle has always laid out segments on disk.
+
+inline void PutFixed32(Buffer* dst, const uint32_t val) {
+  const char* p = reinterpret_cast<const char*>(&val);
+  dst->insert(dst->end(), p, p + sizeof(val));
+}
+
+inline void PutFixed64(Buffer* dst, const uint64_t val) {
+  const char* p = reinterpret_cast<const char*>(&val);
+  dst->insert(dst->end(), p, p + sizeof(val));
+}
+
+inline uint32_t DecodeFixed32(const char* p) {
+  uint32_t val;
+  memcpy(&val, p, sizeof(val));
+  return val;
+}
+
+inline uint64_t DecodeFixed64(const char* p) {
+  uint64_t val;
+  memcpy(&val, p, sizeof(val));
+  return val;
+}
+
+// Number of bytes a segment occupies once encoded.
+inline size_t EncodedSegmentSize(const Segment& segment) {
+  return 2 * sizeof(uint32_t) + segment.key.size() + segment.val.size() +
+         sizeof(bool) + sizeof(SequenceNumber);
+}
+
+// Size of the header at the start of an encoded segment, which holds the key
+// and value sizes.
+constexpr size_t kSegmentHeaderSize = 2 * sizeof(uint32_t);
+
+// Number of bytes the encoded segment starting with 'header' occupies.
+inline size_t EncodedSegmentSize(const char* header) {
+  return kSegmentHeaderSize + DecodeFixed32(header) +
+         DecodeFixed32(header + sizeof(uint32_t)) + sizeof(bool) +
+         sizeof(SequenceNumber);
+}
+
+// Bits of the flags byte that follows the key and value of an encoded segment.
+// Older files only ever set the delete bit.
+constexpr char kSegmentDeleteFlag = 1;
+constexpr char kSegmentValueRefFlag = 2;
+constexpr char kSegmentRangeDeleteFlag = 4;
+constexpr char kSegmentMergeOperandFlag = 8;
+
+// Returns the flags byte of 'segment'.
+inline char SegmentFlags(const Segment& segment) {
+  return (segment.delete_entry ? kSegmentDeleteFlag : 0) |
+         (segment.value_ref ? kSegmentValueRefFlag : 0) |
+         (segment.range_delete ? kSegmentRangeDeleteFlag : 0) |
+         (segment.merge_operand ? kSegmentMergeOperandFlag : 0);
+}
+
+// Sets the fields of 'segment' described by a flags byte.
+inline void SetSegmentFlags(const char flags, Segment* segment) {
+  segment->delete_entry = flags & kSegmentDeleteFlag;
+  segment->value_ref = flags & kSegmentValueRefFlag;
+  segment->range_delete = flags & kSegmentRangeDeleteFlag;
+  segment->merge_operand = flags & kSegmentMergeOperandFlag;
+}
+
+// Appends the serialized form of a segment to 'dst'. This is the layout
+// IOHandle::SegmentWrite stores segments in.
+inline void EncodeSegment(const Segment& segment, Buffer* dst) {
+  PutFixed32(dst, segment.key.size());
+  PutFixed32(dst, segment.val.size());
+  dst->insert(dst->end(), segment.key.begin(), segment.key.end());
+  dst->insert(dst->end(), segment.val.begin(), segment.val.end());
+  dst->push_back(SegmentFlags(segment));
+  PutFixed64(dst, segment.seq);
+}
+
+// Decodes the segment starting at '*p', advancing '*p' past it. Returns false
+// without modifying '*p' if the segment would extend past 'limit'.
+inline bool DecodeSegment(const char** p, const char* limit,
+                          Segment* segment) {
+  const char* cur = *p;
+  if (limit - cur < static_cast<ptrdiff_t>(2 * sizeof(uint32_t))) {
+    return false;
+  }
+  const uint32_t key_size = DecodeFixed32(cur);
+  const uint32_t val_size = DecodeFixed32(cur + sizeof(uint32_t));
+  cur += 2 * sizeof(uint32_t);
+
+  if (static_cast<uint64_t>(limit - cur) <
+      static_cast<uint64_t>(key_size) + val_size + sizeof(bool) +
+          sizeof(SequenceNumber)) {
+    return false;
+  }
+
+  segment->key_size = key_size;
+  segment->val_size = val_size;
+  segment->key.assign(cur, cur + key_size);
+  cur += key_size;
+  segment->val.assign(cur, cur + val_size);
+  cur += val_size;
+  SetSegmentFlags(*cur, segment);
+  cur += sizeof(bool);
+  segment->seq = DecodeFixed64(cur);
+  cur += sizeof(SequenceNumber);
+
+  *p = cur;
+  return true;
+}
+
+// CRC32 of 'n' bytes at 'data'.
+inline uint32_t Checksum(const char* data, const size_t n) {
+  boost::crc_32_type crc;
+  crc.process_bytes(data, n);
+  return crc.checksum();
+}
+
+// The write-ahead log and the manifest are sequences of checksummed records,
+// each laid out as:
+//   [payload size (u32)][crc32 of payload (u32)][payload]
+constexpr size_t kRecordHeaderSize = 2 * sizeof(uint32_t);
+
+// Clears 'record' and leaves room for the header, so that the payload can be
+// appended right after it.
+inline void StartRecord(Buffer* record) {
+  record->clear();
+  record->resize(kRecordHeaderSize);
+}
+
+// Fills in the header of a record begun with StartRecord once its payload has
+// been appended.
+inline void FinishRecord(Buffer* record) {
+  const uint32_t payload_size = record->size() - kRecordHeaderSize;
+  const uint32_t crc =
+      Checksum(record->data() + kRecordHeaderSize, payload_size);
+  memcpy(record->data(), &payload_size, sizeof(uint32_t));
+  memcpy(record->data() + sizeof(uint32_t), &crc, sizeof(uint32_t));
+}
+
+// Checks the record starting at '*p', and points ['*payload', '*limit') at its
+// payload and '*p' past it. Returns false without modifying anything if the
+// record is torn, that is, extends past 'end', or fails its checksum.
+inline bool DecodeRecord(const char** p, const char* end,
+                         const char** payload, const char** limit) {
+  const char* cur = *p;
+  if (static_cast<size_t>(end - cur) < kRecordHeaderSize) {
+    return false;
+  }
+  const uint32_t payload_size = DecodeFixed32(cur);
+  const uint32_t crc = DecodeFixed32(cur + sizeof(uint32_t));
+  cur += kRecordHeaderSize;
+  if (static_cast<size_t>(end - cur) < payload_size ||
+      Checksum(cur, payload_size) != crc) {
+    return false;
+  }
+  *payload = cur;
+  *limit = cur + payload_size;
+  *p = *limit;
+  return true;
+}
+
+}  // namespace coding
+}  // namespace diodb
@@ -0,0 +1,78 @@
+#include <chrono>
+
+#include "coding.h"
+#include "compaction_filter.h"
+
+using namespace std;
+
+namespace diodb {
+
+TtlCompactionFilter::TtlCompactionFilter(
+    const uint64_t ttl_seconds, shared_ptr<const CompactionFilter> inner)
+    : ttl_seconds_(ttl_seconds), inner_(move(inner)) {}
+
+CompactionFilter::Decision TtlCompactionFilter::Filter(
+    const Buffer& key, const Buffer& value, Buffer* new_value) const {
+  Buffer user_value = value;
+  uint64_t write_time;
+  if (!StripWriteTime(&user_value, &write_time)) {
+    return Decision::kKeep;
+  }
+  if (write_time + ttl_seconds_ <= Now()) {
+    return Decision::kRemove;
+  }
+  if (!inner_) {
+    return Decision::kKeep;
+  }
+
+  // A rewritten value keeps the time the original was written.
+  const Decision decision = inner_->Filter(key, user_value, new_value);
+  if (decision == Decision::kChangeValue) {
+    AppendWriteTime(write_time, new_value);
+  }
+  return decision;
+}
+
+CompactionFilter::Decision TtlCompactionFilter::FilterValueRef(
+    const Buffer& key, const Buffer& value_tail) const {
+  Buffer user_tail = value_tail;
+  uint64_t write_time;
+  if (!StripWriteTime(&user_tail, &write_time)) {
+    return Decision::kKeep;
+  }
+  if (write_time + ttl_seconds_ <= Now()) {
+    return Decision::kRemove;
+  }
+  return inner_ ? inner_->FilterValueRef(key, user_tail) : Decision::kKeep;
+}
+
+string TtlCompactionFilter::Name() const {
+  const string name = "ttl:" + to_string(ttl_seconds_);
+  return inner_ ? name + "," + inner_->Name() : name;
+}
+
+void TtlCompactionFilter::AppendWriteTime(const uint64_t write_time,
+                                          Buffer* value) {
+  coding::PutFixed64(value, write_time);
+}
+
+bool TtlCompactionFilter::StripWriteTime(Buffer* value,
+                                         uint64_t* write_time) {
+  if (value->size() < sizeof(uint64_t)) {
+    return false;
+  }
+  const size_t size = value->size() - sizeof(uint64_t);
+  if (write_time) {
+    *write_time = coding::DecodeFixed64(value->data() + size);
+  }
+  value->resize(size);
+  return true;
+}
+
+uint64_t TtlCompactionFilter::Now() {
+  return chrono::duration_cast<chrono::seconds>(
+             chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace diodb
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "buffer.h"
+
+namespace diodb {
+
+// Lets merges drop or rewrite entries as they copy them into the new table, so
+// that data the application no longer wants goes away without writing a delete
+// for every key. Merges consult the filter for the newest version of each key
+// once no snapshot can see it, and leave the versions snapshots need alone.
+// Values that were moved to the value log are decided by FilterValueRef from
+// what their reference keeps of them.
+//
+// A filter is called from the background threads and must be thread-safe.
+class CompactionFilter {
+ public:
+  enum class Decision {
+    // Keep the entry as it is.
+    kKeep = 0,
+
+    // Delete the key. Older versions that snapshots still need are shadowed
+    // by a delete rather than exposed.
+    kRemove = 1,
+
+    // Replace the value with '*new_value'.
+    kChangeValue = 2,
+  };
+
+  virtual ~CompactionFilter() {}
+
+  // Decides what to do with the current value of 'key'.
+  virtual Decision Filter(const Buffer& key, const Buffer& value,
+                          Buffer* new_value) const = 0;
+
+  // Decides whether to keep the current value of 'key' when it was moved to
+  // the value log, from 'value_tail', the end of the value that its reference
+  // keeps a copy of. Only kKeep and kRemove apply. Values are kept unless a
+  // filter says otherwise.
+  virtual Decision FilterValueRef(const Buffer& /* key */,
+                                  const Buffer& /* value_tail */) const {
+    return Decision::kKeep;
+  }
+
+  // Describes the filter in logs.
+  virtual std::string Name() const = 0;
+};
+
+// Drops values written more than 'ttl_seconds' ago. Values are stored with the
+// time they were written appended to them, which DBController adds on writes
+// and strips on reads when --ttl_seconds is set. Expired values stay readable
+// until a merge reaches them. Values that aren't expired are handed to
+// 'inner', if set, without their write time. Values in the value log expire
+// the same way, as long as their references keep the write time.
+class TtlCompactionFilter : public CompactionFilter {
+ public:
+  TtlCompactionFilter(uint64_t ttl_seconds,
+                      std::shared_ptr<const CompactionFilter> inner = nullptr);
+
+  // CompactionFilter.
+  Decision Filter(const Buffer& key, const Buffer& value,
+                  Buffer* new_value) const override;
+  Decision FilterValueRef(const Buffer& key,
+                          const Buffer& value_tail) const override;
+  std::string Name() const override;
+
+  // Appends a write time, in seconds since the epoch, to a value.
+  static void AppendWriteTime(uint64_t write_time, Buffer* value);
+
+  // Removes the write time from a value. Returns false, leaving the value
+  // alone, if it's too short to hold one.
+  static bool StripWriteTime(Buffer* value, uint64_t* write_time = nullptr);
+
+  // The current time in seconds since the epoch.
+  static uint64_t Now();
+
+ private:
+  const uint64_t ttl_seconds_;
+  const std::shared_ptr<const CompactionFilter> inner_;
+};
+
+}  // namespace diodb
@@ -1,4 +1,9 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
 #include <memory>
+#include <numeric>
 
 #include <glog/logging.h>
 #include <boost/filesystem.hpp>
@@ -22,172 +27,1465 @@ DEFINE_int32(num_worker_threads, 0,
              "Number of worker threads in the thread pool. Setting this value"
              "to 0 will use maximum hardware concurrency.");
 
+DEFINE_int32(num_async_threads, 4,
+             "Number of threads completing GetAsync and PutAsync calls.");
+
+DEFINE_int32(num_table_build_threads, 2,
+             "Number of threads encoding and checksumming the blocks of "
+             "SSTables written by flushes and merges.");
+
+DEFINE_string(wal_sync_mode, "batch",
+              "When to sync the write-ahead log to disk. 'none' leaves it to "
+              "the OS, 'batch' syncs once per group commit and 'periodic' "
+              "syncs once every --wal_sync_interval_msecs while there are "
+              "unsynced writes.");
+
+DEFINE_int32(wal_sync_interval_msecs, 100,
+             "Minimum number of milliseconds between write-ahead log syncs "
+             "when --wal_sync_mode=periodic.");
+
+DEFINE_uint64(memtable_flush_bytes, 4 * 1024 * 1024,
+              "Size of the active memtable at which it is flushed to a new "
+              "level-0 SSTable without waiting for the next background tick.");
+
+DEFINE_int32(level0_compaction_trigger, 4,
+             "Number of level-0 SSTables at which they are merged into the "
+             "base table.");
+
+DEFINE_double(compaction_delete_ratio, 0.5,
+              "Share of the keys in an SSTable that must be deletes for the "
+              "table to be merged right away, without waiting for "
+              "--level0_compaction_trigger tables to pile up. Zero turns "
+              "delete-triggered merges off.");
+
+DEFINE_bool(lazy_load_base_tables, true,
+            "Build the indexes and prefix filters of the base SSTables the "
+            "first time a lookup reaches them rather than when the database "
+            "is opened. Level-0 tables are always indexed on open.");
+
+DEFINE_uint64(ttl_seconds, 0,
+              "Number of seconds after which a value expires and is dropped "
+              "by the next merge that reaches it. Zero keeps values forever. "
+              "Values are stored with their write time when it's set, so it "
+              "must not be turned on or off for an existing database.");
+
 namespace diodb {
 
+namespace {
+
+constexpr char kTableExtension[] = ".diodb";
+
+// Number of value log records checked and moved at a time by garbage
+// collection.
+constexpr size_t kValueLogGCBatchSize = 256;
+
+// Syncs a file or a directory to disk.
+void SyncPath(const fs::path& path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  PCHECK(fd >= 0) << "Unable to open " << path;
+  PCHECK(fsync(fd) == 0) << "Error syncing " << path;
+  close(fd);
+}
+
+// Hard-links 'from' at 'to', or copies it if they are on different file
+// systems.
+void LinkOrCopy(const fs::path& from, const fs::path& to) {
+  boost::system::error_code ec;
+  fs::create_hard_link(from, to, ec);
+  if (ec) {
+    fs::copy_file(from, to);
+    SyncPath(to);
+  }
+}
+
+}  // namespace
+
 DBController::DBController(const fs::path db_directory)
-    : started_(false),
-      primary_memtable_(make_unique<Memtable>()),
-      secondary_memtable_(make_unique<Memtable>()),
+    : db_directory_(db_directory),
+      started_(false),
+      value_log_(db_directory_,
+                 FLAGS_ttl_seconds > 0 ? sizeof(uint64_t) : 0),
+      manifest_(db_directory_),
+      ttl_seconds_(FLAGS_ttl_seconds),
+      merge_operator_(MergeOperator::FromFlags()),
+      last_sequence_(0),
+      next_file_number_(0),
+      flush_scheduled_(false),
+      compaction_scheduled_(false),
+      value_log_gc_scheduled_(false),
+      stopping_(false),
+      memtable_bytes_(0),
+      flushing_bytes_(0),
+      async_threadpool_(max(FLAGS_num_async_threads, 1)),
+      build_threadpool_(max(FLAGS_num_table_build_threads, 1)),
+      flush_threadpool_(1),
       threadpool_(FLAGS_num_worker_threads < 1 ? thread::hardware_concurrency()
                                                : FLAGS_num_worker_threads) {
-  // The secondary memtable should never be unlocked. It's immutable.
-  secondary_memtable_->Lock();
-
   LOG(INFO) << "Creating DB controller with concurrency "
             << threadpool_.num_threads();
+
+  // Recover anything that was written but never flushed to an SSTable. The
+  // replayed logs are released along with the next memtable flush.
+  auto memtable = make_shared<Memtable>();
+  map<uint64_t, uint64_t> value_log_bytes;
+  wal_ = make_unique<WriteAheadLog>(
+      db_directory_, WriteAheadLog::ParseSyncMode(FLAGS_wal_sync_mode),
+      chrono::milliseconds(FLAGS_wal_sync_interval_msecs));
+  wal_->Replay([this, &memtable,
+                &value_log_bytes](vector<Segment>&& segments) {
+    for (auto& segment : segments) {
+      last_sequence_ = max<SequenceNumber>(last_sequence_, segment.seq);
+      if (segment.value_ref) {
+        ValueLog::CountReference(segment.val, &value_log_bytes);
+      }
+      ApplyToMemtable(memtable.get(), move(segment));
+    }
+  });
+  memtable_bytes_ = memtable->num_bytes();
+
+  auto version = make_shared<TableVersion>();
+  version->memtable = move(memtable);
+
+  // Open the tables the manifest lists, at their levels. Every lookup goes
+  // through the level-0 tables, so they are indexed right away, while a base
+  // table only serves the keys in its range and can wait for the first lookup
+  // that reaches it.
+  const auto level0 = manifest_.level0();
+  const auto base = manifest_.base();
+  version->level0_sstables = OpenTables(level0, false /* lazy_index */);
+  version->base_sstables = OpenTables(base, FLAGS_lazy_load_base_tables);
+  set<string> live_files;
+  for (const auto* entries : {&level0, &base}) {
+    for (const auto& entry : *entries) {
+      live_files.insert(entry.file_name);
+    }
+  }
+  for (const auto* sstables :
+       {&version->level0_sstables, &version->base_sstables}) {
+    for (const auto& sst : *sstables) {
+      last_sequence_ =
+          max<SequenceNumber>(last_sequence_, sst->properties().max_sequence);
+      for (const auto& entry : sst->properties().value_log_bytes) {
+        value_log_bytes[entry.first] += entry.second;
+      }
+    }
+  }
+
+  // Value log records that nothing recovered references became garbage
+  // before the restart.
+  value_log_.RebuildGarbage(value_log_bytes);
+  version->value_files = value_log_.files();
+  version_ = move(version);
+
+  // Any other table file was being written by a flush or merge that never
+  // committed. Never reuse the name of one, in case removing it fails.
+  for (const auto& entry : fs::directory_iterator(db_directory_)) {
+    const fs::path& p = entry.path();
+    const string stem = p.stem().string();
+    if (p.extension() != kTableExtension || stem.empty() ||
+        !all_of(stem.begin(), stem.end(), ::isdigit)) {
+      continue;
+    }
+    next_file_number_ = max<uint64_t>(next_file_number_, stoull(stem) + 1);
+    if (!live_files.count(p.filename().string())) {
+      LOG(INFO) << "Removing sstable " << p << " missing from the manifest";
+      fs::remove(p);
+    }
+  }
+}
+
+DBController::~DBController() {
+  // Jobs still running may try to schedule more work on one of the thread
+  // pools, which are destroyed in turn.
+  lock_guard<mutex> lock(bg_mtx_);
+  stopping_ = true;
+}
+
+vector<SSTable::SSTablePtr> DBController::OpenTables(
+    const vector<Manifest::TableEntry>& entries, const bool lazy_index) {
+  LOG(INFO) << "Opening " << entries.size() << " sstables";
+  vector<SSTable::SSTablePtr> sstables(entries.size());
+  vector<future<void>> opened;
+  opened.reserve(entries.size());
+  for (size_t ii = 0; ii < entries.size(); ++ii) {
+    auto promise = make_shared<std::promise<void>>();
+    opened.push_back(promise->get_future());
+    threadpool_.Enqueue([this, &entries, &sstables, ii, lazy_index, promise]() {
+      sstables[ii] =
+          make_shared<SSTable>(db_directory_ / entries[ii].file_name,
+                               lazy_index);
+      promise->set_value();
+    });
+  }
+  for (auto& f : opened) {
+    f.wait();
+  }
+  return sstables;
 }
 
 void DBController::Start() {
   LOG(INFO) << "Starting DB controller";
+  WriteController::CheckLevel0Triggers(FLAGS_level0_compaction_trigger);
 
-  // Start the background merging thread.
-  threadpool_.Enqueue([this](){ this->RollTables(); });
+  if (ttl_seconds_ > 0) {
+    compaction_filter_ = make_shared<TtlCompactionFilter>(
+        ttl_seconds_, move(compaction_filter_));
+  }
+  if (compaction_filter_) {
+    LOG(INFO) << "Merging with compaction filter "
+              << compaction_filter_->Name();
+  }
+  if (ttl_seconds_ > 0 && merge_operator_) {
+    merge_operator_ = make_shared<TtlMergeOperator>(move(merge_operator_));
+  }
+
+  // Start the background flushing, and collect value log files that were
+  // left with garbage before a restart.
+  ScheduleTick();
+  ScheduleValueLogGC();
+  if (wal_->sync_mode() == WriteAheadLog::SyncMode::kPeriodic) {
+    ScheduleWalSync();
+  }
   started_ = true;
 }
 
-void DBController::RollTables() {
-  CHECK(secondary_memtable_->is_locked());
-  CHECK_EQ(secondary_sstables_.size(), 0);
-
-  LOG(INFO) << "Performing table merge";
-
-  const auto start_time = chrono::system_clock::now();
-
-  const int32_t gap_msec = FLAGS_background_task_min_gap_msecs;
-  const auto fn = [this, start_time, gap_msec]() {
-    // Guarantee that the minimum time has passed before scheduling the next
-    // rollover.
-    //
-    // An assumption is made here that a negative time duration passed into the
-    // 'sleep_for' function won't break anything.
-    //
-    // TODO: Add a delayed enqueue function to the threadpool.
-    const auto elapsed_time = chrono::system_clock::now() - start_time;
-    this_thread::sleep_for(
-      chrono::milliseconds(gap_msec) - elapsed_time);
-    Threadpool::Job roller = [this]() { this->RollTables(); };
-    this->threadpool_.Enqueue(move(roller));
-  };
-  const ScopedExecutor se(fn);
+void DBController::SetCompactionFilter(
+    shared_ptr<const CompactionFilter> filter) {
+  CHECK(!started_);
+  compaction_filter_ = move(filter);
+}
 
-  // There's no point in rolling if the primary memtable is empty.
-  if (primary_memtable_->Size() == 0) {
-    LOG(INFO) << "Primary memtable is empty- won't merge";
-    return;
+void DBController::SetMergeOperator(
+    shared_ptr<const MergeOperator> merge_operator) {
+  CHECK(!started_);
+  merge_operator_ = move(merge_operator);
+}
+
+void DBController::ScheduleTick() {
+  ScheduleFlush();
+  flush_threadpool_.EnqueueAfter(
+      chrono::milliseconds(FLAGS_background_task_min_gap_msecs),
+      [this]() { this->ScheduleTick(); });
+}
+
+void DBController::ScheduleWalSync() {
+  chrono::milliseconds delay;
+  {
+    lock_guard<mutex> lock(log_mtx_);
+    delay = wal_->SyncIfDue();
   }
+  threadpool_.EnqueueAfter(delay, [this]() { this->ScheduleWalSync(); });
+}
 
-  // Lock primary memtable.
-  primary_memtable_->Lock();
+void DBController::ScheduleFlush() {
+  lock_guard<mutex> lock(bg_mtx_);
+  if (flush_scheduled_ || stopping_) {
+    return;
+  }
+  flush_scheduled_ = true;
+  flush_threadpool_.Enqueue([this]() { this->FlushMemtable(); });
+}
 
-  // Swap primary/secondary memtable
-  LOG(INFO) << "Swapping primary/secondary memtables";
-  swap(primary_memtable_, secondary_memtable_);
+void DBController::ScheduleCompaction() {
+  lock_guard<mutex> lock(bg_mtx_);
+  if (compaction_scheduled_ || stopping_) {
+    return;
+  }
+  compaction_scheduled_ = true;
+  threadpool_.Enqueue([this]() { this->CompactTables(); });
+}
 
-  // Secondary memtable to new sstable.
-  if (secondary_memtable_->Size() > 0) {
-    LOG(INFO) << "Dumping secondary memtable to disk";
-    auto sst = make_shared<SSTable>(fs::path("lvl_0.diodb.secondary"),
-                                    *secondary_memtable_);
-    secondary_sstables_.emplace_back(move(sst));
+void DBController::ScheduleValueLogGC() {
+  uint64_t file_number;
+  if (!value_log_.PickFileToCollect(&file_number)) {
+    return;
   }
-  
-  // Merge existing primary sstables.
-  LOG(INFO) << "Merging primary sstables";
-  auto secondary_sst =
-    make_shared<SSTable>("lvl_base.diodb.secondary", primary_sstables_);
-  secondary_sstables_.emplace_back(move(secondary_sst));
 
-  swap(primary_sstables_, secondary_sstables_);
+  lock_guard<mutex> lock(bg_mtx_);
+  if (value_log_gc_scheduled_ || stopping_) {
+    return;
+  }
+  value_log_gc_scheduled_ = true;
+  threadpool_.Enqueue([this]() { this->CollectValueLogGarbage(); });
+}
 
-  fs::remove("lvl_0.diodb");
-  fs::remove("lvl_base.diodb");
-  fs::rename("lvl_0.diodb.secondary", "lvl_0.diodb");
-  fs::rename("lvl_base.diodb.secondary", "lvl_base.diodb");
+void DBController::InstallVersion(shared_ptr<TableVersion> version) {
+  version->value_files = value_log_.files();
+  atomic_store(&version_, TableVersionPtr(move(version)));
 }
 
-// TODO: Refactor the functions to make use of the ReadableTable abstraction.
-// Perhaps a single vector of readable tables. There is way too much code
-// repeated in KeyExists and Get.
+void DBController::FlushMemtable() {
+  const ScopedExecutor se([this]() {
+    {
+      lock_guard<mutex> lock(bg_mtx_);
+      flush_scheduled_ = false;
+    }
 
-bool DBController::KeyExists(const Buffer& key) const {
-  CHECK(started_);
+    // The active memtable may have filled up while this flush was running.
+    // Writers could be stopped waiting on it, so don't wait for the next write
+    // to notice.
+    if (memtable_bytes_ >= FLAGS_memtable_flush_bytes) {
+      ScheduleFlush();
+    }
+  });
+
+  // Lock the active memtable and make it the immutable one in a new version,
+  // alongside a fresh active memtable. The log is rolled at the same time so
+  // that the closed log files cover exactly the memtable being flushed.
+  shared_ptr<const Memtable> immutable_memtable;
+  uint64_t flushed_log_number;
+  {
+    lock_guard<mutex> lock(log_mtx_);
+    lock_guard<mutex> version_lock(version_mtx_);
+    const TableVersionPtr current = CurrentVersion();
+    CHECK(!current->immutable_memtable);
 
-  auto key_info = primary_memtable_->DeletedKeyExists(key);
-  if (key_info.exists) {
-    return !key_info.is_deleted;
+    // There's no point in flushing if the active memtable is empty. Deletes
+    // count, since they have to reach the SSTables too.
+    if (current->memtable->num_valid_entries() +
+            current->memtable->num_delete_entries() +
+            current->memtable->num_range_tombstones() ==
+        0) {
+      DLOG(INFO) << "Active memtable is empty- won't flush";
+      return;
+    }
+
+    LOG(INFO) << "Swapping active/immutable memtables";
+    current->memtable->Lock();
+    immutable_memtable = current->memtable;
+
+    auto version = make_shared<TableVersion>(*current);
+    version->immutable_memtable = immutable_memtable;
+    version->memtable = make_shared<Memtable>();
+    InstallVersion(move(version));
+
+    flushed_log_number = wal_->Roll();
+    flushing_bytes_ = immutable_memtable->num_bytes();
+    memtable_bytes_ = 0;
+  }
+  UpdateWritePressure();
+
+  // Immutable memtable to new sstable.
+  LOG(INFO) << "Dumping immutable memtable to disk";
+  // Any snapshot taken after the swap is newer than everything in the
+  // immutable memtable, so the list can't miss one that matters.
+  auto sst = make_shared<SSTable>(NewTablePath(), *immutable_memtable,
+                                  LiveSnapshots(), &rate_limiter_,
+                                  &build_threadpool_, &value_log_);
+
+  // The table may reference values just added to the value log, which have to
+  // be durable before it is installed.
+  value_log_.Sync();
+  const vector<Buffer> discarded_value_refs = sst->discarded_value_refs();
+
+  {
+    lock_guard<mutex> lock(version_mtx_);
+    Manifest::VersionEdit edit;
+    edit.added.push_back(ManifestEntry(*sst, Manifest::Level::kLevel0));
+    manifest_.Apply(edit);
+
+    auto version = make_shared<TableVersion>(*CurrentVersion());
+    version->level0_sstables.insert(version->level0_sstables.begin(),
+                                    move(sst));
+    version->immutable_memtable.reset();
+    InstallVersion(move(version));
+  }
+  flushing_bytes_ = 0;
+
+  // The flushed memtable is durable in the SSTables, so the log files covering
+  // it can go. A checkpoint copies the logs under the same mutex.
+  {
+    lock_guard<mutex> lock(log_mtx_);
+    wal_->ReleaseLogs(flushed_log_number);
   }
 
-  key_info = secondary_memtable_->DeletedKeyExists(key);
-  if (key_info.exists) {
-    return !key_info.is_deleted;
+  for (const auto& ref : discarded_value_refs) {
+    value_log_.MarkGarbage(ref);
   }
+  ScheduleValueLogGC();
 
-  // Iterator is valid for objects that are swapped, so background tasks should
-  // not interfere with this.
-  for (const auto& sst : primary_sstables_) {
-    key_info = sst->DeletedKeyExists(key);
-    if (key_info.exists) {
-      return !key_info.is_deleted;
+  UpdateWritePressure();
+  const TableVersionPtr current = CurrentVersion();
+  size_t base_index;
+  if (ShouldMergeLevel0(*current) ||
+      PickDeleteDenseBaseTable(*current, &base_index)) {
+    ScheduleCompaction();
+  }
+}
+
+void DBController::CompactTables() {
+  const ScopedExecutor se([this]() {
+    lock_guard<mutex> lock(bg_mtx_);
+    compaction_scheduled_ = false;
+  });
+
+  // The job can't be rescheduled while it's running, so it keeps going while
+  // there is work left, such as tables flushed in the meantime.
+  while (true) {
+    const TableVersionPtr current = CurrentVersion();
+    size_t base_index;
+    if (ShouldMergeLevel0(*current)) {
+      MergeLevel0(current);
+    } else if (PickDeleteDenseBaseTable(*current, &base_index)) {
+      RewriteBaseTable(current, base_index);
+    } else {
+      return;
     }
+    UpdateWritePressure();
   }
+}
 
+bool DBController::IsDeleteDense(const TableProperties& props) {
+  const uint64_t num_keys = props.num_valid_entries + props.num_delete_entries;
+  return FLAGS_compaction_delete_ratio > 0 && props.num_delete_entries > 0 &&
+         props.num_delete_entries >= FLAGS_compaction_delete_ratio * num_keys;
+}
+
+bool DBController::ShouldMergeLevel0(const TableVersion& version) {
+  const auto& level0 = version.level0_sstables;
+  return !level0.empty() &&
+         (level0.size() >=
+              static_cast<size_t>(FLAGS_level0_compaction_trigger) ||
+          any_of(level0.begin(), level0.end(),
+                 [](const SSTable::SSTablePtr& sst) {
+                   return IsDeleteDense(sst->properties());
+                 }));
+}
+
+bool DBController::PickDeleteDenseBaseTable(const TableVersion& version,
+                                            size_t* index) const {
+  // A delete survives a merge only if a snapshot older than it still sees an
+  // older version of its key. Tables newer than every snapshot are sure to
+  // lose their deletes, so rewriting them can't go on forever.
+  const vector<SequenceNumber> snapshots = LiveSnapshots();
+  for (size_t ii = 0; ii < version.base_sstables.size(); ++ii) {
+    const TableProperties& props = version.base_sstables[ii]->properties();
+    if (IsDeleteDense(props) &&
+        (snapshots.empty() || snapshots.front() >= props.max_sequence)) {
+      *index = ii;
+      return true;
+    }
+  }
   return false;
 }
 
-Buffer DBController::Get(const Buffer& key) const {
+void DBController::RewriteBaseTable(const TableVersionPtr& current,
+                                    const size_t index) {
+  // No other table can hold an older version of a key in the range of a base
+  // table, so the table is merged on its own.
+  const SSTable::SSTablePtr input = current->base_sstables[index];
+  LOG(INFO) << "Merging base sstable " << input->filepath() << " with "
+            << input->properties().num_delete_entries << " deletes among "
+            << input->properties().num_valid_entries +
+                   input->properties().num_delete_entries
+            << " keys";
+  auto merged = make_shared<SSTable>(
+      NewTablePath(), vector<SSTable::SSTablePtr>{input}, LiveSnapshots(),
+      &rate_limiter_, &build_threadpool_, compaction_filter_.get(),
+      merge_operator_.get());
+  const vector<Buffer> discarded_value_refs = merged->discarded_value_refs();
+  if (merged->properties().empty()) {
+    fs::remove(merged->filepath());
+    merged.reset();
+  }
+
+  // Only merges change the base tables, so the table is still where it was.
+  {
+    lock_guard<mutex> lock(version_mtx_);
+    Manifest::VersionEdit edit;
+    edit.removed.push_back(input->filepath().filename().string());
+    if (merged) {
+      edit.added.push_back(ManifestEntry(*merged, Manifest::Level::kBase));
+    }
+    manifest_.Apply(edit);
+
+    auto version = make_shared<TableVersion>(*CurrentVersion());
+    auto& base = version->base_sstables;
+    CHECK(base[index] == input);
+    if (merged) {
+      base[index] = move(merged);
+    } else {
+      base.erase(base.begin() + index);
+    }
+    InstallVersion(move(version));
+  }
+  fs::remove(input->filepath());
+
+  for (const auto& ref : discarded_value_refs) {
+    value_log_.MarkGarbage(ref);
+  }
+  ScheduleValueLogGC();
+}
+
+void DBController::MergeLevel0(const TableVersionPtr& current) {
+  const size_t num_level0_inputs = current->level0_sstables.size();
+
+  // The level-0 tables are merged with the base tables their keys overlap.
+  // Base tables outside that range are left alone, which is what keeps
+  // appending workloads from rewriting the whole database on every merge.
+  // The overlapping base tables form a contiguous run, since the base tables
+  // are sorted and don't overlap each other. The run starts after the base
+  // tables that lie entirely below the level-0 tables, which is also where
+  // new base tables go if nothing overlaps.
+  Buffer smallest = current->level0_sstables.front()->properties().smallest_key;
+  Buffer largest = current->level0_sstables.front()->properties().largest_key;
+  for (const auto& sst : current->level0_sstables) {
+    const TableProperties& props = sst->properties();
+    if (props.empty()) {
+      continue;
+    }
+    smallest = min(smallest, props.smallest_key);
+    largest = max(largest, props.largest_key);
+  }
+
+  vector<SSTable::SSTablePtr> inputs(current->level0_sstables);
+  size_t first_base_input = 0;
+  size_t num_base_inputs = 0;
+  for (size_t ii = 0; ii < current->base_sstables.size(); ++ii) {
+    const TableProperties& props = current->base_sstables[ii]->properties();
+    if (props.largest_key < smallest) {
+      ++first_base_input;
+    } else if (props.Overlaps(smallest, largest)) {
+      ++num_base_inputs;
+      inputs.push_back(current->base_sstables[ii]);
+    }
+  }
+
+  // Flushes that land while the merge is running only ever prepend newer
+  // tables, so the inputs stay at the tail of the level-0 list. Only merges
+  // change the base tables.
+  vector<SSTable::SSTablePtr> outputs;
+  vector<Buffer> discarded_value_refs;
+  // A compaction filter has to see every entry, or with keys written in
+  // ascending order, expired data would never be revisited once moved.
+  if (num_base_inputs == 0 && !compaction_filter_ &&
+      CanMoveToBase(current->level0_sstables)) {
+    // Nothing needs rewriting, as with keys written in ascending order. The
+    // tables keep their deletes and shadowed versions until a later merge
+    // overlaps them.
+    LOG(INFO) << "Moving " << num_level0_inputs
+              << " level-0 sstables to the base without merging them";
+    outputs = current->level0_sstables;
+    sort(outputs.begin(), outputs.end(),
+         [](const SSTable::SSTablePtr& a, const SSTable::SSTablePtr& b) {
+           return a->properties().smallest_key < b->properties().smallest_key;
+         });
+    inputs.clear();
+  } else {
+    LOG(INFO) << "Merging " << num_level0_inputs << " level-0 sstables with "
+              << num_base_inputs << " of " << current->base_sstables.size()
+              << " base sstables";
+    auto merged = make_shared<SSTable>(
+        NewTablePath(), inputs, LiveSnapshots(), &rate_limiter_,
+        &build_threadpool_, compaction_filter_.get(), merge_operator_.get());
+    discarded_value_refs = merged->discarded_value_refs();
+    if (merged->properties().empty()) {
+      // Everything was deleted.
+      fs::remove(merged->filepath());
+    } else {
+      outputs.push_back(move(merged));
+    }
+  }
+
+  {
+    lock_guard<mutex> lock(version_mtx_);
+    // Moved tables are removed from level 0 and added back to the base.
+    Manifest::VersionEdit edit;
+    for (const auto& sst : current->level0_sstables) {
+      edit.removed.push_back(sst->filepath().filename().string());
+    }
+    for (size_t ii = 0; ii < num_base_inputs; ++ii) {
+      edit.removed.push_back(current->base_sstables[first_base_input + ii]
+                                 ->filepath()
+                                 .filename()
+                                 .string());
+    }
+    for (const auto& sst : outputs) {
+      edit.added.push_back(ManifestEntry(*sst, Manifest::Level::kBase));
+    }
+    manifest_.Apply(edit);
+
+    auto version = make_shared<TableVersion>(*CurrentVersion());
+    version->level0_sstables.resize(version->level0_sstables.size() -
+                                    num_level0_inputs);
+
+    auto& base = version->base_sstables;
+    const auto first = base.begin() + first_base_input;
+    const auto pos = base.erase(first, first + num_base_inputs);
+    base.insert(pos, outputs.begin(), outputs.end());
+    InstallVersion(move(version));
+  }
+
+  // Readers that still hold the old version keep its file handles open, so
+  // the files can be unlinked right away.
+  for (const auto& sst : inputs) {
+    fs::remove(sst->filepath());
+  }
+
+  // The values the merge dropped are garbage once the inputs are gone from the
+  // current version.
+  for (const auto& ref : discarded_value_refs) {
+    value_log_.MarkGarbage(ref);
+  }
+  ScheduleValueLogGC();
+}
+
+bool DBController::CanMoveToBase(
+    const vector<SSTable::SSTablePtr>& sstables) {
+  // Tables full of deletes are merged for the sake of dropping them.
+  vector<const TableProperties*> props;
+  for (const auto& sst : sstables) {
+    if (sst->properties().empty() || IsDeleteDense(sst->properties())) {
+      return false;
+    }
+    props.push_back(&sst->properties());
+  }
+  sort(props.begin(), props.end(),
+       [](const TableProperties* a, const TableProperties* b) {
+         return a->smallest_key < b->smallest_key;
+       });
+  for (size_t ii = 1; ii < props.size(); ++ii) {
+    if (!(props[ii - 1]->largest_key < props[ii]->smallest_key)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Manifest::TableEntry DBController::ManifestEntry(const SSTable& sst,
+                                                const Manifest::Level level) {
+  return Manifest::TableEntry{sst.filepath().filename().string(), level,
+                              sst.properties().smallest_key,
+                              sst.properties().largest_key};
+}
+
+void DBController::CollectValueLogGarbage() {
+  const ScopedExecutor se([this]() {
+    lock_guard<mutex> lock(bg_mtx_);
+    value_log_gc_scheduled_ = false;
+  });
+
+  uint64_t file_number;
+  if (!value_log_.PickFileToCollect(&file_number)) {
+    return;
+  }
+
+  LOG(INFO) << "Collecting value log file " << file_number;
+  bool all_moved = true;
+  vector<pair<Segment, Buffer>> records;
+  value_log_.ForEachRecord(
+      file_number,
+      [this, &records, &all_moved](Segment&& segment, const Buffer& ref) {
+        records.emplace_back(move(segment), ref);
+        if (records.size() >= kValueLogGCBatchSize) {
+          all_moved = MoveLiveValues(&records) && all_moved;
+        }
+      });
+  all_moved = MoveLiveValues(&records) && all_moved;
+
+  if (!all_moved) {
+    LOG(INFO) << "Keeping value log file " << file_number
+              << " until the snapshots that still read from it are released";
+    value_log_.DeferCollection(file_number);
+  } else {
+    // Every key that referenced the file now points at a copy. Versions that
+    // are still held pin the file, and new ones won't. The log mutex keeps a
+    // checkpoint from linking the file while it's removed.
+    lock_guard<mutex> log_lock(log_mtx_);
+    value_log_.DeleteFile(file_number);
+    lock_guard<mutex> version_lock(version_mtx_);
+    InstallVersion(make_shared<TableVersion>(*CurrentVersion()));
+  }
+
+  if (memtable_bytes_ >= FLAGS_memtable_flush_bytes) {
+    ScheduleFlush();
+  }
+}
+
+DBController::ValueLiveness DBController::CheckValueLiveness(
+    const TableVersion& version, const Buffer& key, const SequenceNumber seq,
+    const Buffer& ref, Segment* newest) const {
+  // Returns true if a read at 'read_seq' ends up at the value. Sets 'found' to
+  // the version the read finds first.
+  const auto reaches = [&](const SequenceNumber read_seq, Segment* found) {
+    if (read_seq < seq || !FindSegment(version, key, read_seq, found)) {
+      return false;
+    }
+    Segment segment = *found;
+    while (segment.merge_operand &&
+           FindSegment(version, key, segment.seq - 1, &segment)) {
+      // Merge operands on top of the value are applied to it when the key is
+      // read, so the value is still needed.
+    }
+    return segment.value_ref && ValueLog::SameValue(segment.val, ref);
+  };
+
+  Segment found;
+  if (reaches(kMaxSequenceNumber, newest)) {
+    if (!newest->merge_operand) {
+      return ValueLiveness::kNewest;
+    }
+    // The resolved value only stands in for reads at or above the newest
+    // operand. Snapshots below it still apply older operands to the value.
+    for (const SequenceNumber snapshot_seq : LiveSnapshots()) {
+      if (snapshot_seq < newest->seq && reaches(snapshot_seq, &found)) {
+        return ValueLiveness::kSnapshotOnly;
+      }
+    }
+    return ValueLiveness::kUnderMergeOperands;
+  }
+  for (const SequenceNumber snapshot_seq : LiveSnapshots()) {
+    if (reaches(snapshot_seq, &found)) {
+      return ValueLiveness::kSnapshotOnly;
+    }
+  }
+  return ValueLiveness::kDead;
+}
+
+bool DBController::MoveLiveValues(vector<pair<Segment, Buffer>>* records) {
+  // A value is replaced by a new version of its key at the sequence number of
+  // the newest version, which wins over the old one by being in a newer table.
+  // That only works when nothing is newer than the version being replaced.
+  // Values that snapshots see through older versions aren't moved, since a
+  // replacement placed in the memtable would hide the newer versions from
+  // every later read. A value under merge operands is replaced by what the
+  // operands resolve to.
+  typedef struct MovedValue {
+    Segment replacement;
+    ValueLiveness liveness;
+    SequenceNumber seq;
+    Buffer ref;
+  } MovedValue;
+
+  // Copy and resolve the values without holding any locks, and make the
+  // copies durable before anything references them.
+  bool all_moved = true;
+  vector<MovedValue> moved;
+  for (auto& record : *records) {
+    const TableVersionPtr version = CurrentVersion();
+    Segment newest;
+    const ValueLiveness liveness = CheckValueLiveness(
+        *version, record.first.key, record.first.seq, record.second, &newest);
+    if (liveness == ValueLiveness::kDead) {
+      continue;
+    }
+    if (liveness == ValueLiveness::kSnapshotOnly) {
+      all_moved = false;
+      continue;
+    }
+
+    const SequenceNumber seq = record.first.seq;
+    if (liveness == ValueLiveness::kNewest) {
+      newest = Segment(record.first.key, value_log_.Add(record.first), false,
+                       seq);
+      newest.value_ref = true;
+    } else {
+      ResolveMergeOperands(*version, &newest);
+    }
+    moved.push_back(
+        MovedValue{move(newest), liveness, seq, move(record.second)});
+  }
+  records->clear();
+  if (moved.empty()) {
+    return all_moved;
+  }
+  value_log_.Sync();
+
+  // Writes can't change what a key resolves to while the log mutex is held,
+  // so the check is exact this time. Copies of values that were overwritten in
+  // the meantime are garbage right away.
+  lock_guard<mutex> log_lock(log_mtx_);
+  const TableVersionPtr version = CurrentVersion();
+  vector<Segment> segments;
+  for (auto& value : moved) {
+    Segment newest;
+    const ValueLiveness liveness = CheckValueLiveness(
+        *version, value.replacement.key, value.seq, value.ref, &newest);
+    if (liveness == value.liveness && newest.seq == value.replacement.seq) {
+      segments.push_back(move(value.replacement));
+      continue;
+    }
+    if (value.liveness == ValueLiveness::kNewest) {
+      value_log_.MarkGarbage(value.replacement.val);
+    }
+    if (liveness != ValueLiveness::kDead) {
+      all_moved = false;
+    }
+  }
+  if (segments.empty()) {
+    return all_moved;
+  }
+
+  Memtable* const memtable = version->memtable.get();
+  wal_->AddRecord(segments);
+  for (auto& segment : segments) {
+    ApplyToMemtable(memtable, move(segment));
+  }
+  memtable_bytes_ = memtable->num_bytes();
+  return all_moved;
+}
+
+void DBController::UpdateWritePressure() {
+  WriteController::Pressure pressure;
+  const TableVersionPtr version = CurrentVersion();
+  pressure.num_level0_files = version->level0_sstables.size();
+  for (const auto& sst : version->level0_sstables) {
+    pressure.compaction_debt_bytes += sst->file_size();
+  }
+
+  // An active memtable counts as pending once it is due for a flush.
+  pressure.pending_flush_bytes = flushing_bytes_;
+  const size_t memtable_bytes = memtable_bytes_;
+  if (memtable_bytes >= FLAGS_memtable_flush_bytes) {
+    pressure.pending_flush_bytes += memtable_bytes;
+  }
+
+  write_controller_.Update(pressure);
+}
+
+fs::path DBController::NewTablePath() {
+  return db_directory_ / (to_string(next_file_number_++) + kTableExtension);
+}
+
+SequenceNumber DBController::ReadSequence(const Snapshot* snapshot) const {
+  return snapshot ? snapshot->sequence() : last_sequence_.load();
+}
+
+bool DBController::KeyExists(const Buffer& key,
+                             const Snapshot* snapshot) const {
   CHECK(started_);
 
-  // In the event that SSTable merges are occuring at the same time this call is
-  // being made, only swaps with newer tables will occur while reads are making
-  // their way through the table hierarchy.
-  auto key_info = primary_memtable_->DeletedKeyExists(key);
-  if (key_info.exists && key_info.is_deleted) {
+  // The version is loaded before the sequence number. Writes that land in a
+  // memtable installed after this version are all newer than everything in
+  // it, so missing them still leaves the read with a consistent prefix of the
+  // history.
+  const TableVersionPtr version = CurrentVersion();
+  Segment segment;
+  return FindSegment(*version, key, ReadSequence(snapshot), &segment) &&
+         !segment.delete_entry;
+}
+
+Buffer DBController::Get(const Buffer& key, const Snapshot* snapshot) const {
+  CHECK(started_);
+
+  const TableVersionPtr version = CurrentVersion();
+  Segment segment;
+  if (!FindSegment(*version, key, ReadSequence(snapshot), &segment) ||
+      segment.delete_entry) {
     return Buffer();
-  } else if (key_info.exists) {
-    return primary_memtable_->Get(key);
   }
+  if (segment.merge_operand) {
+    ResolveMergeOperands(*version, &segment);
+  }
+  return ReadValue(*version, move(segment));
+}
 
-  key_info = secondary_memtable_->DeletedKeyExists(key);
-  if (key_info.exists && key_info.is_deleted) {
-    return Buffer();
-  } else if (key_info.exists) {
-    return secondary_memtable_->Get(key);
+vector<Buffer> DBController::MultiGet(const vector<Buffer>& keys,
+                                     const Snapshot* snapshot) const {
+  CHECK(started_);
+
+  const TableVersionPtr version = CurrentVersion();
+  const SequenceNumber snapshot_seq = ReadSequence(snapshot);
+
+  // Sort the keys and drop duplicates, so that the tables can serve them in a
+  // single pass.
+  vector<size_t> order(keys.size());
+  iota(order.begin(), order.end(), 0);
+  sort(order.begin(), order.end(),
+       [&keys](const size_t a, const size_t b) { return keys[a] < keys[b]; });
+
+  vector<ReadableTable::KeyLookup> lookups;
+  vector<size_t> lookup_for_key(keys.size());
+  for (const size_t idx : order) {
+    if (lookups.empty() || *lookups.back().key != keys[idx]) {
+      lookups.emplace_back(&keys[idx]);
+    }
+    lookup_for_key[idx] = lookups.size() - 1;
   }
 
-  // Iterator is valid for objects that are swapped, so background tasks should
-  // not interfere with this.
-  for (const auto& sst : primary_sstables_) {
-    key_info = sst->DeletedKeyExists(key);
-    if (key_info.exists && key_info.is_deleted) {
-      return Buffer();
-    } else if (key_info.exists) {
-      return sst->Get(key);
+  // Probe the tables from newest to oldest, stopping once every key is found.
+  vector<const ReadableTable*> tables = {version->memtable.get()};
+  if (version->immutable_memtable) {
+    tables.push_back(version->immutable_memtable.get());
+  }
+  for (const auto& sst : version->level0_sstables) {
+    tables.push_back(sst.get());
+  }
+  for (const auto& sst : version->base_sstables) {
+    tables.push_back(sst.get());
+  }
+  for (const ReadableTable* table : tables) {
+    table->FindSegments(snapshot_seq, &lookups);
+    if (all_of(lookups.begin(), lookups.end(),
+               [](const ReadableTable::KeyLookup& l) { return l.found; })) {
+      break;
     }
   }
 
-  return Buffer();
+  // Values are read once per distinct key, from the value log if need be.
+  // Keys with merge operands are resolved one by one.
+  for (auto& lookup : lookups) {
+    if (lookup.found && lookup.segment.merge_operand) {
+      ResolveMergeOperands(*version, &lookup.segment);
+    }
+    if (lookup.found && !lookup.segment.delete_entry) {
+      lookup.segment.val = ReadValue(*version, move(lookup.segment));
+      lookup.segment.value_ref = false;
+    }
+  }
+
+  vector<Buffer> values(keys.size());
+  for (size_t ii = 0; ii < keys.size(); ++ii) {
+    const auto& lookup = lookups[lookup_for_key[ii]];
+    if (lookup.found && !lookup.segment.delete_entry) {
+      values[ii] = lookup.segment.val;
+    }
+  }
+  return values;
 }
 
-void DBController::Put(Buffer&& key, Buffer&& val) {
+unique_ptr<Iterator> DBController::NewIterator(
+    const Snapshot* snapshot) const {
+  CHECK(started_);
+
+  return NewVersionIterator(CurrentVersion(), ReadSequence(snapshot),
+                            [](const SSTable&) { return true; });
+}
+
+unique_ptr<Iterator> DBController::NewPrefixIterator(
+    const Buffer& prefix, const Snapshot* snapshot) const {
+  CHECK(started_);
+
+  auto it = NewVersionIterator(
+      CurrentVersion(), ReadSequence(snapshot),
+      [&prefix](const SSTable& sst) { return sst.MayContainPrefix(prefix); });
+  return NewPrefixBoundedIterator(move(it), prefix);
+}
+
+Buffer DBController::ReadValue(const TableVersion& version,
+                               Segment&& segment) const {
+  CHECK(!segment.merge_operand);
+  Buffer value = segment.value_ref
+                     ? value_log_.Get(segment.val, version.value_files.get())
+                     : move(segment.val);
+  if (ttl_seconds_ > 0) {
+    TtlCompactionFilter::StripWriteTime(&value);
+  }
+  return value;
+}
+
+unique_ptr<Iterator> DBController::NewVersionIterator(
+    const TableVersionPtr& version, const SequenceNumber snapshot_seq,
+    const function<bool(const SSTable&)>& include) const {
+  vector<unique_ptr<InternalIterator>> children;
+  children.emplace_back(make_unique<MemtableIterator>(version->memtable));
+  if (version->immutable_memtable) {
+    children.emplace_back(
+        make_unique<MemtableIterator>(version->immutable_memtable));
+  }
+  for (const auto& sst : version->level0_sstables) {
+    if (include(*sst)) {
+      children.emplace_back(make_unique<SSTableIterator>(sst));
+    }
+  }
+  for (const auto& sst : version->base_sstables) {
+    if (include(*sst)) {
+      children.emplace_back(make_unique<SSTableIterator>(sst));
+    }
+  }
+  // Range tombstones hide keys in older tables, so they're gathered from every
+  // table, including the ones left out.
+  vector<RangeTombstone> tombstones = version->memtable->range_tombstones();
+  if (version->immutable_memtable) {
+    const auto immutable_tombstones =
+        version->immutable_memtable->range_tombstones();
+    tombstones.insert(tombstones.end(), immutable_tombstones.begin(),
+                      immutable_tombstones.end());
+  }
+  for (const auto& sst : version->level0_sstables) {
+    const auto& sst_tombstones = sst->properties().range_tombstones;
+    tombstones.insert(tombstones.end(), sst_tombstones.begin(),
+                      sst_tombstones.end());
+  }
+  for (const auto& sst : version->base_sstables) {
+    const auto& sst_tombstones = sst->properties().range_tombstones;
+    tombstones.insert(tombstones.end(), sst_tombstones.begin(),
+                      sst_tombstones.end());
+  }
+  shared_ptr<const RangeTombstoneList> tombstone_list;
+  if (!tombstones.empty()) {
+    tombstone_list = make_shared<RangeTombstoneList>(tombstones);
+  }
+
+  // The iterator holds on to the version, which keeps the value log files it
+  // references readable.
+  auto it = NewMergingIterator(
+      move(children), snapshot_seq,
+      [this, version](const Buffer& ref) {
+        return value_log_.Get(ref, version->value_files.get());
+      },
+      move(tombstone_list), merge_operator_);
+  if (ttl_seconds_ == 0) {
+    return it;
+  }
+  return NewValueMappingIterator(move(it), [](const Buffer& value) {
+    Buffer user_value = value;
+    TtlCompactionFilter::StripWriteTime(&user_value);
+    return user_value;
+  });
+}
+
+void DBController::ResolveMergeOperands(const TableVersion& version,
+                                        Segment* segment) const {
+  CHECK(merge_operator_) << "Found a merge operand for "
+                         << segment->DebugString()
+                         << ", but no merge operator is set";
+
+  // Gather the operands from newest to oldest, down to the version they apply
+  // to. The search can't find the same version twice, since each step only
+  // looks at older sequence numbers.
+  vector<Segment> operands;
+  operands.push_back(move(*segment));
+  Segment older;
+  bool found;
+  while ((found = FindSegment(version, operands.back().key,
+                              operands.back().seq - 1, &older)) &&
+         older.merge_operand) {
+    operands.push_back(move(older));
+  }
+
+  Buffer value;
+  bool exists = found && !older.delete_entry;
+  if (exists) {
+    value = older.value_ref
+                ? value_log_.Get(older.val, version.value_files.get())
+                : move(older.val);
+  }
+  for (auto it = operands.rbegin(); it != operands.rend(); ++it) {
+    value = merge_operator_->Merge(it->key, exists ? &value : nullptr, it->val);
+    exists = true;
+  }
+  *segment = Segment(move(operands.front().key), move(value),
+                     false /* del */, operands.front().seq);
+}
+
+bool DBController::FindSegment(const TableVersion& version, const Buffer& key,
+                               const SequenceNumber snapshot_seq,
+                               Segment* segment) {
+  return FindInMemtables(version, key, snapshot_seq, segment) ||
+         FindInSSTables(version, key, snapshot_seq, segment);
+}
+
+bool DBController::FindInMemtables(const TableVersion& version,
+                                   const Buffer& key,
+                                   const SequenceNumber snapshot_seq,
+                                   Segment* segment) {
+  if (version.memtable->FindSegment(key, snapshot_seq, segment)) {
+    return true;
+  }
+
+  return version.immutable_memtable &&
+         version.immutable_memtable->FindSegment(key, snapshot_seq, segment);
+}
+
+bool DBController::FindInSSTables(const TableVersion& version,
+                                  const Buffer& key,
+                                  const SequenceNumber snapshot_seq,
+                                  Segment* segment) {
+  for (const auto& sst : version.level0_sstables) {
+    if (sst->FindSegment(key, snapshot_seq, segment)) {
+      return true;
+    }
+  }
+
+  // The base tables don't overlap, so at most one of them can hold the key.
+  // The others are ruled out by their key ranges without any I/O.
+  for (const auto& sst : version.base_sstables) {
+    if (sst->FindSegment(key, snapshot_seq, segment)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+future<Buffer> DBController::GetAsync(const Buffer& key,
+                                      const Snapshot* snapshot) {
+  auto promise = make_shared<std::promise<Buffer>>();
+  future<Buffer> result = promise->get_future();
+  GetAsync(key, snapshot,
+           [promise](Buffer val) { promise->set_value(move(val)); });
+  return result;
+}
+
+void DBController::GetAsync(const Buffer& key, const Snapshot* snapshot,
+                            function<void(Buffer)>&& callback) {
+  CHECK(started_);
+
+  TableVersionPtr version = CurrentVersion();
+  const SequenceNumber snapshot_seq = ReadSequence(snapshot);
+
+  Segment segment;
+  bool found = FindInMemtables(*version, key, snapshot_seq, &segment);
+  if (found && !segment.merge_operand) {
+    callback(segment.delete_entry ? Buffer()
+                                  : ReadValue(*version, move(segment)));
+    return;
+  }
+
+  // The job holds on to the version, so the tables it reads stay around even
+  // if a merge replaces them in the meantime. Merge operands found in the
+  // memtables still need whatever the SSTables hold beneath them.
+  async_threadpool_.Enqueue([this, version = move(version), key, snapshot_seq,
+                             found, segment = move(segment),
+                             callback = move(callback)]() mutable {
+    if (!found && (!FindInSSTables(*version, key, snapshot_seq, &segment) ||
+                   segment.delete_entry)) {
+      callback(Buffer());
+      return;
+    }
+    if (segment.merge_operand) {
+      ResolveMergeOperands(*version, &segment);
+    }
+    callback(ReadValue(*version, move(segment)));
+  });
+}
+
+future<void> DBController::PutAsync(Buffer&& key, Buffer&& val) {
+  auto promise = make_shared<std::promise<void>>();
+  future<void> result = promise->get_future();
+  PutAsync(move(key), move(val), [promise]() { promise->set_value(); });
+  return result;
+}
+
+void DBController::PutAsync(Buffer&& key, Buffer&& val,
+                            function<void()>&& callback) {
   CHECK(started_);
 
-  // The memtable might be locked because it's about to be swapped with the
-  // secondary memtable and flushed. Keep retrying until the primary memtable is
-  // not locked.
-  //
-  // Note: This is not expected to loop for very long, because at the time of
-  // writing, the creation of a new memtable takes a negligible amount of time.
-  // If that changes, this will cause CPU spikes during table merges.
-  while (!primary_memtable_->Put(move(key), move(val))) {
+  WriteBatch batch;
+  batch.Put(move(key), move(val));
+  async_threadpool_.Enqueue(
+      [this, batch = move(batch), callback = move(callback)]() mutable {
+        Write(move(batch));
+        callback();
+      });
+}
+
+const Snapshot* DBController::GetSnapshot() {
+  lock_guard<mutex> lock(snapshots_mtx_);
+  const SequenceNumber seq = last_sequence_;
+  snapshots_.insert(seq);
+  return new Snapshot(seq);
+}
+
+void DBController::ReleaseSnapshot(const Snapshot* snapshot) {
+  {
+    lock_guard<mutex> lock(snapshots_mtx_);
+    const auto it = snapshots_.find(snapshot->sequence());
+    CHECK(it != snapshots_.end()) << "Releasing unknown snapshot";
+    snapshots_.erase(it);
   }
+  delete snapshot;
+
+  // Value log files kept for the snapshot may be free to go now.
+  value_log_.RetryDeferredFiles();
+  ScheduleValueLogGC();
+}
+
+vector<SequenceNumber> DBController::LiveSnapshots() const {
+  lock_guard<mutex> lock(snapshots_mtx_);
+  return vector<SequenceNumber>(snapshots_.begin(), snapshots_.end());
+}
+
+void DBController::Put(Buffer&& key, Buffer&& val) {
+  WriteBatch batch;
+  batch.Put(move(key), move(val));
+  Write(move(batch));
 }
 
 void DBController::Erase(Buffer&& key) {
+  WriteBatch batch;
+  batch.Erase(move(key));
+  Write(move(batch));
+}
+
+void DBController::Merge(Buffer&& key, Buffer&& operand) {
+  WriteBatch batch;
+  batch.Merge(move(key), move(operand));
+  Write(move(batch));
+}
+
+void DBController::DeleteRange(Buffer&& begin, Buffer&& end) {
+  WriteBatch batch;
+  batch.DeleteRange(move(begin), move(end));
+  Write(move(batch));
+}
+
+void DBController::Write(WriteBatch&& batch) {
   CHECK(started_);
+  if (batch.empty()) {
+    return;
+  }
+
+  // Commits the batch to the write-ahead log and then to the active memtable.
+  // Concurrent callers are grouped so that a single log append and sync covers
+  // all of them.
+  Writer w(move(batch));
+
+  unique_lock<mutex> lock(writers_mtx_);
+  writers_.push_back(&w);
+  while (!w.done && &w != writers_.front()) {
+    w.cv.wait(lock);
+  }
+  if (w.done) {
+    // A leader committed this write on our behalf.
+    return;
+  }
+
+  // This writer is the leader. Take every writer queued so far and commit them
+  // as one group. Writers that show up while the group is being committed
+  // queue up behind it and form the next group.
+  vector<Writer*> group(writers_.begin(), writers_.end());
+  lock.unlock();
+
+  vector<Segment> segments;
+  if (group.size() == 1) {
+    segments = move(w.batch.segments_);
+  } else {
+    for (Writer* writer : group) {
+      for (auto& segment : writer->batch.segments_) {
+        segments.emplace_back(move(segment));
+      }
+    }
+  }
+
+  // Every value is stamped with the time it was written, which merges use to
+  // expire it.
+  if (ttl_seconds_ > 0) {
+    const uint64_t now = TtlCompactionFilter::Now();
+    for (auto& segment : segments) {
+      if (!segment.delete_entry && !segment.range_delete) {
+        TtlCompactionFilter::AppendWriteTime(now, &segment.val);
+        segment.val_size = segment.val.size();
+      }
+    }
+  }
+
+  // Sleep here, holding up the writers queued behind this group, if flushes
+  // or merges have fallen behind.
+  size_t group_bytes = 0;
+  for (Writer* writer : group) {
+    group_bytes += writer->batch.num_bytes();
+  }
+  write_controller_.MaybeStall(group_bytes);
+
+  size_t memtable_bytes;
+  {
+    lock_guard<mutex> log_lock(log_mtx_);
+
+    // Stamp the group with consecutive sequence numbers. Operations later in a
+    // batch get higher numbers, so they win over earlier ones on the same key.
+    SequenceNumber seq = last_sequence_;
+    for (auto& segment : segments) {
+      segment.seq = ++seq;
+    }
+
+    // The active memtable can't be swapped out while the log mutex is held.
+    Memtable* const memtable = CurrentVersion()->memtable.get();
+    wal_->AddRecord(segments);
+    for (auto& segment : segments) {
+      ApplyToMemtable(memtable, move(segment));
+    }
+    memtable_bytes = memtable->num_bytes();
+    memtable_bytes_ = memtable_bytes;
+
+    // Publish the whole group at once.
+    last_sequence_ = seq;
+  }
+
+  if (memtable_bytes >= FLAGS_memtable_flush_bytes) {
+    ScheduleFlush();
+    UpdateWritePressure();
+  }
+
+  lock.lock();
+  for (Writer* writer : group) {
+    CHECK_EQ(writers_.front(), writer);
+    writers_.pop_front();
+    if (writer != &w) {
+      writer->done = true;
+      writer->cv.notify_one();
+    }
+  }
+
+  // Hand leadership to the next group.
+  if (!writers_.empty()) {
+    writers_.front()->cv.notify_one();
+  }
+}
+
+bool DBController::IngestExternalFile(const fs::path& path) {
+  CHECK(started_);
+
+  // Tables written by SSTableWriter for ingestion have every entry at sequence
+  // number zero and no range deletes.
+  if (!SSTable::HasFooter(path)) {
+    LOG(WARNING) << "Not ingesting " << path << ", which isn't a table";
+    return false;
+  }
+  auto sst = make_shared<SSTable>(path);
+  const TableProperties& props = sst->properties();
+  if (props.empty() || props.max_sequence != 0 ||
+      !props.range_tombstones.empty() || !sst->SanityCheck()) {
+    LOG(WARNING) << "Not ingesting " << path
+                 << ", which isn't a table written by SSTableWriter";
+    return false;
+  }
+
+  // Writers are held off until the table is installed, so that none of them
+  // can add a key in its range in the meantime.
+  lock_guard<mutex> log_lock(log_mtx_);
+  const TableVersionPtr current = CurrentVersion();
+
+  // Lookups stop at the memtables, which would hide the table's keys behind
+  // older versions of them.
+  if (MemtableOverlaps(*current->memtable, props) ||
+      (current->immutable_memtable &&
+       MemtableOverlaps(*current->immutable_memtable, props))) {
+    LOG(WARNING) << "Not ingesting " << path
+                 << " until the writes its keys overlap are flushed";
+    return false;
+  }
+
+  bool overlaps_tables = false;
+  for (const auto* sstables :
+       {&current->level0_sstables, &current->base_sstables}) {
+    for (const auto& other : *sstables) {
+      overlaps_tables |=
+          other->properties().Overlaps(props.smallest_key, props.largest_key);
+    }
+  }
+
+  const fs::path table_path = NewTablePath();
+  SequenceNumber seq = 0;
+  if (overlaps_tables || !LiveSnapshots().empty()) {
+    seq = last_sequence_ + 1;
+    LOG(INFO) << "Ingesting " << path << " as " << table_path
+              << " at sequence number " << seq;
+    SSTableWriter writer(table_path, &build_threadpool_, seq);
+    SSTableIterator it(sst);
+    for (it.SeekToFirst(); it.Valid(); it.Next()) {
+      const Segment& segment = it.segment();
+      if (segment.delete_entry) {
+        writer.Delete(segment.key);
+      } else {
+        writer.Put(segment.key, segment.val);
+      }
+    }
+    writer.Finish();
+    sst = make_shared<SSTable>(table_path);
+    fs::remove(path);
+  } else {
+    LOG(INFO) << "Ingesting " << path << " as " << table_path;
+    sst->RenameFile(table_path);
+  }
+
+  {
+    lock_guard<mutex> lock(version_mtx_);
+    Manifest::VersionEdit edit;
+    edit.added.push_back(ManifestEntry(*sst, Manifest::Level::kLevel0));
+    manifest_.Apply(edit);
+
+    auto version = make_shared<TableVersion>(*CurrentVersion());
+    version->level0_sstables.insert(version->level0_sstables.begin(),
+                                    move(sst));
+    InstallVersion(move(version));
+  }
+  if (seq > 0) {
+    last_sequence_ = seq;
+  }
+
+  UpdateWritePressure();
+  if (ShouldMergeLevel0(*CurrentVersion())) {
+    ScheduleCompaction();
+  }
+  return true;
+}
+
+void DBController::CreateCheckpoint(const fs::path& checkpoint_directory) {
+  CHECK(started_);
+  CHECK(!fs::exists(checkpoint_directory))
+      << "Checkpoint directory " << checkpoint_directory << " exists";
+  fs::create_directories(checkpoint_directory);
+  LOG(INFO) << "Creating checkpoint in " << checkpoint_directory;
+
+  // Holding both mutexes keeps out writes, memtable swaps and new versions, so
+  // the tables and the logs in the checkpoint agree with each other. Neither
+  // value log files nor write-ahead logs are removed without the log mutex,
+  // and tables are only removed once a version without them is installed.
+  lock_guard<mutex> log_lock(log_mtx_);
+  lock_guard<mutex> version_lock(version_mtx_);
+  const TableVersionPtr current = CurrentVersion();
+
+  // Level-0 tables are added oldest first, so that each becomes the newest.
+  Manifest::VersionEdit edit;
+  const auto link_table = [&](const SSTable::SSTablePtr& sst,
+                              const Manifest::Level level) {
+    const fs::path from = sst->filepath();
+    LinkOrCopy(from, checkpoint_directory / from.filename());
+    edit.added.push_back(ManifestEntry(*sst, level));
+  };
+  for (auto it = current->level0_sstables.rbegin();
+       it != current->level0_sstables.rend(); ++it) {
+    link_table(*it, Manifest::Level::kLevel0);
+  }
+  for (const auto& sst : current->base_sstables) {
+    link_table(sst, Manifest::Level::kBase);
+  }
+  Manifest(checkpoint_directory).Apply(edit);
+
+  // Once the file being appended to is sealed, the value log files can be
+  // shared too.
+  value_log_.Seal();
+  for (const auto& entry : *value_log_.files()) {
+    const fs::path from = entry.second->filepath();
+    LinkOrCopy(from, checkpoint_directory / from.filename());
+  }
+
+  // The active log is still being appended to, so it can't be shared.
+  wal_->CopyTo(checkpoint_directory);
+  SyncPath(checkpoint_directory);
+}
+
+bool DBController::MemtableOverlaps(const Memtable& memtable,
+                                    const TableProperties& props) {
+  vector<Segment> first;
+  memtable.Scan(props.smallest_key, kMaxSequenceNumber, false /* after */, 1,
+                &first);
+  if (!first.empty() && !(props.largest_key < first.front().key)) {
+    return true;
+  }
+  for (const auto& tombstone : memtable.range_tombstones()) {
+    if (!(props.largest_key < tombstone.begin) &&
+        props.smallest_key < tombstone.end) {
+      return true;
+    }
+  }
+  return false;
+}
 
-  // See comment block in DBController::Put().
-  while (!primary_memtable_->Erase(move(key))) {
+void DBController::ApplyToMemtable(Memtable* const memtable,
+                                   Segment&& segment) {
+  bool ok;
+  if (segment.range_delete) {
+    ok = memtable->DeleteRange(move(segment.key), move(segment.val),
+                               segment.seq);
+  } else if (segment.merge_operand) {
+    ok = memtable->Merge(move(segment.key), move(segment.val), segment.seq);
+  } else {
+    ok = memtable->Put(move(segment.key), move(segment.val),
+                       segment.delete_entry, segment.seq, segment.value_ref);
   }
+  CHECK(ok) << "Active memtable is locked";
 }
 
 }  // namespace diodb
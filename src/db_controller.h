@@ -1,27 +1,95 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <thread>
 
 #include "buffer.h"
+#include "compaction_filter.h"
+#include "iterator.h"
+#include "manifest.h"
 #include "memtable.h"
+#include "merge_operator.h"
+#include "rate_limiter.h"
+#include "snapshot.h"
 #include "sstable.h"
 #include "util/threadpool.h"
+#include "value_log.h"
+#include "wal.h"
+#include "write_batch.h"
+#include "write_controller.h"
 
 namespace diodb {
 
 class DBController {
  public:
   DBController(const fs::path db_directory);
-  virtual ~DBController() {}
+  virtual ~DBController();
 
   // Begins the background tasks and renders the controller useable.
   void Start();
 
-  // Returns true if a key exists in the database.
-  bool KeyExists(const Buffer& key) const;
+  // Has merges run 'filter' over the entries they copy. Must be called before
+  // Start. With --ttl_seconds set, the filter only sees the values that
+  // haven't expired, without their write time.
+  void SetCompactionFilter(std::shared_ptr<const CompactionFilter> filter);
 
-  // Get the value associated with a key.
-  Buffer Get(const Buffer& key) const;
+  // Sets the operator that applies the operands of Merge, replacing the one
+  // --merge_operator configures. Must be called before Start, and must produce
+  // the same values as the operator the database was written with.
+  void SetMergeOperator(std::shared_ptr<const MergeOperator> merge_operator);
+
+  // Returns true if a key exists in the database. If a snapshot is provided,
+  // the key is looked up as of that snapshot.
+  bool KeyExists(const Buffer& key,
+                 const Snapshot* snapshot = nullptr) const;
+
+  // Get the value associated with a key. If a snapshot is provided, the value
+  // is looked up as of that snapshot.
+  Buffer Get(const Buffer& key, const Snapshot* snapshot = nullptr) const;
+
+  // Gets the values associated with several keys at once. The result holds one
+  // value per key, in the same order, and an empty value for keys that don't
+  // exist. Each table is probed once for the whole batch, which is much
+  // cheaper than calling Get for each key.
+  std::vector<Buffer> MultiGet(const std::vector<Buffer>& keys,
+                               const Snapshot* snapshot = nullptr) const;
+
+  // Returns an iterator over the database in key order. If a snapshot is
+  // provided, the iterator sees the database as of that snapshot. Otherwise it
+  // sees the writes committed before it was created. The iterator holds on to
+  // the tables it reads from, so it stays valid while flushes and merges
+  // replace them.
+  std::unique_ptr<Iterator> NewIterator(
+      const Snapshot* snapshot = nullptr) const;
+
+  // Returns an iterator over the keys that start with 'prefix', in key order.
+  // SSTables that can't hold such a key, by their key range or their prefix
+  // filter, are left out entirely.
+  std::unique_ptr<Iterator> NewPrefixIterator(
+      const Buffer& prefix, const Snapshot* snapshot = nullptr) const;
+
+  // Asynchronous variants of Get. Keys found in the memtables are resolved on
+  // the calling thread. Otherwise the SSTables are read on one of
+  // --num_async_threads threads, so a few callers can keep many lookups in
+  // flight. The read sees the database as of the call. The callback runs on
+  // whichever thread completes the lookup.
+  std::future<Buffer> GetAsync(const Buffer& key,
+                               const Snapshot* snapshot = nullptr);
+  void GetAsync(const Buffer& key, const Snapshot* snapshot,
+                std::function<void(Buffer)>&& callback);
+
+  // Asynchronous variants of Put. The write is committed through the usual
+  // group commit on one of the async threads, and is durable once the future
+  // is ready or the callback runs.
+  std::future<void> PutAsync(Buffer&& key, Buffer&& val);
+  void PutAsync(Buffer&& key, Buffer&& val, std::function<void()>&& callback);
 
   // Inserts a key/value pair into the database.
   void Put(Buffer&& key, Buffer&& val);
@@ -29,31 +97,361 @@ class DBController {
   // Erases a key/value pair from the database.
   void Erase(Buffer&& key);
 
+  // Updates the value of a key with an operand for the merge operator, e.g.
+  // an amount to add to a counter, without reading the value. The operand is
+  // applied when the key is read, and folded into the value by merges.
+  void Merge(Buffer&& key, Buffer&& operand);
+
+  // Erases every key in ['begin', 'end') with a single write. The range is
+  // kept as a tombstone that reads and iterators honor, and merges drop the
+  // keys it covers along with it.
+  void DeleteRange(Buffer&& begin, Buffer&& end);
+
+  // Applies every operation in the batch atomically. The batch lands in the
+  // write-ahead log as part of a single record, so after a crash either all of
+  // it is recovered or none of it is.
+  void Write(WriteBatch&& batch);
+
+  // Adds a table written by SSTableWriter to the database as the newest
+  // level-0 table, moving the file into the database directory, which must be
+  // on the same file system. Its keys become visible all at once, as if they
+  // were a single batch. Returns false, leaving the file alone, if it isn't a
+  // valid table for ingestion, or if its key range overlaps writes that are
+  // still in the memtables, in which case it can be retried after the next
+  // flush.
+  //
+  // If none of the tables hold keys in the file's range and no snapshot is
+  // open, the file is used as it is, and a later merge moves it to the base
+  // without rewriting it. Otherwise its keys need a sequence number newer than
+  // the versions they replace, so the file is copied with one stamped on
+  // every entry, and writes wait for the copy.
+  bool IngestExternalFile(const fs::path& path);
+
+  // Makes a copy of the database in 'checkpoint_directory', which must not
+  // exist, that can be opened on its own. Table and value log files are never
+  // changed once written, so the checkpoint hard-links them where it's on the
+  // same file system, and it takes next to no time or space. The write-ahead
+  // log, which covers the memtables, is copied. Writes wait while the
+  // checkpoint is taken.
+  void CreateCheckpoint(const fs::path& checkpoint_directory);
+
+  // Returns a snapshot of the current state of the database. The caller must
+  // release it with ReleaseSnapshot.
+  const Snapshot* GetSnapshot();
+
+  // Releases a snapshot returned by GetSnapshot.
+  void ReleaseSnapshot(const Snapshot* snapshot);
+
+  // Accessors.
+  const WriteController::Stats& write_stall_stats() const {
+    return write_controller_.stats();
+  }
+  const RateLimiter::Stats& background_io_stats() const {
+    return rate_limiter_.stats();
+  }
+
  private:
-  // Dump secondary memtable to an SSTable. Swap the active memtable and flush
-  // the full memtable into an SSTable.
-  void RollTables();
+  // A thread waiting for its batch to be committed.
+  typedef struct Writer {
+    explicit Writer(WriteBatch&& b) : batch(std::move(b)), done(false) {}
+
+    // The batch to commit. It is consumed by the group commit leader.
+    WriteBatch batch;
+
+    // Set by the group commit leader once the segments are committed.
+    bool done;
+
+    // Signalled when the writer is done or becomes the leader.
+    std::condition_variable cv;
+  } Writer;
+
+  // An immutable view of the tables making up the database. A new version is
+  // installed whenever a flush or merge changes the set of tables, and readers
+  // hold on to the version they started with, which keeps its tables alive
+  // until they are done.
+  typedef struct TableVersion {
+    // The active memtable that services all writes. It is the only part of a
+    // version that changes, and only by having entries added to it.
+    std::shared_ptr<Memtable> memtable;
+
+    // The locked memtable being flushed, if any.
+    std::shared_ptr<const Memtable> immutable_memtable;
+
+    // SSTables flushed from memtables that have not been merged into the base
+    // table yet, ordered from newest to oldest.
+    std::vector<SSTable::SSTablePtr> level0_sstables;
+
+    // The tables holding everything that has been merged, sorted by key. Their
+    // key ranges don't overlap.
+    std::vector<SSTable::SSTablePtr> base_sstables;
+
+    // The value log files when the version was installed. Values referenced
+    // from its tables stay readable while it's held, even if garbage
+    // collection has moved them since.
+    std::shared_ptr<const ValueLog::FileSet> value_files;
+  } TableVersion;
+  using TableVersionPtr = std::shared_ptr<const TableVersion>;
+
+  // Returns the current version without taking any locks.
+  TableVersionPtr CurrentVersion() const {
+    return std::atomic_load(&version_);
+  }
+
+  // Installs a new version, pinning the current value log files in it. Callers
+  // must hold 'version_mtx_'.
+  void InstallVersion(std::shared_ptr<TableVersion> version);
+
+  // Applies a committed segment to a memtable.
+  static void ApplyToMemtable(Memtable* memtable, Segment&& segment);
+
+  // Finds the newest version of a key that is visible at 'snapshot_seq',
+  // searching the tables in 'version' from newest to oldest.
+  static bool FindSegment(const TableVersion& version, const Buffer& key,
+                          SequenceNumber snapshot_seq, Segment* segment);
+
+  // The two halves of FindSegment: the in-memory tables, which never block on
+  // I/O, and the SSTables.
+  static bool FindInMemtables(const TableVersion& version, const Buffer& key,
+                              SequenceNumber snapshot_seq, Segment* segment);
+  static bool FindInSSTables(const TableVersion& version, const Buffer& key,
+                             SequenceNumber snapshot_seq, Segment* segment);
+
+  // Returns the value of a segment found in 'version', reading it from the
+  // value log if the segment only holds a reference to it.
+  Buffer ReadValue(const TableVersion& version, Segment&& segment) const;
+
+  // Turns the merge operand found in 'segment' into the value it resolves to,
+  // by applying it and the operands beneath it to the first older version of
+  // the key in 'version'.
+  void ResolveMergeOperands(const TableVersion& version,
+                            Segment* segment) const;
+
+  // Builds a merging iterator over the tables of 'version'. SSTables for which
+  // 'include' returns false are left out.
+  std::unique_ptr<Iterator> NewVersionIterator(
+      const TableVersionPtr& version, SequenceNumber snapshot_seq,
+      const std::function<bool(const SSTable&)>& include) const;
+
+  // Resolves the sequence number a read is done at.
+  SequenceNumber ReadSequence(const Snapshot* snapshot) const;
+
+  // Returns the sequence numbers of all live snapshots in ascending order.
+  std::vector<SequenceNumber> LiveSnapshots() const;
+
+  // Requests a flush of the active memtable every
+  // --background_task_min_gap_msecs.
+  void ScheduleTick();
+
+  // Syncs the write-ahead log whenever a sync is due in periodic mode, so that
+  // the last writes before an idle spell don't wait for the next write.
+  void ScheduleWalSync();
+
+  // Enqueues a memtable flush unless one is already scheduled.
+  void ScheduleFlush();
+
+  // Enqueues a merge unless one is already scheduled.
+  void ScheduleCompaction();
+
+  // Swaps out the active memtable and flushes it into a
+  // new level-0 SSTable.
+  void FlushMemtable();
+
+  // Runs merges until none is due: of the level-0 tables into the base once
+  // there are --level0_compaction_trigger of them or one is full of deletes,
+  // and of base tables full of deletes on their own.
+  void CompactTables();
+
+  // Merges every level-0 SSTable in 'current' with the base tables it
+  // overlaps into a new base table. Level-0 tables that overlap neither are
+  // moved to the base as they are.
+  void MergeLevel0(const TableVersionPtr& current);
+
+  // Merges the base table at 'index' in 'current' on its own, which drops its
+  // deletes.
+  void RewriteBaseTable(const TableVersionPtr& current, size_t index);
+
+  // Returns true if at least --compaction_delete_ratio of the keys in a table
+  // are deleted.
+  static bool IsDeleteDense(const TableProperties& props);
+
+  // Returns true if the level-0 tables of 'version' are due for a merge.
+  static bool ShouldMergeLevel0(const TableVersion& version);
+
+  // Finds a base table of 'version' that is full of deletes a merge would
+  // drop. Returns false if there is none.
+  bool PickDeleteDenseBaseTable(const TableVersion& version,
+                                size_t* index) const;
+
+  // Returns true if 'sstables' can become base tables without being merged,
+  // because none of them overlap. Merges never skip a compaction filter this
+  // way, whatever this returns.
+  static bool CanMoveToBase(const std::vector<SSTable::SSTablePtr>& sstables);
+
+  // Opens the tables listed in 'entries' on the worker threads, and returns
+  // them in the same order.
+  std::vector<SSTable::SSTablePtr> OpenTables(
+      const std::vector<Manifest::TableEntry>& entries, bool lazy_index);
+
+  // Returns true if 'memtable' holds a key or a range delete in the key range
+  // of 'props'.
+  static bool MemtableOverlaps(const Memtable& memtable,
+                               const TableProperties& props);
+
+  // Describes a table for a manifest edit.
+  static Manifest::TableEntry ManifestEntry(const SSTable& sst,
+                                            Manifest::Level level);
+
+  // Enqueues a value log garbage collection if there is a file worth
+  // collecting and none is scheduled.
+  void ScheduleValueLogGC();
+
+  // Rewrites the live values of the value log file with the most garbage to
+  // the end of the log, points their keys at the copies, and removes the file.
+  // If a snapshot still sees a value that can't be moved, the file stays until
+  // a snapshot is released.
+  void CollectValueLogGarbage();
+
+  // How a value in the value log is still referenced.
+  enum class ValueLiveness {
+    // Nothing can read it any more.
+    kDead,
+
+    // The newest version of its key references it.
+    kNewest,
+
+    // The newest version of its key is a merge operand applied on top of it,
+    // and no snapshot reads it from below that operand.
+    kUnderMergeOperands,
+
+    // Snapshots still see it through versions that a replacement at the
+    // newest version can't stand in for.
+    kSnapshotOnly,
+  };
+
+  // Works out how 'version' and the live snapshots reference the value 'ref'
+  // points to, which was written for 'key' at 'seq'. Sets 'newest' to the
+  // newest version of the key.
+  ValueLiveness CheckValueLiveness(const TableVersion& version,
+                                   const Buffer& key, SequenceNumber seq,
+                                   const Buffer& ref, Segment* newest) const;
+
+  // Moves the values in 'records' that the newest versions of their keys still
+  // need to the end of the log and commits the new references. 'records' holds
+  // value log segments along with the references to them, and is cleared.
+  // Returns false if a snapshot still sees a value that wasn't moved.
+  bool MoveLiveValues(std::vector<std::pair<Segment, Buffer>>* records);
+
+  // Reports the outstanding flush and merge work to the write controller.
+  void UpdateWritePressure();
+
+  // Returns the path for a new SSTable file.
+  fs::path NewTablePath();
 
  private:
+  // Directory holding the database files.
+  const fs::path db_directory_;
+
   // Indicates whether the controller is useable.
   bool started_;
 
-  // The active memtable that services all I/O.
-  std::unique_ptr<Memtable> primary_memtable_;
+  // Write-ahead log covering the contents of the memtables.
+  std::unique_ptr<WriteAheadLog> wal_;
+
+  // Holds the large values of flushed tables.
+  ValueLog value_log_;
+
+  // Records which tables make up the current version. Edits are appended
+  // under 'version_mtx_', so they land in the order versions are installed.
+  Manifest manifest_;
+
+  // Age in seconds at which values expire, or zero if they never do. Values
+  // carry their write time when it's set.
+  const uint64_t ttl_seconds_;
+
+  // The filter merges run, if any, including the expiry of old values.
+  std::shared_ptr<const CompactionFilter> compaction_filter_;
+
+  // Applies merge operands, if they are used.
+  std::shared_ptr<const MergeOperator> merge_operator_;
+
+  // Protects the writer queue.
+  std::mutex writers_mtx_;
+
+  // Writers waiting to commit. The writer at the front is the group commit
+  // leader.
+  std::deque<Writer*> writers_;
+
+  // The sequence number of the last write visible to readers. It is only
+  // advanced once a whole group has been applied to the memtable, so readers
+  // never see part of a batch.
+  std::atomic<SequenceNumber> last_sequence_;
+
+  // Protects 'snapshots_'.
+  mutable std::mutex snapshots_mtx_;
+
+  // Sequence numbers of the live snapshots.
+  std::multiset<SequenceNumber> snapshots_;
+
+  // Held while appending to the log and the active memtable, and while
+  // swapping the memtables and rolling the log. This guarantees the active
+  // memtable is never locked underneath a group commit leader.
+  std::mutex log_mtx_;
+
+  // Serializes the installation of new versions by background tasks. Readers
+  // never take it. When both are held, 'log_mtx_' is taken first.
+  std::mutex version_mtx_;
+
+  // The current version. It is only accessed through std::atomic_load and
+  // std::atomic_store.
+  TableVersionPtr version_;
+
+  // Number used to name the next SSTable file.
+  std::atomic<uint64_t> next_file_number_;
+
+  // Protects the scheduling flags below.
+  std::mutex bg_mtx_;
+
+  // True if a flush job is queued or running.
+  bool flush_scheduled_;
+
+  // True if a merge job is queued or running.
+  bool compaction_scheduled_;
+
+  // True if a value log garbage collection is queued or running.
+  bool value_log_gc_scheduled_;
+
+  // Set once the controller is being destroyed. No background job is enqueued
+  // after that, so none can land on a thread pool that's already gone.
+  bool stopping_;
+
+  // Size of the active memtable as of the last write.
+  std::atomic<size_t> memtable_bytes_;
+
+  // Size of the immutable memtable while it is being flushed.
+  std::atomic<size_t> flushing_bytes_;
+
+  // Slows down and stops writes when background work falls behind.
+  WriteController write_controller_;
+
+  // Paces the writes of flushes and merges.
+  RateLimiter rate_limiter_;
 
-  // The memtable that is not currently in use. This could potentially be in the
-  // process of being flushed.
-  std::unique_ptr<Memtable> secondary_memtable_;
+  // Thread pool that completes asynchronous reads and writes, kept apart from
+  // the background tasks so that a long merge can't hold up lookups.
+  util::Threadpool async_threadpool_;
 
-  // The active collection of pointers to SSTables ordered from newest to
-  // oldest. The last table is the base table.
-  std::vector<SSTable::SSTablePtr> primary_sstables_;
+  // Thread pool that encodes the blocks of new SSTables for the flushes and
+  // merges running on 'threadpool_'.
+  util::Threadpool build_threadpool_;
 
-  // A secondary collection of SSTables ordered from newest to oldest. The last
-  // table is the base table.
-  std::vector<SSTable::SSTablePtr> secondary_sstables_;
+  // Single thread that runs the memtable flushes and the background tick.
+  // Writers stalled on a pending flush wait for it alone, never for a long
+  // merge that happens to be queued ahead of it on 'threadpool_'.
+  util::Threadpool flush_threadpool_;
 
-  // Thread pool that executes all the tasks.
+  // Thread pool that executes the merges and the rest of the background tasks.
+  // The thread pools must be destroyed before anything their jobs use, so they
+  // stay last.
   util::Threadpool threadpool_;
 };
 
@@ -1,5 +1,10 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <string.h>
 #include <algorithm>
+#include <atomic>
 #include <memory>
 
 #include <glog/logging.h>
@@ -7,13 +12,92 @@
 #include <boost/functional/hash.hpp>
 
 #include "src/buffer.h"
+#include "src/coding.h"
 #include "src/iohandle.h"
+#include "src/util/threadpool.h"
 
 using namespace std;
 
+DEFINE_string(io_backend, "stdio",
+              "How table files are accessed. Either 'stdio' for buffered "
+              "streams and positional reads, or 'io_uring' for batched "
+              "asynchronous reads and writes through io_uring. Falls back to "
+              "'stdio' where io_uring is unavailable.");
+
+DEFINE_uint64(io_uring_write_buffer_bytes, 256 * 1024,
+              "Size of each registered buffer that writes are staged in "
+              "before being handed to io_uring.");
+
+DEFINE_int32(io_uring_write_buffers, 4,
+             "Number of registered buffers that writes are staged in, and "
+             "so the number of writes in flight per file.");
+
+DEFINE_uint64(direct_io_buffer_bytes, 1024 * 1024,
+              "Size of the aligned buffer that direct writes are gathered in "
+              "when they don't go through io_uring.");
+
+DEFINE_uint64(sequential_reader_readahead_bytes, 1024 * 1024,
+              "Number of bytes full scans of table files, such as merges and "
+              "sparse index builds, read at a time.");
+
+DEFINE_bool(sequential_reader_async_readahead, true,
+            "Read the next block of a full table scan on a background thread "
+            "while the current one is being parsed.");
+
+DEFINE_int32(sequential_reader_readahead_threads, 4,
+             "Number of threads shared by all full table scans to read their "
+             "next blocks with --sequential_reader_async_readahead.");
+
 namespace diodb {
 
-IOHandle::IOHandle(const fs::path& filepath) : filepath_(filepath) {
+namespace {
+
+bool UseIoUring() { return FLAGS_io_backend == "io_uring"; }
+
+// Reads ahead for every SequentialReader. It's never destroyed, so that a
+// reader that outlives static destruction still gets its block.
+util::Threadpool* ReadaheadPool() {
+  static util::Threadpool* const pool =
+      new util::Threadpool(max(FLAGS_sequential_reader_readahead_threads, 1));
+  return pool;
+}
+
+// Writes are charged against the rate limiter in chunks of at least this
+// many bytes, so that small segments don't each take its lock.
+constexpr size_t kRateLimiterChunkBytes = 64 * 1024;
+
+// Offsets, sizes and buffer addresses of O_DIRECT I/O must be multiples of the
+// logical block size. This covers every common device.
+constexpr size_t kDirectIOAlignment = 4096;
+
+size_t RoundUpToBlock(const size_t n) {
+  return (max<size_t>(n, 1) + kDirectIOAlignment - 1) / kDirectIOAlignment *
+         kDirectIOAlignment;
+}
+
+void WarnDirectIOUnavailable(const fs::path& filepath) {
+  static atomic<bool> warned(false);
+  if (!warned.exchange(true)) {
+    PLOG(WARNING) << "Unable to open " << filepath
+                  << " for direct I/O. Going through the page cache instead";
+  }
+}
+
+// Set once a ring for staging writes couldn't be set up, so that it isn't
+// attempted for every write.
+atomic<bool> staging_unavailable(false);
+
+}  // namespace
+
+IOHandle::IOHandle(const fs::path& filepath)
+    : filepath_(filepath),
+      direct_write_buffer_size_(0),
+      current_staged_(0),
+      write_offset_(0),
+      direct_write_fd_(-1),
+      rate_limiter_(nullptr),
+      rate_limiter_priority_(RateLimiter::Priority::kLow),
+      uncharged_bytes_(0) {
   LOG(INFO) << "Creating file handle for " << filepath_;
 
   // If the file exists, open it for update but don't overwrite it. If it
@@ -31,9 +115,12 @@ IOHandle::IOHandle(const fs::path& filepath) : filepath_(filepath) {
   CHECK_EQ(ferror(fp_), 0);
 }
 
-IOHandle::~IOHandle() { fclose(fp_); }
+IOHandle::~IOHandle() {
+  DrainStaged();
+  fclose(fp_);
+}
 
-void IOHandle::Reset() { fseek(fp_, 0, SEEK_SET); }
+void IOHandle::Reset() { Seek(0); }
 
 void IOHandle::ParseNext(Segment* segment) {
   CHECK(!End());
@@ -62,43 +149,460 @@ void IOHandle::ParseNext(Segment* segment) {
     PCHECK(ret == 1) << "Error reading segment ret=" << ret;
   }
 
-  // Determine delete.
-  ret = fread(&(segment->delete_entry), sizeof(bool), 1, fp_);
+  // Flags.
+  char flags;
+  ret = fread(&flags, sizeof(flags), 1, fp_);
+  PCHECK(ret == 1) << "Error reading segment ret=" << ret;
+  coding::SetSegmentFlags(flags, segment);
+
+  // Sequence number.
+  ret = fread(&(segment->seq), sizeof(SequenceNumber), 1, fp_);
   PCHECK(ret == 1) << "Error reading segment ret=" << ret;
 }
 
-bool IOHandle::SegmentWrite(const Segment& segment) {
-  // Key and val size.
-  size_t ret = fwrite(&segment.key_size, sizeof(uint32_t), 2, fp_);
-  PCHECK(ret == 2) << "Error writing segment ret=" << ret;
+size_t IOHandle::ReadAt(const int64_t offset, const size_t num_bytes,
+                        char* dst) const {
+  size_t num_read = 0;
+  while (num_read < num_bytes) {
+    const ssize_t ret =
+        pread(fileno(fp_), dst + num_read, num_bytes - num_read,
+              offset + num_read);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    PCHECK(ret >= 0) << "Error reading " << filepath_ << " at offset "
+                     << offset + num_read;
+    if (ret == 0) {
+      break;
+    }
+    num_read += ret;
+  }
+  return num_read;
+}
 
-  // Key.
-  if (segment.key_size > 0) {
-    ret = fwrite(segment.key.data(), segment.key_size, 1, fp_);
-    PCHECK(ret == 1) << "Error writing segment ret=" << ret;
+void IOHandle::ReadBatch(vector<ReadRequest>* requests) const {
+  IoUring* const ring = UseIoUring() ? IoUring::ForThisThread() : nullptr;
+  if (!ring) {
+    for (auto& request : *requests) {
+      request.num_read = ReadAt(request.offset, request.num_bytes, request.dst);
+    }
+    return;
   }
 
-  // Val.
-  if (segment.val_size > 0) {
-    ret = fwrite(segment.val.data(), segment.val_size, 1, fp_);
-    PCHECK(ret == 1) << "Error writing segment ret=" << ret;
+  // Reads that come back short are reissued for the remainder, until they
+  // reach the end of the file.
+  const auto prepare = [this, ring, requests](const size_t index) {
+    ReadRequest& request = (*requests)[index];
+    CHECK(ring->PrepareRead(fileno(fp_), request.offset + request.num_read,
+                            request.dst + request.num_read,
+                            request.num_bytes - request.num_read, index));
+  };
+
+  size_t next = 0;
+  for (auto& request : *requests) {
+    request.num_read = 0;
+  }
+  while (next < requests->size() || ring->in_flight() > 0) {
+    while (next < requests->size() && ring->in_flight() < ring->depth()) {
+      if ((*requests)[next].num_bytes > 0) {
+        prepare(next);
+      }
+      ++next;
+    }
+    ring->Submit(1);
+
+    uint64_t index;
+    int32_t result;
+    while (ring->PopCompletion(&index, &result)) {
+      ReadRequest& request = (*requests)[index];
+      if (result == -EINTR || result == -EAGAIN) {
+        prepare(index);
+        continue;
+      }
+      CHECK_GE(result, 0) << "Error reading " << filepath_ << " at offset "
+                          << request.offset + request.num_read << ": "
+                          << strerror(-result);
+      request.num_read += result;
+      if (result > 0 && request.num_read < request.num_bytes) {
+        prepare(index);
+      }
+    }
+  }
+}
+
+void IOHandle::Write(const char* data, size_t size) {
+  if (rate_limiter_) {
+    uncharged_bytes_ += size;
+    if (uncharged_bytes_ >= kRateLimiterChunkBytes) {
+      rate_limiter_->Request(uncharged_bytes_, rate_limiter_priority_);
+      uncharged_bytes_ = 0;
+    }
+  }
+  if (staged_.empty()) {
+    StartStaging();
+  }
+
+  if (staged_.empty()) {
+    if (size > 0) {
+      const size_t ret = fwrite(data, size, 1, fp_);
+      PCHECK(ret == 1) << "Error writing ret=" << ret;
+    }
+    return;
+  }
+
+  const size_t buffer_size = write_ring_ ? write_ring_->buffer_size()
+                                         : direct_write_buffer_size_;
+  while (size > 0) {
+    StagedBuffer& staged = staged_[current_staged_];
+    if (staged.size == 0) {
+      staged.offset = write_offset_;
+    }
+    const size_t count = min(size, buffer_size - staged.size);
+    memcpy(StagedData(current_staged_) + staged.size, data, count);
+    staged.size += count;
+    write_offset_ += count;
+    data += count;
+    size -= count;
+
+    if (staged.size == buffer_size) {
+      SubmitStaged(current_staged_);
+      current_staged_ = (current_staged_ + 1) % staged_.size();
+      while (staged_[current_staged_].in_flight) {
+        ReapStaged(1);
+      }
+    }
+  }
+}
+
+void IOHandle::StartStaging() {
+  if (UseIoUring() && !staging_unavailable) {
+    const int num_buffers = max(FLAGS_io_uring_write_buffers, 1);
+    write_ring_ = IoUring::Create(
+        num_buffers, num_buffers,
+        max<uint64_t>(FLAGS_io_uring_write_buffer_bytes, 1));
+    if (!write_ring_) {
+      staging_unavailable = true;
+    }
+  }
+
+  size_t num_buffers = 1;
+  if (write_ring_) {
+    num_buffers = write_ring_->num_buffers();
+  } else if (direct_write_fd_ >= 0) {
+    direct_write_buffer_size_ = RoundUpToBlock(FLAGS_direct_io_buffer_bytes);
+    direct_write_buffer_.reset(static_cast<char*>(
+        aligned_alloc(kDirectIOAlignment, direct_write_buffer_size_)));
+    CHECK(direct_write_buffer_) << "Unable to allocate a direct I/O buffer";
+  } else {
+    // Plain stream writes.
+    return;
+  }
+
+  write_offset_ = Offset();
+  staged_.assign(num_buffers, StagedBuffer{0, 0, 0, false});
+  current_staged_ = 0;
+}
+
+char* IOHandle::StagedData(const size_t index) const {
+  return write_ring_ ? write_ring_->buffer(index) : direct_write_buffer_.get();
+}
+
+void IOHandle::SubmitStaged(const size_t index) {
+  StagedBuffer& staged = staged_[index];
+  const int fd = direct_write_fd_ >= 0 ? direct_write_fd_ : fileno(fp_);
+  if (write_ring_) {
+    CHECK(write_ring_->PrepareWrite(
+        fd, staged.offset + staged.written, StagedData(index) + staged.written,
+        staged.size - staged.written, index, index));
+    staged.in_flight = true;
+    write_ring_->Submit(0);
+    return;
   }
 
-  // Determine delete.
-  ret = fwrite(&segment.delete_entry, sizeof(bool), 1, fp_);
-  PCHECK(ret == 1) << "Error writing segment ret=" << ret;
+  while (staged.written < staged.size) {
+    const ssize_t ret =
+        pwrite(fd, StagedData(index) + staged.written,
+               staged.size - staged.written, staged.offset + staged.written);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    PCHECK(ret > 0) << "Error writing " << filepath_ << " at offset "
+                    << staged.offset + staged.written;
+    staged.written += ret;
+  }
+  staged = StagedBuffer{0, 0, 0, false};
+}
+
+void IOHandle::ReapStaged(const unsigned min_complete) {
+  write_ring_->Submit(min_complete);
+
+  uint64_t index;
+  int32_t result;
+  while (write_ring_->PopCompletion(&index, &result)) {
+    StagedBuffer& staged = staged_[index];
+    if (result == -EINTR || result == -EAGAIN) {
+      SubmitStaged(index);
+      continue;
+    }
+    CHECK_GT(result, 0) << "Error writing " << filepath_ << " at offset "
+                        << staged.offset + staged.written << ": "
+                        << strerror(-result);
+    staged.written += result;
+    if (staged.written < staged.size) {
+      SubmitStaged(index);
+    } else {
+      staged = StagedBuffer{0, 0, 0, false};
+    }
+  }
+}
+
+void IOHandle::DrainStaged() {
+  if (staged_.empty()) {
+    return;
+  }
 
+  StagedBuffer& last = staged_[current_staged_];
+  if (last.size > 0) {
+    // Direct writes have to cover whole blocks. The padding is cut off again
+    // below.
+    if (direct_write_fd_ >= 0) {
+      const size_t padded_size = RoundUpToBlock(last.size);
+      memset(StagedData(current_staged_) + last.size, 0,
+             padded_size - last.size);
+      last.size = padded_size;
+    }
+    SubmitStaged(current_staged_);
+  }
+  while (write_ring_ && write_ring_->in_flight() > 0) {
+    ReapStaged(1);
+  }
+
+  if (direct_write_fd_ >= 0) {
+    // This also releases whatever was preallocated past the end.
+    PCHECK(ftruncate(direct_write_fd_, write_offset_) == 0)
+        << "Error truncating " << filepath_;
+    close(direct_write_fd_);
+    direct_write_fd_ = -1;
+    direct_write_buffer_.reset();
+  }
+
+  // Later stream writes pick up where the staged ones left off.
+  write_ring_.reset();
+  staged_.clear();
+  fseek(fp_, write_offset_, SEEK_SET);
+}
+
+bool IOHandle::EnableDirectWrites(const uint64_t expected_size) {
+  DrainStaged();
+  PCHECK(fflush(fp_) == 0) << "error flushing";
+  const int64_t offset = Offset();
+  if (offset % kDirectIOAlignment != 0) {
+    return false;
+  }
+
+  const int fd = open(filepath_.c_str(), O_WRONLY | O_DIRECT);
+  if (fd < 0) {
+    WarnDirectIOUnavailable(filepath_);
+    return false;
+  }
+
+  // Preallocation is only a hint, so failures are ignored. The file size
+  // stays put, so readers never see the preallocated space.
+  if (expected_size > 0) {
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, RoundUpToBlock(expected_size));
+  }
+
+  direct_write_fd_ = fd;
+  StartStaging();
+  return true;
+}
+
+bool IOHandle::Append(const Buffer& data) {
+  Write(data.data(), data.size());
+  return true;
+}
+
+bool IOHandle::SegmentWrite(const Segment& segment) {
+  // Encoding the segment up front turns it into a single write.
+  scratch_.clear();
+  coding::EncodeSegment(segment, &scratch_);
+  Write(scratch_.data(), scratch_.size());
   return true;
 }
 
-void IOHandle::Flush() { PCHECK(fflush(fp_) == 0) << "error flushing"; }
+void IOHandle::SetRateLimiter(RateLimiter* rate_limiter,
+                              const RateLimiter::Priority priority) {
+  rate_limiter_ = rate_limiter;
+  rate_limiter_priority_ = priority;
+  uncharged_bytes_ = 0;
+}
+
+void IOHandle::Flush() {
+  if (rate_limiter_ && uncharged_bytes_ > 0) {
+    rate_limiter_->Request(uncharged_bytes_, rate_limiter_priority_);
+    uncharged_bytes_ = 0;
+  }
+  DrainStaged();
+  PCHECK(fflush(fp_) == 0) << "error flushing";
+  PCHECK(fdatasync(fileno(fp_)) == 0) << "error syncing";
+}
+
+void IOHandle::Rename(const fs::path& new_filepath) {
+  fs::rename(filepath_, new_filepath);
+  filepath_ = fs::canonical(new_filepath);
+}
 
 int64_t IOHandle::Offset() const {
+  if (!staged_.empty()) {
+    return write_offset_;
+  }
+
   int64_t pos = ftell(fp_);
   PCHECK(pos >= 0) << "Failed to get offset";
   return pos;
 }
 
-void IOHandle::Seek(int64_t offset) { fseek(fp_, offset, SEEK_SET); }
+void IOHandle::Seek(int64_t offset) {
+  DrainStaged();
+  fseek(fp_, offset, SEEK_SET);
+}
+
+SequentialReader::SequentialReader(const fs::path& filepath,
+                                   const uint64_t limit, const bool direct)
+    : filepath_(filepath),
+      limit_(limit),
+      fd_(-1),
+      direct_(direct),
+      block_size_(RoundUpToBlock(FLAGS_sequential_reader_readahead_bytes)),
+      buffer_offset_(0),
+      buffer_size_(0),
+      pos_(0),
+      offset_(0) {
+  if (direct_) {
+    fd_ = open(filepath_.c_str(), O_RDONLY | O_DIRECT);
+    if (fd_ < 0) {
+      WarnDirectIOUnavailable(filepath_);
+      direct_ = false;
+    }
+  }
+  if (fd_ < 0) {
+    fd_ = open(filepath_.c_str(), O_RDONLY);
+    PCHECK(fd_ >= 0) << "Unable to open " << filepath_;
+    // The whole file is about to be read in order.
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  buffer_.reset(
+      static_cast<char*>(aligned_alloc(kDirectIOAlignment, block_size_)));
+  next_buffer_.reset(
+      static_cast<char*>(aligned_alloc(kDirectIOAlignment, block_size_)));
+  CHECK(buffer_ && next_buffer_) << "Unable to allocate read-ahead buffers";
+}
+
+SequentialReader::~SequentialReader() {
+  // The background read still holds the descriptor and the buffer.
+  if (prefetch_.valid()) {
+    prefetch_.wait();
+  }
+  close(fd_);
+}
+
+bool SequentialReader::Next(Segment* segment) {
+  CHECK(segment);
+  if (offset_ >= static_cast<int64_t>(limit_)) {
+    return false;
+  }
+  if (pos_ == buffer_size_) {
+    Advance();
+  }
+
+  const char* const begin = buffer_.get() + pos_;
+  const char* const end = buffer_.get() + buffer_size_;
+  const char* p = begin;
+  if (coding::DecodeSegment(&p, end, segment)) {
+    pos_ += p - begin;
+    offset_ += p - begin;
+    return true;
+  }
+
+  // The segment runs into the next block, or further for a big one. Gather it
+  // in one place, reading only its header until its size is known.
+  stitch_.assign(begin, end);
+  pos_ = buffer_size_;
+  size_t segment_size = stitch_.size() < coding::kSegmentHeaderSize
+                            ? coding::kSegmentHeaderSize
+                            : coding::EncodedSegmentSize(stitch_.data());
+  while (stitch_.size() < segment_size) {
+    if (pos_ == buffer_size_) {
+      Advance();
+    }
+    const size_t count =
+        min(segment_size - stitch_.size(), buffer_size_ - pos_);
+    stitch_.insert(stitch_.end(), buffer_.get() + pos_,
+                   buffer_.get() + pos_ + count);
+    pos_ += count;
+    if (stitch_.size() >= coding::kSegmentHeaderSize) {
+      segment_size = coding::EncodedSegmentSize(stitch_.data());
+    }
+  }
+
+  p = stitch_.data();
+  CHECK(coding::DecodeSegment(&p, stitch_.data() + stitch_.size(), segment));
+  offset_ += stitch_.size();
+  return true;
+}
+
+void SequentialReader::Advance() {
+  const int64_t offset = buffer_offset_ + buffer_size_;
+  if (prefetch_.valid()) {
+    buffer_size_ = prefetch_.get();
+    swap(buffer_, next_buffer_);
+  } else {
+    buffer_size_ = ReadBlock(offset, buffer_.get());
+  }
+  buffer_offset_ = offset;
+  pos_ = 0;
+  CHECK_GT(buffer_size_, 0) << "Error reading segment in " << filepath_
+                            << " at offset " << offset_
+                            << ": the file is truncated";
+
+  // Start on the next block, unless this one already reached the limit or the
+  // end of the file.
+  const int64_t next_offset = offset + buffer_size_;
+  if (FLAGS_sequential_reader_async_readahead && buffer_size_ == block_size_ &&
+      next_offset < static_cast<int64_t>(limit_)) {
+    auto read = make_shared<promise<size_t>>();
+    prefetch_ = read->get_future();
+    ReadaheadPool()->Enqueue([this, read, next_offset] {
+      read->set_value(ReadBlock(next_offset, next_buffer_.get()));
+    });
+  }
+}
+
+size_t SequentialReader::ReadBlock(const int64_t offset, char* dst) const {
+  // Nothing past the limit is needed, though direct reads have to cover whole
+  // blocks.
+  const size_t num_bytes =
+      min(block_size_, RoundUpToBlock(limit_ - min<uint64_t>(offset, limit_)));
+
+  size_t num_read = 0;
+  while (num_read < num_bytes) {
+    const ssize_t ret =
+        pread(fd_, dst + num_read, num_bytes - num_read, offset + num_read);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    PCHECK(ret >= 0) << "Error reading " << filepath_ << " at offset "
+                     << offset + num_read;
+    num_read += ret;
+
+    // A direct read can only come back short at the end of the file, and
+    // can't be resumed from an unaligned offset anyway.
+    if (ret == 0 || (direct_ && num_read % kDirectIOAlignment != 0)) {
+      break;
+    }
+  }
+  return num_read;
+}
 
 }  // namespace diodb
@@ -1,12 +1,25 @@
 #pragma once
 
+#include <cstdlib>
+#include <future>
+#include <memory>
+#include <vector>
+
 #include <boost/filesystem.hpp>
 
 #include "buffer.h"
+#include "rate_limiter.h"
+#include "uring.h"
 
 namespace fs = boost::filesystem;
 namespace diodb {
 
+// Memory from aligned_alloc.
+struct FreeDeleter {
+  void operator()(char *p) const { free(p); }
+};
+using AlignedBuffer = std::unique_ptr<char, FreeDeleter>;
+
 class IOHandle {
  public:
   IOHandle(const fs::path &filepath);
@@ -19,6 +32,32 @@ class IOHandle {
   // message.
   void ParseNext(Segment *segment);
 
+  // Reads up to 'num_bytes' bytes starting at 'offset' into 'dst' without
+  // touching the stream offset, so concurrent callers don't interfere with each
+  // other or with the stream. Returns the number of bytes read. Writes must be
+  // flushed before they can be read back this way.
+  size_t ReadAt(int64_t offset, size_t num_bytes, char *dst) const;
+
+  // A read issued through ReadBatch.
+  struct ReadRequest {
+    ReadRequest(int64_t offset, size_t num_bytes, char *dst)
+        : offset(offset), num_bytes(num_bytes), dst(dst), num_read(0) {}
+
+    int64_t offset;
+    size_t num_bytes;
+    char *dst;
+
+    // The number of bytes read, which is only short at the end of the file.
+    size_t num_read;
+  };
+
+  // Performs a batch of reads as if by ReadAt. With --io_backend=io_uring the
+  // reads are all in flight at once.
+  void ReadBatch(std::vector<ReadRequest> *requests) const;
+
+  // Writes raw bytes to the file.
+  bool Append(const Buffer &data);
+
   // Serializes a segment and writes it to the file.
   bool SegmentWrite(const Segment &segment);
 
@@ -31,6 +70,21 @@ class IOHandle {
   // Sync writes to disk.
   void Flush();
 
+  // Charges writes against 'rate_limiter' at 'priority' from here on. Writes
+  // block once they exceed the allowed rate.
+  void SetRateLimiter(RateLimiter *rate_limiter,
+                      RateLimiter::Priority priority);
+
+  // Bypasses the page cache for writes from here until the next Flush, using
+  // O_DIRECT and block-aligned buffers. 'expected_size' more bytes are
+  // preallocated up front so the file is laid out in as few extents as
+  // possible. Returns false, leaving the handle as it was, if the offset
+  // isn't block-aligned or the file system doesn't support O_DIRECT.
+  bool EnableDirectWrites(uint64_t expected_size);
+
+  // Renames the underlying file. The open file stream remains valid.
+  void Rename(const fs::path &new_filepath);
+
   // True if current offset is at the end of the file.
   bool End() const {
     return Offset() == static_cast<int64_t>(fs::file_size(filepath_));
@@ -39,12 +93,117 @@ class IOHandle {
   // Accessors.
   fs::path filepath() { return filepath_; }
 
+ private:
+  // Copies raw bytes to the end of the written data.
+  void Write(const char *data, size_t size);
+
+  // Starts writing out the staged buffer at 'index'.
+  void SubmitStaged(size_t index);
+
+  // Handles the completions of staged writes, waiting for at least
+  // 'min_complete' of them.
+  void ReapStaged(unsigned min_complete);
+
+  // Writes out every staged buffer and waits for them, then goes back to
+  // writing through the stream.
+  void DrainStaged();
+
+  // Sets up the staged buffers, if writes are to be staged at all.
+  void StartStaging();
+
+  // The staged buffer at 'index'.
+  char *StagedData(size_t index) const;
+
  private:
   // The filepath being parsed.
   fs::path filepath_;
 
   // File pointer.
   FILE *fp_;
+
+  // With --io_backend=io_uring, writes are gathered in the registered buffers
+  // of a ring of their own. Each buffer is written out as soon as it fills up,
+  // while the next one is being filled. Direct writes without io_uring are
+  // gathered in a single aligned buffer and written out synchronously.
+  struct StagedBuffer {
+    int64_t offset;
+    size_t size;
+    size_t written;
+    bool in_flight;
+  };
+  std::unique_ptr<IoUring> write_ring_;
+  AlignedBuffer direct_write_buffer_;
+  size_t direct_write_buffer_size_;
+  std::vector<StagedBuffer> staged_;
+  size_t current_staged_;
+
+  // File offset just past the staged data.
+  int64_t write_offset_;
+
+  // The O_DIRECT descriptor staged writes go to, or -1.
+  int direct_write_fd_;
+
+  // The rate limiter writes are charged against, and the bytes written since
+  // the last charge.
+  RateLimiter *rate_limiter_;
+  RateLimiter::Priority rate_limiter_priority_;
+  size_t uncharged_bytes_;
+
+  // Holds a segment while it is encoded.
+  Buffer scratch_;
+};
+
+// Reads the segments of a table file front to back, for merges, index builds
+// and other full scans. The file is read --sequential_reader_readahead_bytes at
+// a time, and segments are parsed straight out of the buffer. With
+// --sequential_reader_async_readahead, the next block is read by a small pool
+// of threads shared by all readers while the current one is being parsed.
+class SequentialReader {
+ public:
+  // Reads the segments in the first 'limit' bytes of 'filepath'. With
+  // 'direct', the file is read with O_DIRECT so that a one-off scan doesn't
+  // push hot data out of the page cache, where the file system supports it.
+  SequentialReader(const fs::path &filepath, uint64_t limit,
+                   bool direct = false);
+  ~SequentialReader();
+
+  // Parses the next segment. Returns false once the limit is reached.
+  bool Next(Segment *segment);
+
+  // Offset of the next segment in the file.
+  int64_t offset() const { return offset_; }
+
+ private:
+  // Moves on to the block after the current one.
+  void Advance();
+
+  // Reads the block at 'offset' into 'dst'. Returns the number of bytes read,
+  // which is only short at the end of the file.
+  size_t ReadBlock(int64_t offset, char *dst) const;
+
+ private:
+  const fs::path filepath_;
+  const uint64_t limit_;
+  int fd_;
+  bool direct_;
+  const size_t block_size_;
+
+  // The block being parsed, its offset in the file, its size and the parse
+  // position within it.
+  AlignedBuffer buffer_;
+  int64_t buffer_offset_;
+  size_t buffer_size_;
+  size_t pos_;
+
+  // The block after it, while it's read in the background.
+  AlignedBuffer next_buffer_;
+  std::future<size_t> prefetch_;
+
+  // Offset of the next segment.
+  int64_t offset_;
+
+  // Gathers a segment that straddles two or more blocks.
+  Buffer stitch_;
 };
 
 }  // namespace diodb
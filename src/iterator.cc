@@ -0,0 +1,338 @@
+#include <algorithm>
+#include <utility>
+
+#include <glog/logging.h>
+
+#include "iterator.h"
+
+using namespace std;
+
+namespace diodb {
+
+namespace {
+
+// Heap-merges the children and resolves the versions of each key down to the
+// one visible at the snapshot.
+class MergingIterator : public Iterator {
+ public:
+  MergingIterator(vector<unique_ptr<InternalIterator>>&& children,
+                  const SequenceNumber snapshot_seq, ValueResolver resolver,
+                  shared_ptr<const RangeTombstoneList> tombstones,
+                  shared_ptr<const MergeOperator> merge_operator)
+      : children_(move(children)),
+        snapshot_seq_(snapshot_seq),
+        resolver_(move(resolver)),
+        tombstones_(move(tombstones)),
+        merge_operator_(move(merge_operator)),
+        valid_(false) {}
+
+  // Iterator.
+  bool Valid() const override { return valid_; }
+
+  void SeekToFirst() override {
+    for (auto& child : children_) {
+      child->SeekToFirst();
+    }
+    BuildHeap();
+    FindNextVisible();
+  }
+
+  void Seek(const Buffer& target) override {
+    for (auto& child : children_) {
+      child->Seek(target);
+    }
+    BuildHeap();
+    FindNextVisible();
+  }
+
+  void Next() override {
+    CHECK(valid_);
+    SkipKey(key_);
+    FindNextVisible();
+  }
+
+  const Buffer& key() const override {
+    CHECK(valid_);
+    return key_;
+  }
+
+  const Buffer& value() const override {
+    CHECK(valid_);
+    return value_;
+  }
+
+ private:
+  // Orders the heap so the smallest segment is on top. Identical versions are
+  // ordered by child index so the copy in the newest table comes out first.
+  bool HeapGreater(const size_t a, const size_t b) const {
+    const Segment& sa = children_[a]->segment();
+    const Segment& sb = children_[b]->segment();
+    if (sb < sa) {
+      return true;
+    } else if (sa < sb) {
+      return false;
+    }
+    return a > b;
+  }
+
+  void BuildHeap() {
+    heap_.clear();
+    for (size_t ii = 0; ii < children_.size(); ++ii) {
+      if (children_[ii]->Valid()) {
+        heap_.push_back(ii);
+      }
+    }
+    make_heap(heap_.begin(), heap_.end(), Greater());
+  }
+
+  // The segment at the top of the heap.
+  const Segment& Top() const { return children_[heap_.front()]->segment(); }
+
+  // Advances the child at the top of the heap past its current segment.
+  void AdvanceTop() {
+    pop_heap(heap_.begin(), heap_.end(), Greater());
+    const size_t child = heap_.back();
+    children_[child]->Next();
+    if (children_[child]->Valid()) {
+      push_heap(heap_.begin(), heap_.end(), Greater());
+    } else {
+      heap_.pop_back();
+    }
+  }
+
+  // Skips every remaining version of 'key'.
+  void SkipKey(const Buffer& key) {
+    while (!heap_.empty() && Top().key == key) {
+      AdvanceTop();
+    }
+  }
+
+  // Moves to the next key whose newest visible version is not a delete.
+  void FindNextVisible() {
+    valid_ = false;
+    while (!heap_.empty()) {
+      const Segment& top = Top();
+      if (top.seq > snapshot_seq_) {
+        // Written after the snapshot.
+        AdvanceTop();
+        continue;
+      }
+
+      // This is the newest visible version of the key.
+      key_ = top.key;
+      if (top.delete_entry ||
+          (tombstones_ &&
+           tombstones_->MaxCoveringSeq(key_, snapshot_seq_) > top.seq)) {
+        SkipKey(key_);
+        continue;
+      }
+      if (top.merge_operand) {
+        ApplyMergeOperands();
+      } else {
+        value_ = ReadValue(top);
+      }
+      valid_ = true;
+      return;
+    }
+  }
+
+  // Returns the value of a version, reading it from the value log if need be.
+  Buffer ReadValue(const Segment& segment) const {
+    if (!segment.value_ref) {
+      return segment.val;
+    }
+    CHECK(resolver_) << "No way to read values from the value log";
+    return resolver_(segment.val);
+  }
+
+  // Consumes the merge operands of 'key_' at the top of the heap, and the
+  // version beneath them, and applies them to it.
+  void ApplyMergeOperands() {
+    CHECK(merge_operator_) << "Found a merge operand, but no merge operator "
+                              "is set";
+    const SequenceNumber tombstone_seq =
+        tombstones_ ? tombstones_->MaxCoveringSeq(key_, snapshot_seq_) : 0;
+
+    vector<Buffer> operands;
+    SequenceNumber last_seq = kMaxSequenceNumber;
+    bool exists = false;
+    Buffer value;
+    while (!heap_.empty() && Top().key == key_) {
+      const Segment& top = Top();
+      if (top.seq == last_seq) {
+        // Another copy of the version just used.
+        AdvanceTop();
+        continue;
+      }
+      if (top.seq < tombstone_seq) {
+        // Deleted by a range tombstone.
+        break;
+      }
+      last_seq = top.seq;
+      if (!top.merge_operand) {
+        exists = !top.delete_entry;
+        if (exists) {
+          value = ReadValue(top);
+        }
+        break;
+      }
+      operands.push_back(top.val);
+      AdvanceTop();
+    }
+
+    for (auto it = operands.rbegin(); it != operands.rend(); ++it) {
+      value = merge_operator_->Merge(key_, exists ? &value : nullptr, *it);
+      exists = true;
+    }
+    value_ = move(value);
+  }
+
+  // Adapts HeapGreater for the std heap algorithms.
+  struct GreaterFn {
+    const MergingIterator* it;
+    bool operator()(const size_t a, const size_t b) const {
+      return it->HeapGreater(a, b);
+    }
+  };
+  GreaterFn Greater() const { return GreaterFn{this}; }
+
+ private:
+  // Iterators over each table, ordered from newest to oldest.
+  vector<unique_ptr<InternalIterator>> children_;
+
+  // Indices of the valid children, arranged as a min-heap on their segments.
+  vector<size_t> heap_;
+
+  // Versions newer than this are invisible.
+  const SequenceNumber snapshot_seq_;
+
+  // Fetches values from the value log.
+  const ValueResolver resolver_;
+
+  // The range tombstones of every table, if there are any.
+  const shared_ptr<const RangeTombstoneList> tombstones_;
+
+  // Applies merge operands, if there are any.
+  const shared_ptr<const MergeOperator> merge_operator_;
+
+  // The current key/value pair.
+  bool valid_;
+  Buffer key_;
+  Buffer value_;
+};
+
+// Wraps an iterator and stops it at the end of a prefix.
+class PrefixBoundedIterator : public Iterator {
+ public:
+  PrefixBoundedIterator(unique_ptr<Iterator> it, Buffer prefix)
+      : it_(move(it)), prefix_(move(prefix)) {}
+
+  // Iterator.
+  bool Valid() const override {
+    if (!it_->Valid()) {
+      return false;
+    }
+    const Buffer& key = it_->key();
+    return key.size() >= prefix_.size() &&
+           equal(prefix_.begin(), prefix_.end(), key.begin());
+  }
+
+  void SeekToFirst() override { it_->Seek(prefix_); }
+
+  void Seek(const Buffer& target) override {
+    it_->Seek(target < prefix_ ? prefix_ : target);
+  }
+
+  void Next() override {
+    CHECK(Valid());
+    it_->Next();
+  }
+
+  const Buffer& key() const override {
+    CHECK(Valid());
+    return it_->key();
+  }
+
+  const Buffer& value() const override {
+    CHECK(Valid());
+    return it_->value();
+  }
+
+ private:
+  unique_ptr<Iterator> it_;
+  const Buffer prefix_;
+};
+
+class ValueMappingIterator : public Iterator {
+ public:
+  ValueMappingIterator(unique_ptr<Iterator> it,
+                       function<Buffer(const Buffer&)> fn)
+      : it_(move(it)), fn_(move(fn)) {}
+
+  // Iterator.
+  bool Valid() const override { return it_->Valid(); }
+
+  void SeekToFirst() override {
+    it_->SeekToFirst();
+    MapValue();
+  }
+
+  void Seek(const Buffer& target) override {
+    it_->Seek(target);
+    MapValue();
+  }
+
+  void Next() override {
+    CHECK(Valid());
+    it_->Next();
+    MapValue();
+  }
+
+  const Buffer& key() const override {
+    CHECK(Valid());
+    return it_->key();
+  }
+
+  const Buffer& value() const override {
+    CHECK(Valid());
+    return value_;
+  }
+
+ private:
+  // Maps the value at the current position, if there is one.
+  void MapValue() {
+    if (it_->Valid()) {
+      value_ = fn_(it_->value());
+    }
+  }
+
+  unique_ptr<Iterator> it_;
+  const function<Buffer(const Buffer&)> fn_;
+
+  // The mapped value at the current position.
+  Buffer value_;
+};
+
+}  // namespace
+
+unique_ptr<Iterator> NewMergingIterator(
+    vector<unique_ptr<InternalIterator>>&& children,
+    const SequenceNumber snapshot_seq, ValueResolver resolver,
+    shared_ptr<const RangeTombstoneList> tombstones,
+    shared_ptr<const MergeOperator> merge_operator) {
+  return make_unique<MergingIterator>(move(children), snapshot_seq,
+                                      move(resolver), move(tombstones),
+                                      move(merge_operator));
+}
+
+unique_ptr<Iterator> NewPrefixBoundedIterator(unique_ptr<Iterator> it,
+                                              Buffer prefix) {
+  return make_unique<PrefixBoundedIterator>(move(it), move(prefix));
+}
+
+unique_ptr<Iterator> NewValueMappingIterator(
+    unique_ptr<Iterator> it, function<Buffer(const Buffer&)> fn) {
+  return make_unique<ValueMappingIterator>(move(it), move(fn));
+}
+
+}  // namespace diodb
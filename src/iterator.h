@@ -0,0 +1,88 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "buffer.h"
+#include "merge_operator.h"
+#include "range_tombstone.h"
+
+namespace diodb {
+
+// Walks the live key/value pairs of the database in key order. Only the newest
+// version of each key that is visible to the iterator is returned, and deleted
+// keys are skipped. An iterator starts out unpositioned; call SeekToFirst or
+// Seek before reading from it.
+class Iterator {
+ public:
+  virtual ~Iterator() {}
+
+  // Returns true if the iterator is positioned at a key/value pair.
+  virtual bool Valid() const = 0;
+
+  // Positions the iterator at the first key.
+  virtual void SeekToFirst() = 0;
+
+  // Positions the iterator at the first key that is at or past 'target'.
+  virtual void Seek(const Buffer& target) = 0;
+
+  // Moves to the next key. The iterator must be valid.
+  virtual void Next() = 0;
+
+  // The key and value at the current position. The iterator must be valid.
+  virtual const Buffer& key() const = 0;
+  virtual const Buffer& value() const = 0;
+};
+
+// Walks every version stored in a single table, including deletes, in segment
+// order: by key, and versions of the same key from newest to oldest.
+class InternalIterator {
+ public:
+  virtual ~InternalIterator() {}
+
+  // Returns true if the iterator is positioned at a segment.
+  virtual bool Valid() const = 0;
+
+  // Positions the iterator at the first segment.
+  virtual void SeekToFirst() = 0;
+
+  // Positions the iterator at the newest version of the first key that is at
+  // or past 'target'.
+  virtual void Seek(const Buffer& target) = 0;
+
+  // Moves to the next segment. The iterator must be valid.
+  virtual void Next() = 0;
+
+  // The segment at the current position. The iterator must be valid.
+  virtual const Segment& segment() const = 0;
+};
+
+// Turns a value log reference into the value it points to.
+using ValueResolver = std::function<Buffer(const Buffer& ref)>;
+
+// Returns an iterator that merges 'children', ordered from newest to oldest
+// table, into a view of the database as of 'snapshot_seq'. When two tables hold
+// the same version of a key, the newer table wins. Values held in the value log
+// are fetched through 'resolver', which must be set if there are any. Keys
+// covered by one of 'tombstones', the range tombstones of all the tables, are
+// skipped. Merge operands are applied to the versions beneath them with
+// 'merge_operator', which must be set if there are any.
+std::unique_ptr<Iterator> NewMergingIterator(
+    std::vector<std::unique_ptr<InternalIterator>>&& children,
+    SequenceNumber snapshot_seq, ValueResolver resolver = nullptr,
+    std::shared_ptr<const RangeTombstoneList> tombstones = nullptr,
+    std::shared_ptr<const MergeOperator> merge_operator = nullptr);
+
+// Returns an iterator that only walks the keys of 'it' that start with
+// 'prefix'. SeekToFirst positions it at the first such key, and it becomes
+// invalid once it moves past the last one.
+std::unique_ptr<Iterator> NewPrefixBoundedIterator(std::unique_ptr<Iterator> it,
+                                                   Buffer prefix);
+
+// Returns an iterator over the same keys as 'it', whose values are those of
+// 'it' passed through 'fn'.
+std::unique_ptr<Iterator> NewValueMappingIterator(
+    std::unique_ptr<Iterator> it, std::function<Buffer(const Buffer&)> fn);
+
+}  // namespace diodb
@@ -0,0 +1,240 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+#include <glog/logging.h>
+
+#include "coding.h"
+#include "manifest.h"
+
+using namespace std;
+
+namespace diodb {
+
+namespace {
+
+// Number of edits appended before the manifest is rewritten as a single one.
+constexpr size_t kMaxEditsBeforeRewrite = 1024;
+
+void PutLengthPrefixed(Buffer* dst, const Buffer& data) {
+  coding::PutFixed32(dst, data.size());
+  dst->insert(dst->end(), data.begin(), data.end());
+}
+
+bool GetLengthPrefixed(const char** p, const char* limit, Buffer* data) {
+  if (static_cast<size_t>(limit - *p) < sizeof(uint32_t)) {
+    return false;
+  }
+  const uint32_t size = coding::DecodeFixed32(*p);
+  const char* begin = *p + sizeof(uint32_t);
+  if (static_cast<size_t>(limit - begin) < size) {
+    return false;
+  }
+  data->assign(begin, begin + size);
+  *p = begin + size;
+  return true;
+}
+
+// Each table in an edit is a segment keyed by its file name. Removed tables
+// are deletes, and added ones carry their level and key range in the value.
+Segment EncodeAddedTable(const Manifest::TableEntry& entry) {
+  Buffer val;
+  coding::PutFixed32(&val, static_cast<uint32_t>(entry.level));
+  PutLengthPrefixed(&val, entry.smallest_key);
+  PutLengthPrefixed(&val, entry.largest_key);
+  return Segment(Buffer(entry.file_name.begin(), entry.file_name.end()),
+                 move(val));
+}
+
+bool DecodeAddedTable(const Segment& segment, Manifest::TableEntry* entry) {
+  const char* p = segment.val.data();
+  const char* const limit = segment.val.data() + segment.val.size();
+  if (segment.val.size() < sizeof(uint32_t)) {
+    return false;
+  }
+  const uint32_t level = coding::DecodeFixed32(p);
+  if (level > static_cast<uint32_t>(Manifest::Level::kBase)) {
+    return false;
+  }
+  p += sizeof(uint32_t);
+  entry->file_name.assign(segment.key.begin(), segment.key.end());
+  entry->level = static_cast<Manifest::Level>(level);
+  return GetLengthPrefixed(&p, limit, &entry->smallest_key) &&
+         GetLengthPrefixed(&p, limit, &entry->largest_key) && p == limit;
+}
+
+}  // namespace
+
+Manifest::Manifest(const fs::path& db_directory)
+    : db_directory_(db_directory),
+      fd_(-1),
+      num_edits_since_rewrite_(0),
+      num_edits_written_(0) {
+  fs::create_directories(db_directory_);
+  lock_guard<mutex> lock(mtx_);
+  Replay();
+  Rewrite();
+  LOG(INFO) << "Opened manifest " << filepath() << " with " << level0_.size()
+            << " level-0 and " << base_.size() << " base sstables";
+}
+
+Manifest::~Manifest() { close(fd_); }
+
+void Manifest::Apply(const VersionEdit& edit) {
+  lock_guard<mutex> lock(mtx_);
+  ApplyToTables(edit);
+  if (num_edits_since_rewrite_ >= kMaxEditsBeforeRewrite) {
+    Rewrite();
+    return;
+  }
+  AppendRecord(fd_, edit);
+  ++num_edits_since_rewrite_;
+}
+
+vector<Manifest::TableEntry> Manifest::level0() const {
+  lock_guard<mutex> lock(mtx_);
+  return level0_;
+}
+
+vector<Manifest::TableEntry> Manifest::base() const {
+  lock_guard<mutex> lock(mtx_);
+  return base_;
+}
+
+size_t Manifest::num_edits_written() const {
+  lock_guard<mutex> lock(mtx_);
+  return num_edits_written_;
+}
+
+void Manifest::ApplyToTables(const VersionEdit& edit) {
+  for (const auto& file_name : edit.removed) {
+    const auto named = [&file_name](const TableEntry& entry) {
+      return entry.file_name == file_name;
+    };
+    level0_.erase(remove_if(level0_.begin(), level0_.end(), named),
+                  level0_.end());
+    base_.erase(remove_if(base_.begin(), base_.end(), named), base_.end());
+  }
+
+  for (const auto& entry : edit.added) {
+    if (entry.level == Level::kLevel0) {
+      level0_.insert(level0_.begin(), entry);
+      continue;
+    }
+    const auto pos = upper_bound(
+        base_.begin(), base_.end(), entry,
+        [](const TableEntry& a, const TableEntry& b) {
+          return a.smallest_key < b.smallest_key;
+        });
+    base_.insert(pos, entry);
+  }
+}
+
+void Manifest::Replay() {
+  const fs::path path = filepath();
+  if (!fs::exists(path)) {
+    return;
+  }
+
+  ifstream ifs(path.string(), ios::binary);
+  const Buffer contents((istreambuf_iterator<char>(ifs)),
+                        istreambuf_iterator<char>());
+
+  size_t num_edits = 0;
+  const char* p = contents.data();
+  const char* const end = contents.data() + contents.size();
+  while (p < end) {
+    const char* payload;
+    const char* limit;
+    if (!coding::DecodeRecord(&p, end, &payload, &limit) ||
+        static_cast<size_t>(limit - payload) < sizeof(uint32_t)) {
+      LOG(WARNING) << "Discarding torn or corrupt edit at offset "
+                   << p - contents.data() << " of " << path;
+      break;
+    }
+
+    const char* cur = payload + sizeof(uint32_t);
+    const uint32_t count = coding::DecodeFixed32(payload);
+    VersionEdit edit;
+    for (uint32_t ii = 0; ii < count; ++ii) {
+      Segment segment;
+      CHECK(coding::DecodeSegment(&cur, limit, &segment))
+          << "Malformed edit with a valid checksum in " << path;
+      if (segment.delete_entry) {
+        edit.removed.emplace_back(segment.key.begin(), segment.key.end());
+        continue;
+      }
+      TableEntry entry;
+      CHECK(DecodeAddedTable(segment, &entry))
+          << "Malformed table entry with a valid checksum in " << path;
+      edit.added.push_back(move(entry));
+    }
+    ApplyToTables(edit);
+    ++num_edits;
+  }
+
+  LOG(INFO) << "Replayed " << num_edits << " edits from " << path;
+}
+
+void Manifest::Rewrite() {
+  // Level-0 tables are added oldest first, so that each becomes the newest.
+  VersionEdit snapshot;
+  snapshot.added.assign(level0_.rbegin(), level0_.rend());
+  snapshot.added.insert(snapshot.added.end(), base_.begin(), base_.end());
+
+  const fs::path path = filepath();
+  const fs::path tmp_path = db_directory_ / "MANIFEST.tmp";
+  const int fd =
+      open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  PCHECK(fd >= 0) << "Unable to create manifest " << tmp_path;
+  AppendRecord(fd, snapshot);
+
+  // The rename has to reach the disk before any edit is appended to the new
+  // file, or a crash could bring back the old one without that edit.
+  fs::rename(tmp_path, path);
+  const int dir_fd = open(db_directory_.c_str(), O_RDONLY);
+  PCHECK(dir_fd >= 0) << "Unable to open " << db_directory_;
+  PCHECK(fsync(dir_fd) == 0) << "Error syncing " << db_directory_;
+  close(dir_fd);
+
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  fd_ = fd;
+  num_edits_since_rewrite_ = 0;
+}
+
+void Manifest::AppendRecord(const int fd, const VersionEdit& edit) {
+  Buffer record;
+  coding::StartRecord(&record);
+  coding::PutFixed32(&record, edit.removed.size() + edit.added.size());
+  for (const auto& file_name : edit.removed) {
+    coding::EncodeSegment(
+        Segment(Buffer(file_name.begin(), file_name.end()), Buffer(), true),
+        &record);
+  }
+  for (const auto& entry : edit.added) {
+    coding::EncodeSegment(EncodeAddedTable(entry), &record);
+  }
+  coding::FinishRecord(&record);
+
+  const char* p = record.data();
+  size_t remaining = record.size();
+  while (remaining > 0) {
+    const ssize_t ret = write(fd, p, remaining);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    PCHECK(ret > 0) << "Error appending to manifest";
+    p += ret;
+    remaining -= ret;
+  }
+  PCHECK(fdatasync(fd) == 0) << "Error syncing manifest";
+  ++num_edits_written_;
+}
+
+}  // namespace diodb
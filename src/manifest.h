@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "buffer.h"
+
+namespace fs = boost::filesystem;
+
+namespace diodb {
+
+// Log of the changes to the set of live SSTables, kept in a MANIFEST file in
+// the database directory. Every flush and merge appends an edit before
+// installing its new version, so that opening the database loads exactly the
+// tables the last version held, at their levels, and ignores any file a crash
+// left half-written.
+//
+// Edits use the same record framing as the write-ahead log, and a torn edit at
+// the tail is discarded on replay. The log is rewritten as a single edit when
+// it's opened and whenever it grows long, by writing a new file and renaming
+// it over the old one.
+class Manifest {
+ public:
+  enum class Level {
+    kLevel0 = 0,
+    kBase = 1,
+  };
+
+  typedef struct TableEntry {
+    // Name of the table file within the database directory.
+    std::string file_name;
+    Level level;
+    Buffer smallest_key;
+    Buffer largest_key;
+  } TableEntry;
+
+  // Tables leaving and joining the current version. Removals are applied
+  // first, so a table can change levels by appearing in both. Each added
+  // level-0 table becomes the newest, and base tables are kept sorted by key.
+  typedef struct VersionEdit {
+    std::vector<std::string> removed;
+    std::vector<TableEntry> added;
+  } VersionEdit;
+
+  // Replays the manifest in 'db_directory', if there is one, and rewrites it
+  // to hold just the tables that are live.
+  explicit Manifest(const fs::path& db_directory);
+  ~Manifest();
+
+  // Appends an edit and syncs it to disk.
+  void Apply(const VersionEdit& edit);
+
+  // Level-0 tables, newest first.
+  std::vector<TableEntry> level0() const;
+
+  // Base tables, sorted by key.
+  std::vector<TableEntry> base() const;
+
+  // Accessors.
+  fs::path filepath() const { return db_directory_ / "MANIFEST"; }
+  size_t num_edits_written() const;
+
+ private:
+  // Applies an edit to 'level0_' and 'base_'.
+  void ApplyToTables(const VersionEdit& edit);
+
+  // Reads the edits in the manifest file, if it exists.
+  void Replay();
+
+  // Replaces the manifest file with one holding a single edit that adds every
+  // live table, and opens it for appending.
+  void Rewrite();
+
+  // Appends a framed edit to 'fd' and syncs it.
+  void AppendRecord(int fd, const VersionEdit& edit);
+
+  const fs::path db_directory_;
+
+  // Protects everything below.
+  mutable std::mutex mtx_;
+
+  std::vector<TableEntry> level0_;
+  std::vector<TableEntry> base_;
+
+  // File descriptor of the manifest file being appended to.
+  int fd_;
+
+  // Edits appended since the file was last rewritten.
+  size_t num_edits_since_rewrite_;
+
+  // Stats.
+  size_t num_edits_written_;
+};
+
+}  // namespace diodb
@@ -1,3 +1,5 @@
+#include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <utility>
 #include <vector>
@@ -10,13 +12,35 @@ using namespace std;
 
 namespace diodb {
 
+namespace {
+
+// Number of versions a MemtableIterator copies out at a time.
+constexpr size_t kIteratorBatchSize = 128;
+
+}  // namespace
+
 Memtable::Memtable() : is_locked_(false) {}
 
+Memtable::Memtable(Memtable&& other)
+    : TableStats(other),
+      memtable_map_(move(other.memtable_map_)),
+      range_tombstones_(move(other.range_tombstones_)),
+      is_locked_(other.is_locked_.load()) {}
+
+Memtable& Memtable::operator=(Memtable&& other) {
+  TableStats::operator=(other);
+  memtable_map_ = move(other.memtable_map_);
+  range_tombstones_ = move(other.range_tombstones_);
+  is_locked_ = other.is_locked_.load();
+  return *this;
+}
+
 ReadableTable::DetailedKeyResponse Memtable::DeletedKeyExists(const Buffer& key) const {
   ReadableTable::DetailedKeyResponse ret;
-  if (memtable_map_.count(key) > 0) {
+  Segment segment;
+  if (FindSegment(key, kMaxSequenceNumber, &segment)) {
     ret.exists = true;
-    ret.is_deleted = memtable_map_.at(key).delete_entry;
+    ret.is_deleted = segment.delete_entry;
   } else {
     ret.exists = false;
     ret.is_deleted = false;
@@ -25,57 +49,168 @@ ReadableTable::DetailedKeyResponse Memtable::DeletedKeyExists(const Buffer& key)
   return ret;
 }
 
-bool Memtable::Put(const string& key, const string& val, const bool del) {
+Memtable::MapType::const_iterator Memtable::Newest(const Buffer& key) const {
+  const auto it = memtable_map_.lower_bound({key, kMaxSequenceNumber});
+  if (it == memtable_map_.end() || it->first.first != key) {
+    return memtable_map_.end();
+  }
+  return it;
+}
+
+bool Memtable::FindSegment(const Buffer& key, const SequenceNumber snapshot_seq,
+                           Segment* segment) const {
+  shared_lock<shared_mutex> lock(mtx_);
+  const auto it = memtable_map_.lower_bound({key, snapshot_seq});
+  const bool found = it != memtable_map_.end() && it->first.first == key;
+  if (found) {
+    *segment = it->second;
+  }
+  return ApplyRangeTombstone(
+      key, MaxCoveringSeq(range_tombstones_, key, snapshot_seq), found,
+      segment);
+}
+
+void Memtable::FindSegments(const SequenceNumber snapshot_seq,
+                            vector<KeyLookup>* lookups) const {
+  // Take the lock once for the whole batch.
+  shared_lock<shared_mutex> lock(mtx_);
+  for (auto& lookup : *lookups) {
+    if (lookup.found) {
+      continue;
+    }
+    const auto it = memtable_map_.lower_bound({*lookup.key, snapshot_seq});
+    const bool found =
+        it != memtable_map_.end() && it->first.first == *lookup.key;
+    if (found) {
+      lookup.segment = it->second;
+    }
+    const SequenceNumber tombstone_seq =
+        MaxCoveringSeq(range_tombstones_, *lookup.key, snapshot_seq);
+    lookup.found = ApplyRangeTombstone(*lookup.key, tombstone_seq, found,
+                                       &lookup.segment);
+  }
+}
+
+bool Memtable::Put(const string& key, const string& val, const bool del,
+                   const SequenceNumber seq) {
   Buffer key_buf(key.begin(), key.end());
   Buffer val_buf(val.begin(), val.end());
-  return Put(move(key_buf), move(val_buf), del);
+  return Put(move(key_buf), move(val_buf), del, seq);
+}
+
+bool Memtable::Put(Buffer&& key, Buffer&& val, const bool del,
+                   const SequenceNumber seq, const bool value_ref) {
+  Segment segment(key, del ? Buffer() : move(val), del, seq);
+  segment.value_ref = value_ref && !del;
+  return Insert(move(key), move(segment));
+}
+
+bool Memtable::Merge(Buffer&& key, Buffer&& operand,
+                     const SequenceNumber seq) {
+  Segment segment(key, move(operand), false /* del */, seq);
+  segment.merge_operand = true;
+  return Insert(move(key), move(segment));
 }
 
-bool Memtable::Put(Buffer&& key, Buffer&& val, const bool del) {
+bool Memtable::Insert(Buffer&& key, Segment&& segment) {
+  unique_lock<shared_mutex> lock(mtx_);
   if (is_locked_) {
     return false;
   }
 
-  Segment segment(key, val, del);
+  // The entry counts describe the newest version of each key. A merge operand
+  // always leaves the key with a value.
+  const bool del = segment.delete_entry;
+  const SequenceNumber seq = segment.seq;
+  const auto newest = Newest(key);
+  if (newest == memtable_map_.end()) {
+    ++(del ? mutable_num_delete_entries() : mutable_num_valid_entries());
+  } else if (newest->first.second <= seq &&
+             newest->second.delete_entry != del) {
+    --(del ? mutable_num_valid_entries() : mutable_num_delete_entries());
+    ++(del ? mutable_num_delete_entries() : mutable_num_valid_entries());
+  }
 
-  if (memtable_map_.count(key) > 0) {
-    if (memtable_map_[key].delete_entry) {
-      --mutable_num_delete_entries();
-      ++mutable_num_valid_entries();
-    }
-    memtable_map_[key] = move(segment);
+  mutable_num_bytes() += segment.key_size + segment.val_size;
+
+  auto it = memtable_map_.find({key, seq});
+  if (it != memtable_map_.end()) {
+    mutable_num_bytes() -= it->second.key_size + it->second.val_size;
+    it->second = move(segment);
   } else {
-    memtable_map_.emplace(move(key), move(segment));
-    ++mutable_num_valid_entries();
+    memtable_map_.emplace(make_pair(move(key), seq), move(segment));
   }
 
   return true;
 }
 
 Buffer Memtable::Get(const Buffer& key) const {
-  if (!KeyExists(key)) {
+  Segment segment;
+  if (!FindSegment(key, kMaxSequenceNumber, &segment) ||
+      segment.delete_entry) {
     return Buffer();
   }
-  return memtable_map_.at(key).val;
+  return move(segment.val);
+}
+
+bool Memtable::Erase(Buffer&& key, const SequenceNumber seq) {
+  return Put(move(key), Buffer(), true /* del */, seq);
 }
 
-bool Memtable::Erase(Buffer&& key) {
+bool Memtable::DeleteRange(Buffer&& begin, Buffer&& end,
+                           const SequenceNumber seq) {
+  unique_lock<shared_mutex> lock(mtx_);
   if (is_locked_) {
     return false;
   }
 
-  if (memtable_map_.count(key) > 0 && memtable_map_[key].delete_entry) {
-    return true;
-  } else if (memtable_map_.count(key) > 0 && !memtable_map_[key].delete_entry) {
-    memtable_map_[key].delete_entry = true;
-  } else if (memtable_map_.count(key) == 0) {
-    Buffer buf;
-    Put(move(key), move(buf), true /* del */);
+  mutable_num_bytes() += begin.size() + end.size();
+  range_tombstones_.emplace_back(move(begin), move(end), seq);
+  return true;
+}
+
+vector<RangeTombstone> Memtable::range_tombstones() const {
+  shared_lock<shared_mutex> lock(mtx_);
+  return range_tombstones_;
+}
+
+void Memtable::Scan(const Buffer& key, const SequenceNumber seq,
+                    const bool after, const size_t max_entries,
+                    vector<Segment>* segments) const {
+  shared_lock<shared_mutex> lock(mtx_);
+  auto it = after ? memtable_map_.upper_bound({key, seq})
+                  : memtable_map_.lower_bound({key, seq});
+  for (; it != memtable_map_.end() && segments->size() < max_entries; ++it) {
+    segments->push_back(it->second);
+  }
+}
+
+MemtableIterator::MemtableIterator(shared_ptr<const Memtable> memtable)
+    : memtable_(move(memtable)), pos_(0) {}
+
+void MemtableIterator::SeekToFirst() {
+  Fill(Buffer(), kMaxSequenceNumber, false /* after */);
+}
+
+void MemtableIterator::Seek(const Buffer& target) {
+  Fill(target, kMaxSequenceNumber, false /* after */);
+}
+
+void MemtableIterator::Next() {
+  CHECK(Valid());
+  ++pos_;
+  if (pos_ == batch_.size() && batch_.size() == kIteratorBatchSize) {
+    // The batch ran out, but the memtable may hold more.
+    const Segment last = move(batch_.back());
+    Fill(last.key, last.seq, true /* after */);
   }
+}
 
-  --mutable_num_valid_entries();
-  ++mutable_num_delete_entries();
-  return true;
+void MemtableIterator::Fill(const Buffer& key, const SequenceNumber seq,
+                            const bool after) {
+  batch_.clear();
+  pos_ = 0;
+  memtable_->Scan(key, seq, after, kIteratorBatchSize, &batch_);
 }
 
 }  // namespace diodb
@@ -1,24 +1,45 @@
 #pragma once
 
+#include <atomic>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "buffer.h"
+#include "iterator.h"
+#include "range_tombstone.h"
 #include "readable_table_base.h"
 #include "table_stats.h"
 
 namespace diodb {
 
+// The memtable keeps every version of a key that it is given, ordered from
+// newest to oldest, so that reads at older snapshots can still find theirs.
+// Versions that no snapshot needs are dropped when the memtable is flushed.
+//
+// Lookups may run concurrently with each other and with Put/Erase. Iterating
+// over the memtable is only safe once it is locked.
 class Memtable : public TableStats, public ReadableTable {
  public:
   Memtable();
   virtual ~Memtable() {}
 
+  // The mutex doesn't move, so a moved-to memtable gets its own. Neither
+  // memtable may be in use by another thread during the move.
+  Memtable(Memtable&& other);
+  Memtable& operator=(Memtable&& other);
+
   // ReadableTable.
   virtual ReadableTable::DetailedKeyResponse DeletedKeyExists(
       const Buffer& key) const override;
+  virtual bool FindSegment(const Buffer& key, SequenceNumber snapshot_seq,
+                           Segment* segment) const override;
+  virtual void FindSegments(SequenceNumber snapshot_seq,
+                            std::vector<KeyLookup>* lookups) const override;
   virtual Buffer Get(const Buffer& key) const override;
   virtual Buffer Get(const std::string&& key) const {
     Buffer k(key.begin(), key.end());
@@ -26,35 +47,90 @@ class Memtable : public TableStats, public ReadableTable {
   }
   virtual size_t Size() const override { return num_valid_entries(); }
 
-  // Inserts a key/value pair into the memtable. Returns true if successful.
-  bool Put(Buffer&& key, Buffer&& val, const bool del = false);
+  // Inserts a version of a key/value pair into the memtable. A version with
+  // the same key and sequence number replaces the existing one. If
+  // 'value_ref' is set, 'val' is a reference into the value log. Returns true
+  // if successful.
+  bool Put(Buffer&& key, Buffer&& val, const bool del = false,
+           const SequenceNumber seq = 0, const bool value_ref = false);
   bool Put(const std::string& key, const std::string& val,
-           const bool del = false);
+           const bool del = false, const SequenceNumber seq = 0);
 
-  // Erases a key/value pair from the memtable. Returns true if successful.
-  bool Erase(Buffer&& key);
+  // Erases a key/value pair from the memtable by inserting a delete entry.
+  // Returns true if successful.
+  bool Erase(Buffer&& key, const SequenceNumber seq = 0);
   bool Erase(const std::string&& key) {
     Buffer k(key.begin(), key.end());
     return Erase(std::move(k));
   }
 
+  // Inserts a merge operand for a key, which reads apply to the older
+  // versions. Returns true if successful.
+  bool Merge(Buffer&& key, Buffer&& operand, SequenceNumber seq);
+
+  // Deletes every key in ['begin', 'end') older than 'seq'. Lookups in the
+  // memtable honor the deletion, and it is carried into the SSTable the
+  // memtable is flushed to. Returns true if successful.
+  bool DeleteRange(Buffer&& begin, Buffer&& end, SequenceNumber seq);
+
+  // Returns a copy of the range deletes in the memtable.
+  std::vector<RangeTombstone> range_tombstones() const;
+
+  // Copies up to 'max_entries' versions into 'segments' in segment order,
+  // starting with the version of 'key' at 'seq' or the first one after it. If
+  // 'after' is set, that version itself is skipped.
+  void Scan(const Buffer& key, SequenceNumber seq, bool after,
+            size_t max_entries, std::vector<Segment>* segments) const;
+
   // Locks the memtable, rendering it immutable.
-  inline void Lock() { is_locked_ = true; }
+  inline void Lock() {
+    std::unique_lock<std::shared_mutex> lock(mtx_);
+    is_locked_ = true;
+  }
 
   // Accessors.
   bool is_locked() const { return is_locked_; }
+  size_t num_range_tombstones() const {
+    std::shared_lock<std::shared_mutex> lock(mtx_);
+    return range_tombstones_.size();
+  }
 
  private:
   void InitializeStats();
 
  private:
+  // Orders versions by key, then from newest to oldest.
+  typedef struct VersionedKeyComparator {
+    bool operator()(const std::pair<Buffer, SequenceNumber>& a,
+                    const std::pair<Buffer, SequenceNumber>& b) const {
+      return a.first < b.first ||
+             (a.first == b.first && a.second > b.second);
+    }
+  } VersionedKeyComparator;
+
+  // Inserts a version of a key, which 'segment' describes. Returns false if
+  // the memtable is locked.
+  bool Insert(Buffer&& key, Segment&& segment);
+
+  // Returns the newest version of a key, or end() if there is none.
+  std::map<std::pair<Buffer, SequenceNumber>, Segment,
+           VersionedKeyComparator>::const_iterator
+  Newest(const Buffer& key) const;
+
+  // Readers share the mutex and Put takes it exclusively.
+  mutable std::shared_mutex mtx_;
+
   // Sorted structure for key/value mappings.
   // TODO: Use some abseil map.
-  std::map<Buffer, Segment> memtable_map_;
+  std::map<std::pair<Buffer, SequenceNumber>, Segment, VersionedKeyComparator>
+      memtable_map_;
+
+  // The range deletes, in the order they were written.
+  std::vector<RangeTombstone> range_tombstones_;
 
   // If the memtable is locked, no further Put/Erase operations are allowed.
   // This is asserted.
-  bool is_locked_;
+  std::atomic<bool> is_locked_;
 
  public:
   // Iterator will just iterate over the internal map type.
@@ -69,4 +145,31 @@ class Memtable : public TableStats, public ReadableTable {
   inline const_iterator cend() const { return memtable_map_.cend(); }
 };
 
+// Iterates over a memtable that may still be taking writes. Versions are copied
+// out in small batches under the memtable's lock, so the iterator sees every
+// version that was present when a batch was taken but never holds the lock
+// between calls.
+class MemtableIterator : public InternalIterator {
+ public:
+  explicit MemtableIterator(std::shared_ptr<const Memtable> memtable);
+
+  // InternalIterator.
+  bool Valid() const override { return pos_ < batch_.size(); }
+  void SeekToFirst() override;
+  void Seek(const Buffer& target) override;
+  void Next() override;
+  const Segment& segment() const override { return batch_[pos_]; }
+
+ private:
+  // Replaces the batch with the versions starting at the given position.
+  void Fill(const Buffer& key, SequenceNumber seq, bool after);
+
+ private:
+  std::shared_ptr<const Memtable> memtable_;
+
+  // The versions copied out of the memtable, and the current one.
+  std::vector<Segment> batch_;
+  size_t pos_;
+};
+
 }  // namespace diodb
@@ -0,0 +1,112 @@
+#include <glog/logging.h>
+
+#include "coding.h"
+#include "compaction_filter.h"
+#include "merge_operator.h"
+
+using namespace std;
+
+DEFINE_string(merge_operator, "",
+              "How DBController::Merge operands are applied to values. Either "
+              "'uint64add' to add 64-bit counters, 'append:<c>' to append "
+              "the operands separated by c, or empty if merges aren't used.");
+
+namespace diodb {
+
+namespace {
+
+class UInt64AddOperator : public MergeOperator {
+ public:
+  Buffer Merge(const Buffer& /* key */, const Buffer* existing_value,
+               const Buffer& operand) const override {
+    Buffer result;
+    coding::PutFixed64(&result, Decode(existing_value) + Decode(&operand));
+    return result;
+  }
+
+  string Name() const override { return "uint64add"; }
+
+ private:
+  // Values that don't hold a counter count as zero.
+  static uint64_t Decode(const Buffer* value) {
+    if (!value || value->size() != sizeof(uint64_t)) {
+      return 0;
+    }
+    return coding::DecodeFixed64(value->data());
+  }
+};
+
+class AppendOperator : public MergeOperator {
+ public:
+  explicit AppendOperator(const char delimiter) : delimiter_(delimiter) {}
+
+  Buffer Merge(const Buffer& /* key */, const Buffer* existing_value,
+               const Buffer& operand) const override {
+    if (!existing_value) {
+      return operand;
+    }
+    Buffer result;
+    result.reserve(existing_value->size() + 1 + operand.size());
+    result.insert(result.end(), existing_value->begin(), existing_value->end());
+    result.push_back(delimiter_);
+    result.insert(result.end(), operand.begin(), operand.end());
+    return result;
+  }
+
+  string Name() const override { return string("append:") + delimiter_; }
+
+ private:
+  const char delimiter_;
+};
+
+}  // namespace
+
+shared_ptr<const MergeOperator> MergeOperator::Create(const string& spec) {
+  if (spec.empty()) {
+    return nullptr;
+  }
+  if (spec == "uint64add") {
+    return make_shared<UInt64AddOperator>();
+  }
+
+  const size_t colon = spec.find(':');
+  CHECK_NE(colon, string::npos) << "Malformed merge operator " << spec;
+  const string type = spec.substr(0, colon);
+  const string arg = spec.substr(colon + 1);
+  if (type == "append") {
+    CHECK_EQ(arg.size(), 1) << "Malformed merge operator " << spec;
+    return make_shared<AppendOperator>(arg[0]);
+  }
+
+  LOG(FATAL) << "Unknown merge operator " << spec;
+  return nullptr;
+}
+
+shared_ptr<const MergeOperator> MergeOperator::FromFlags() {
+  return Create(FLAGS_merge_operator);
+}
+
+TtlMergeOperator::TtlMergeOperator(shared_ptr<const MergeOperator> inner)
+    : inner_(move(inner)) {}
+
+Buffer TtlMergeOperator::Merge(const Buffer& key, const Buffer* existing_value,
+                               const Buffer& operand) const {
+  Buffer user_operand = operand;
+  uint64_t write_time = 0;
+  TtlCompactionFilter::StripWriteTime(&user_operand, &write_time);
+
+  Buffer result;
+  if (existing_value) {
+    Buffer user_value = *existing_value;
+    TtlCompactionFilter::StripWriteTime(&user_value);
+    result = inner_->Merge(key, &user_value, user_operand);
+  } else {
+    result = inner_->Merge(key, nullptr, user_operand);
+  }
+  TtlCompactionFilter::AppendWriteTime(write_time, &result);
+  return result;
+}
+
+string TtlMergeOperator::Name() const { return "ttl," + inner_->Name(); }
+
+}  // namespace diodb
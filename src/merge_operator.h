@@ -0,0 +1,62 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "buffer.h"
+
+namespace diodb {
+
+// Applies updates to values without reading them first. DBController::Merge
+// stores an operand, such as an amount to add to a counter, as a version of
+// its own. Reads fold the operands of a key into the value beneath them, and
+// merges fold them into new values as they copy them, so an update costs a
+// single write however the value is built.
+//
+// Operators must be associative: merging an operand into one that was merged
+// into a value must give the same result as merging both into the value one
+// after the other. That lets merges fold operands into each other before the
+// value they apply to is known. An operator is called from reads and from the
+// background threads, and must be thread-safe.
+class MergeOperator {
+ public:
+  virtual ~MergeOperator() {}
+
+  // Returns the result of applying 'operand' to 'existing_value', which is
+  // null if the key doesn't exist.
+  virtual Buffer Merge(const Buffer& key, const Buffer* existing_value,
+                       const Buffer& operand) const = 0;
+
+  // Describes the operator. Two operators with the same name produce the same
+  // values.
+  virtual std::string Name() const = 0;
+
+  // Creates an operator from a specification of the form
+  //   uint64add     adds 64-bit unsigned integers encoded with
+  //                 coding::PutFixed64, treating anything else as zero
+  //   append:<c>    appends the operands to the value, separated by c
+  // Returns null for an empty specification. Aborts on a malformed one.
+  static std::shared_ptr<const MergeOperator> Create(const std::string& spec);
+
+  // Returns the operator configured by --merge_operator, or null if none is.
+  static std::shared_ptr<const MergeOperator> FromFlags();
+};
+
+// Runs 'inner' on values stored with their write time, as they are when
+// --ttl_seconds is set. The write times are removed before 'inner' sees the
+// values, and the result carries the time the operand was written, so that
+// updating a value keeps it from expiring.
+class TtlMergeOperator : public MergeOperator {
+ public:
+  explicit TtlMergeOperator(std::shared_ptr<const MergeOperator> inner);
+
+  // MergeOperator.
+  Buffer Merge(const Buffer& key, const Buffer* existing_value,
+               const Buffer& operand) const override;
+  std::string Name() const override;
+
+ private:
+  const std::shared_ptr<const MergeOperator> inner_;
+};
+
+}  // namespace diodb
@@ -0,0 +1,86 @@
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "prefix_extractor.h"
+
+using namespace std;
+
+DEFINE_string(prefix_extractor, "",
+              "How keys are mapped to the prefixes that SSTable prefix "
+              "filters are built on. Either 'fixed:<n>' for the first n "
+              "bytes, 'delimiter:<c>' for everything up to and including the "
+              "first c, or empty to disable prefix filters.");
+
+namespace diodb {
+
+namespace {
+
+class FixedPrefixExtractor : public PrefixExtractor {
+ public:
+  explicit FixedPrefixExtractor(const size_t length) : length_(length) {}
+
+  bool InDomain(const Buffer& key) const override {
+    return key.size() >= length_;
+  }
+
+  Buffer Transform(const Buffer& key) const override {
+    return Buffer(key.begin(), key.begin() + length_);
+  }
+
+  string Name() const override { return "fixed:" + to_string(length_); }
+
+ private:
+  const size_t length_;
+};
+
+class DelimiterPrefixExtractor : public PrefixExtractor {
+ public:
+  explicit DelimiterPrefixExtractor(const char delimiter)
+      : delimiter_(delimiter) {}
+
+  bool InDomain(const Buffer& key) const override {
+    return find(key.begin(), key.end(), delimiter_) != key.end();
+  }
+
+  Buffer Transform(const Buffer& key) const override {
+    return Buffer(key.begin(), find(key.begin(), key.end(), delimiter_) + 1);
+  }
+
+  string Name() const override { return string("delimiter:") + delimiter_; }
+
+ private:
+  const char delimiter_;
+};
+
+}  // namespace
+
+shared_ptr<const PrefixExtractor> PrefixExtractor::Create(const string& spec) {
+  if (spec.empty()) {
+    return nullptr;
+  }
+
+  const size_t colon = spec.find(':');
+  CHECK_NE(colon, string::npos) << "Malformed prefix extractor " << spec;
+  const string type = spec.substr(0, colon);
+  const string arg = spec.substr(colon + 1);
+  if (type == "fixed") {
+    CHECK(!arg.empty() && all_of(arg.begin(), arg.end(), ::isdigit))
+        << "Malformed prefix extractor " << spec;
+    const size_t length = stoul(arg);
+    CHECK_GT(length, 0) << "Malformed prefix extractor " << spec;
+    return make_shared<FixedPrefixExtractor>(length);
+  } else if (type == "delimiter") {
+    CHECK_EQ(arg.size(), 1) << "Malformed prefix extractor " << spec;
+    return make_shared<DelimiterPrefixExtractor>(arg[0]);
+  }
+
+  LOG(FATAL) << "Unknown prefix extractor " << spec;
+  return nullptr;
+}
+
+shared_ptr<const PrefixExtractor> PrefixExtractor::FromFlags() {
+  return Create(FLAGS_prefix_extractor);
+}
+
+}  // namespace diodb
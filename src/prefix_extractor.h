@@ -0,0 +1,41 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "buffer.h"
+
+namespace diodb {
+
+// Maps a key to the prefix that prefix filters and prefix scans work with,
+// e.g. the tenant a key belongs to. Extractors must be prefix-preserving: if a
+// key is in the domain, every key that starts with it is also in the domain
+// and has the same prefix. That is what lets a filter over prefixes answer
+// whether a table holds any key starting with a given string.
+class PrefixExtractor {
+ public:
+  virtual ~PrefixExtractor() {}
+
+  // Returns true if the key has a prefix.
+  virtual bool InDomain(const Buffer& key) const = 0;
+
+  // Returns the prefix of a key in the domain.
+  virtual Buffer Transform(const Buffer& key) const = 0;
+
+  // Describes the extractor. Two extractors with the same name produce the
+  // same prefixes.
+  virtual std::string Name() const = 0;
+
+  // Creates an extractor from a specification of the form
+  //   fixed:<n>         the first n bytes of keys at least n bytes long
+  //   delimiter:<c>     everything up to and including the first c
+  // Returns null for an empty specification. Aborts on a malformed one.
+  static std::shared_ptr<const PrefixExtractor> Create(
+      const std::string& spec);
+
+  // Returns the extractor configured by --prefix_extractor, or null if prefix
+  // filtering is disabled.
+  static std::shared_ptr<const PrefixExtractor> FromFlags();
+};
+
+}  // namespace diodb
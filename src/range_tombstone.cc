@@ -0,0 +1,94 @@
+#include <algorithm>
+#include <functional>
+
+#include "range_tombstone.h"
+
+using namespace std;
+
+namespace diodb {
+
+SequenceNumber MaxCoveringSeq(const vector<RangeTombstone>& tombstones,
+                              const Buffer& key,
+                              const SequenceNumber snapshot_seq) {
+  SequenceNumber max_seq = 0;
+  for (const auto& tombstone : tombstones) {
+    if (tombstone.seq <= snapshot_seq && tombstone.seq > max_seq &&
+        tombstone.Covers(key)) {
+      max_seq = tombstone.seq;
+    }
+  }
+  return max_seq;
+}
+
+bool ApplyRangeTombstone(const Buffer& key, const SequenceNumber tombstone_seq,
+                         const bool found, Segment* segment) {
+  if (tombstone_seq == 0 || (found && segment->seq > tombstone_seq)) {
+    return found;
+  }
+  *segment = Segment(key, Buffer(), true /* del */, tombstone_seq);
+  return true;
+}
+
+RangeTombstoneList::RangeTombstoneList(
+    const vector<RangeTombstone>& tombstones) {
+  // Every begin and end key is a fragment boundary.
+  vector<Buffer> bounds;
+  for (const auto& tombstone : tombstones) {
+    if (tombstone.begin < tombstone.end) {
+      bounds.push_back(tombstone.begin);
+      bounds.push_back(tombstone.end);
+    }
+  }
+  sort(bounds.begin(), bounds.end());
+  bounds.erase(unique(bounds.begin(), bounds.end()), bounds.end());
+  if (bounds.size() < 2) {
+    return;
+  }
+
+  vector<vector<SequenceNumber>> seqs(bounds.size() - 1);
+  for (const auto& tombstone : tombstones) {
+    if (!(tombstone.begin < tombstone.end)) {
+      continue;
+    }
+    const size_t first =
+        lower_bound(bounds.begin(), bounds.end(), tombstone.begin) -
+        bounds.begin();
+    const size_t last =
+        lower_bound(bounds.begin(), bounds.end(), tombstone.end) -
+        bounds.begin();
+    for (size_t ii = first; ii < last; ++ii) {
+      seqs[ii].push_back(tombstone.seq);
+    }
+  }
+
+  // Gaps between tombstones don't need a fragment.
+  for (size_t ii = 0; ii + 1 < bounds.size(); ++ii) {
+    if (seqs[ii].empty()) {
+      continue;
+    }
+    sort(seqs[ii].begin(), seqs[ii].end(), greater<SequenceNumber>());
+    fragments_.push_back(Fragment{bounds[ii], bounds[ii + 1], move(seqs[ii])});
+  }
+}
+
+SequenceNumber RangeTombstoneList::MaxCoveringSeq(
+    const Buffer& key, const SequenceNumber snapshot_seq) const {
+  // The last fragment beginning at or before the key is the only one that can
+  // cover it.
+  auto it = upper_bound(
+      fragments_.begin(), fragments_.end(), key,
+      [](const Buffer& k, const Fragment& f) { return k < f.begin; });
+  if (it == fragments_.begin()) {
+    return 0;
+  }
+  --it;
+  if (!(key < it->end)) {
+    return 0;
+  }
+
+  const auto seq = lower_bound(it->seqs.begin(), it->seqs.end(), snapshot_seq,
+                               greater<SequenceNumber>());
+  return seq == it->seqs.end() ? 0 : *seq;
+}
+
+}  // namespace diodb
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <utility>
+#include <vector>
+
+#include "buffer.h"
+
+namespace diodb {
+
+// Deletes every version of every key in ['begin', 'end') that is older than
+// 'seq'. Written by DBController::DeleteRange, so that deleting a range costs a
+// single write however many keys it holds.
+typedef struct RangeTombstone {
+  RangeTombstone() : seq(0) {}
+  RangeTombstone(Buffer b, Buffer e, const SequenceNumber s)
+      : begin(std::move(b)), end(std::move(e)), seq(s) {}
+
+  // Returns true if 'key' falls in the range.
+  bool Covers(const Buffer& key) const { return !(key < begin) && key < end; }
+
+  Buffer begin;
+  Buffer end;
+  SequenceNumber seq;
+} RangeTombstone;
+
+// Returns the largest sequence number, no greater than 'snapshot_seq', of any
+// of 'tombstones' covering 'key', or zero if none does. The tombstones are
+// scanned one by one, which is fine for the few a memtable holds.
+SequenceNumber MaxCoveringSeq(const std::vector<RangeTombstone>& tombstones,
+                              const Buffer& key, SequenceNumber snapshot_seq);
+
+// Folds the range tombstones of a table into a point lookup in the same table.
+// 'found' says whether 'segment' holds the version of 'key' the lookup found,
+// and 'tombstone_seq' is what MaxCoveringSeq returned for the key. If the
+// tombstone is newer, 'segment' is replaced by a delete at its sequence
+// number. Returns true if the table holds either.
+bool ApplyRangeTombstone(const Buffer& key, SequenceNumber tombstone_seq,
+                         bool found, Segment* segment);
+
+// An immutable set of range tombstones that answers MaxCoveringSeq with a
+// binary search. Overlapping tombstones are split into disjoint fragments, each
+// with the sequence numbers of every tombstone that covers it.
+class RangeTombstoneList {
+ public:
+  RangeTombstoneList() {}
+  explicit RangeTombstoneList(const std::vector<RangeTombstone>& tombstones);
+
+  // Same as the free function, over the tombstones in the list.
+  SequenceNumber MaxCoveringSeq(const Buffer& key,
+                                SequenceNumber snapshot_seq) const;
+
+  // Accessors.
+  bool empty() const { return fragments_.empty(); }
+
+ private:
+  typedef struct Fragment {
+    Buffer begin;
+    Buffer end;
+
+    // In descending order.
+    std::vector<SequenceNumber> seqs;
+  } Fragment;
+
+  // Sorted by 'begin', and not overlapping.
+  std::vector<Fragment> fragments_;
+};
+
+}  // namespace diodb
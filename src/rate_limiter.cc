@@ -0,0 +1,194 @@
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "rate_limiter.h"
+
+using namespace std;
+
+DEFINE_uint64(background_io_bytes_per_sec, 0,
+              "Rate at which memtable flushes and merges may write, in bytes "
+              "per second. Zero means unlimited.");
+
+DEFINE_bool(background_io_rate_auto_tune, false,
+            "Treat --background_io_bytes_per_sec as an upper bound, and tune "
+            "the rate to how much background I/O is backed up.");
+
+DEFINE_int32(background_io_refill_msecs, 100,
+             "How often the background I/O rate limiter tops up its bucket. "
+             "Requests of more than a period's worth of bytes are split.");
+
+namespace diodb {
+
+namespace {
+
+// One in this many refills serves the low priority queue first.
+constexpr int kFairness = 10;
+
+// Number of refills auto-tuning looks at before adjusting the rate, the factor
+// the rate changes by each time, and the backlogged fractions that trigger the
+// changes.
+constexpr int kTuneRefills = 100;
+constexpr double kTuneFactor = 1.05;
+constexpr double kTuneRaiseFraction = 0.9;
+constexpr double kTuneLowerFraction = 0.5;
+
+// Auto-tuning never goes below this fraction of the configured rate.
+constexpr uint64_t kMinRateDivisor = 20;
+
+}  // namespace
+
+RateLimiter::RateLimiter()
+    : bytes_per_sec_(FLAGS_background_io_bytes_per_sec),
+      max_bytes_per_sec_(FLAGS_background_io_bytes_per_sec),
+      auto_tune_(FLAGS_background_io_rate_auto_tune),
+      refill_period_(max(FLAGS_background_io_refill_msecs, 1)),
+      available_bytes_(0),
+      next_refill_(chrono::steady_clock::now()),
+      refill_pending_(false),
+      num_refills_(0),
+      num_backlogged_refills_(0) {}
+
+size_t RateLimiter::RefillBytes() const {
+  return max<uint64_t>(bytes_per_sec_ * refill_period_.count() / 1000, 1);
+}
+
+void RateLimiter::Request(size_t num_bytes, const Priority priority) {
+  while (num_bytes > 0) {
+    size_t chunk;
+    {
+      lock_guard<mutex> lock(mtx_);
+      if (bytes_per_sec_ == 0) {
+        stats_.bytes_through[static_cast<int>(priority)] += num_bytes;
+        return;
+      }
+      chunk = min(num_bytes, RefillBytes());
+    }
+    RequestRefill(chunk, priority);
+    num_bytes -= chunk;
+  }
+}
+
+void RateLimiter::RequestRefill(const size_t num_bytes,
+                                const Priority priority) {
+  const int queue = static_cast<int>(priority);
+  unique_lock<mutex> lock(mtx_);
+  stats_.bytes_through[queue] += num_bytes;
+  if (bytes_per_sec_ == 0) {
+    return;
+  }
+
+  if (queues_[0].empty() && queues_[1].empty()) {
+    Refill(false /* backlogged */);
+    if (available_bytes_ >= num_bytes) {
+      available_bytes_ -= num_bytes;
+      return;
+    }
+  }
+
+  // The rate may have dropped since the request was split up.
+  Waiter waiter(min(num_bytes, RefillBytes()));
+  queues_[queue].push_back(&waiter);
+  ++stats_.num_waits[queue];
+  const auto start = chrono::steady_clock::now();
+
+  // One waiter sleeps until the next refill and performs it. The rest wait
+  // for it to finish.
+  while (!waiter.granted) {
+    if (refill_pending_) {
+      cv_.wait(lock);
+      continue;
+    }
+
+    refill_pending_ = true;
+    while (bytes_per_sec_ != 0 &&
+           chrono::steady_clock::now() < next_refill_) {
+      cv_.wait_until(lock, next_refill_);
+    }
+    refill_pending_ = false;
+    Refill(true /* backlogged */);
+  }
+
+  stats_.wait_micros[queue] += chrono::duration_cast<chrono::microseconds>(
+                                   chrono::steady_clock::now() - start)
+                                   .count();
+}
+
+void RateLimiter::Refill(const bool backlogged) {
+  const auto now = chrono::steady_clock::now();
+  if (now >= next_refill_) {
+    // Unused bytes don't carry over, so the burst after an idle spell is
+    // bounded by a single refill.
+    available_bytes_ = RefillBytes();
+    next_refill_ = now + refill_period_;
+
+    if (auto_tune_) {
+      ++num_refills_;
+      num_backlogged_refills_ += backlogged;
+      if (num_refills_ >= kTuneRefills) {
+        Tune();
+      }
+    }
+  }
+
+  // Requests are granted in order, high priority first, except now and then
+  // when the low priority ones get to go first.
+  const bool low_first = rand_() % kFairness == 0;
+  for (const int queue : {low_first ? 1 : 0, low_first ? 0 : 1}) {
+    auto& waiters = queues_[queue];
+    while (!waiters.empty()) {
+      Waiter* const waiter = waiters.front();
+      if (bytes_per_sec_ != 0) {
+        if (waiter->num_bytes > available_bytes_) {
+          break;
+        }
+        available_bytes_ -= waiter->num_bytes;
+      }
+      waiter->granted = true;
+      waiters.pop_front();
+    }
+    if (!waiters.empty()) {
+      break;
+    }
+  }
+  cv_.notify_all();
+}
+
+void RateLimiter::Tune() {
+  const double backlogged =
+      static_cast<double>(num_backlogged_refills_) / num_refills_;
+  const uint64_t old_bytes_per_sec = bytes_per_sec_;
+  if (backlogged >= kTuneRaiseFraction) {
+    bytes_per_sec_ =
+        min<uint64_t>(max_bytes_per_sec_, bytes_per_sec_ * kTuneFactor + 1);
+  } else if (backlogged < kTuneLowerFraction) {
+    bytes_per_sec_ = max<uint64_t>(max_bytes_per_sec_ / kMinRateDivisor,
+                                   bytes_per_sec_ / kTuneFactor);
+  }
+  bytes_per_sec_ = max<uint64_t>(bytes_per_sec_, 1);
+  num_refills_ = 0;
+  num_backlogged_refills_ = 0;
+
+  if (bytes_per_sec_ != old_bytes_per_sec) {
+    VLOG(1) << "Background I/O rate tuned from " << old_bytes_per_sec
+            << " to " << bytes_per_sec_ << " bytes/sec";
+  }
+}
+
+void RateLimiter::SetBytesPerSecond(const uint64_t bytes_per_sec) {
+  {
+    lock_guard<mutex> lock(mtx_);
+    bytes_per_sec_ = bytes_per_sec;
+    max_bytes_per_sec_ = bytes_per_sec;
+    num_refills_ = 0;
+    num_backlogged_refills_ = 0;
+  }
+  cv_.notify_all();
+}
+
+uint64_t RateLimiter::bytes_per_second() const {
+  lock_guard<mutex> lock(mtx_);
+  return bytes_per_sec_;
+}
+
+}  // namespace diodb
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <random>
+
+namespace diodb {
+
+// Limits the rate of background I/O with a token bucket, so that flushes and
+// merges don't starve foreground reads and writes of disk bandwidth. Every
+// refill period the bucket is topped up with a period's worth of bytes, and
+// callers block until enough bytes are available for their request. Waiting
+// requests are granted in FIFO order within a priority, and high priority ones
+// go first, except that every so often the low priority queue is served first
+// so that it can't be starved entirely.
+//
+// With auto-tuning, the configured rate is an upper bound. The limiter lowers
+// the rate while background work keeps up, and raises it back towards the
+// bound when requests keep running the bucket dry.
+class RateLimiter {
+ public:
+  enum class Priority {
+    // Memtable flushes, which writers may be waiting for.
+    kHigh = 0,
+
+    // Merges.
+    kLow = 1,
+  };
+
+  // Traffic through the limiter.
+  typedef struct Stats {
+    Stats()
+        : bytes_through{{0}, {0}}, num_waits{{0}, {0}}, wait_micros{{0}, {0}} {}
+
+    // Bytes granted, requests that had to wait, and the total time they
+    // waited, by priority.
+    std::atomic<uint64_t> bytes_through[2];
+    std::atomic<uint64_t> num_waits[2];
+    std::atomic<uint64_t> wait_micros[2];
+  } Stats;
+
+  // Configured by --background_io_bytes_per_sec,
+  // --background_io_rate_auto_tune and --background_io_refill_msecs.
+  RateLimiter();
+
+  // Blocks until 'num_bytes' bytes of I/O may be issued. Requests bigger than
+  // a refill are granted a refill at a time.
+  void Request(size_t num_bytes, Priority priority);
+
+  // Changes the rate, or the upper bound on it when auto-tuning. Zero turns
+  // limiting off.
+  void SetBytesPerSecond(uint64_t bytes_per_sec);
+
+  // The rate currently enforced, which changes over time when auto-tuning.
+  uint64_t bytes_per_second() const;
+
+  // Accessors.
+  const Stats& stats() const { return stats_; }
+
+ private:
+  // A request waiting for bytes.
+  typedef struct Waiter {
+    explicit Waiter(size_t num_bytes) : num_bytes(num_bytes), granted(false) {}
+    size_t num_bytes;
+    bool granted;
+  } Waiter;
+
+  // Blocks until 'num_bytes', which fit in a single refill, are granted.
+  void RequestRefill(size_t num_bytes, Priority priority);
+
+  // Tops up the bucket if a refill period has passed, and grants whatever
+  // waiting requests it can cover. 'backlogged' is true if a request had to
+  // wait for the refill, which is what auto-tuning goes by.
+  void Refill(bool backlogged);
+
+  // Adjusts the rate to the backlog seen over the last tuning window.
+  void Tune();
+
+  // Bytes added to the bucket every refill period.
+  size_t RefillBytes() const;
+
+ private:
+  mutable std::mutex mtx_;
+
+  // Signalled after every refill.
+  std::condition_variable cv_;
+
+  // The enforced rate, and the configured one it's capped at.
+  uint64_t bytes_per_sec_;
+  uint64_t max_bytes_per_sec_;
+  const bool auto_tune_;
+
+  // How often the bucket is topped up, the bytes left in it, and when it's
+  // next topped up.
+  const std::chrono::milliseconds refill_period_;
+  size_t available_bytes_;
+  std::chrono::steady_clock::time_point next_refill_;
+
+  // Requests waiting for bytes, by priority.
+  std::deque<Waiter*> queues_[2];
+
+  // True while a waiter is sleeping until the next refill. The others wait to
+  // be woken up by it.
+  bool refill_pending_;
+
+  // Picks when the low priority queue is served first.
+  std::minstd_rand rand_;
+
+  // Refills in the current tuning window, and how many of them requests had
+  // to wait for.
+  int num_refills_;
+  int num_backlogged_refills_;
+
+  Stats stats_;
+};
+
+}  // namespace diodb
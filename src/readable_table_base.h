@@ -2,6 +2,7 @@
 
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "buffer.h"
 
@@ -31,7 +32,39 @@ class ReadableTable {
   } DetailedKeyResponse;
   virtual DetailedKeyResponse DeletedKeyExists(const Buffer& key) const = 0;
 
-  // Gets the value associated with a particular key.
+  // Finds the newest version of a key whose sequence number is no greater than
+  // 'snapshot_seq' and puts it in the provided segment. Returns true if one is
+  // found. The version found may be a delete entry.
+  virtual bool FindSegment(const Buffer& key, SequenceNumber snapshot_seq,
+                           Segment* segment) const = 0;
+
+  // A key looked up as part of a batch.
+  typedef struct KeyLookup {
+    explicit KeyLookup(const Buffer* k) : key(k), found(false) {}
+
+    // The key to look up.
+    const Buffer* key;
+
+    // The version found for the key, valid if 'found' is set.
+    Segment segment;
+    bool found;
+  } KeyLookup;
+
+  // Looks up a batch of keys, sorted in ascending order and without
+  // duplicates, as FindSegment would. Lookups that are already marked found
+  // are skipped, so the same batch can be passed down a list of tables from
+  // newest to oldest.
+  virtual void FindSegments(SequenceNumber snapshot_seq,
+                            std::vector<KeyLookup>* lookups) const {
+    for (auto& lookup : *lookups) {
+      if (!lookup.found) {
+        lookup.found = FindSegment(*lookup.key, snapshot_seq, &lookup.segment);
+      }
+    }
+  }
+
+  // Gets the value associated with a particular key. A value that was moved to
+  // the value log comes back as the reference to it.
   virtual Buffer Get(const Buffer& key) const = 0;
 
   // Returns the number of non-deleted key/value pairs in the memtable.
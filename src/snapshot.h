@@ -0,0 +1,29 @@
+#pragma once
+
+#include "buffer.h"
+
+namespace diodb {
+
+class DBController;
+
+// A consistent point-in-time view of the database. Reads at a snapshot only see
+// writes that were committed before the snapshot was taken. Snapshots are
+// handed out by DBController::GetSnapshot and must be given back with
+// DBController::ReleaseSnapshot, after which merges are free to drop the
+// versions the snapshot was holding on to.
+class Snapshot {
+ public:
+  // Accessors.
+  SequenceNumber sequence() const { return sequence_; }
+
+ private:
+  friend class DBController;
+
+  explicit Snapshot(const SequenceNumber sequence) : sequence_(sequence) {}
+  ~Snapshot() {}
+
+  // The newest sequence number visible at this snapshot.
+  const SequenceNumber sequence_;
+};
+
+}  // namespace diodb
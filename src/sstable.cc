@@ -3,6 +3,7 @@
 #include <sys/types.h>
 #include <algorithm>
 #include <fstream>
+#include <limits>
 #include <memory>
 #include <queue>
 
@@ -10,6 +11,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/functional/hash.hpp>
 
+#include "coding.h"
 #include "iohandle.h"
 #include "sstable.h"
 
@@ -20,11 +22,62 @@ DEFINE_uint64(sstable_index_offset_bytes, 4 * 1024,
               "referenced in the sparse index. Increasing this will decrease "
               "memory usage, but at the cost of higher read overhead");
 
+DEFINE_int32(prefix_filter_bits_per_key, 10,
+             "Number of bits per distinct key prefix in SSTable prefix "
+             "filters. More bits mean fewer false positives.");
+
+DEFINE_uint64(sstable_multiget_coalesce_bytes, 16 * 1024,
+              "Largest gap between the index regions of two keys in a "
+              "MultiGet batch for which both are fetched with a single read.");
+
+DEFINE_uint64(sstable_readahead_bytes, 256 * 1024,
+              "Number of bytes SSTable iterators read at a time while "
+              "scanning.");
+
+DEFINE_bool(use_direct_io_for_flush_and_compaction, false,
+            "Write the SSTables produced by memtable flushes and merges with "
+            "O_DIRECT, and index them without reading them back through the "
+            "page cache, so that background work doesn't evict the pages "
+            "foreground reads depend on.");
+
+DEFINE_bool(use_direct_reads_for_compaction, false,
+            "Read the input tables of merges with O_DIRECT.");
+
 namespace diodb {
 
+namespace {
+
+// Tables end with a footer holding the offset of the properties block followed
+// by this magic number. Files without it predate the properties block and are
+// made up of segments only.
+constexpr uint64_t kTableMagic = 0x7473736264626f69ULL;
+constexpr size_t kFooterSize = 2 * sizeof(uint64_t);
+
+// Appends the properties block and the footer after the 'data_size' bytes of
+// segments written so far, and syncs the file.
+void AppendPropertiesAndFooter(IOHandle* io_handle,
+                               const TableProperties& properties,
+                               const uint64_t data_size) {
+  Buffer block;
+  properties.Encode(&block);
+  coding::PutFixed64(&block, data_size);
+  coding::PutFixed64(&block, kTableMagic);
+  io_handle->Append(block);
+  io_handle->Flush();
+}
+
+}  // namespace
+
 // Constructor for recovering SSTable from an existing file.
-SSTable::SSTable(const fs::path sstable_path)
-    : filepath_(sstable_path), table_id_(fs::hash_value(filepath_)) {
+SSTable::SSTable(const fs::path sstable_path, const bool lazy_index)
+    : filepath_(sstable_path),
+      file_size_(0),
+      data_size_(0),
+      table_id_(fs::hash_value(filepath_)),
+      lazy_index_(false),
+      value_log_(nullptr),
+      compaction_filter_(nullptr),
+      merge_operator_(nullptr) {
   CHECK(fs::exists(sstable_path))
       << "SSTable file " << sstable_path << " does not exist";
 
@@ -33,35 +86,76 @@ SSTable::SSTable(const fs::path sstable_path)
 
   file_size_ = fs::file_size(filepath_);
   io_handle_ = make_unique<IOHandle>(filepath_);
-  BuildSparseIndexFromFile(filepath_);
+
+  // Older files have no properties, so they're worked out while indexing.
+  const bool has_properties = ReadProperties();
+  if (!has_properties) {
+    data_size_ = file_size_;
+  }
+  if (has_properties && lazy_index) {
+    lazy_index_ = true;
+    return;
+  }
+  BuildSparseIndexFromFile(filepath_, !has_properties);
 }
 
 // Constructor for flushing a memtable to an SSTable file.
-SSTable::SSTable(const fs::path& new_sstable_path, const Memtable& memtable)
-    : filepath_(new_sstable_path), table_id_(fs::hash_value(filepath_)) {
+SSTable::SSTable(const fs::path& new_sstable_path, const Memtable& memtable,
+                 const vector<SequenceNumber>& snapshots,
+                 RateLimiter* rate_limiter, util::Threadpool* build_pool,
+                 ValueLog* value_log)
+    : filepath_(new_sstable_path),
+      file_size_(0),
+      data_size_(0),
+      table_id_(fs::hash_value(filepath_)),
+      lazy_index_(false),
+      value_log_(value_log),
+      compaction_filter_(nullptr),
+      merge_operator_(nullptr) {
   CHECK(!fs::exists(new_sstable_path))
       << "SSTable file " << filepath_ << " exists";
   CHECK(memtable.is_locked())
       << "Attempting to flush an unlocked memtable to " << new_sstable_path;
 
   io_handle_ = make_unique<IOHandle>(filepath_);
+  io_handle_->SetRateLimiter(rate_limiter, RateLimiter::Priority::kHigh);
+  if (FLAGS_use_direct_io_for_flush_and_compaction) {
+    const size_t num_entries =
+        memtable.num_valid_entries() + memtable.num_delete_entries();
+    io_handle_->EnableDirectWrites(
+        memtable.num_bytes() +
+        num_entries * coding::EncodedSegmentSize(Segment()));
+  }
+  builder_ = make_unique<TableBuilder>(io_handle_.get(), build_pool);
 
   LOG(INFO) << "Flushing memtable into SSTable " << filepath_
             << " with id=" << table_id_;
 
-  CHECK(FlushMemtable(filepath_, memtable))
+  CHECK(FlushMemtable(filepath_, memtable, snapshots))
       << "Error flushing memtable into SSTable " << filepath_
       << " with id=" << table_id_;
 
   file_size_ = fs::file_size(filepath_);
 
-  BuildSparseIndexFromFile(filepath_);
+  BuildSparseIndexFromFile(filepath_, false /* compute_properties */,
+                           FLAGS_use_direct_io_for_flush_and_compaction);
 }
 
 // Constructor for merging multiple SSTables into a new one.
 SSTable::SSTable(const fs::path new_sstable_path,
-                 const vector<SSTablePtr>& sstables)
-    : filepath_(new_sstable_path), table_id_(fs::hash_value(filepath_)) {
+                 const vector<SSTablePtr>& sstables,
+                 const vector<SequenceNumber>& snapshots,
+                 RateLimiter* rate_limiter, util::Threadpool* build_pool,
+                 const CompactionFilter* compaction_filter,
+                 const MergeOperator* merge_operator)
+    : filepath_(new_sstable_path),
+      file_size_(0),
+      data_size_(0),
+      table_id_(fs::hash_value(filepath_)),
+      lazy_index_(false),
+      value_log_(nullptr),
+      compaction_filter_(compaction_filter),
+      merge_operator_(merge_operator) {
   CHECK(!fs::exists(new_sstable_path))
       << "SSTable file " << filepath_ << " exists";
 
@@ -75,127 +169,398 @@ SSTable::SSTable(const fs::path new_sstable_path,
             << filepath_ << " with id=" << table_id_;
 
   io_handle_ = make_unique<IOHandle>(filepath_);
+  io_handle_->SetRateLimiter(rate_limiter, RateLimiter::Priority::kLow);
+  if (FLAGS_use_direct_io_for_flush_and_compaction) {
+    // The merged table is at most as big as its parents.
+    uint64_t expected_size = 0;
+    for (const auto& sst : sstables) {
+      expected_size += sst->file_size();
+    }
+    io_handle_->EnableDirectWrites(expected_size);
+  }
+  builder_ = make_unique<TableBuilder>(io_handle_.get(), build_pool);
 
-  MergeSSTables(sstables);
+  MergeSSTables(sstables, snapshots);
   file_size_ = fs::file_size(filepath_);
-  BuildSparseIndexFromFile(filepath_);
+
+  BuildSparseIndexFromFile(filepath_, false /* compute_properties */,
+                           FLAGS_use_direct_io_for_flush_and_compaction);
 }
 
-void SSTable::MergeSSTables(const vector<SSTablePtr>& sstables) {
-  // Build new IOHandles for the parent SSTs and count up the segments that need to be merged.
-  vector<IOHandle> parent_sst_handles_;
-  parent_sst_handles_.reserve(sstables.size());
+void SSTable::MergeSSTables(const vector<SSTablePtr>& sstables,
+                            const vector<SequenceNumber>& snapshots) {
+  // Open a reader on each of the parent SSTs.
+  vector<unique_ptr<SequentialReader>> parent_readers;
+  parent_readers.reserve(sstables.size());
   for (const auto& sst : sstables) {
-    parent_sst_handles_.emplace_back(sst->filepath());
+    parent_readers.push_back(make_unique<SequentialReader>(
+        sst->filepath(), sst->data_size_,
+        FLAGS_use_direct_reads_for_compaction));
   }
 
   using AgedSegment = pair<Segment, uint32_t>;
   set<AgedSegment> segment_queue;
 
-  auto load_queue = [&segment_queue](uint32_t age, IOHandle& h) {
-    if (h.End()) {
+  auto load_queue = [&segment_queue, &parent_readers](uint32_t age) {
+    Segment segment;
+    if (!parent_readers[age]->Next(&segment)) {
       // Already at the end of the file.
       return;
     }
-
-    Segment segment;
-    h.ParseNext(&segment);
     auto success = segment_queue.emplace(move(segment), age);
     CHECK(success.second);
   };
 
   // Run through each SSTable and populate the segment queue with its first entry.
-  for (int idx = 0; idx < parent_sst_handles_.size(); ++idx) {
-    IOHandle& h = parent_sst_handles_.at(idx);
-    load_queue(idx, h);
+  for (uint32_t idx = 0; idx < parent_readers.size(); ++idx) {
+    load_queue(idx);
   }
 
-  // Perform the merge.
+  // Range tombstones from any of the tables can shadow versions in the others.
+  vector<RangeTombstone> tombstones;
+  for (const auto& sst : sstables) {
+    const auto& sst_tombstones = sst->properties().range_tombstones;
+    tombstones.insert(tombstones.end(), sst_tombstones.begin(),
+                      sst_tombstones.end());
+  }
+  const RangeTombstoneList tombstone_list(tombstones);
+
+  // Perform the merge. Versions of the same key come out of the queue from
+  // newest to oldest, and are gathered up so they can be resolved together.
+  vector<Segment> versions;
   while (!segment_queue.empty()) {
     const uint32_t age = segment_queue.begin()->second;
-    auto segment = segment_queue.begin()->first;
-    ResolveWrite(move(segment), age);
+    Segment segment = segment_queue.begin()->first;
     segment_queue.erase(segment_queue.begin());
 
-    // Pull the next segment from the sstable we just resolved a write from.
-    IOHandle& h = parent_sst_handles_.at(age);
-    load_queue(age, h);
+    // Pull the next segment from the sstable we just took a segment from.
+    load_queue(age);
+
+    if (!versions.empty() && versions.back().key != segment.key) {
+      WriteVersions(&versions, snapshots, tombstone_list,
+                    true /* drop_deletes */);
+    } else if (!versions.empty() && versions.back().seq == segment.seq) {
+      // The same version showed up in an older table. The younger copy wins.
+      // The older copy can point at a different spot in the value log if the
+      // value was moved by garbage collection.
+      if (segment.value_ref && segment.val != versions.back().val) {
+        discarded_value_refs_.push_back(move(segment.val));
+      }
+      continue;
+    }
+    versions.emplace_back(move(segment));
   }
 
-  // There's nothing left to read from file. Merge the final item in the merge buffer by resolving a
-  // write with a bogus segment.
-  ResolveWrite(Segment(), 1337);
+  // Merges always include every base table that overlaps the level-0 tables,
+  // so there is nothing older left for a delete to shadow once every snapshot
+  // can see it.
+  WriteVersions(&versions, snapshots, tombstone_list, true /* drop_deletes */);
+
+  // The same goes for range tombstones. Once no snapshot predates one, every
+  // version it covers has been dropped above.
+  for (const auto& tombstone : tombstones) {
+    if (!snapshots.empty() && snapshots.front() < tombstone.seq) {
+      properties_.AddRangeTombstone(tombstone);
+    }
+  }
 
-  Flush();
-  file_size_ = fs::file_size(io_handle_->filepath());
+  WriteProperties();
 }
 
-void SSTable::ResolveWrite(Segment&& segment, const int age) {
-  if (merge_buffer_.first.key.empty()) {
-    merge_buffer_.first = segment;
-    return;
+void SSTable::WriteVersions(vector<Segment>* versions,
+                            const vector<SequenceNumber>& snapshots,
+                            const RangeTombstoneList& tombstones,
+                            const bool drop_deletes) {
+  if (merge_operator_) {
+    FoldMergeOperands(versions, snapshots, tombstones, drop_deletes);
+  }
+
+  // Each snapshot sees the newest version at or below its sequence number, and
+  // the newest version overall is visible to new readers. Any other version is
+  // unreachable. Versions are bucketed by the oldest snapshot that can see
+  // them, and only the newest version in each bucket is kept, along with
+  // whatever a merge operand still has to be applied to.
+  //
+  // A range tombstone hides a version in the same way when it falls in the
+  // version's bucket, so the version is dropped too.
+  size_t last_bucket = numeric_limits<size_t>::max();
+  size_t num_kept = 0;
+  for (size_t ii = 0; ii < versions->size(); ++ii) {
+    const Segment& version = (*versions)[ii];
+    const size_t bucket =
+        lower_bound(snapshots.begin(), snapshots.end(), version.seq) -
+        snapshots.begin();
+    const SequenceNumber bucket_seq =
+        bucket < snapshots.size() ? snapshots[bucket] : kMaxSequenceNumber;
+    if ((bucket == last_bucket &&
+         !(*versions)[num_kept - 1].merge_operand) ||
+        (!tombstones.empty() &&
+         tombstones.MaxCoveringSeq(version.key, bucket_seq) > version.seq)) {
+      if ((*versions)[ii].value_ref) {
+        discarded_value_refs_.push_back(move((*versions)[ii].val));
+      }
+      continue;
+    }
+    last_bucket = bucket;
+    if (num_kept != ii) {
+      (*versions)[num_kept] = move((*versions)[ii]);
+    }
+    ++num_kept;
+  }
+  versions->resize(num_kept);
+
+  // The filter only sees a version that no snapshot can see, so that
+  // snapshots never notice it.
+  if (compaction_filter_ && !versions->empty()) {
+    Segment& newest = versions->front();
+    if (!newest.delete_entry && !newest.merge_operand &&
+        lower_bound(snapshots.begin(), snapshots.end(), newest.seq) ==
+            snapshots.end()) {
+      // A value in the value log is judged by what its reference keeps.
+      Buffer new_value;
+      const CompactionFilter::Decision decision =
+          newest.value_ref
+              ? compaction_filter_->FilterValueRef(
+                    newest.key, ValueLog::RefTail(newest.val))
+              : compaction_filter_->Filter(newest.key, newest.val,
+                                           &new_value);
+      switch (decision) {
+        case CompactionFilter::Decision::kKeep:
+          break;
+        case CompactionFilter::Decision::kRemove:
+          // Older versions that snapshots need must not become visible, so the
+          // version turns into a delete. It goes away below if they don't.
+          if (newest.value_ref) {
+            discarded_value_refs_.push_back(move(newest.val));
+            newest.value_ref = false;
+          }
+          newest.val.clear();
+          newest.val_size = 0;
+          newest.delete_entry = true;
+          break;
+        case CompactionFilter::Decision::kChangeValue:
+          CHECK(!newest.value_ref)
+              << "Compaction filter " << compaction_filter_->Name()
+              << " changed a value in the value log";
+          newest.val = move(new_value);
+          newest.val_size = newest.val.size();
+          break;
+      }
+    }
   }
 
-  if (merge_buffer_.first.key != segment.key) {
-    // Since we're trying to resolve a segment that's not what is currencly in the buffer, the
-    // segment that is in the buffer is the most recent write for that key. Persist it.
-    if (!segment.delete_entry) {
-      io_handle_->SegmentWrite(merge_buffer_.first);
+  // A delete with nothing older behind it doesn't need to be kept around.
+  while (drop_deletes && !versions->empty() &&
+         versions->back().delete_entry) {
+    versions->pop_back();
+  }
+
+  for (auto& version : *versions) {
+    if (value_log_ && !version.delete_entry && !version.value_ref &&
+        !version.merge_operand && ValueLog::MinValueBytes() > 0 &&
+        version.val.size() >= ValueLog::MinValueBytes()) {
+      version.val = value_log_->Add(version);
+      version.val_size = version.val.size();
+      version.value_ref = true;
+    }
+    properties_.Add(version);
+    if (version.value_ref) {
+      ValueLog::CountReference(version.val, &properties_.value_log_bytes);
     }
-    merge_buffer_.first = move(segment);
-    merge_buffer_.second = age;
-  } else if (merge_buffer_.first.key == segment.key &&
-             age < merge_buffer_.second) {
-    // Segment is the same as what is in the merge buffer and the segment is more recent. We can
-    // replace the segment in the merge buffer with the more recent one.
-    merge_buffer_.first = move(segment);
+    builder_->Add(move(version));
   }
+  versions->clear();
 }
 
-void SSTable::BuildSparseIndexFromFile(const fs::path filepath) {
+void SSTable::FoldMergeOperands(vector<Segment>* versions,
+                                const vector<SequenceNumber>& snapshots,
+                                const RangeTombstoneList& tombstones,
+                                const bool drop_deletes) {
+  const auto bucket_of = [&snapshots](const SequenceNumber seq) {
+    return lower_bound(snapshots.begin(), snapshots.end(), seq) -
+           snapshots.begin();
+  };
+
+  vector<Segment> folded;
+  size_t ii = 0;
+  while (ii < versions->size()) {
+    Segment segment = move((*versions)[ii++]);
+    if (!segment.merge_operand) {
+      folded.push_back(move(segment));
+      continue;
+    }
+
+    // A snapshot between an operand and an older version sees the version
+    // without the operand, so the two stay apart.
+    const auto bucket = bucket_of(segment.seq);
+    SequenceNumber oldest_seq = segment.seq;
+    while (segment.merge_operand) {
+      const Segment* older = ii < versions->size() ? &(*versions)[ii] : nullptr;
+      const SequenceNumber tombstone_seq =
+          tombstones.empty()
+              ? 0
+              : tombstones.MaxCoveringSeq(segment.key, oldest_seq);
+      if ((tombstone_seq > 0 && (!older || older->seq < tombstone_seq)) ||
+          (!older && drop_deletes)) {
+        // Nothing older is left to apply the operands to.
+        segment.val = merge_operator_->Merge(segment.key, nullptr, segment.val);
+        segment.merge_operand = false;
+        break;
+      }
+      if (!older || older->value_ref || bucket_of(older->seq) != bucket) {
+        break;
+      }
+
+      // Merging two operands gives an operand, and merging into a put or a
+      // delete gives a value.
+      segment.val = merge_operator_->Merge(
+          segment.key, older->delete_entry ? nullptr : &older->val,
+          segment.val);
+      segment.merge_operand = older->merge_operand;
+      oldest_seq = older->seq;
+      ++ii;
+    }
+    segment.val_size = segment.val.size();
+    folded.push_back(move(segment));
+  }
+  *versions = move(folded);
+}
+
+void SSTable::WriteProperties() {
+  properties_.block_checksums = builder_->Finish();
+  builder_.reset();
+  value_log_ = nullptr;
+  compaction_filter_ = nullptr;
+  merge_operator_ = nullptr;
+  data_size_ = io_handle_->Offset();
+  AppendPropertiesAndFooter(io_handle_.get(), properties_, data_size_);
+
+  mutable_num_valid_entries() = properties_.num_valid_entries;
+  mutable_num_delete_entries() = properties_.num_delete_entries;
+  range_tombstones_ = RangeTombstoneList(properties_.range_tombstones);
+}
+
+bool SSTable::ReadProperties() {
+  if (file_size_ < kFooterSize) {
+    return false;
+  }
+
+  const vector<char> footer = ReadRegion(file_size_ - kFooterSize, file_size_);
+  if (coding::DecodeFixed64(footer.data() + sizeof(uint64_t)) != kTableMagic) {
+    return false;
+  }
+
+  const uint64_t properties_offset = coding::DecodeFixed64(footer.data());
+  CHECK_LE(properties_offset, file_size_ - kFooterSize)
+      << "Corrupt footer in " << filepath_;
+  const vector<char> block =
+      ReadRegion(properties_offset, file_size_ - kFooterSize);
+  CHECK(properties_.Decode(block.data(), block.data() + block.size()))
+      << "Corrupt properties in " << filepath_;
+
+  data_size_ = properties_offset;
+  mutable_num_valid_entries() = properties_.num_valid_entries;
+  mutable_num_delete_entries() = properties_.num_delete_entries;
+  range_tombstones_ = RangeTombstoneList(properties_.range_tombstones);
+  return true;
+}
+
+void SSTable::BuildSparseIndexFromFile(const fs::path filepath,
+                                       const bool compute_properties,
+                                       const bool direct) {
   LOG(INFO) << "building sparse index for SSTable " << table_id_;
 
-  if (file_size_ == 0) {
+  if (data_size_ == 0) {
     LOG(WARNING) << "building sparse index from empty file";
     return;
   }
 
+  // The prefix filter is built in the same pass. Keys are sorted, so each
+  // distinct prefix shows up in a single run.
+  prefix_extractor_ = PrefixExtractor::FromFlags();
+  vector<uint64_t> prefix_hashes;
+  Buffer last_prefix;
+
   off_t last_offset = 0;
-  io_handle_->Reset();
-  while (!io_handle_->End()) {
-    Segment segment;
-    CHECK_LE(last_offset, io_handle_->Offset());
+  Buffer last_key;
+  SequentialReader reader(filepath, data_size_, direct);
+  Segment segment;
+  while (true) {
+    CHECK_LE(last_offset, reader.offset());
 
     // Always add the first key in the SSTable and index after the appropriate
     // number of bytes has been cycled through.
     int64_t offset = -1;
-    if (io_handle_->Offset() == 0 ||
-        io_handle_->Offset() - last_offset >= KeyIndexOffsetBytes()) {
+    if (reader.offset() == 0 ||
+        reader.offset() - last_offset >= KeyIndexOffsetBytes()) {
       // We're past the minimum file offset, so insert into the sparse index.
-      offset = io_handle_->Offset();
+      offset = reader.offset();
+    }
+
+    if (!reader.Next(&segment)) {
+      break;
+    }
+    if (compute_properties) {
+      properties_.Add(segment);
+      if (segment.value_ref) {
+        ValueLog::CountReference(segment.val, &properties_.value_log_bytes);
+      }
     }
 
-    io_handle_->ParseNext(&segment);
-    if (offset >= 0) {
+    // Only the newest version of a key is indexed, so that a lookup starting
+    // from the index never skips over a version.
+    if (offset >= 0 && (offset == 0 || segment.key != last_key)) {
       sparse_index_.emplace(segment.key, offset);
       last_offset = offset;
     }
+
+    if (prefix_extractor_ && prefix_extractor_->InDomain(segment.key)) {
+      Buffer prefix = prefix_extractor_->Transform(segment.key);
+      if (prefix_hashes.empty() || prefix != last_prefix) {
+        prefix_hashes.push_back(BloomFilter::Hash(prefix));
+        last_prefix = move(prefix);
+      }
+    }
+    last_key = move(segment.key);
+  }
+  if (compute_properties) {
+    mutable_num_valid_entries() = properties_.num_valid_entries;
+    mutable_num_delete_entries() = properties_.num_delete_entries;
+  }
+
+  if (prefix_extractor_) {
+    prefix_filter_ =
+        BloomFilter(prefix_hashes, FLAGS_prefix_filter_bits_per_key);
   }
 
-  LOG(INFO) << "built sparse index of size " << sparse_index_.size();
+  LOG(INFO) << "built sparse index of size " << sparse_index_.size()
+            << " and prefix filter of " << prefix_filter_.num_bits()
+            << " bits";
 }
 
 bool SSTable::FlushMemtable(const fs::path& new_sstable_path,
-                            const Memtable& memtable) {
+                            const Memtable& memtable,
+                            const vector<SequenceNumber>& snapshots) {
+  // The memtable is ordered by key and then from newest to oldest, so the
+  // versions of each key are adjacent. Deletes are kept, since older tables
+  // may still hold the key.
+  // Range tombstones are kept for the same reason.
+  const vector<RangeTombstone> tombstones = memtable.range_tombstones();
+  const RangeTombstoneList tombstone_list(tombstones);
+  vector<Segment> versions;
   for (const auto& entry : memtable) {
-    Segment segment = entry.second;
-    const bool ok = io_handle_->SegmentWrite(segment);
-    if (!ok) {
-      return false;
+    if (!versions.empty() && versions.back().key != entry.second.key) {
+      WriteVersions(&versions, snapshots, tombstone_list,
+                    false /* drop_deletes */);
     }
+    versions.emplace_back(entry.second);
+  }
+  WriteVersions(&versions, snapshots, tombstone_list, false /* drop_deletes */);
+  for (const auto& tombstone : tombstones) {
+    properties_.AddRangeTombstone(tombstone);
   }
 
-  io_handle_->Flush();
+  WriteProperties();
 
   return true;
 }
@@ -206,7 +571,7 @@ ReadableTable::DetailedKeyResponse SSTable::DeletedKeyExists(const Buffer& key)
   ReadableTable::DetailedKeyResponse ret;
 
   Segment segment;
-  if (FindSegment(key, &segment)) {
+  if (FindSegment(key, kMaxSequenceNumber, &segment)) {
     ret.exists = true;
     ret.is_deleted = segment.delete_entry;
   } else {
@@ -217,30 +582,111 @@ ReadableTable::DetailedKeyResponse SSTable::DeletedKeyExists(const Buffer& key)
   return ret;
 }
 
-bool SSTable::FindSegment(const Buffer& key, Segment* segment) const {
-  CHECK(segment);
-  if (sparse_index_.empty() || key < sparse_index_.begin()->first) {
+off_t SSTable::IndexedOffset(const Buffer& key) const {
+  LoadIndex();
+  auto it = sparse_index_.upper_bound(key);
+  if (it == sparse_index_.cbegin()) {
+    return 0;
+  }
+  return prev(it)->second;
+}
+
+bool SSTable::MayContainKey(const Buffer& key) const {
+  if (properties_.num_entries == 0 || key < properties_.smallest_key ||
+      properties_.largest_key < key) {
     return false;
   }
+  LoadIndex();
+  return !prefix_extractor_ || !prefix_extractor_->InDomain(key) ||
+         prefix_filter_.MayContain(prefix_extractor_->Transform(key));
+}
 
-  auto it = sparse_index_.lower_bound(key);
-  if (it->first == key) {
-    // Exact match in the sparse index.
-    io_handle_->Seek(it->second);
-    io_handle_->ParseNext(segment);
-    return true;
-  } else if (it == sparse_index_.cbegin()) {
-    // The index entry is guaranteed to evaluate greater than the key now, so
-    // if it's the smallest item in the index, it's not a match.
+bool SSTable::MayContainPrefix(const Buffer& prefix) const {
+  if (properties_.num_entries == 0) {
     return false;
-  } else {
-    it = prev(it);
   }
 
-  io_handle_->Seek(it->second);
-  while (!io_handle_->End()) {
-    io_handle_->ParseNext(segment);
-    if (segment->key == key) {
+  // Every key that starts with the prefix sorts at or after it, and before any
+  // larger key that doesn't start with it.
+  const Buffer& smallest_key = properties_.smallest_key;
+  const bool smallest_has_prefix =
+      smallest_key.size() >= prefix.size() &&
+      equal(prefix.begin(), prefix.end(), smallest_key.begin());
+  if (properties_.largest_key < prefix ||
+      (prefix < smallest_key && !smallest_has_prefix)) {
+    return false;
+  }
+  LoadIndex();
+
+  // Since the extractor is prefix-preserving, every key that starts with a
+  // prefix in its domain maps to the same prefix as the prefix itself.
+  return !prefix_extractor_ || !prefix_extractor_->InDomain(prefix) ||
+         prefix_filter_.MayContain(prefix_extractor_->Transform(prefix));
+}
+
+bool SSTable::IndexRegion(const Buffer& key, off_t* begin, off_t* end) const {
+  // Start from the last indexed key at or before the one we're looking for.
+  // Indexed offsets always point at the newest version of a key, so every
+  // version of the key sits between that offset and the next indexed one.
+  LoadIndex();
+  auto it = sparse_index_.upper_bound(key);
+  if (it == sparse_index_.cbegin()) {
+    return false;
+  }
+  *begin = prev(it)->second;
+  *end = it == sparse_index_.cend() ? data_size_ : it->second;
+  return true;
+}
+
+void SSTable::LoadIndex() const {
+  if (!lazy_index_) {
+    return;
+  }
+
+  // Nothing reads the index before call_once returns, so building it in place
+  // doesn't race with lookups.
+  call_once(index_loaded_, [this]() {
+    const_cast<SSTable*>(this)->BuildSparseIndexFromFile(
+        filepath_, false /* compute_properties */);
+  });
+}
+
+vector<char> SSTable::ReadRegion(const off_t begin, const off_t end) const {
+  // The region is read with a single positional read rather than through the
+  // shared stream, so lookups can run concurrently.
+  vector<char> region(end - begin);
+  CHECK_EQ(io_handle_->ReadAt(begin, region.size(), region.data()),
+           region.size())
+      << "Short read from " << filepath_;
+  return region;
+}
+
+bool SSTable::FindSegment(const Buffer& key, const SequenceNumber snapshot_seq,
+                          Segment* segment) const {
+  CHECK(segment);
+  const bool found = FindVersion(key, snapshot_seq, segment);
+  if (range_tombstones_.empty()) {
+    return found;
+  }
+  return ApplyRangeTombstone(
+      key, range_tombstones_.MaxCoveringSeq(key, snapshot_seq), found, segment);
+}
+
+bool SSTable::FindVersion(const Buffer& key, const SequenceNumber snapshot_seq,
+                          Segment* segment) const {
+  off_t begin, end;
+  if (!MayContainKey(key) || !IndexRegion(key, &begin, &end)) {
+    return false;
+  }
+  const vector<char> region = ReadRegion(begin, end);
+
+  const char* p = region.data();
+  const char* const limit = p + region.size();
+  while (p < limit) {
+    CHECK(coding::DecodeSegment(&p, limit, segment))
+        << "Corrupt segment in " << filepath_ << " at offset "
+        << begin + (p - region.data());
+    if (segment->key == key && segment->seq <= snapshot_seq) {
       return true;
     } else if (key < segment->key) {
       // It's impossible to encounter the key since the remaining values to
@@ -252,11 +698,105 @@ bool SSTable::FindSegment(const Buffer& key, Segment* segment) const {
   return false;
 }
 
+void SSTable::FindSegments(const SequenceNumber snapshot_seq,
+                           vector<KeyLookup>* lookups) const {
+  // Only the lookups that reach this table are subject to its range
+  // tombstones.
+  vector<bool> pending;
+  if (!range_tombstones_.empty()) {
+    for (const auto& lookup : *lookups) {
+      pending.push_back(!lookup.found);
+    }
+  }
+
+  // Work out which regions of the file hold the keys, coalescing the regions of
+  // neighbouring keys, then fetch them all with a single batch of reads.
+  struct Region {
+    size_t first_lookup;
+    size_t end_lookup;
+    off_t begin;
+    vector<char> data;
+  };
+  vector<Region> regions;
+  vector<IOHandle::ReadRequest> reads;
+
+  size_t ii = 0;
+  while (ii < lookups->size()) {
+    off_t begin, end;
+    if ((*lookups)[ii].found || !MayContainKey(*(*lookups)[ii].key) ||
+        !IndexRegion(*(*lookups)[ii].key, &begin, &end)) {
+      ++ii;
+      continue;
+    }
+
+    // Grow the read over the following keys as long as their regions are
+    // close enough that reading the gap is cheaper than another read.
+    size_t jj = ii + 1;
+    for (; jj < lookups->size(); ++jj) {
+      off_t next_begin, next_end;
+      if ((*lookups)[jj].found || !MayContainKey(*(*lookups)[jj].key)) {
+        continue;
+      }
+      CHECK(IndexRegion(*(*lookups)[jj].key, &next_begin, &next_end));
+      if (next_begin >
+          end + static_cast<off_t>(FLAGS_sstable_multiget_coalesce_bytes)) {
+        break;
+      }
+      end = max(end, next_end);
+    }
+
+    regions.push_back(Region{ii, jj, begin, vector<char>(end - begin)});
+    ii = jj;
+  }
+
+  reads.reserve(regions.size());
+  for (auto& region : regions) {
+    reads.emplace_back(region.begin, region.data.size(), region.data.data());
+  }
+  io_handle_->ReadBatch(&reads);
+
+  for (size_t rr = 0; rr < regions.size(); ++rr) {
+    const Region& region = regions[rr];
+    CHECK_EQ(reads[rr].num_read, region.data.size())
+        << "Short read from " << filepath_;
+
+    // Walk the segments and the sorted keys in step.
+    const char* p = region.data.data();
+    const char* const limit = p + region.data.size();
+    size_t kk = region.first_lookup;
+    Segment segment;
+    while (p < limit && kk < region.end_lookup) {
+      CHECK(coding::DecodeSegment(&p, limit, &segment))
+          << "Corrupt segment in " << filepath_ << " at offset "
+          << region.begin + (p - region.data.data());
+      while (kk < region.end_lookup && ((*lookups)[kk].found ||
+                                        *(*lookups)[kk].key < segment.key)) {
+        ++kk;
+      }
+      if (kk < region.end_lookup && *(*lookups)[kk].key == segment.key &&
+          segment.seq <= snapshot_seq) {
+        (*lookups)[kk].segment = move(segment);
+        (*lookups)[kk].found = true;
+      }
+    }
+  }
+
+  for (size_t kk = 0; kk < pending.size(); ++kk) {
+    if (pending[kk]) {
+      KeyLookup& lookup = (*lookups)[kk];
+      const SequenceNumber tombstone_seq =
+          range_tombstones_.MaxCoveringSeq(*lookup.key, snapshot_seq);
+      lookup.found = ApplyRangeTombstone(*lookup.key, tombstone_seq,
+                                         lookup.found, &lookup.segment);
+    }
+  }
+}
+
 Buffer SSTable::Get(const Buffer& key) const {
   Segment segment;
-  const bool found = FindSegment(key, &segment);
+  const bool found = FindSegment(key, kMaxSequenceNumber, &segment);
 
-  return found ? segment.val : Buffer();
+  return found && !segment.delete_entry ? segment.val : Buffer();
 }
 
 off_t SSTable::KeyIndexOffsetBytes() const {
@@ -265,28 +805,169 @@ off_t SSTable::KeyIndexOffsetBytes() const {
 
 bool SSTable::SanityCheck() {
   DLOG(INFO) << "sanity checking sstable " << table_id_;
-  io_handle_->Reset();
+  SequentialReader reader(filepath_, data_size_);
 
   Segment segment, last_segment;
-  while (!io_handle_->End()) {
+  while (true) {
     last_segment = segment;
-    io_handle_->ParseNext(&segment);
-    if (!last_segment.key.empty() && last_segment.key > segment.key) {
+    if (!reader.Next(&segment)) {
+      break;
+    }
+    if (!last_segment.key.empty() && !(last_segment < segment)) {
       DLOG(INFO) << "failed sanity check. " << segment.DebugString()
                  << " comes after " << last_segment.DebugString();
       return false;
     }
   }
 
+  // The blocks, where the table has checksums for them, must be intact and
+  // cover every segment.
+  uint64_t block_begin = 0;
+  for (const auto& block : properties_.block_checksums) {
+    if (block.end_offset <= block_begin || block.end_offset > data_size_) {
+      DLOG(INFO) << "failed sanity check. block ends at " << block.end_offset
+                 << " after starting at " << block_begin;
+      return false;
+    }
+    const vector<char> data = ReadRegion(block_begin, block.end_offset);
+    if (coding::Checksum(data.data(), data.size()) != block.crc) {
+      DLOG(INFO) << "failed sanity check. checksum mismatch in block at "
+                 << block_begin;
+      return false;
+    }
+    block_begin = block.end_offset;
+  }
+  if (!properties_.block_checksums.empty() && block_begin != data_size_) {
+    DLOG(INFO) << "failed sanity check. blocks end at " << block_begin
+               << " but the data ends at " << data_size_;
+    return false;
+  }
+
   return true;
 }
 
-void SSTable::Flush() {
-  if (!merge_buffer_.first.key.empty()) {
-    io_handle_->SegmentWrite(merge_buffer_.first);
-    merge_buffer_.first = Segment();
+bool SSTable::HasFooter(const fs::path& path) {
+  boost::system::error_code ec;
+  const uint64_t size = fs::file_size(path, ec);
+  if (ec || size < kFooterSize) {
+    return false;
+  }
+
+  ifstream ifs(path.string(), ios::binary);
+  vector<char> footer(kFooterSize);
+  ifs.seekg(size - kFooterSize);
+  ifs.read(footer.data(), footer.size());
+  return ifs.good() &&
+         coding::DecodeFixed64(footer.data() + sizeof(uint64_t)) ==
+             kTableMagic;
+}
+
+void SSTable::RenameFile(const fs::path& new_sstable_path) {
+  io_handle_->Rename(new_sstable_path);
+  filepath_ = io_handle_->filepath();
+}
+
+SSTableIterator::SSTableIterator(shared_ptr<const SSTable> sstable)
+    : sstable_(move(sstable)), buffer_offset_(0), pos_(0), valid_(false) {}
+
+void SSTableIterator::SeekToFirst() { SeekToOffset(0); }
+
+void SSTableIterator::Seek(const Buffer& target) {
+  SeekToOffset(sstable_->IndexedOffset(target));
+  while (valid_ && segment_.key < target) {
+    ParseNext();
+  }
+}
+
+void SSTableIterator::Next() {
+  CHECK(valid_);
+  ParseNext();
+}
+
+void SSTableIterator::SeekToOffset(const off_t offset) {
+  // Keep the buffer if it already covers the offset.
+  if (offset < buffer_offset_ ||
+      offset > buffer_offset_ + static_cast<off_t>(buffer_.size())) {
+    buffer_.clear();
+    buffer_offset_ = offset;
+  }
+  pos_ = offset - buffer_offset_;
+  ParseNext();
+}
+
+void SSTableIterator::ParseNext() {
+  const off_t offset = buffer_offset_ + pos_;
+  if (offset >= static_cast<off_t>(sstable_->data_size_)) {
+    valid_ = false;
+    return;
+  }
+
+  const char* p = buffer_.data() + pos_;
+  if (!coding::DecodeSegment(&p, buffer_.data() + buffer_.size(), &segment_)) {
+    // The segment runs past the end of the buffer. Read ahead from its start,
+    // and if it's bigger than the read-ahead size, read it whole.
+    Fill(offset, FLAGS_sstable_readahead_bytes);
+    CHECK_GE(buffer_.size(), coding::kSegmentHeaderSize)
+        << "Truncated segment in " << sstable_->filepath() << " at offset "
+        << offset;
+    const size_t segment_size = coding::EncodedSegmentSize(buffer_.data());
+    if (buffer_.size() < segment_size) {
+      Fill(offset, segment_size);
+    }
+
+    p = buffer_.data();
+    CHECK(coding::DecodeSegment(&p, buffer_.data() + buffer_.size(),
+                                &segment_))
+        << "Truncated segment in " << sstable_->filepath() << " at offset "
+        << offset;
   }
-  io_handle_->Flush();
+  pos_ = p - buffer_.data();
+  valid_ = true;
+}
+
+void SSTableIterator::Fill(const off_t offset, const size_t num_bytes) {
+  const size_t remaining = sstable_->data_size_ - offset;
+  buffer_.resize(min(max<size_t>(num_bytes, 1), remaining));
+  buffer_offset_ = offset;
+  pos_ = 0;
+  CHECK_EQ(sstable_->io_handle_->ReadAt(offset, buffer_.size(), buffer_.data()),
+           buffer_.size())
+      << "Short read from " << sstable_->filepath();
+}
+
+SSTableWriter::SSTableWriter(const fs::path& path,
+                             util::Threadpool* build_pool,
+                             const SequenceNumber seq)
+    : filepath_(path), seq_(seq), finished_(false) {
+  CHECK(!fs::exists(filepath_)) << "SSTable file " << filepath_ << " exists";
+  io_handle_ = make_unique<IOHandle>(filepath_);
+  builder_ = make_unique<TableBuilder>(io_handle_.get(), build_pool);
+}
+
+void SSTableWriter::Put(const Buffer& key, const Buffer& val) {
+  Add(Segment(key, val, false /* del */, seq_));
+}
+
+void SSTableWriter::Delete(const Buffer& key) {
+  Add(Segment(key, Buffer(), true /* del */, seq_));
+}
+
+void SSTableWriter::Add(Segment&& segment) {
+  CHECK(!finished_) << "Adding to finished SSTable " << filepath_;
+  CHECK(properties_.num_entries == 0 || properties_.largest_key < segment.key)
+      << "Keys must be added to " << filepath_ << " in ascending order";
+  properties_.Add(segment);
+  builder_->Add(move(segment));
+}
+
+void SSTableWriter::Finish() {
+  CHECK(!finished_) << "SSTable " << filepath_ << " is already finished";
+  properties_.block_checksums = builder_->Finish();
+  builder_.reset();
+  AppendPropertiesAndFooter(io_handle_.get(), properties_,
+                            io_handle_->Offset());
+  io_handle_.reset();
+  finished_ = true;
 }
 
 }  // namespace diodb
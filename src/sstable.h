@@ -2,15 +2,27 @@
 
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include <boost/filesystem.hpp>
 
+#include "bloom_filter.h"
 #include "buffer.h"
+#include "compaction_filter.h"
+#include "merge_operator.h"
 #include "iohandle.h"
+#include "iterator.h"
 #include "memtable.h"
+#include "prefix_extractor.h"
+#include "range_tombstone.h"
+#include "rate_limiter.h"
 #include "readable_table_base.h"
+#include "table_builder.h"
+#include "table_properties.h"
+#include "util/threadpool.h"
+#include "value_log.h"
 
 namespace fs = boost::filesystem;
 namespace diodb {
@@ -22,24 +34,59 @@ class SSTable : public TableStats, public ReadableTable {
   // Constructing an SSTable object with just a filename implies that we are
   // simply representing an SSTable file that already exists. If the file
   // indicated by 'sstable_path' DOES NOT exist, DiverDB will abort.
-  explicit SSTable(const fs::path sstable_path);
+  //
+  // With 'lazy_index', only the properties are read up front, and the sparse
+  // index and prefix filter are built by the first lookup that needs them.
+  // Tables without properties are always indexed right away.
+  explicit SSTable(const fs::path sstable_path, bool lazy_index = false);
 
   // Constructing an SSTable using a filename and a memtable implies we are
   // flushing the memtable to disk. The file indicated by 'new_sstable_path'
   // MUST NOT exist, or DiverDB will abort.
-  SSTable(const fs::path& new_sstable_path, const Memtable& memtable);
+  //
+  // Versions of a key that are not visible at any of the sequence numbers in
+  // 'snapshots' (sorted in ascending order) are left out. If 'rate_limiter' is
+  // set, the writes are charged against it at high priority. If 'build_pool'
+  // is set, blocks of the table are encoded on it in parallel. If 'value_log'
+  // is set, large values are moved into it and the table only keeps
+  // references to them; the log must be synced before the table is used.
+  SSTable(const fs::path& new_sstable_path, const Memtable& memtable,
+          const std::vector<SequenceNumber>& snapshots = {},
+          RateLimiter* rate_limiter = nullptr,
+          util::Threadpool* build_pool = nullptr,
+          ValueLog* value_log = nullptr);
 
   // Constructing an SSTable from other SSTable objects will merge the provided
   // SSTables into a new object at the provided filename. The file indicated by
   // 'new_sstable_path' MUST NOT exist, or DiverDB will abort.
+  //
+  // The merge is assumed to include the oldest data for every key, so deletes
+  // are dropped along with the versions they shadow once no snapshot in
+  // 'snapshots' needs them. If 'rate_limiter' is set, the writes are charged
+  // against it at low priority. If 'build_pool' is set, blocks of the table
+  // are encoded on it in parallel. If 'compaction_filter' is set, it decides
+  // what becomes of the newest version of each key. If 'merge_operator' is
+  // set, merge operands are folded into the versions beneath them.
   SSTable(const fs::path new_sstable_path,
-          const std::vector<SSTablePtr>& sstables);
+          const std::vector<SSTablePtr>& sstables,
+          const std::vector<SequenceNumber>& snapshots = {},
+          RateLimiter* rate_limiter = nullptr,
+          util::Threadpool* build_pool = nullptr,
+          const CompactionFilter* compaction_filter = nullptr,
+          const MergeOperator* merge_operator = nullptr);
 
   virtual ~SSTable() {}
 
   // ReadableTable.
   virtual ReadableTable::DetailedKeyResponse DeletedKeyExists(
       const Buffer& key) const override;
+  virtual bool FindSegment(const Buffer& key, SequenceNumber snapshot_seq,
+                           Segment* segment) const override;
+
+  // Keys that fall in the same or nearby index regions are served by a single
+  // read, and each region is decoded once for all of its keys.
+  virtual void FindSegments(SequenceNumber snapshot_seq,
+                            std::vector<KeyLookup>* lookups) const override;
   virtual Buffer Get(const Buffer& key) const override;
   virtual Buffer Get(const std::string&& key) const {
     Buffer k(key.begin(), key.end());
@@ -48,72 +95,240 @@ class SSTable : public TableStats, public ReadableTable {
 
   virtual size_t Size() const override { return num_valid_entries(); }
 
-  // Verify SSTable invariants.
+  // Returns false if the table definitely holds no key starting with 'prefix'.
+  // The prefix filter is consulted when the prefix is in the domain of the
+  // extractor the table was built with, and the table's key range otherwise.
+  bool MayContainPrefix(const Buffer& prefix) const;
+
+  // Verify SSTable invariants, including the checksums of the blocks.
   bool SanityCheck();
 
+  // Renames the SSTable file. Lookups against this object keep working.
+  void RenameFile(const fs::path& new_sstable_path);
+
+  // Returns true if the file at 'path' ends with a table footer. Opening a
+  // file that doesn't treats it as a table without properties, and aborts if
+  // it isn't made up of segments.
+  static bool HasFooter(const fs::path& path);
+
   // Accessors.
   fs::path filepath() const { return filepath_; }
   size_t table_id() const { return table_id_; }
+  uint64_t file_size() const { return file_size_; }
+  const TableProperties& properties() const { return properties_; }
+
+  // Value log references that were dropped while building the table, along
+  // with the versions holding them. Their values are garbage once the table
+  // replaces the tables it was built from.
+  const std::vector<Buffer>& discarded_value_refs() const {
+    return discarded_value_refs_;
+  }
 
   // TODO: stats such as num_bytes..
 
  private:
+  friend class SSTableIterator;
+
+  // Returns the offset to start scanning from to find 'key': the offset of the
+  // last indexed key at or before it, or 0 if there is none.
+  off_t IndexedOffset(const Buffer& key) const;
+
+  // FindSegment without the range tombstones.
+  bool FindVersion(const Buffer& key, SequenceNumber snapshot_seq,
+                   Segment* segment) const;
+
+  // Returns false if the table definitely doesn't hold 'key'.
+  bool MayContainKey(const Buffer& key) const;
+
+  // Builds the sparse index and prefix filter if the table was opened with
+  // 'lazy_index' and they haven't been built yet. Concurrent callers wait for
+  // the one building them.
+  void LoadIndex() const;
+
+  // Finds the region of the file between two consecutive index entries that
+  // holds every version of 'key', if the key is in the table. Returns false if
+  // the key sorts before the first key in the table.
+  bool IndexRegion(const Buffer& key, off_t* begin, off_t* end) const;
+
+  // Reads the region of the file in ['begin', 'end').
+  std::vector<char> ReadRegion(off_t begin, off_t end) const;
+
   // Persists an SSTable to disk from a provided memtable by appending segment
   // files to each other on disk. Returns true on success.
   bool FlushMemtable(const fs::path& new_sstable_path,
-                     const Memtable& memtable);
+                     const Memtable& memtable,
+                     const std::vector<SequenceNumber>& snapshots);
+
+  // Builds the sparse in-memory segment index from a provided filepath. The
+  // table properties are worked out along the way if 'compute_properties' is
+  // set. With 'direct', the file is read around the page cache.
+  void BuildSparseIndexFromFile(const fs::path filepath,
+                                bool compute_properties, bool direct = false);
 
-  // Builds the sparse in-memory segment index from a provided filepath.
-  void BuildSparseIndexFromFile(const fs::path filepath);
+  // Appends the properties block and the footer to a newly written table, and
+  // syncs the file.
+  void WriteProperties();
+
+  // Reads the properties block of an existing table. Returns false if the
+  // file has no footer.
+  bool ReadProperties();
 
   // Returns the minimum key offset bytes for the sparse index.
   virtual off_t KeyIndexOffsetBytes() const;
 
   // Takes a vector of existing SSTable files that are sorted chronologically
   // (newest to oldest) and creates a new SSTable at 'filepath_' with the merged
-  // contents. The merge keeps the most recent version of any segment.
-  void MergeSSTables(const std::vector<SSTablePtr>& sstables);
-
-  // Batches up writes, such that identical keys are deduped and age
-  // priority is resolved. A call to Flush() is necessary to fully clear the
-  // batch.
-  void ResolveWrite(Segment&& segment, int age);
-
-  // Sync writes to disk.
-  void Flush();
-
-  // Finds a segment in the SSTable given a key and puts it in the provided
-  // segment reference. Returns true if one is found.
-  bool FindSegment(const Buffer& key, Segment* segment) const;
+  // contents. The merge keeps the most recent version of any segment, plus any
+  // older versions that a snapshot still needs.
+  void MergeSSTables(const std::vector<SSTablePtr>& sstables,
+                     const std::vector<SequenceNumber>& snapshots);
 
-  // Writes the remaining items in the segment cache in the correct order, while
-  // also keeping track of the age of each item.
-  void FinishSegmentCache(std::vector<std::shared_ptr<Segment>>& segment_cache);
+  // Writes out the versions of a single key, ordered from newest to oldest,
+  // that are visible to a reader at the latest sequence number or at one of
+  // the snapshots, and not covered by one of 'tombstones' for them. If
+  // 'drop_deletes' is set, deletes that have no older versions left behind
+  // them are dropped too. The vector is cleared.
+  void WriteVersions(std::vector<Segment>* versions,
+                     const std::vector<SequenceNumber>& snapshots,
+                     const RangeTombstoneList& tombstones, bool drop_deletes);
 
-  // Accessor.
-  int32_t file_size() { return file_size_; }
+  // Folds each run of merge operands in 'versions' into the older versions
+  // that the same readers see, turning it into a plain value once it reaches
+  // a put, a delete or the oldest version of the key. Values in the value log
+  // aren't read, so operands stop short of them.
+  void FoldMergeOperands(std::vector<Segment>* versions,
+                         const std::vector<SequenceNumber>& snapshots,
+                         const RangeTombstoneList& tombstones,
+                         bool drop_deletes);
 
  private:
   // Filepath of this SSTable.
   fs::path filepath_;
 
   // Size of the SSTable file after being written.
-  int32_t file_size_;
+  uint64_t file_size_;
+
+  // Number of bytes of segments at the start of the file, which are followed
+  // by the properties block and the footer.
+  uint64_t data_size_;
+
+  // Summary of the table's contents.
+  TableProperties properties_;
+
+  // The range tombstones in 'properties_', ready for lookups.
+  RangeTombstoneList range_tombstones_;
 
   // Unique identifier for this SSTable. Calculated as a hash of the file path.
   size_t table_id_;
 
+  // Set if the index below is built on first use by LoadIndex().
+  bool lazy_index_;
+  mutable std::once_flag index_loaded_;
+
   // A sparse index of the keys and offsets of the associated SSTable entries
   // in the file.
   std::map<Buffer, off_t> sparse_index_;
 
+  // Maps keys to the prefixes in 'prefix_filter_'. Null if the table has no
+  // prefix filter.
+  std::shared_ptr<const PrefixExtractor> prefix_extractor_;
+
+  // A Bloom filter over the prefixes of the keys in the table.
+  BloomFilter prefix_filter_;
+
   // SSTable segment file controller.
   std::unique_ptr<IOHandle> io_handle_;
 
-  // Buffer maintained for resolving write batches during merge. Contains a
-  // segment and its age. Younger (lower number) sstables will replace old ones
-  // with the same key.
-  std::pair<Segment, int> merge_buffer_;
+  // Writes the segments of a table while it's being built.
+  std::unique_ptr<TableBuilder> builder_;
+
+  // Where large values go while the table is being flushed, if anywhere.
+  ValueLog* value_log_;
+
+  // Filters the entries of the table while it's being merged, if set.
+  const CompactionFilter* compaction_filter_;
+
+  // Folds merge operands while the table is being merged, if set.
+  const MergeOperator* merge_operator_;
+
+  std::vector<Buffer> discarded_value_refs_;
+};
+
+// Scans an SSTable sequentially, reading --sstable_readahead_bytes at a time
+// with positional reads so that it doesn't disturb concurrent lookups.
+class SSTableIterator : public InternalIterator {
+ public:
+  explicit SSTableIterator(std::shared_ptr<const SSTable> sstable);
+
+  // InternalIterator.
+  bool Valid() const override { return valid_; }
+  void SeekToFirst() override;
+  void Seek(const Buffer& target) override;
+  void Next() override;
+  const Segment& segment() const override { return segment_; }
+
+ private:
+  // Positions the iterator at the segment starting at 'offset'.
+  void SeekToOffset(off_t offset);
+
+  // Decodes the segment at the current offset, reading ahead if it isn't
+  // entirely in the buffer.
+  void ParseNext();
+
+  // Refills the buffer with at least 'num_bytes' bytes starting at 'offset',
+  // or as many as are left in the file.
+  void Fill(off_t offset, size_t num_bytes);
+
+ private:
+  std::shared_ptr<const SSTable> sstable_;
+
+  // Bytes read ahead from the file, starting at 'buffer_offset_'.
+  std::vector<char> buffer_;
+  off_t buffer_offset_;
+
+  // Position of the next segment in the buffer.
+  size_t pos_;
+
+  // The current segment.
+  Segment segment_;
+  bool valid_;
+};
+
+// Writes a table from keys given in ascending order, for loading data in bulk
+// through DBController::IngestExternalFile rather than through the memtable.
+// The table holds a single version of each key, at sequence number 'seq',
+// which must be zero for tables that are to be ingested. With --ttl_seconds
+// set, values must end with their write time, laid out as
+// TtlCompactionFilter::AppendWriteTime does.
+class SSTableWriter {
+ public:
+  // Creates the table at 'path', which must not exist. If 'build_pool' is set,
+  // blocks are encoded on it in parallel.
+  explicit SSTableWriter(const fs::path& path,
+                         util::Threadpool* build_pool = nullptr,
+                         SequenceNumber seq = 0);
+
+  // Adds a value, or a delete, for a key greater than any added so far.
+  void Put(const Buffer& key, const Buffer& val);
+  void Delete(const Buffer& key);
+
+  // Writes the properties block and the footer and syncs the file. Nothing
+  // can be added afterwards, and the file isn't a valid table until then.
+  void Finish();
+
+  // Accessors.
+  fs::path filepath() const { return filepath_; }
+  const TableProperties& properties() const { return properties_; }
+
+ private:
+  void Add(Segment&& segment);
+
+  const fs::path filepath_;
+  const SequenceNumber seq_;
+  std::unique_ptr<IOHandle> io_handle_;
+  std::unique_ptr<TableBuilder> builder_;
+  TableProperties properties_;
+  bool finished_;
 };
 
 }  // namespace diodb
@@ -0,0 +1,110 @@
+#include <algorithm>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "coding.h"
+#include "table_builder.h"
+
+using namespace std;
+
+DEFINE_uint64(sstable_block_bytes, 64 * 1024,
+              "Approximate number of bytes of segments in each block of a new "
+              "SSTable. Blocks are encoded and checksummed in parallel, and "
+              "each one gets a checksum of its own.");
+
+namespace diodb {
+
+TableBuilder::TableBuilder(IOHandle* io_handle, util::Threadpool* pool)
+    : io_handle_(io_handle),
+      pool_(pool),
+      block_bytes_(max<uint64_t>(FLAGS_sstable_block_bytes, 1)),
+      current_(make_unique<Block>()),
+      current_bytes_(0),
+      offset_(io_handle->Offset()) {
+  CHECK(io_handle_);
+}
+
+TableBuilder::~TableBuilder() {
+  // Jobs that are still running use the blocks and 'mtx_'.
+  unique_lock<mutex> lock(mtx_);
+  cv_.wait(lock, [this] {
+    return all_of(pending_.begin(), pending_.end(),
+                  [](const shared_ptr<Block>& block) { return block->done; });
+  });
+}
+
+void TableBuilder::Add(Segment&& segment) {
+  current_bytes_ += coding::EncodedSegmentSize(segment);
+  current_->segments.push_back(move(segment));
+  if (current_bytes_ >= block_bytes_) {
+    CutBlock();
+  }
+}
+
+vector<BlockChecksum> TableBuilder::Finish() {
+  CutBlock();
+  WriteBlocks(0);
+  return move(checksums_);
+}
+
+void TableBuilder::CutBlock() {
+  if (current_->segments.empty()) {
+    return;
+  }
+
+  shared_ptr<Block> block(current_.release());
+  block->encoded.reserve(current_bytes_);
+  block->done = false;
+  current_ = make_unique<Block>();
+  current_bytes_ = 0;
+  pending_.push_back(block);
+
+  if (!pool_) {
+    Encode(block.get());
+    block->done = true;
+    WriteBlocks(0);
+    return;
+  }
+
+  pool_->Enqueue([this, block]() {
+    Encode(block.get());
+    {
+      lock_guard<mutex> lock(mtx_);
+      block->done = true;
+    }
+    cv_.notify_all();
+  });
+
+  // Enough blocks stay in flight to keep the pool busy, and no more, so that
+  // a big flush or merge doesn't pile up in memory.
+  WriteBlocks(2 * pool_->num_threads());
+}
+
+void TableBuilder::Encode(Block* block) {
+  for (const auto& segment : block->segments) {
+    coding::EncodeSegment(segment, &block->encoded);
+  }
+  block->crc = coding::Checksum(block->encoded.data(), block->encoded.size());
+  block->segments.clear();
+}
+
+void TableBuilder::WriteBlocks(const size_t max_pending) {
+  while (!pending_.empty()) {
+    const shared_ptr<Block> block = pending_.front();
+    {
+      unique_lock<mutex> lock(mtx_);
+      if (!block->done && pending_.size() <= max_pending) {
+        return;
+      }
+      cv_.wait(lock, [&block] { return block->done; });
+    }
+
+    io_handle_->Append(block->encoded);
+    offset_ += block->encoded.size();
+    checksums_.push_back(BlockChecksum{offset_, block->crc});
+    pending_.pop_front();
+  }
+}
+
+}  // namespace diodb
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "buffer.h"
+#include "iohandle.h"
+#include "table_properties.h"
+#include "util/threadpool.h"
+
+namespace diodb {
+
+// Writes the segments of a new table through an IOHandle. Segments are
+// gathered into blocks of about --sstable_block_bytes, and each block is
+// encoded and checksummed by a job on a thread pool while the next one is
+// being gathered. Finished blocks are appended to the file in the order they
+// were cut, so the file comes out the same as if every segment had been
+// written one after the other.
+class TableBuilder {
+ public:
+  // Writes to 'io_handle', starting at its current offset. Without a
+  // 'pool', blocks are encoded on the calling thread. The caller must not be
+  // running on 'pool' itself, since it waits for the blocks it hands off.
+  TableBuilder(IOHandle* io_handle, util::Threadpool* pool = nullptr);
+  ~TableBuilder();
+
+  // Adds a segment after the ones added so far.
+  void Add(Segment&& segment);
+
+  // Writes out every block that's still pending. Returns the checksums of all
+  // the blocks written.
+  std::vector<BlockChecksum> Finish();
+
+ private:
+  // A block on its way to the file. The segments are only touched by the job
+  // encoding them; 'done' is guarded by 'mtx_'.
+  typedef struct Block {
+    std::vector<Segment> segments;
+    Buffer encoded;
+    uint32_t crc;
+    bool done;
+  } Block;
+
+  // Hands the block being gathered off to be encoded.
+  void CutBlock();
+
+  // Encodes and checksums a block.
+  static void Encode(Block* block);
+
+  // Appends the finished blocks at the head of the queue to the file, waiting
+  // for the head block while more than 'max_pending' blocks are pending.
+  void WriteBlocks(size_t max_pending);
+
+ private:
+  IOHandle* const io_handle_;
+  util::Threadpool* const pool_;
+  const size_t block_bytes_;
+
+  // The block being gathered, and its encoded size so far.
+  std::unique_ptr<Block> current_;
+  size_t current_bytes_;
+
+  std::mutex mtx_;
+
+  // Signalled when a block is done.
+  std::condition_variable cv_;
+
+  // Blocks cut but not yet written, in file order. Only touched by the
+  // calling thread.
+  std::deque<std::shared_ptr<Block>> pending_;
+
+  // Offset just past the last block written, and the checksums written so far.
+  uint64_t offset_;
+  std::vector<BlockChecksum> checksums_;
+};
+
+}  // namespace diodb
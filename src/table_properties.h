@@ -0,0 +1,243 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "buffer.h"
+#include "coding.h"
+#include "range_tombstone.h"
+
+namespace diodb {
+
+// A CRC32 of the segments in ['begin', 'end_offset') of a table file, where
+// 'begin' is where the previous block ends.
+typedef struct BlockChecksum {
+  uint64_t end_offset;
+  uint32_t crc;
+} BlockChecksum;
+
+// Summary of an SSTable's contents, persisted in the table file so that it is
+// available without scanning the table.
+typedef struct TableProperties {
+  TableProperties()
+      : num_entries(0),
+        num_valid_entries(0),
+        num_delete_entries(0),
+        max_sequence(0) {}
+
+  // Folds a segment into the properties. Segments must be added in the order
+  // they are stored.
+  void Add(const Segment& segment) {
+    const bool newest_version = num_entries == 0 || segment.key != largest_key;
+    if (num_entries == 0) {
+      smallest_key = segment.key;
+    }
+    if (newest_version) {
+      ++(segment.delete_entry ? num_delete_entries : num_valid_entries);
+      largest_key = segment.key;
+    }
+    ++num_entries;
+    max_sequence = std::max(max_sequence, segment.seq);
+  }
+
+  // Folds a range tombstone into the properties. Tombstones are added after
+  // all of the segments, and widen the key range to cover them.
+  void AddRangeTombstone(const RangeTombstone& tombstone) {
+    if (empty()) {
+      smallest_key = tombstone.begin;
+      largest_key = tombstone.end;
+    } else {
+      smallest_key = std::min(smallest_key, tombstone.begin);
+      largest_key = std::max(largest_key, tombstone.end);
+    }
+    max_sequence = std::max(max_sequence, tombstone.seq);
+    range_tombstones.push_back(tombstone);
+  }
+
+  // Returns true if the table holds neither segments nor range tombstones.
+  bool empty() const { return num_entries == 0 && range_tombstones.empty(); }
+
+  // Returns true if the table may hold keys in ['smallest', 'largest'].
+  bool Overlaps(const Buffer& smallest, const Buffer& largest) const {
+    return !empty() && !(largest < smallest_key) && !(largest_key < smallest);
+  }
+
+  // Appends the properties to 'dst', one segment per property, which keeps the
+  // block readable with the same decoder as the rest of the table.
+  void Encode(Buffer* dst) const {
+    const auto put_number = [dst](const std::string& name, uint64_t val) {
+      Buffer encoded;
+      coding::PutFixed64(&encoded, val);
+      coding::EncodeSegment(Segment(Buffer(name.begin(), name.end()),
+                                    std::move(encoded)),
+                            dst);
+    };
+    const auto put_key = [dst](const std::string& name, const Buffer& key) {
+      coding::EncodeSegment(Segment(Buffer(name.begin(), name.end()), key),
+                            dst);
+    };
+    put_number("diodb.num_entries", num_entries);
+    put_number("diodb.num_valid_entries", num_valid_entries);
+    put_number("diodb.num_delete_entries", num_delete_entries);
+    put_number("diodb.max_sequence", max_sequence);
+    put_key("diodb.smallest_key", smallest_key);
+    put_key("diodb.largest_key", largest_key);
+
+    Buffer checksums;
+    for (const auto& block : block_checksums) {
+      coding::PutFixed64(&checksums, block.end_offset);
+      coding::PutFixed32(&checksums, block.crc);
+    }
+    put_key("diodb.block_checksums", checksums);
+
+    if (!value_log_bytes.empty()) {
+      Buffer referenced;
+      for (const auto& entry : value_log_bytes) {
+        coding::PutFixed64(&referenced, entry.first);
+        coding::PutFixed64(&referenced, entry.second);
+      }
+      put_key("diodb.value_log_bytes", referenced);
+    }
+
+    if (!range_tombstones.empty()) {
+      Buffer tombstones;
+      for (const auto& tombstone : range_tombstones) {
+        coding::PutFixed32(&tombstones, tombstone.begin.size());
+        tombstones.insert(tombstones.end(), tombstone.begin.begin(),
+                          tombstone.begin.end());
+        coding::PutFixed32(&tombstones, tombstone.end.size());
+        tombstones.insert(tombstones.end(), tombstone.end.begin(),
+                          tombstone.end.end());
+        coding::PutFixed64(&tombstones, tombstone.seq);
+      }
+      put_key("diodb.range_tombstones", tombstones);
+    }
+  }
+
+  // Parses properties written by Encode. Unknown properties are skipped, so
+  // that newer files stay readable. Returns false if the block is malformed.
+  bool Decode(const char* p, const char* const limit) {
+    Segment segment;
+    while (p < limit) {
+      if (!coding::DecodeSegment(&p, limit, &segment)) {
+        return false;
+      }
+      const std::string name(segment.key.begin(), segment.key.end());
+      uint64_t* number = nullptr;
+      if (name == "diodb.num_entries") {
+        number = &num_entries;
+      } else if (name == "diodb.num_valid_entries") {
+        number = &num_valid_entries;
+      } else if (name == "diodb.num_delete_entries") {
+        number = &num_delete_entries;
+      } else if (name == "diodb.max_sequence") {
+        number = &max_sequence;
+      } else if (name == "diodb.smallest_key") {
+        smallest_key = std::move(segment.val);
+      } else if (name == "diodb.largest_key") {
+        largest_key = std::move(segment.val);
+      } else if (name == "diodb.block_checksums") {
+        constexpr size_t kEntrySize = sizeof(uint64_t) + sizeof(uint32_t);
+        if (segment.val.size() % kEntrySize != 0) {
+          return false;
+        }
+        block_checksums.clear();
+        for (size_t ii = 0; ii < segment.val.size(); ii += kEntrySize) {
+          const char* entry = segment.val.data() + ii;
+          block_checksums.push_back(
+              BlockChecksum{coding::DecodeFixed64(entry),
+                            coding::DecodeFixed32(entry + sizeof(uint64_t))});
+        }
+      } else if (name == "diodb.value_log_bytes") {
+        constexpr size_t kEntrySize = 2 * sizeof(uint64_t);
+        if (segment.val.size() % kEntrySize != 0) {
+          return false;
+        }
+        value_log_bytes.clear();
+        for (size_t ii = 0; ii < segment.val.size(); ii += kEntrySize) {
+          const char* entry = segment.val.data() + ii;
+          value_log_bytes[coding::DecodeFixed64(entry)] =
+              coding::DecodeFixed64(entry + sizeof(uint64_t));
+        }
+      } else if (name == "diodb.range_tombstones") {
+        if (!DecodeRangeTombstones(segment.val)) {
+          return false;
+        }
+      }
+
+      if (number) {
+        if (segment.val.size() != sizeof(uint64_t)) {
+          return false;
+        }
+        *number = coding::DecodeFixed64(segment.val.data());
+      }
+    }
+    return true;
+  }
+
+  // Number of segments, counting every version of every key.
+  uint64_t num_entries;
+
+  // Number of keys whose newest version is a put.
+  uint64_t num_valid_entries;
+
+  // Number of keys whose newest version is a delete.
+  uint64_t num_delete_entries;
+
+  // The largest sequence number of any segment.
+  SequenceNumber max_sequence;
+
+  // The smallest and largest keys in the table, including the bounds of its
+  // range tombstones. A tombstone's end is exclusive but still counts, which
+  // only makes the range a little wider than it has to be.
+  Buffer smallest_key;
+  Buffer largest_key;
+
+  // Checksums of the blocks the segments were written in, in file order.
+  // Empty for tables written before blocks were checksummed.
+  std::vector<BlockChecksum> block_checksums;
+
+  // Bytes of value log records the table's segments reference, by value log
+  // file. Lets the log work out its garbage when it's reopened.
+  std::map<uint64_t, uint64_t> value_log_bytes;
+
+  // The range deletes in the table. They're few enough to keep here rather
+  // than among the segments.
+  std::vector<RangeTombstone> range_tombstones;
+
+ private:
+  bool DecodeRangeTombstones(const Buffer& encoded) {
+    range_tombstones.clear();
+    const char* p = encoded.data();
+    const char* const limit = p + encoded.size();
+    const auto get_key = [&p, limit](Buffer* key) {
+      if (limit - p < static_cast<ptrdiff_t>(sizeof(uint32_t))) {
+        return false;
+      }
+      const uint32_t size = coding::DecodeFixed32(p);
+      p += sizeof(uint32_t);
+      if (static_cast<uint64_t>(limit - p) < size) {
+        return false;
+      }
+      key->assign(p, p + size);
+      p += size;
+      return true;
+    };
+    while (p < limit) {
+      RangeTombstone tombstone;
+      if (!get_key(&tombstone.begin) || !get_key(&tombstone.end) ||
+          limit - p < static_cast<ptrdiff_t>(sizeof(uint64_t))) {
+        return false;
+      }
+      tombstone.seq = coding::DecodeFixed64(p);
+      p += sizeof(uint64_t);
+      range_tombstones.push_back(std::move(tombstone));
+    }
+    return true;
+  }
+} TableProperties;
+
+}  // namespace diodb
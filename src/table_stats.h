@@ -2,18 +2,21 @@ namespace diodb {
 
 class TableStats {
  public:
-  TableStats() : num_valid_entries_(0), num_delete_entries_(0) {}
+  TableStats()
+      : num_valid_entries_(0), num_delete_entries_(0), num_bytes_(0) {}
 
   ~TableStats() {}
 
   // Accessors.
   size_t num_valid_entries() const { return num_valid_entries_; }
   size_t num_delete_entries() const { return num_delete_entries_; }
+  size_t num_bytes() const { return num_bytes_; }
 
  protected:
   // Accessors.
   size_t& mutable_num_valid_entries() { return num_valid_entries_; }
   size_t& mutable_num_delete_entries() { return num_delete_entries_; }
+  size_t& mutable_num_bytes() { return num_bytes_; }
 
  private:
   // The number of entries that are not deletes.
@@ -21,6 +24,9 @@ class TableStats {
 
   // The number of entries that are deletes.
   size_t num_delete_entries_;
+
+  // The number of key and value bytes held by the table.
+  size_t num_bytes_;
 };
 
 }  // namespace diodb
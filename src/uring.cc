@@ -0,0 +1,283 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "uring.h"
+
+using namespace std;
+
+DEFINE_int32(io_uring_queue_depth, 32,
+             "Number of operations each io_uring instance keeps in flight.");
+
+namespace diodb {
+
+namespace {
+
+// io_uring being unavailable is only worth mentioning once.
+void WarnUnavailable(const char* what) {
+  static atomic<bool> warned(false);
+  if (!warned.exchange(true)) {
+    LOG(WARNING) << what << ": " << strerror(errno)
+                 << ". Falling back to synchronous I/O.";
+  }
+}
+
+}  // namespace
+
+unique_ptr<IoUring> IoUring::Create(const unsigned depth,
+                                    const size_t num_buffers,
+                                    const size_t buffer_size) {
+  CHECK_GT(depth, 0);
+
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  const int ring_fd = syscall(__NR_io_uring_setup, depth, &params);
+  if (ring_fd < 0) {
+    WarnUnavailable("Unable to set up io_uring");
+    return nullptr;
+  }
+
+  unique_ptr<IoUring> ring(new IoUring(ring_fd, depth));
+
+  // Plain reads and writes arrived in the same kernel release as this feature.
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+    errno = ENOTSUP;
+    WarnUnavailable("io_uring lacks IORING_OP_READ");
+    return nullptr;
+  }
+  if (!ring->MapRings(params)) {
+    WarnUnavailable("Unable to map io_uring");
+    return nullptr;
+  }
+  if (num_buffers > 0 && !ring->SetUpBuffers(num_buffers, buffer_size)) {
+    WarnUnavailable("Unable to allocate io_uring buffers");
+    return nullptr;
+  }
+  return ring;
+}
+
+IoUring* IoUring::ForThisThread() {
+  thread_local unique_ptr<IoUring> ring;
+  thread_local bool set_up = false;
+  if (!set_up) {
+    set_up = true;
+    ring = Create(max(FLAGS_io_uring_queue_depth, 1));
+  }
+  return ring.get();
+}
+
+IoUring::IoUring(const int ring_fd, const unsigned depth)
+    : ring_fd_(ring_fd),
+      depth_(depth),
+      in_flight_(0),
+      to_submit_(0),
+      sqe_tail_(0),
+      sq_ring_(MAP_FAILED),
+      sq_ring_size_(0),
+      cq_ring_(MAP_FAILED),
+      cq_ring_size_(0),
+      sqes_(static_cast<io_uring_sqe*>(MAP_FAILED)),
+      sqes_size_(0),
+      buffers_(nullptr),
+      num_buffers_(0),
+      buffer_size_(0),
+      buffers_registered_(false) {}
+
+IoUring::~IoUring() {
+  // Operations still running would write to memory that's about to go away.
+  while (in_flight_ > 0) {
+    Submit(1);
+    uint64_t tag;
+    int32_t result;
+    while (PopCompletion(&tag, &result)) {
+    }
+  }
+
+  if (sqes_ != MAP_FAILED) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_ != MAP_FAILED) {
+    munmap(sq_ring_, sq_ring_size_);
+  }
+  close(ring_fd_);
+  free(buffers_);
+}
+
+bool IoUring::MapRings(const io_uring_params& params) {
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = max(sq_ring_size_, cq_ring_size_);
+  }
+
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    return false;
+  }
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      return false;
+    }
+  }
+
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return false;
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  char* const sq = static_cast<char*>(sq_ring_);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  sqe_tail_ = *sq_tail_;
+
+  char* const cq = static_cast<char*>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  return true;
+}
+
+bool IoUring::SetUpBuffers(const size_t num_buffers, const size_t buffer_size) {
+  constexpr size_t kPageSize = 4096;
+  CHECK_GT(buffer_size, 0);
+  buffer_size_ = (buffer_size + kPageSize - 1) / kPageSize * kPageSize;
+  buffers_ = static_cast<char*>(
+      aligned_alloc(kPageSize, num_buffers * buffer_size_));
+  if (!buffers_) {
+    return false;
+  }
+  num_buffers_ = num_buffers;
+
+  vector<iovec> iovecs(num_buffers_);
+  for (size_t ii = 0; ii < num_buffers_; ++ii) {
+    iovecs[ii].iov_base = buffer(ii);
+    iovecs[ii].iov_len = buffer_size_;
+  }
+
+  // Registration counts against the locked memory limit, which may be too low.
+  // The buffers still work without it.
+  buffers_registered_ =
+      syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS,
+              iovecs.data(), iovecs.size()) == 0;
+  if (!buffers_registered_) {
+    LOG(WARNING) << "Unable to register io_uring buffers: " << strerror(errno);
+  }
+  return true;
+}
+
+io_uring_sqe* IoUring::NextSqe(const uint64_t tag) {
+  if (in_flight_ >= depth_) {
+    return nullptr;
+  }
+
+  // The entry becomes visible to the kernel when Submit moves the tail.
+  const unsigned index = (sqe_tail_++) & *sq_mask_;
+  io_uring_sqe* const sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = tag;
+  sq_array_[index] = index;
+  ++in_flight_;
+  ++to_submit_;
+  return sqe;
+}
+
+bool IoUring::PrepareRead(const int fd, const int64_t offset, char* data,
+                          const size_t size, const uint64_t tag,
+                          const int buffer_index) {
+  io_uring_sqe* const sqe = NextSqe(tag);
+  if (!sqe) {
+    return false;
+  }
+  const bool fixed = buffer_index >= 0 && buffers_registered_;
+  sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->off = offset;
+  sqe->addr = reinterpret_cast<uint64_t>(data);
+  sqe->len = size;
+  sqe->buf_index = fixed ? buffer_index : 0;
+  return true;
+}
+
+bool IoUring::PrepareWrite(const int fd, const int64_t offset,
+                           const char* data, const size_t size,
+                           const uint64_t tag, const int buffer_index) {
+  io_uring_sqe* const sqe = NextSqe(tag);
+  if (!sqe) {
+    return false;
+  }
+  const bool fixed = buffer_index >= 0 && buffers_registered_;
+  sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->off = offset;
+  sqe->addr = reinterpret_cast<uint64_t>(data);
+  sqe->len = size;
+  sqe->buf_index = fixed ? buffer_index : 0;
+  return true;
+}
+
+void IoUring::Submit(unsigned min_complete) {
+  // The kernel must see the entries before it sees the new tail.
+  __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+
+  min_complete = min(min_complete, in_flight_);
+  while (true) {
+    const unsigned ready =
+        __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) - *cq_head_;
+    const bool wait = ready < min_complete;
+    if (to_submit_ == 0 && !wait) {
+      return;
+    }
+
+    const int ret =
+        syscall(__NR_io_uring_enter, ring_fd_, to_submit_,
+                wait ? min_complete - ready : 0,
+                wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+      continue;
+    }
+    PCHECK(ret >= 0) << "io_uring_enter failed";
+    to_submit_ -= ret;
+  }
+}
+
+bool IoUring::PopCompletion(uint64_t* tag, int32_t* result) {
+  const unsigned head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+
+  const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+  *tag = cqe.user_data;
+  *result = cqe.res;
+
+  // Hand the entry back to the kernel only after it has been read.
+  __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+  --in_flight_;
+  return true;
+}
+
+}  // namespace diodb
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <cstdint>
+#include <memory>
+
+namespace diodb {
+
+// A minimal io_uring instance, driven through the raw system calls so that it
+// works without liburing. Operations are queued with the Prepare* calls, handed
+// to the kernel in one go by Submit, and their results come back through
+// PopCompletion tagged with the value they were queued with. An instance is not
+// thread safe.
+class IoUring {
+ public:
+  // Sets up a ring that can hold 'depth' operations at a time. If 'num_buffers'
+  // is nonzero, that many 'buffer_size' byte buffers are allocated and
+  // registered with the kernel, so operations on them skip pinning the pages
+  // every time. Returns null if io_uring is unavailable, e.g. on older kernels
+  // or when it is blocked by a seccomp policy.
+  static std::unique_ptr<IoUring> Create(unsigned depth,
+                                         size_t num_buffers = 0,
+                                         size_t buffer_size = 0);
+
+  // Returns a ring without registered buffers that belongs to the calling
+  // thread, set up on first use with --io_uring_queue_depth entries. Returns
+  // null if io_uring is unavailable.
+  static IoUring* ForThisThread();
+
+  ~IoUring();
+
+  // Queues a read of 'size' bytes at 'offset' of 'fd' into 'data', or a write
+  // of 'size' bytes from 'data'. If 'buffer_index' is not negative, 'data'
+  // must lie within that registered buffer. Returns false if the ring already
+  // holds 'depth' operations.
+  bool PrepareRead(int fd, int64_t offset, char* data, size_t size,
+                   uint64_t tag, int buffer_index = -1);
+  bool PrepareWrite(int fd, int64_t offset, const char* data, size_t size,
+                    uint64_t tag, int buffer_index = -1);
+
+  // Hands every queued operation to the kernel, and waits until at least
+  // 'min_complete' completions are ready.
+  void Submit(unsigned min_complete);
+
+  // Pops a completion, setting 'result' to the number of bytes transferred or
+  // to a negated errno. Returns false if no completion is ready.
+  bool PopCompletion(uint64_t* tag, int32_t* result);
+
+  // Number of operations queued or submitted that haven't been popped yet.
+  unsigned in_flight() const { return in_flight_; }
+
+  unsigned depth() const { return depth_; }
+
+  // The registered buffers. If the kernel refused to register them, they can
+  // still be used, just without the fixed-buffer fast path.
+  size_t num_buffers() const { return num_buffers_; }
+  size_t buffer_size() const { return buffer_size_; }
+  char* buffer(size_t index) const { return buffers_ + index * buffer_size_; }
+
+ private:
+  IoUring(int ring_fd, unsigned depth);
+
+  // Maps the rings shared with the kernel. Returns false on failure.
+  bool MapRings(const io_uring_params& params);
+
+  // Allocates and registers the buffers.
+  bool SetUpBuffers(size_t num_buffers, size_t buffer_size);
+
+  // Claims the next submission queue entry.
+  io_uring_sqe* NextSqe(uint64_t tag);
+
+ private:
+  const int ring_fd_;
+  const unsigned depth_;
+  unsigned in_flight_;
+
+  // Queued entries not yet handed to the kernel, and the submission queue
+  // tail once they are.
+  unsigned to_submit_;
+  unsigned sqe_tail_;
+
+  // Memory shared with the kernel.
+  void* sq_ring_;
+  size_t sq_ring_size_;
+  void* cq_ring_;
+  size_t cq_ring_size_;
+  io_uring_sqe* sqes_;
+  size_t sqes_size_;
+
+  // Fields of the submission and completion rings.
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  io_uring_cqe* cqes_;
+
+  char* buffers_;
+  size_t num_buffers_;
+  size_t buffer_size_;
+  bool buffers_registered_;
+};
+
+}  // namespace diodb
@@ -2,7 +2,6 @@
 #include <memory>
 #include <mutex>
 #include <queue>
-#include <random>
 #include <thread>
 #include <vector>
 
@@ -11,18 +10,33 @@
 namespace util {
 
 Threadpool::Threadpool(const int num_threads)
-    : num_threads_(num_threads), distribution_(0, num_threads_ - 1) {
+    : num_threads_(num_threads),
+      stop_timer_(false),
+      next_worker_(0) {
   for (int ii = 0; ii < num_threads_; ++ii) {
     auto w = std::make_shared<Worker>();
     w->rage_quit = false;
     workers_.emplace_back(w);
     workers_[ii]->wthread = std::thread(&Threadpool::Toil, ii, workers_[ii]);
   }
+  timer_thread_ = std::thread(&Threadpool::Tick, this);
 }
 
 Threadpool::~Threadpool() {
+  {
+    std::unique_lock<std::mutex> lock(timer_mtx_);
+    stop_timer_ = true;
+  }
+  timer_cv_.notify_one();
+  timer_thread_.join();
+
   for (auto& work : workers_) {
-    work->rage_quit = true;
+    {
+      // Hold the lock so the worker can't miss the wakeup between checking
+      // its queue and going to sleep.
+      std::unique_lock<std::mutex> lock(work->mtx);
+      work->rage_quit = true;
+    }
     work->cv.notify_one();
     work->wthread.join();
   }
@@ -37,12 +51,44 @@ void Threadpool::Enqueue(Job&& fn) {
   worker->cv.notify_one();
 }
 
+void Threadpool::EnqueueAfter(const std::chrono::milliseconds delay,
+                              Job&& fn) {
+  {
+    std::unique_lock<std::mutex> lock(timer_mtx_);
+    delayed_jobs_.emplace(std::chrono::steady_clock::now() + delay,
+                          std::move(fn));
+  }
+  timer_cv_.notify_one();
+}
+
+void Threadpool::Tick() {
+  std::unique_lock<std::mutex> lock(timer_mtx_);
+  while (!stop_timer_) {
+    if (delayed_jobs_.empty()) {
+      timer_cv_.wait(lock);
+      continue;
+    }
+
+    const auto due = delayed_jobs_.begin()->first;
+    if (std::chrono::steady_clock::now() < due) {
+      timer_cv_.wait_until(lock, due);
+      continue;
+    }
+
+    Job job = std::move(delayed_jobs_.begin()->second);
+    delayed_jobs_.erase(delayed_jobs_.begin());
+    lock.unlock();
+    Enqueue(std::move(job));
+    lock.lock();
+  }
+}
+
 void Threadpool::Toil(const int thread_idx, std::shared_ptr<Worker> worker) {
   while (!worker->rage_quit) {
     Job job;
     {
       std::unique_lock<std::mutex> lock(worker->mtx);
-      if (worker->workq.empty()) {
+      if (worker->workq.empty() && !worker->rage_quit) {
         worker->cv.wait(lock);
       }
 
@@ -60,7 +106,7 @@ void Threadpool::Toil(const int thread_idx, std::shared_ptr<Worker> worker) {
 }
 
 std::shared_ptr<Threadpool::Worker> Threadpool::Select() {
-  return workers_[distribution_(generator_)];
+  return workers_[next_worker_++ % num_threads_];
 }
 
 }  // namespace util
@@ -2,11 +2,12 @@
 
 #include <condition_variable>
 #include <atomic>
+#include <chrono>
 #include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <queue>
-#include <random>
 #include <thread>
 #include <vector>
 
@@ -22,6 +23,11 @@ class Threadpool {
   // Queue up work for execution.
   void Enqueue(Job&& fn);
 
+  // Queue up work for execution once 'delay' has passed. No worker is tied up
+  // while the delay elapses. Jobs still waiting when the pool is destroyed are
+  // dropped.
+  void EnqueueAfter(std::chrono::milliseconds delay, Job&& fn);
+
   int num_threads() const { return num_threads_; }
 
  private:
@@ -46,8 +52,23 @@ class Threadpool {
   // The number of threads in this pool.
   const int num_threads_;
 
-  std::default_random_engine generator_;
-  std::uniform_int_distribution<int> distribution_;
+  // Thread that hands delayed jobs to the workers once they are due.
+  std::thread timer_thread_;
+
+  // Mutex protecting the delayed jobs.
+  std::mutex timer_mtx_;
+
+  // Condition variable used to wake up the timer thread.
+  std::condition_variable timer_cv_;
+
+  // Delayed jobs keyed by the time they become due.
+  std::multimap<std::chrono::steady_clock::time_point, Job> delayed_jobs_;
+
+  // If true, the timer thread will stop.
+  bool stop_timer_;
+
+  // Jobs are handed to the workers in turn. Any thread may enqueue jobs.
+  std::atomic<unsigned int> next_worker_;
 
  private:
   // Choose a thread to execute a job.
@@ -56,6 +77,9 @@ class Threadpool {
   // Life of a worker thread. It takes the index of the worker thread in the
   // worker thread vector.
   static void Toil(const int thread_idx, std::shared_ptr<Worker> worker);
+
+  // Life of the timer thread.
+  void Tick();
 };
 
 }  // namespace util
@@ -0,0 +1,293 @@
+#include <algorithm>
+#include <string>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "coding.h"
+#include "value_log.h"
+
+using namespace std;
+
+DEFINE_uint64(value_log_min_value_bytes, 0,
+              "Values of at least this many bytes are moved to the value log "
+              "when their memtable is flushed, and the SSTables only hold a "
+              "reference to them. Zero keeps every value in the SSTables.");
+
+DEFINE_uint64(value_log_file_bytes, 64 * 1024 * 1024,
+              "Size at which a value log file is closed and a new one begun.");
+
+DEFINE_double(value_log_gc_garbage_ratio, 0.5,
+              "Share of a value log file's bytes that must be garbage before "
+              "its live values are rewritten and the file removed.");
+
+namespace diodb {
+
+namespace {
+
+constexpr char kValueLogExtension[] = ".vlog";
+
+// Size of the location at the start of a reference: the file number, the
+// offset and the size of the record.
+constexpr size_t kLocationSize = 2 * sizeof(uint64_t) + sizeof(uint32_t);
+
+}  // namespace
+
+ValueLog::ValueLog(const fs::path& db_directory, const size_t ref_tail_bytes)
+    : db_directory_(db_directory),
+      ref_tail_bytes_(ref_tail_bytes),
+      files_(make_shared<FileSet>()),
+      active_number_(0),
+      next_file_number_(0) {
+  fs::create_directories(db_directory_);
+  auto files = make_shared<FileSet>();
+  for (const auto& entry : fs::directory_iterator(db_directory_)) {
+    const fs::path& p = entry.path();
+    const string stem = p.stem().string();
+    if (p.extension() != kValueLogExtension || stem.empty() ||
+        !all_of(stem.begin(), stem.end(), ::isdigit)) {
+      continue;
+    }
+
+    // Whatever was referenced from these files before is unknown until the
+    // tables are read, so none of it counts as garbage until RebuildGarbage.
+    const uint64_t number = stoull(stem);
+    files->emplace(number, make_shared<IOHandle>(p));
+    stats_[number] = FileStats{fs::file_size(p), 0, false};
+    next_file_number_ = max(next_file_number_, number + 1);
+  }
+  files_ = move(files);
+}
+
+Buffer ValueLog::Add(const Segment& segment) {
+  lock_guard<mutex> lock(mtx_);
+  if (!active_ ||
+      static_cast<uint64_t>(active_->Offset()) >= FLAGS_value_log_file_bytes) {
+    Roll();
+  }
+
+  // The log holds plain puts. The key and sequence number are only kept so
+  // that garbage collection can tell whether the value is still referenced.
+  CHECK(!segment.delete_entry && !segment.value_ref);
+  const Location location{
+      active_number_, static_cast<uint64_t>(active_->Offset()),
+      static_cast<uint32_t>(coding::EncodedSegmentSize(segment))};
+  active_->SegmentWrite(segment);
+  stats_[active_number_].total_bytes += location.size;
+  return EncodeRef(location, segment.val);
+}
+
+void ValueLog::Sync() {
+  lock_guard<mutex> lock(mtx_);
+  if (active_) {
+    active_->Flush();
+  }
+}
+
+void ValueLog::Seal() {
+  lock_guard<mutex> lock(mtx_);
+  if (active_) {
+    active_->Flush();
+    active_.reset();
+  }
+}
+
+Buffer ValueLog::Get(const Buffer& ref, const FileSet* pinned) const {
+  const Location location = DecodeLocation(ref);
+
+  shared_ptr<IOHandle> handle;
+  {
+    lock_guard<mutex> lock(mtx_);
+    const auto it = files_->find(location.file_number);
+    if (it != files_->end()) {
+      handle = it->second;
+    }
+  }
+  if (!handle && pinned) {
+    const auto it = pinned->find(location.file_number);
+    if (it != pinned->end()) {
+      handle = it->second;
+    }
+  }
+  CHECK(handle) << "Value log file " << location.file_number
+                << " is gone, but a value in it is still referenced";
+
+  vector<char> data(location.size);
+  CHECK_EQ(handle->ReadAt(location.offset, location.size, data.data()),
+           location.size)
+      << "Truncated value log file " << handle->filepath() << " at offset "
+      << location.offset;
+  const char* p = data.data();
+  Segment segment;
+  CHECK(coding::DecodeSegment(&p, data.data() + data.size(), &segment))
+      << "Corrupt value log record in " << handle->filepath()
+      << " at offset " << location.offset;
+  return move(segment.val);
+}
+
+void ValueLog::MarkGarbage(const Buffer& ref) {
+  const Location location = DecodeLocation(ref);
+
+  // The file may have been collected already.
+  lock_guard<mutex> lock(mtx_);
+  const auto it = stats_.find(location.file_number);
+  if (it != stats_.end()) {
+    it->second.garbage_bytes += location.size;
+  }
+}
+
+void ValueLog::CountReference(const Buffer& ref,
+                              map<uint64_t, uint64_t>* referenced_bytes) {
+  const Location location = DecodeLocation(ref);
+  (*referenced_bytes)[location.file_number] += location.size;
+}
+
+void ValueLog::RebuildGarbage(const map<uint64_t, uint64_t>& referenced_bytes) {
+  // Collecting a file checks every value in it anyway, so overestimating the
+  // garbage only costs some extra work.
+  lock_guard<mutex> lock(mtx_);
+  for (auto& entry : stats_) {
+    const auto it = referenced_bytes.find(entry.first);
+    const uint64_t referenced =
+        it == referenced_bytes.end() ? 0 : it->second;
+    entry.second.garbage_bytes =
+        entry.second.total_bytes - min(referenced, entry.second.total_bytes);
+  }
+}
+
+bool ValueLog::PickFileToCollect(uint64_t* file_number) const {
+  lock_guard<mutex> lock(mtx_);
+  double best_ratio = FLAGS_value_log_gc_garbage_ratio;
+  bool found = false;
+  for (const auto& entry : stats_) {
+    if ((active_ && entry.first == active_number_) ||
+        entry.second.total_bytes == 0 || entry.second.deferred) {
+      continue;
+    }
+    const double ratio = static_cast<double>(entry.second.garbage_bytes) /
+                         entry.second.total_bytes;
+    if (ratio >= best_ratio) {
+      best_ratio = ratio;
+      *file_number = entry.first;
+      found = true;
+    }
+  }
+  return found;
+}
+
+void ValueLog::DeferCollection(const uint64_t file_number) {
+  lock_guard<mutex> lock(mtx_);
+  const auto it = stats_.find(file_number);
+  if (it != stats_.end()) {
+    it->second.deferred = true;
+  }
+}
+
+void ValueLog::RetryDeferredFiles() {
+  lock_guard<mutex> lock(mtx_);
+  for (auto& entry : stats_) {
+    entry.second.deferred = false;
+  }
+}
+
+void ValueLog::ForEachRecord(
+    const uint64_t file_number,
+    const function<void(Segment&&, const Buffer&)>& fn) const {
+  shared_ptr<IOHandle> handle;
+  {
+    lock_guard<mutex> lock(mtx_);
+    const auto it = files_->find(file_number);
+    CHECK(it != files_->end()) << "No value log file " << file_number;
+    handle = it->second;
+  }
+
+  const fs::path path = handle->filepath();
+  SequentialReader reader(path, fs::file_size(path));
+  Segment segment;
+  while (true) {
+    const uint64_t offset = reader.offset();
+    if (!reader.Next(&segment)) {
+      break;
+    }
+    const Location location{
+        file_number, offset,
+        static_cast<uint32_t>(reader.offset() - offset)};
+    const Buffer ref = EncodeRef(location, segment.val);
+    fn(move(segment), ref);
+  }
+}
+
+void ValueLog::DeleteFile(const uint64_t file_number) {
+  lock_guard<mutex> lock(mtx_);
+  CHECK(!active_ || file_number != active_number_)
+      << "Deleting the value log file being appended to";
+  const auto it = files_->find(file_number);
+  if (it == files_->end()) {
+    return;
+  }
+
+  // Open handles keep the data around for pinned readers.
+  LOG(INFO) << "Removing value log file " << it->second->filepath();
+  fs::remove(it->second->filepath());
+  auto files = make_shared<FileSet>(*files_);
+  files->erase(file_number);
+  files_ = move(files);
+  stats_.erase(file_number);
+}
+
+shared_ptr<const ValueLog::FileSet> ValueLog::files() const {
+  lock_guard<mutex> lock(mtx_);
+  return files_;
+}
+
+uint64_t ValueLog::MinValueBytes() { return FLAGS_value_log_min_value_bytes; }
+
+bool ValueLog::SameValue(const Buffer& a, const Buffer& b) {
+  CHECK(a.size() >= kLocationSize && b.size() >= kLocationSize)
+      << "Malformed value log reference";
+  return equal(a.begin(), a.begin() + kLocationSize, b.begin());
+}
+
+Buffer ValueLog::RefTail(const Buffer& ref) {
+  CHECK_GE(ref.size(), kLocationSize) << "Malformed value log reference";
+  return Buffer(ref.begin() + kLocationSize, ref.end());
+}
+
+Buffer ValueLog::EncodeRef(const Location& location,
+                           const Buffer& value) const {
+  Buffer ref;
+  coding::PutFixed64(&ref, location.file_number);
+  coding::PutFixed64(&ref, location.offset);
+  coding::PutFixed32(&ref, location.size);
+  if (value.size() >= ref_tail_bytes_) {
+    ref.insert(ref.end(), value.end() - ref_tail_bytes_, value.end());
+  }
+  return ref;
+}
+
+ValueLog::Location ValueLog::DecodeLocation(const Buffer& ref) {
+  CHECK_GE(ref.size(), kLocationSize) << "Malformed value log reference";
+  return Location{coding::DecodeFixed64(ref.data()),
+                  coding::DecodeFixed64(ref.data() + sizeof(uint64_t)),
+                  coding::DecodeFixed32(ref.data() + 2 * sizeof(uint64_t))};
+}
+
+void ValueLog::Roll() {
+  // Values in the closed file are referenced as soon as the table holding
+  // them is installed, so it has to be durable first.
+  if (active_) {
+    active_->Flush();
+  }
+
+  active_number_ = next_file_number_++;
+  const fs::path path =
+      db_directory_ / (to_string(active_number_) + kValueLogExtension);
+  active_ = make_shared<IOHandle>(path);
+  stats_[active_number_] = FileStats{0, 0, false};
+
+  auto files = make_shared<FileSet>(*files_);
+  files->emplace(active_number_, active_);
+  files_ = move(files);
+}
+
+}  // namespace diodb
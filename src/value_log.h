@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <boost/filesystem.hpp>
+
+#include "buffer.h"
+#include "iohandle.h"
+
+namespace fs = boost::filesystem;
+namespace diodb {
+
+// Holds values of at least --value_log_min_value_bytes apart from the SSTables,
+// which only keep a small reference to them. Merges then move the references
+// around instead of the values, which is what dominates their I/O when values
+// are large.
+//
+// Values are appended to log files as segments, so a log file reads like an
+// SSTable without the properties block. A reference can also keep a copy of
+// the last few bytes of its value, such as the write time that --ttl_seconds
+// appends, so that merges can look at them without reading the log.
+//
+// The log keeps track of how many of each file's bytes are no longer
+// referenced, and files where that share reaches --value_log_gc_garbage_ratio
+// are collected by rewriting their live values to the end of the log.
+class ValueLog {
+ public:
+  // The open log files by number. A table version pins the files that exist
+  // when it is installed, so that readers of old versions can still read
+  // values that have been moved since.
+  using FileSet = std::map<uint64_t, std::shared_ptr<IOHandle>>;
+
+  // Opens the log files in 'db_directory'. New values always go to a new file.
+  // References to values added from now on keep a copy of the last
+  // 'ref_tail_bytes' bytes of the value.
+  explicit ValueLog(const fs::path& db_directory, size_t ref_tail_bytes = 0);
+
+  // Appends the value of 'segment' to the log, and returns the reference to
+  // store in its place. The value can't be read back until the next Sync.
+  Buffer Add(const Segment& segment);
+
+  // Makes every value added so far durable and readable.
+  void Sync();
+
+  // Syncs and closes the file being appended to, so that no existing file
+  // changes any more. The next Add starts a new file.
+  void Seal();
+
+  // Reads the value 'ref' points to. The file is looked for among the current
+  // files and then among those in 'pinned', if it's set.
+  Buffer Get(const Buffer& ref, const FileSet* pinned = nullptr) const;
+
+  // Notes that the value 'ref' points to is no longer referenced by any table.
+  void MarkGarbage(const Buffer& ref);
+
+  // Returns true if references 'a' and 'b' point to the same value, whatever
+  // they keep of its end.
+  static bool SameValue(const Buffer& a, const Buffer& b);
+
+  // Returns the end of the value that 'ref' keeps a copy of. Empty for logs
+  // that don't keep one.
+  static Buffer RefTail(const Buffer& ref);
+
+  // Adds the size of the record 'ref' points to to the bytes referenced in its
+  // file.
+  static void CountReference(const Buffer& ref,
+                             std::map<uint64_t, uint64_t>* referenced_bytes);
+
+  // Counts whatever 'referenced_bytes' doesn't account for in each file that
+  // was opened as garbage. Called once the tables and the memtable have been
+  // recovered, with everything they reference.
+  void RebuildGarbage(const std::map<uint64_t, uint64_t>& referenced_bytes);
+
+  // Finds the file with the largest share of garbage, if that share is at
+  // least --value_log_gc_garbage_ratio. The file being appended to is never
+  // picked, and neither are deferred ones. Returns false if there is no such
+  // file.
+  bool PickFileToCollect(uint64_t* file_number) const;
+
+  // Keeps a file from being picked again until RetryDeferredFiles, for when
+  // some of its values can't be moved yet.
+  void DeferCollection(uint64_t file_number);
+
+  // Makes the deferred files candidates for collection again.
+  void RetryDeferredFiles();
+
+  // Calls 'fn' with every segment in a file and the reference to its value.
+  void ForEachRecord(
+      uint64_t file_number,
+      const std::function<void(Segment&&, const Buffer&)>& fn) const;
+
+  // Removes a collected file. Readers that pinned it can still read from it
+  // until they let go of it.
+  void DeleteFile(uint64_t file_number);
+
+  // The current files.
+  std::shared_ptr<const FileSet> files() const;
+
+  // Values at least this big are stored in the log. Zero if the log is off.
+  static uint64_t MinValueBytes();
+
+ private:
+  // Where a value lives. Encoded as the value of a segment with 'value_ref'
+  // set.
+  typedef struct Location {
+    uint64_t file_number;
+    uint64_t offset;
+    uint32_t size;
+  } Location;
+
+  // References start with the location, and go on with the tail of the value.
+  Buffer EncodeRef(const Location& location, const Buffer& value) const;
+  static Location DecodeLocation(const Buffer& ref);
+
+  // Starts a new file to append to. Callers must hold 'mtx_'.
+  void Roll();
+
+ private:
+  const fs::path db_directory_;
+  const size_t ref_tail_bytes_;
+
+  mutable std::mutex mtx_;
+
+  // The current files. Replaced rather than modified, so that pinned sets
+  // never change underneath their readers.
+  std::shared_ptr<const FileSet> files_;
+
+  // Bytes written to each file, how many of them are garbage, and whether
+  // collecting the file has been put off.
+  typedef struct FileStats {
+    uint64_t total_bytes;
+    uint64_t garbage_bytes;
+    bool deferred;
+  } FileStats;
+  std::map<uint64_t, FileStats> stats_;
+
+  // The file being appended to, if any, and the number of the next file.
+  std::shared_ptr<IOHandle> active_;
+  uint64_t active_number_;
+  uint64_t next_file_number_;
+};
+
+}  // namespace diodb
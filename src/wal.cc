@@ -0,0 +1,265 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+#include <glog/logging.h>
+#include <boost/filesystem.hpp>
+
+#include "coding.h"
+#include "wal.h"
+
+using namespace std;
+
+namespace diodb {
+
+namespace {
+
+constexpr char kLogExtension[] = ".wal";
+
+// Makes the entries of 'directory' durable, such as a newly created log.
+void SyncDirectory(const fs::path& directory) {
+  const int fd = open(directory.c_str(), O_RDONLY);
+  PCHECK(fd >= 0) << "Unable to open " << directory;
+  PCHECK(fsync(fd) == 0) << "Error syncing " << directory;
+  close(fd);
+}
+
+}  // namespace
+
+WriteAheadLog::SyncMode WriteAheadLog::ParseSyncMode(const string& mode) {
+  if (mode == "none") {
+    return SyncMode::kNone;
+  } else if (mode == "batch") {
+    return SyncMode::kBatch;
+  } else if (mode == "periodic") {
+    return SyncMode::kPeriodic;
+  }
+  LOG(FATAL) << "Invalid WAL sync mode '" << mode << "'";
+  return SyncMode::kBatch;
+}
+
+WriteAheadLog::WriteAheadLog(const fs::path& log_directory,
+                             const SyncMode sync_mode,
+                             const chrono::milliseconds sync_interval)
+    : log_directory_(log_directory),
+      sync_mode_(sync_mode),
+      sync_interval_(sync_interval),
+      active_log_number_(0),
+      fd_(-1),
+      unsynced_(false),
+      last_sync_(chrono::steady_clock::now()),
+      num_records_written_(0),
+      num_syncs_(0) {
+  fs::create_directories(log_directory_);
+
+  // Never append to a log left behind by a previous process. Its tail may be
+  // torn, and anything appended after a torn record would be unreachable.
+  const auto existing = ListLogNumbers();
+  if (!existing.empty()) {
+    active_log_number_ = existing.back() + 1;
+  }
+
+  LOG(INFO) << "Opening write-ahead log in " << log_directory_ << " with "
+            << existing.size() << " existing log files";
+  OpenActiveLog();
+}
+
+WriteAheadLog::~WriteAheadLog() {
+  if (unsynced_ && sync_mode_ != SyncMode::kNone) {
+    Sync();
+  }
+  close(fd_);
+}
+
+fs::path WriteAheadLog::LogPath(const uint64_t log_number) const {
+  return log_directory_ / (to_string(log_number) + kLogExtension);
+}
+
+vector<uint64_t> WriteAheadLog::ListLogNumbers() const {
+  vector<uint64_t> numbers;
+  for (const auto& entry : fs::directory_iterator(log_directory_)) {
+    const fs::path& p = entry.path();
+    if (p.extension() != kLogExtension) {
+      continue;
+    }
+    const string stem = p.stem().string();
+    if (stem.empty() || !all_of(stem.begin(), stem.end(), ::isdigit)) {
+      continue;
+    }
+    numbers.push_back(stoull(stem));
+  }
+  sort(numbers.begin(), numbers.end());
+  return numbers;
+}
+
+void WriteAheadLog::OpenActiveLog() {
+  const fs::path path = LogPath(active_log_number_);
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  PCHECK(fd_ >= 0) << "Unable to open write-ahead log " << path;
+  unsynced_ = false;
+
+  // Syncing the file doesn't make its directory entry durable, and without
+  // it a power loss could take the whole log along.
+  SyncDirectory(log_directory_);
+}
+
+void WriteAheadLog::Replay(const function<void(vector<Segment>&&)>& fn) {
+  const vector<uint64_t> log_numbers = ListLogNumbers();
+  for (auto it = log_numbers.begin(); it != log_numbers.end(); ++it) {
+    const uint64_t log_number = *it;
+    if (log_number == active_log_number_) {
+      continue;
+    }
+
+    const fs::path path = LogPath(log_number);
+    ifstream ifs(path.string(), ios::binary);
+    const Buffer contents((istreambuf_iterator<char>(ifs)),
+                          istreambuf_iterator<char>());
+
+    size_t num_records = 0;
+    const char* p = contents.data();
+    const char* const end = contents.data() + contents.size();
+    while (p < end) {
+      const char* payload;
+      const char* limit;
+      if (!coding::DecodeRecord(&p, end, &payload, &limit) ||
+          static_cast<size_t>(limit - payload) < sizeof(uint32_t)) {
+        LOG(WARNING) << "Discarding torn or corrupt record at offset "
+                     << p - contents.data() << " of " << path
+                     << " and everything logged after it";
+        DiscardFrom(log_number, p - contents.data(),
+                    vector<uint64_t>(it + 1, log_numbers.end()));
+        return;
+      }
+
+      const char* cur = payload + sizeof(uint32_t);
+      const uint32_t count = coding::DecodeFixed32(payload);
+      vector<Segment> segments(count);
+      for (auto& segment : segments) {
+        CHECK(coding::DecodeSegment(&cur, limit, &segment))
+            << "Malformed record with a valid checksum in " << path;
+      }
+      fn(move(segments));
+      ++num_records;
+    }
+
+    LOG(INFO) << "Replayed " << num_records << " records from " << path;
+  }
+}
+
+void WriteAheadLog::DiscardFrom(const uint64_t log_number,
+                                const uint64_t offset,
+                                const vector<uint64_t>& later_log_numbers) {
+  // Otherwise the next replay would stop at the same record, and never reach
+  // the logs written from now on.
+  fs::resize_file(LogPath(log_number), offset);
+  const int fd = open(LogPath(log_number).c_str(), O_WRONLY);
+  PCHECK(fd >= 0) << "Unable to open " << LogPath(log_number);
+  PCHECK(fdatasync(fd) == 0) << "Error syncing " << LogPath(log_number);
+  close(fd);
+  for (const uint64_t n : later_log_numbers) {
+    if (n != active_log_number_) {
+      fs::remove(LogPath(n));
+    }
+  }
+  SyncDirectory(log_directory_);
+}
+
+void WriteAheadLog::AddRecord(const vector<Segment>& segments) {
+  coding::StartRecord(&scratch_);
+  coding::PutFixed32(&scratch_, segments.size());
+  for (const auto& segment : segments) {
+    coding::EncodeSegment(segment, &scratch_);
+  }
+  coding::FinishRecord(&scratch_);
+
+  const char* p = scratch_.data();
+  size_t remaining = scratch_.size();
+  while (remaining > 0) {
+    const ssize_t ret = write(fd_, p, remaining);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    PCHECK(ret > 0) << "Error appending to write-ahead log";
+    p += ret;
+    remaining -= ret;
+  }
+  unsynced_ = true;
+  ++num_records_written_;
+
+  switch (sync_mode_) {
+    case SyncMode::kNone:
+      break;
+    case SyncMode::kBatch:
+      Sync();
+      break;
+    case SyncMode::kPeriodic:
+      if (chrono::steady_clock::now() - last_sync_ >= sync_interval_) {
+        Sync();
+      }
+      break;
+  }
+}
+
+void WriteAheadLog::Sync() {
+  PCHECK(fdatasync(fd_) == 0) << "Error syncing write-ahead log";
+  unsynced_ = false;
+  last_sync_ = chrono::steady_clock::now();
+  ++num_syncs_;
+}
+
+chrono::milliseconds WriteAheadLog::SyncIfDue() {
+  // An append made with nothing left unsynced is synced by AddRecord itself
+  // if the interval has passed, so an idle log is only checked once per
+  // interval.
+  const auto interval = max(sync_interval_, chrono::milliseconds(1));
+  if (!unsynced_) {
+    return interval;
+  }
+  const auto elapsed = chrono::duration_cast<chrono::milliseconds>(
+      chrono::steady_clock::now() - last_sync_);
+  if (elapsed < sync_interval_) {
+    return max(sync_interval_ - elapsed, chrono::milliseconds(1));
+  }
+  Sync();
+  return interval;
+}
+
+uint64_t WriteAheadLog::Roll() {
+  if (unsynced_ && sync_mode_ != SyncMode::kNone) {
+    Sync();
+  }
+  close(fd_);
+
+  const uint64_t closed_log_number = active_log_number_++;
+  OpenActiveLog();
+  return closed_log_number;
+}
+
+void WriteAheadLog::ReleaseLogs(const uint64_t log_number) {
+  for (const uint64_t n : ListLogNumbers()) {
+    if (n > log_number) {
+      break;
+    }
+    CHECK_NE(n, active_log_number_);
+    DLOG(INFO) << "Releasing write-ahead log " << LogPath(n);
+    fs::remove(LogPath(n));
+  }
+}
+
+void WriteAheadLog::CopyTo(const fs::path& directory) const {
+  for (const uint64_t n : ListLogNumbers()) {
+    const fs::path to = directory / LogPath(n).filename();
+    fs::copy_file(LogPath(n), to);
+    const int fd = open(to.c_str(), O_RDONLY);
+    PCHECK(fd >= 0) << "Unable to open " << to;
+    PCHECK(fsync(fd) == 0) << "Error syncing " << to;
+    close(fd);
+  }
+}
+
+}  // namespace diodb
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "buffer.h"
+
+namespace fs = boost::filesystem;
+namespace diodb {
+
+// Append-only write-ahead log. Every write is appended to the log before it is
+// applied to the memtable so that it can be replayed after a crash. The log is
+// split into numbered files so that the files covering a memtable can be
+// dropped once that memtable has been flushed to an SSTable.
+//
+// Each record on disk is a checksummed record as laid out in coding.h, whose
+// payload is a segment count (u32) followed by that many encoded segments. A
+// record is the unit of atomicity: a torn or corrupt record is discarded on
+// replay along with everything after it, including later log files, so that
+// what is replayed is always a prefix of the history.
+//
+// The log itself is not thread-safe. The DB controller serializes all appends
+// through its group commit leader.
+class WriteAheadLog {
+ public:
+  enum class SyncMode {
+    // Never call fdatasync. Writes survive a process crash but not a machine
+    // crash.
+    kNone,
+
+    // Sync once per appended record. Since a record holds a whole group of
+    // concurrent writes, this costs one sync per group commit.
+    kBatch,
+
+    // Sync at most once per sync interval, and no later than a sync interval
+    // after the last one. The owner of the log drives the timed syncs through
+    // SyncIfDue.
+    kPeriodic,
+  };
+
+  // Parses a sync mode from its flag representation ("none", "batch" or
+  // "periodic"). Aborts on anything else.
+  static SyncMode ParseSyncMode(const std::string& mode);
+
+  // Opens a log in 'log_directory', creating the directory if necessary. Any
+  // log files already present are left in place so they can be replayed.
+  WriteAheadLog(const fs::path& log_directory, SyncMode sync_mode,
+                std::chrono::milliseconds sync_interval);
+  ~WriteAheadLog();
+
+  // Replays every record found in the existing log files, oldest first, up
+  // to the first torn or corrupt one. What comes after that record is
+  // removed from the log files.
+  void Replay(const std::function<void(std::vector<Segment>&&)>& fn);
+
+  // Appends a single record holding all of the provided segments and syncs
+  // according to the sync mode.
+  void AddRecord(const std::vector<Segment>& segments);
+
+  // Forces the active log file to disk.
+  void Sync();
+
+  // Syncs the active log file if there are unsynced appends and the sync
+  // interval has passed since the last sync. Returns the time until the next
+  // sync may be due. Only meant for periodic mode, where nothing else syncs a
+  // tail that no further appends arrive behind.
+  std::chrono::milliseconds SyncIfDue();
+
+  // Closes the active log file and starts a new one. Returns the number of the
+  // log file that was closed. Everything written before the call lives in log
+  // files numbered at or below the returned value.
+  uint64_t Roll();
+
+  // Deletes every log file numbered at or below 'log_number'. Callers must
+  // only do this once the contents of those files are durable elsewhere.
+  void ReleaseLogs(uint64_t log_number);
+
+  // Copies every log file into 'directory' and syncs the copies, so that a log
+  // opened there replays the records appended so far.
+  void CopyTo(const fs::path& directory) const;
+
+  // Accessors.
+  SyncMode sync_mode() const { return sync_mode_; }
+  uint64_t active_log_number() const { return active_log_number_; }
+  size_t num_records_written() const { return num_records_written_; }
+  size_t num_syncs() const { return num_syncs_; }
+
+ private:
+  // Returns the path of the log file with the given number.
+  fs::path LogPath(uint64_t log_number) const;
+
+  // Returns the numbers of all log files in the log directory, sorted.
+  std::vector<uint64_t> ListLogNumbers() const;
+
+  // Opens the active log file for appending.
+  void OpenActiveLog();
+
+  // Cuts log 'log_number' off at 'offset', and removes the logs in
+  // 'later_log_numbers' other than the active one.
+  void DiscardFrom(uint64_t log_number, uint64_t offset,
+                   const std::vector<uint64_t>& later_log_numbers);
+
+ private:
+  // Directory holding the log files.
+  const fs::path log_directory_;
+
+  // When to fdatasync the log.
+  const SyncMode sync_mode_;
+
+  // Minimum time between syncs in periodic mode.
+  const std::chrono::milliseconds sync_interval_;
+
+  // Number of the log file currently being appended to.
+  uint64_t active_log_number_;
+
+  // File descriptor of the active log file.
+  int fd_;
+
+  // True if there are appended bytes that have not been synced.
+  bool unsynced_;
+
+  // Time of the last sync. Only meaningful in periodic mode.
+  std::chrono::steady_clock::time_point last_sync_;
+
+  // Scratch buffer reused across records.
+  Buffer scratch_;
+
+  // Stats.
+  size_t num_records_written_;
+  size_t num_syncs_;
+};
+
+}  // namespace diodb
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "buffer.h"
+
+namespace diodb {
+
+class DBController;
+
+// A collection of puts, erases, merges and range deletes that are committed
+// atomically by DBController::Write. Operations are applied in the order they
+// were added, so a later operation on a key wins over an earlier one in the
+// same batch.
+class WriteBatch {
+ public:
+  WriteBatch() : num_bytes_(0) {}
+
+  // Queues up the insertion of a key/value pair.
+  void Put(Buffer&& key, Buffer&& val) {
+    num_bytes_ += key.size() + val.size();
+    segments_.emplace_back(std::move(key), std::move(val));
+  }
+  void Put(const std::string& key, const std::string& val) {
+    num_bytes_ += key.size() + val.size();
+    segments_.emplace_back(key, val);
+  }
+
+  // Queues up the erasure of a key.
+  void Erase(Buffer&& key) {
+    num_bytes_ += key.size();
+    segments_.emplace_back(std::move(key), Buffer(), true /* del */);
+  }
+  void Erase(const std::string& key) {
+    num_bytes_ += key.size();
+    segments_.emplace_back(key, std::string(), true /* del */);
+  }
+
+  // Queues up a merge operand for a key. See MergeOperator.
+  void Merge(Buffer&& key, Buffer&& operand) {
+    num_bytes_ += key.size() + operand.size();
+    Segment segment(std::move(key), std::move(operand));
+    segment.merge_operand = true;
+    segments_.push_back(std::move(segment));
+  }
+  void Merge(const std::string& key, const std::string& operand) {
+    Merge(Buffer(key.begin(), key.end()),
+          Buffer(operand.begin(), operand.end()));
+  }
+
+  // Queues up the erasure of every key in ['begin', 'end'). An empty range
+  // deletes nothing and is dropped.
+  void DeleteRange(Buffer&& begin, Buffer&& end) {
+    if (!(begin < end)) {
+      return;
+    }
+    num_bytes_ += begin.size() + end.size();
+    Segment segment(std::move(begin), std::move(end));
+    segment.range_delete = true;
+    segments_.push_back(std::move(segment));
+  }
+  void DeleteRange(const std::string& begin, const std::string& end) {
+    DeleteRange(Buffer(begin.begin(), begin.end()),
+                Buffer(end.begin(), end.end()));
+  }
+
+  // Drops all queued operations.
+  void Clear() {
+    segments_.clear();
+    num_bytes_ = 0;
+  }
+
+  // Accessors.
+  size_t Count() const { return segments_.size(); }
+  bool empty() const { return segments_.empty(); }
+  size_t num_bytes() const { return num_bytes_; }
+
+ private:
+  friend class DBController;
+
+  // The queued operations, in order.
+  std::vector<Segment> segments_;
+
+  // Total number of key and value bytes in the batch.
+  size_t num_bytes_;
+};
+
+}  // namespace diodb
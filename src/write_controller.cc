@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <thread>
+
+#include <glog/logging.h>
+
+#include "write_controller.h"
+
+using namespace std;
+
+DEFINE_uint64(pending_flush_slowdown_bytes, 8 * 1024 * 1024,
+              "Number of memtable bytes waiting to be flushed at which writes "
+              "start being slowed down.");
+
+DEFINE_uint64(pending_flush_stop_bytes, 16 * 1024 * 1024,
+              "Number of memtable bytes waiting to be flushed at which writes "
+              "are stopped until a flush completes.");
+
+DEFINE_int32(level0_slowdown_writes_trigger, 8,
+             "Number of level-0 SSTables at which writes start being slowed "
+             "down. Must be above --level0_compaction_trigger.");
+
+DEFINE_int32(level0_stop_writes_trigger, 12,
+             "Number of level-0 SSTables at which writes are stopped until a "
+             "merge completes. Must be above --level0_compaction_trigger.");
+
+DEFINE_uint64(compaction_debt_slowdown_bytes, 64 * 1024 * 1024,
+              "Number of bytes pending merge at which writes start being "
+              "slowed down.");
+
+DEFINE_uint64(compaction_debt_stop_bytes, 256 * 1024 * 1024,
+              "Number of bytes pending merge at which writes are stopped until "
+              "a merge completes.");
+
+DEFINE_uint64(delayed_write_rate_bytes_per_sec, 16 * 1024 * 1024,
+              "Write rate allowed when writes first start being slowed down. "
+              "The rate drops further as background work approaches the stop "
+              "thresholds.");
+
+namespace diodb {
+
+namespace {
+
+// Returns where 'val' falls between 'slowdown' and 'stop', scaled to [0, 1]
+// within that range. Values below 'slowdown' are negative.
+double Fraction(const double val, const double slowdown, const double stop) {
+  if (val < slowdown) {
+    return -1;
+  } else if (stop <= slowdown) {
+    return val >= stop ? 1 : 0;
+  }
+  return (val - slowdown) / (stop - slowdown);
+}
+
+}  // namespace
+
+WriteController::WriteController() {}
+
+void WriteController::CheckLevel0Triggers(const int compaction_trigger) {
+  CHECK_GT(FLAGS_level0_slowdown_writes_trigger, compaction_trigger)
+      << "--level0_slowdown_writes_trigger must be above "
+         "--level0_compaction_trigger";
+  CHECK_GT(FLAGS_level0_stop_writes_trigger, compaction_trigger)
+      << "--level0_stop_writes_trigger must be above "
+         "--level0_compaction_trigger";
+}
+
+void WriteController::Update(const Pressure& pressure) {
+  {
+    lock_guard<mutex> lock(mtx_);
+    pressure_ = pressure;
+  }
+  cv_.notify_all();
+}
+
+double WriteController::Severity() const {
+  const double flush = Fraction(pressure_.pending_flush_bytes,
+                                FLAGS_pending_flush_slowdown_bytes,
+                                FLAGS_pending_flush_stop_bytes);
+  const double level0 =
+      Fraction(pressure_.num_level0_files, FLAGS_level0_slowdown_writes_trigger,
+               FLAGS_level0_stop_writes_trigger);
+  const double debt = Fraction(pressure_.compaction_debt_bytes,
+                               FLAGS_compaction_debt_slowdown_bytes,
+                               FLAGS_compaction_debt_stop_bytes);
+  return max({flush, level0, debt});
+}
+
+WriteController::State WriteController::state() const {
+  lock_guard<mutex> lock(mtx_);
+  const double severity = Severity();
+  if (severity >= 1) {
+    return State::kStopped;
+  } else if (severity >= 0) {
+    return State::kDelayed;
+  }
+  return State::kNormal;
+}
+
+void WriteController::MaybeStall(const size_t num_bytes) {
+  unique_lock<mutex> lock(mtx_);
+  double severity = Severity();
+  if (severity < 0) {
+    return;
+  }
+
+  if (severity >= 1) {
+    LOG(WARNING) << "Stopping writes: pending_flush_bytes="
+                 << pressure_.pending_flush_bytes
+                 << " num_level0_files=" << pressure_.num_level0_files
+                 << " compaction_debt_bytes="
+                 << pressure_.compaction_debt_bytes;
+
+    const auto start = chrono::steady_clock::now();
+    while (severity >= 1) {
+      cv_.wait_for(lock, chrono::milliseconds(100));
+      severity = Severity();
+    }
+    ++stats_.num_stops;
+    stats_.stop_micros += chrono::duration_cast<chrono::microseconds>(
+                              chrono::steady_clock::now() - start)
+                              .count();
+    if (severity < 0) {
+      return;
+    }
+  }
+  lock.unlock();
+
+  // The allowed rate shrinks linearly to a tenth of the delayed write rate as
+  // the pressure approaches the stop threshold.
+  const double rate =
+      FLAGS_delayed_write_rate_bytes_per_sec * (1 - 0.9 * severity);
+  const auto delay = chrono::microseconds(
+      static_cast<int64_t>(num_bytes * 1000000.0 / max(rate, 1.0)));
+  this_thread::sleep_for(delay);
+
+  ++stats_.num_delays;
+  stats_.delay_micros += delay.count();
+}
+
+}  // namespace diodb
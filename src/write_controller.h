@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+namespace diodb {
+
+// Applies backpressure to writers when background flushes and merges fall
+// behind. Background jobs report how much work is outstanding, and the group
+// commit leader asks the controller for permission before every write. Writes
+// are slowed down progressively as the outstanding work approaches its limit
+// and stopped outright once it is reached, so that an overloaded database
+// degrades gracefully instead of growing without bound.
+class WriteController {
+ public:
+  // Outstanding background work.
+  typedef struct Pressure {
+    Pressure()
+        : pending_flush_bytes(0),
+          num_level0_files(0),
+          compaction_debt_bytes(0) {}
+
+    // Bytes sitting in memtables that are full and waiting to be flushed.
+    size_t pending_flush_bytes;
+
+    // Number of SSTables flushed from memtables that have not yet been merged
+    // into the base table.
+    size_t num_level0_files;
+
+    // Bytes that a merge still has to rewrite to catch up.
+    size_t compaction_debt_bytes;
+  } Pressure;
+
+  enum class State {
+    kNormal,
+    kDelayed,
+    kStopped,
+  };
+
+  // Time spent stalling writes.
+  typedef struct Stats {
+    Stats()
+        : num_delays(0), delay_micros(0), num_stops(0), stop_micros(0) {}
+
+    // Number of writes that were slowed down and the total time they slept.
+    std::atomic<uint64_t> num_delays;
+    std::atomic<uint64_t> delay_micros;
+
+    // Number of writes that were stopped and the total time they waited.
+    std::atomic<uint64_t> num_stops;
+    std::atomic<uint64_t> stop_micros;
+  } Stats;
+
+  WriteController();
+
+  // Aborts unless the level-0 slowdown and stop triggers are above
+  // 'compaction_trigger'. Writes stopped at a level-0 count that never
+  // schedules a merge would never resume.
+  static void CheckLevel0Triggers(int compaction_trigger);
+
+  // Replaces the current view of the outstanding background work. Writers
+  // that are stopped are woken up to re-evaluate.
+  void Update(const Pressure& pressure);
+
+  // Blocks the calling writer according to the current pressure. 'num_bytes'
+  // is the size of the write about to happen, which determines how long a
+  // delayed write sleeps.
+  void MaybeStall(size_t num_bytes);
+
+  // Returns the state the controller is in for the current pressure.
+  State state() const;
+
+  // Accessors.
+  const Stats& stats() const { return stats_; }
+
+ private:
+  // Returns how far the worst metric is between its slowdown and stop
+  // thresholds, from 0 (at the slowdown threshold) to 1 (at the stop
+  // threshold). The result is negative if every metric is below its slowdown
+  // threshold and greater than 1 if one is past its stop threshold.
+  double Severity() const;
+
+ private:
+  // Protects 'pressure_'.
+  mutable std::mutex mtx_;
+
+  // Signalled whenever the pressure changes.
+  std::condition_variable cv_;
+
+  // The last reported pressure.
+  Pressure pressure_;
+
+  // Stall stats.
+  Stats stats_;
+};
+
+}  // namespace diodb
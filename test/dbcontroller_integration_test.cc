@@ -1,17 +1,45 @@
+#include <algorithm>
+#include <atomic>
 #include <thread>
 #include <chrono>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <set>
+#include <vector>
 
+#include <gflags/gflags.h>
+#include <boost/filesystem/fstream.hpp>
 #include "gtest/gtest.h"
 
 #include "src/buffer.h"
+#include "src/coding.h"
 #include "src/db_controller.h"
 
+DECLARE_int32(background_task_min_gap_msecs);
+DECLARE_int32(level0_compaction_trigger);
+DECLARE_int32(level0_slowdown_writes_trigger);
+DECLARE_int32(level0_stop_writes_trigger);
+DECLARE_uint64(memtable_flush_bytes);
+DECLARE_string(prefix_extractor);
+DECLARE_uint64(ttl_seconds);
+DECLARE_uint64(value_log_file_bytes);
+DECLARE_double(value_log_gc_garbage_ratio);
+DECLARE_uint64(value_log_min_value_bytes);
+
 using namespace std;
 
 namespace diodb {
 namespace test {
 
 class DBControllerIntegrationTest : public ::testing::Test {
+ protected:
+  // Tests tune the flags to get flushes and merges going quickly. They are put
+  // back when the test ends, however it ends.
+  gflags::FlagSaver flag_saver_;
 };
 
 TEST_F(DBControllerIntegrationTest, Basic) {
@@ -34,5 +62,1555 @@ TEST_F(DBControllerIntegrationTest, Basic) {
   ASSERT_EQ(dbcontroller.Get(key1), val1);
 }
 
+TEST_F(DBControllerIntegrationTest, WriteBatch) {
+  const fs::path db_dir("write_batch_dbc_test");
+  fs::remove_all(db_dir);
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    WriteBatch batch;
+    batch.Put("holy", "diver");
+    batch.Put("ride", "tiger");
+    batch.Put("gone", "too long");
+    batch.Erase("gone");
+    batch.Put("ride", "the tiger");
+    EXPECT_EQ(batch.Count(), 5);
+    dbcontroller.Write(move(batch));
+
+    ASSERT_EQ(dbcontroller.Get(Buffer({'h', 'o', 'l', 'y'})),
+              Buffer({'d', 'i', 'v', 'e', 'r'}));
+    ASSERT_FALSE(dbcontroller.KeyExists(Buffer({'g', 'o', 'n', 'e'})));
+
+    const string expected = "the tiger";
+    ASSERT_EQ(dbcontroller.Get(Buffer({'r', 'i', 'd', 'e'})),
+              Buffer(expected.begin(), expected.end()));
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, FlushAndMerge) {
+  const fs::path db_dir("flush_merge_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 50;
+  FLAGS_memtable_flush_bytes = 1024;
+  FLAGS_level0_compaction_trigger = 2;
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    // Enough data for several flushes and merges.
+    for (int ii = 0; ii < 2000; ++ii) {
+      WriteBatch batch;
+      batch.Put("key" + to_string(ii), "val" + to_string(ii));
+      if (ii % 3 == 0) {
+        batch.Erase("key" + to_string(ii / 3));
+      }
+      dbcontroller.Write(move(batch));
+    }
+    this_thread::sleep_for(chrono::milliseconds(500));
+
+    for (int ii = 0; ii < 2000; ++ii) {
+      const string key = "key" + to_string(ii);
+      const string val = "val" + to_string(ii);
+      const Buffer k(key.begin(), key.end());
+      if (ii * 3 < 2000) {
+        ASSERT_FALSE(dbcontroller.KeyExists(k)) << key;
+      } else {
+        ASSERT_EQ(dbcontroller.Get(k), Buffer(val.begin(), val.end())) << key;
+      }
+    }
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, ReadsDuringFlushAndMerge) {
+  const fs::path db_dir("concurrent_reads_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 10;
+  FLAGS_memtable_flush_bytes = 512;
+  FLAGS_level0_compaction_trigger = 2;
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    // Readers check every key written so far while the writer keeps the
+    // background tasks busy swapping tables out from underneath them.
+    constexpr int kNumKeys = 3000;
+    atomic<int> num_written(0);
+    atomic<bool> failed(false);
+    vector<thread> readers;
+    for (int rr = 0; rr < 4; ++rr) {
+      readers.emplace_back([&dbcontroller, &num_written, &failed, rr]() {
+        int ii = rr;
+        while (num_written < kNumKeys && !failed) {
+          const int limit = num_written;
+          if (limit == 0) {
+            continue;
+          }
+          ii = (ii + 7) % limit;
+          const string key = "key" + to_string(ii);
+          const string val = "val" + to_string(ii);
+          if (dbcontroller.Get(Buffer(key.begin(), key.end())) !=
+              Buffer(val.begin(), val.end())) {
+            failed = true;
+          }
+        }
+      });
+    }
+
+    for (int ii = 0; ii < kNumKeys; ++ii) {
+      const string key = "key" + to_string(ii);
+      const string val = "val" + to_string(ii);
+      dbcontroller.Put(Buffer(key.begin(), key.end()),
+                       Buffer(val.begin(), val.end()));
+      ++num_written;
+    }
+
+    for (auto& reader : readers) {
+      reader.join();
+    }
+    ASSERT_FALSE(failed);
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, Snapshots) {
+  const fs::path db_dir("snapshot_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 50;
+  FLAGS_level0_compaction_trigger = 1;
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    const Buffer key({'k'});
+    WriteBatch batch;
+    batch.Put("k", "v1");
+    dbcontroller.Write(move(batch));
+    const Snapshot* snap1 = dbcontroller.GetSnapshot();
+
+    batch.Put("k", "v2");
+    dbcontroller.Write(move(batch));
+    const Snapshot* snap2 = dbcontroller.GetSnapshot();
+
+    batch.Erase("k");
+    dbcontroller.Write(move(batch));
+
+    // Check before and after the memtable is flushed and merged.
+    for (int ii = 0; ii < 2; ++ii) {
+      ASSERT_FALSE(dbcontroller.KeyExists(key));
+      ASSERT_EQ(dbcontroller.Get(key, snap1), Buffer({'v', '1'}));
+      ASSERT_EQ(dbcontroller.Get(key, snap2), Buffer({'v', '2'}));
+      this_thread::sleep_for(chrono::milliseconds(300));
+    }
+
+    dbcontroller.ReleaseSnapshot(snap1);
+    dbcontroller.ReleaseSnapshot(snap2);
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, MultiGet) {
+  const fs::path db_dir("multiget_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 50;
+  FLAGS_memtable_flush_bytes = 1024;
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    for (int ii = 0; ii < 500; ++ii) {
+      WriteBatch batch;
+      batch.Put("key" + to_string(ii), "val" + to_string(ii));
+      if (ii % 5 == 0) {
+        batch.Erase("key" + to_string(ii / 5));
+      }
+      dbcontroller.Write(move(batch));
+    }
+    this_thread::sleep_for(chrono::milliseconds(300));
+
+    // Out of order, with duplicates and keys that were never written.
+    vector<Buffer> keys;
+    for (int ii = 600; ii >= 0; ii -= 3) {
+      const string key = "key" + to_string(ii % 550);
+      keys.emplace_back(key.begin(), key.end());
+    }
+
+    const vector<Buffer> values = dbcontroller.MultiGet(keys);
+    ASSERT_EQ(values.size(), keys.size());
+    for (size_t ii = 0; ii < keys.size(); ++ii) {
+      ASSERT_EQ(values[ii], dbcontroller.Get(keys[ii]))
+          << string(keys[ii].begin(), keys[ii].end());
+    }
+    EXPECT_EQ(values.back(), Buffer());
+    EXPECT_EQ(values[50], Buffer({'v', 'a', 'l', '4', '5', '0'}));
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, AsyncGetAndPut) {
+  const fs::path db_dir("async_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 50;
+  FLAGS_memtable_flush_bytes = 1024;
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    vector<future<void>> puts;
+    for (int ii = 0; ii < 300; ++ii) {
+      const string key = "key" + to_string(ii);
+      const string val = "val" + to_string(ii);
+      puts.push_back(dbcontroller.PutAsync(Buffer(key.begin(), key.end()),
+                                           Buffer(val.begin(), val.end())));
+    }
+    for (auto& put : puts) {
+      put.get();
+    }
+    dbcontroller.Erase(Buffer({'k', 'e', 'y', '7'}));
+
+    // Let the older keys make it into SSTables.
+    this_thread::sleep_for(chrono::milliseconds(300));
+
+    vector<future<Buffer>> gets;
+    for (int ii = 0; ii < 320; ++ii) {
+      const string key = "key" + to_string(ii);
+      gets.push_back(dbcontroller.GetAsync(Buffer(key.begin(), key.end())));
+    }
+    for (int ii = 0; ii < 320; ++ii) {
+      const Buffer val = gets[ii].get();
+      if (ii == 7 || ii >= 300) {
+        EXPECT_EQ(val, Buffer()) << ii;
+      } else {
+        const string expected = "val" + to_string(ii);
+        EXPECT_EQ(val, Buffer(expected.begin(), expected.end())) << ii;
+      }
+    }
+
+    // Callbacks, reading as of a snapshot taken before an overwrite.
+    const Snapshot* snapshot = dbcontroller.GetSnapshot();
+    dbcontroller.Put(Buffer({'k', 'e', 'y', '1'}), Buffer({'n', 'e', 'w'}));
+
+    mutex mtx;
+    condition_variable cv;
+    int pending = 2;
+    Buffer old_val, new_val;
+    const auto done = [&mtx, &cv, &pending](Buffer* dst, Buffer val) {
+      lock_guard<mutex> lock(mtx);
+      *dst = move(val);
+      --pending;
+      cv.notify_all();
+    };
+    dbcontroller.GetAsync(Buffer({'k', 'e', 'y', '1'}), snapshot,
+                          [&done, &old_val](Buffer val) {
+                            done(&old_val, move(val));
+                          });
+    dbcontroller.GetAsync(Buffer({'k', 'e', 'y', '1'}), nullptr,
+                          [&done, &new_val](Buffer val) {
+                            done(&new_val, move(val));
+                          });
+    {
+      unique_lock<mutex> lock(mtx);
+      cv.wait(lock, [&pending]() { return pending == 0; });
+    }
+    EXPECT_EQ(old_val, Buffer({'v', 'a', 'l', '1'}));
+    EXPECT_EQ(new_val, Buffer({'n', 'e', 'w'}));
+    dbcontroller.ReleaseSnapshot(snapshot);
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, Iterator) {
+  const fs::path db_dir("iterator_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 50;
+  FLAGS_memtable_flush_bytes = 1024;
+  FLAGS_level0_compaction_trigger = 3;
+
+  auto to_string_key = [](const int ii) {
+    return "key" + to_string(10000 + ii);
+  };
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    // Spread versions of the keys across memtables, level-0 tables and the
+    // base table. Every fourth key ends up deleted, and every third is
+    // overwritten.
+    for (int ii = 0; ii < 1000; ++ii) {
+      WriteBatch batch;
+      batch.Put(to_string_key(ii), "old");
+      dbcontroller.Write(move(batch));
+    }
+    this_thread::sleep_for(chrono::milliseconds(300));
+    const Snapshot* snapshot = dbcontroller.GetSnapshot();
+    for (int ii = 0; ii < 1000; ++ii) {
+      WriteBatch batch;
+      if (ii % 4 == 0) {
+        batch.Erase(to_string_key(ii));
+      } else if (ii % 3 == 0) {
+        batch.Put(to_string_key(ii), "new");
+      }
+      dbcontroller.Write(move(batch));
+    }
+
+    auto it = dbcontroller.NewIterator();
+    int expected = 1;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      const string key = to_string_key(expected);
+      ASSERT_EQ(it->key(), Buffer(key.begin(), key.end()));
+      const string val = expected % 3 == 0 ? "new" : "old";
+      ASSERT_EQ(it->value(), Buffer(val.begin(), val.end()));
+      expected += expected % 4 == 3 ? 2 : 1;
+    }
+    EXPECT_EQ(expected, 1001);
+
+    // Seeking to a deleted key lands on the next live one.
+    const string target = to_string_key(500);
+    it->Seek(Buffer(target.begin(), target.end()));
+    ASSERT_TRUE(it->Valid());
+    const string next = to_string_key(501);
+    EXPECT_EQ(it->key(), Buffer(next.begin(), next.end()));
+
+    // The snapshot predates the deletes and overwrites.
+    auto snapshot_it = dbcontroller.NewIterator(snapshot);
+    int num_keys = 0;
+    for (snapshot_it->SeekToFirst(); snapshot_it->Valid();
+         snapshot_it->Next()) {
+      ASSERT_EQ(snapshot_it->value(), Buffer({'o', 'l', 'd'}));
+      ++num_keys;
+    }
+    EXPECT_EQ(num_keys, 1000);
+    dbcontroller.ReleaseSnapshot(snapshot);
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, PrefixIterator) {
+  const fs::path db_dir("prefix_iterator_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 50;
+  FLAGS_level0_compaction_trigger = 11;
+  FLAGS_level0_slowdown_writes_trigger = 12;
+  FLAGS_level0_stop_writes_trigger = 16;
+  FLAGS_prefix_extractor = "delimiter:/";
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    // Each tenant's keys end up in their own level-0 table.
+    for (int tenant = 0; tenant < 10; ++tenant) {
+      for (int user = 0; user < 20; ++user) {
+        WriteBatch batch;
+        batch.Put("tenant" + to_string(tenant) + "/user" + to_string(user),
+                  "val");
+        dbcontroller.Write(move(batch));
+      }
+      this_thread::sleep_for(chrono::milliseconds(150));
+    }
+    Buffer erased({'t', 'e', 'n', 'a', 'n', 't', '3', '/', 'u', 's', 'e', 'r',
+                   '7'});
+    dbcontroller.Erase(move(erased));
+
+    const string prefix = "tenant3/";
+    auto it = dbcontroller.NewPrefixIterator(Buffer(prefix.begin(),
+                                                    prefix.end()));
+    int num_keys = 0;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      const string key(it->key().begin(), it->key().end());
+      ASSERT_EQ(key.substr(0, prefix.size()), prefix);
+      ASSERT_NE(key, "tenant3/user7");
+      ++num_keys;
+    }
+    EXPECT_EQ(num_keys, 19);
+
+    // A prefix with no keys.
+    const string missing = "tenant42/";
+    it = dbcontroller.NewPrefixIterator(Buffer(missing.begin(),
+                                               missing.end()));
+    it->SeekToFirst();
+    EXPECT_FALSE(it->Valid());
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, MergesSkipDisjointBaseTables) {
+  const fs::path db_dir("disjoint_merge_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 50;
+  FLAGS_level0_compaction_trigger = 1;
+
+  auto num_table_files = [&db_dir]() {
+    int num_files = 0;
+    for (const auto& entry : fs::directory_iterator(db_dir)) {
+      num_files += entry.path().extension() == ".diodb";
+    }
+    return num_files;
+  };
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    // Each round lands past the keys of the previous one, so it's merged
+    // into a base table of its own.
+    for (int round = 0; round < 3; ++round) {
+      WriteBatch batch;
+      for (int ii = 0; ii < 10; ++ii) {
+        batch.Put("key" + to_string(round) + to_string(ii), "val");
+      }
+      dbcontroller.Write(move(batch));
+      this_thread::sleep_for(chrono::milliseconds(300));
+      ASSERT_EQ(num_table_files(), round + 1);
+    }
+
+    // A flush spanning the first and last rounds pulls in all of them.
+    WriteBatch batch;
+    batch.Put("key00x", "val");
+    batch.Put("key29x", "val");
+    dbcontroller.Write(move(batch));
+    this_thread::sleep_for(chrono::milliseconds(300));
+    ASSERT_EQ(num_table_files(), 1);
+
+    auto it = dbcontroller.NewIterator();
+    int num_keys = 0;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      ++num_keys;
+    }
+    EXPECT_EQ(num_keys, 32);
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, DeleteRange) {
+  const fs::path db_dir("delete_range_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 50;
+  FLAGS_memtable_flush_bytes = 1024;
+  FLAGS_level0_compaction_trigger = 2;
+
+  const auto make_key = [](const string& tenant, const int ii) {
+    const string key = tenant + "/" + to_string(1000 + ii);
+    return Buffer(key.begin(), key.end());
+  };
+  const auto make_val = [](const int ii) {
+    const string val = "val" + to_string(ii);
+    return Buffer(val.begin(), val.end());
+  };
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    for (const string tenant : {"t1", "t2", "t3"}) {
+      for (int ii = 0; ii < 200; ++ii) {
+        dbcontroller.Put(make_key(tenant, ii), make_val(ii));
+      }
+    }
+    this_thread::sleep_for(chrono::milliseconds(300));
+
+    // Drop the whole of tenant t2, which by now sits in the SSTables, with a
+    // single write. A snapshot taken before still sees it.
+    const Snapshot* snapshot = dbcontroller.GetSnapshot();
+    dbcontroller.DeleteRange(Buffer({'t', '2', '/'}), Buffer({'t', '2', '0'}));
+    dbcontroller.Put(make_key("t2", 7), make_val(7));
+
+    const auto check = [&](const int num_other_keys) {
+      vector<Buffer> keys;
+      for (const string tenant : {"t1", "t2", "t3"}) {
+        for (int ii = 0; ii < 200; ++ii) {
+          const Buffer key = make_key(tenant, ii);
+          const bool deleted = tenant == "t2" && ii != 7;
+          ASSERT_EQ(dbcontroller.KeyExists(key), !deleted) << tenant << ii;
+          ASSERT_EQ(dbcontroller.Get(key), deleted ? Buffer() : make_val(ii));
+          ASSERT_EQ(dbcontroller.GetAsync(key).get(),
+                    deleted ? Buffer() : make_val(ii));
+          ASSERT_EQ(dbcontroller.Get(key, snapshot), make_val(ii));
+          keys.push_back(key);
+        }
+      }
+      const vector<Buffer> values = dbcontroller.MultiGet(keys);
+      ASSERT_EQ(values[200 + 7], make_val(7));
+      for (int ii = 0; ii < 200; ++ii) {
+        ASSERT_EQ(values[ii], make_val(ii));
+        ASSERT_EQ(values[400 + ii], make_val(ii));
+        if (ii != 7) {
+          ASSERT_TRUE(values[200 + ii].empty()) << ii;
+        }
+      }
+
+      // Iterators skip the range, and the prefix iterator over it finds only
+      // the key written after the delete.
+      auto it = dbcontroller.NewIterator();
+      int num_keys = 0;
+      for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        ++num_keys;
+      }
+      ASSERT_EQ(num_keys, 401 + num_other_keys);
+      auto prefix_it = dbcontroller.NewPrefixIterator(Buffer({'t', '2'}));
+      prefix_it->SeekToFirst();
+      ASSERT_TRUE(prefix_it->Valid());
+      ASSERT_EQ(prefix_it->key(), make_key("t2", 7));
+      prefix_it->Next();
+      ASSERT_FALSE(prefix_it->Valid());
+
+      auto snapshot_it = dbcontroller.NewIterator(snapshot);
+      num_keys = 0;
+      for (snapshot_it->SeekToFirst(); snapshot_it->Valid();
+           snapshot_it->Next()) {
+        ++num_keys;
+      }
+      ASSERT_EQ(num_keys, 600);
+    };
+
+    // While the tombstone is in the memtable, and once it has been flushed
+    // and merged.
+    check(0);
+    for (int ii = 0; ii < 100; ++ii) {
+      dbcontroller.Put(make_key("t4", ii), make_val(ii));
+    }
+    this_thread::sleep_for(chrono::milliseconds(500));
+    check(100);
+    dbcontroller.ReleaseSnapshot(snapshot);
+  }
+
+  fs::remove_all(db_dir);
+}
+
+// Removes the keys ending in "-filtered".
+class SuffixCompactionFilter : public CompactionFilter {
+ public:
+  Decision Filter(const Buffer& key, const Buffer& value,
+                  Buffer* new_value) const override {
+    const string suffix = "-filtered";
+    return key.size() >= suffix.size() &&
+                   equal(suffix.begin(), suffix.end(),
+                         key.end() - suffix.size())
+               ? Decision::kRemove
+               : Decision::kKeep;
+  }
+
+  string Name() const override { return "suffix"; }
+};
+
+TEST_F(DBControllerIntegrationTest, CompactionFilterAndTtl) {
+  const fs::path db_dir("compaction_filter_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 50;
+  FLAGS_memtable_flush_bytes = 1024;
+  FLAGS_level0_compaction_trigger = 2;
+  FLAGS_ttl_seconds = 3;
+
+  // The old and new keys interleave, so merging the new ones reaches every
+  // old one.
+  const auto make_key = [](const int ii, const string& suffix) {
+    const string key = "key" + to_string(1000 + ii) + suffix;
+    return Buffer(key.begin(), key.end());
+  };
+  const auto make_val = [](const int ii) {
+    const string val = "val" + to_string(ii);
+    return Buffer(val.begin(), val.end());
+  };
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.SetCompactionFilter(make_shared<SuffixCompactionFilter>());
+    dbcontroller.Start();
+
+    for (int ii = 0; ii < 100; ++ii) {
+      dbcontroller.Put(make_key(ii, "-old"), make_val(ii));
+    }
+
+    // Reads never see the write time.
+    this_thread::sleep_for(chrono::milliseconds(300));
+    for (int ii = 0; ii < 100; ++ii) {
+      ASSERT_EQ(dbcontroller.Get(make_key(ii, "-old")), make_val(ii));
+    }
+    EXPECT_EQ(dbcontroller.MultiGet({make_key(7, "-old")}).front(),
+              make_val(7));
+    EXPECT_EQ(dbcontroller.GetAsync(make_key(7, "-old")).get(), make_val(7));
+    auto it = dbcontroller.NewIterator();
+    it->SeekToFirst();
+    ASSERT_TRUE(it->Valid());
+    EXPECT_EQ(it->value(), make_val(0));
+
+    // Once they expire, the old keys are dropped by the merges of new ones.
+    this_thread::sleep_for(chrono::milliseconds(3500));
+    for (int ii = 0; ii < 100; ++ii) {
+      dbcontroller.Put(make_key(ii, "-new"), make_val(ii));
+      dbcontroller.Put(make_key(ii, "-filtered"), make_val(ii));
+    }
+    this_thread::sleep_for(chrono::milliseconds(500));
+    for (int ii = 0; ii < 100; ++ii) {
+      ASSERT_FALSE(dbcontroller.KeyExists(make_key(ii, "-old"))) << ii;
+      ASSERT_EQ(dbcontroller.Get(make_key(ii, "-new")), make_val(ii));
+    }
+
+    // The filter only removes what has been merged, which leaves whatever the
+    // memtable holds.
+    int num_filtered = 0;
+    for (int ii = 0; ii < 100; ++ii) {
+      num_filtered += !dbcontroller.KeyExists(make_key(ii, "-filtered"));
+    }
+    EXPECT_GT(num_filtered, 0);
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, TtlWithValueLog) {
+  const fs::path db_dir("ttl_value_log_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 50;
+  FLAGS_memtable_flush_bytes = 4096;
+  FLAGS_level0_compaction_trigger = 2;
+  FLAGS_ttl_seconds = 3;
+  FLAGS_value_log_min_value_bytes = 100;
+  FLAGS_value_log_file_bytes = 16 * 1024;
+  FLAGS_value_log_gc_garbage_ratio = 0.5;
+
+  // The old and new keys interleave, so merging the new ones reaches every
+  // old one.
+  const auto make_key = [](const int ii, const string& suffix) {
+    const string key = "key" + to_string(1000 + ii) + suffix;
+    return Buffer(key.begin(), key.end());
+  };
+  const auto make_val = [](const int ii) {
+    const string val = "val" + to_string(ii) + string(500, 'v');
+    return Buffer(val.begin(), val.end());
+  };
+  const auto log_files = [&db_dir]() {
+    set<string> names;
+    for (const auto& entry : fs::directory_iterator(db_dir)) {
+      if (entry.path().extension() == ".vlog") {
+        names.insert(entry.path().filename().string());
+      }
+    }
+    return names;
+  };
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    for (int ii = 0; ii < 100; ++ii) {
+      dbcontroller.Put(make_key(ii, "-old"), make_val(ii));
+    }
+    this_thread::sleep_for(chrono::milliseconds(300));
+    const set<string> old_files = log_files();
+    ASSERT_GT(old_files.size(), 1);
+    for (int ii = 0; ii < 100; ++ii) {
+      ASSERT_EQ(dbcontroller.Get(make_key(ii, "-old")), make_val(ii));
+    }
+
+    // Expired values in the value log are dropped by the merges of new keys
+    // like any other, and the log files holding them are collected.
+    this_thread::sleep_for(chrono::milliseconds(3500));
+    for (int ii = 0; ii < 100; ++ii) {
+      dbcontroller.Put(make_key(ii, "-new"), make_val(ii));
+    }
+    this_thread::sleep_for(chrono::milliseconds(500));
+    for (int ii = 0; ii < 100; ++ii) {
+      ASSERT_FALSE(dbcontroller.KeyExists(make_key(ii, "-old"))) << ii;
+      ASSERT_EQ(dbcontroller.Get(make_key(ii, "-new")), make_val(ii));
+    }
+
+    bool collected = false;
+    for (int attempt = 0; attempt < 50 && !collected; ++attempt) {
+      const set<string> remaining = log_files();
+      collected = any_of(old_files.begin(), old_files.end(),
+                         [&remaining](const string& name) {
+                           return remaining.count(name) == 0;
+                         });
+      this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    ASSERT_TRUE(collected);
+    for (int ii = 0; ii < 100; ++ii) {
+      ASSERT_EQ(dbcontroller.Get(make_key(ii, "-new")), make_val(ii));
+    }
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, MergeOperator) {
+  const fs::path db_dir("merge_operator_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 20;
+  FLAGS_memtable_flush_bytes = 1024;
+  FLAGS_level0_compaction_trigger = 2;
+
+  const auto make_key = [](const int ii) {
+    const string key = "counter" + to_string(ii);
+    return Buffer(key.begin(), key.end());
+  };
+  const auto make_count = [](const uint64_t count) {
+    Buffer val;
+    coding::PutFixed64(&val, count);
+    return val;
+  };
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.SetMergeOperator(MergeOperator::Create("uint64add"));
+    dbcontroller.Start();
+
+    // Concurrent increments never lose an update, while flushes and merges
+    // fold them. Counter 0 starts from a put, the others from nothing.
+    constexpr int kNumCounters = 10;
+    constexpr int kNumThreads = 4;
+    constexpr int kNumIncrements = 100;
+    dbcontroller.Put(make_key(0), make_count(1000));
+    vector<thread> threads;
+    for (int tt = 0; tt < kNumThreads; ++tt) {
+      threads.emplace_back([&]() {
+        for (int ii = 0; ii < kNumIncrements; ++ii) {
+          for (int cc = 0; cc < kNumCounters; ++cc) {
+            dbcontroller.Merge(make_key(cc), make_count(1));
+          }
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+
+    const Snapshot* snapshot = dbcontroller.GetSnapshot();
+    dbcontroller.Merge(make_key(1), make_count(5));
+    dbcontroller.Erase(make_key(2));
+    dbcontroller.Merge(make_key(2), make_count(7));
+
+    const uint64_t total = kNumThreads * kNumIncrements;
+    const auto expected = [&](const int cc) {
+      return make_count(cc == 0 ? 1000 + total
+                        : cc == 1 ? total + 5
+                        : cc == 2 ? 7
+                                  : total);
+    };
+    const auto check = [&]() {
+      vector<Buffer> keys;
+      for (int cc = 0; cc < kNumCounters; ++cc) {
+        ASSERT_TRUE(dbcontroller.KeyExists(make_key(cc)));
+        ASSERT_EQ(dbcontroller.Get(make_key(cc)), expected(cc)) << cc;
+        ASSERT_EQ(dbcontroller.GetAsync(make_key(cc)).get(), expected(cc));
+        ASSERT_EQ(dbcontroller.Get(make_key(cc), snapshot),
+                  make_count(cc == 0 ? 1000 + total : total));
+        keys.push_back(make_key(cc));
+      }
+      const vector<Buffer> values = dbcontroller.MultiGet(keys);
+      const string prefix = "counter";
+      auto it = dbcontroller.NewPrefixIterator(
+          Buffer(prefix.begin(), prefix.end()));
+      it->SeekToFirst();
+      for (int cc = 0; cc < kNumCounters; ++cc) {
+        ASSERT_EQ(values[cc], expected(cc));
+        ASSERT_TRUE(it->Valid());
+        ASSERT_EQ(it->key(), make_key(cc));
+        ASSERT_EQ(it->value(), expected(cc));
+        it->Next();
+      }
+      ASSERT_FALSE(it->Valid());
+    };
+
+    // Before and after the rest of the operands are flushed and merged.
+    check();
+    for (int ii = 0; ii < 100; ++ii) {
+      const string key = "other" + to_string(ii);
+      dbcontroller.Put(Buffer(key.begin(), key.end()), Buffer(100, 'x'));
+    }
+    this_thread::sleep_for(chrono::milliseconds(500));
+    check();
+    dbcontroller.ReleaseSnapshot(snapshot);
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, TrivialMove) {
+  const fs::path db_dir("trivial_move_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 20;
+  FLAGS_memtable_flush_bytes = 1024;
+  FLAGS_level0_compaction_trigger = 2;
+
+  const auto make_key = [](const int ii) {
+    const string key = "key" + to_string(100000 + ii);
+    return Buffer(key.begin(), key.end());
+  };
+  const auto make_val = [](const int ii) {
+    const string val = "val" + to_string(ii);
+    return Buffer(val.begin(), val.end());
+  };
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    // Keys written in ascending order land in tables that never overlap, so
+    // merges move them to the base instead of rewriting them.
+    const auto& stats = dbcontroller.background_io_stats();
+    const int kLow = static_cast<int>(RateLimiter::Priority::kLow);
+    const int kHigh = static_cast<int>(RateLimiter::Priority::kHigh);
+    for (int ii = 0; ii < 1000; ++ii) {
+      dbcontroller.Put(make_key(ii), make_val(ii));
+      if (ii % 100 == 0) {
+        this_thread::sleep_for(chrono::milliseconds(50));
+      }
+    }
+    this_thread::sleep_for(chrono::milliseconds(300));
+    EXPECT_GT(stats.bytes_through[kHigh], 0);
+    EXPECT_EQ(stats.bytes_through[kLow], 0);
+
+    const auto check = [&]() {
+      for (int ii = 0; ii < 1000; ++ii) {
+        ASSERT_EQ(dbcontroller.Get(make_key(ii)), make_val(ii)) << ii;
+      }
+      auto it = dbcontroller.NewIterator();
+      int num_keys = 0;
+      for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        ASSERT_EQ(it->key(), make_key(num_keys));
+        ++num_keys;
+      }
+      ASSERT_EQ(num_keys, 1000);
+    };
+    check();
+
+    // Overwriting keys in the middle takes a real merge.
+    for (int ii = 0; ii < 1000; ii += 10) {
+      dbcontroller.Put(make_key(ii), make_val(ii));
+    }
+    this_thread::sleep_for(chrono::milliseconds(300));
+    EXPECT_GT(stats.bytes_through[kLow], 0);
+    check();
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, DeleteTriggeredMerges) {
+  const fs::path db_dir("delete_triggered_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 20;
+  FLAGS_level0_compaction_trigger = 100;
+  FLAGS_level0_slowdown_writes_trigger = 200;
+  FLAGS_level0_stop_writes_trigger = 300;
+
+  const auto make_key = [](const int ii) {
+    const string key = "key" + to_string(1000 + ii);
+    return Buffer(key.begin(), key.end());
+  };
+  const auto make_val = [](const int ii) {
+    const string val = "val" + to_string(ii);
+    return Buffer(val.begin(), val.end());
+  };
+  const auto table_bytes = [&db_dir]() {
+    uint64_t bytes = 0;
+    for (const auto& entry : fs::directory_iterator(db_dir)) {
+      if (entry.path().extension() == ".diodb") {
+        bytes += fs::file_size(entry.path());
+      }
+    }
+    return bytes;
+  };
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+    const auto& stats = dbcontroller.background_io_stats();
+    const int kLow = static_cast<int>(RateLimiter::Priority::kLow);
+
+    // A flushed table that is mostly deletes is merged right away, however
+    // few level-0 tables there are.
+    for (int ii = 0; ii < 100; ++ii) {
+      dbcontroller.Put(make_key(ii), make_val(ii));
+    }
+    this_thread::sleep_for(chrono::milliseconds(200));
+    EXPECT_EQ(stats.bytes_through[kLow], 0);
+
+    const Snapshot* snapshot = dbcontroller.GetSnapshot();
+    for (int ii = 0; ii < 80; ++ii) {
+      dbcontroller.Erase(make_key(ii));
+    }
+    this_thread::sleep_for(chrono::milliseconds(200));
+    EXPECT_GT(stats.bytes_through[kLow], 0);
+
+    // The snapshot keeps the deletes and what they shadow in the base table.
+    // Once it's gone, the base table is merged on its own to drop them.
+    const uint64_t snapshot_bytes = table_bytes();
+    dbcontroller.ReleaseSnapshot(snapshot);
+    dbcontroller.Put(make_key(1000), make_val(1000));
+    this_thread::sleep_for(chrono::milliseconds(200));
+    EXPECT_LT(table_bytes(), snapshot_bytes);
+
+    for (int ii = 0; ii < 100; ++ii) {
+      ASSERT_EQ(dbcontroller.Get(make_key(ii)),
+                ii < 80 ? Buffer() : make_val(ii));
+    }
+    EXPECT_EQ(dbcontroller.Get(make_key(1000)), make_val(1000));
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, WriteAheadLogReplay) {
+  const fs::path db_dir("wal_replay_dbc_test");
+  fs::remove_all(db_dir);
+
+  Buffer key1({'a'});
+  Buffer val1({'f', 'o', 'o'});
+  Buffer key2({'b'});
+  Buffer val2({'b', 'a', 'r'});
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    Buffer tmpk = key1;
+    Buffer tmpv = val1;
+    dbcontroller.Put(move(tmpk), move(tmpv));
+    tmpk = key2;
+    tmpv = val2;
+    dbcontroller.Put(move(tmpk), move(tmpv));
+    tmpk = key1;
+    dbcontroller.Erase(move(tmpk));
+  }
+
+  {
+    // Nothing was flushed, so everything has to come back from the log.
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+    ASSERT_FALSE(dbcontroller.KeyExists(key1));
+    ASSERT_EQ(dbcontroller.Get(key2), val2);
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, ReopenFromManifest) {
+  const fs::path db_dir("manifest_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 20;
+  FLAGS_memtable_flush_bytes = 1024;
+  FLAGS_level0_compaction_trigger = 3;
+
+  const auto make_key = [](const int ii) {
+    const string key = "key" + to_string(1000 + ii);
+    return Buffer(key.begin(), key.end());
+  };
+  const auto make_val = [](const int ii, const int round) {
+    const string val = "val" + to_string(ii) + "." + to_string(round);
+    return Buffer(val.begin(), val.end());
+  };
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    // Overwrites in a random order make for both merged base tables and
+    // level-0 tables.
+    vector<int> order(500);
+    iota(order.begin(), order.end(), 0);
+    for (int round = 0; round < 3; ++round) {
+      shuffle(order.begin(), order.end(), mt19937(round));
+      for (const int ii : order) {
+        dbcontroller.Put(make_key(ii), make_val(ii, round));
+      }
+      this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    for (int ii = 0; ii < 500; ii += 5) {
+      dbcontroller.Erase(make_key(ii));
+    }
+    this_thread::sleep_for(chrono::milliseconds(300));
+  }
+
+  // A table file the manifest doesn't list, as a crash mid-flush leaves.
+  const fs::path orphan = db_dir / "999999.diodb";
+  fs::ofstream(orphan) << "half-written";
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+    EXPECT_FALSE(fs::exists(orphan));
+
+    const auto check = [&](const int round) {
+      for (int ii = 0; ii < 500; ++ii) {
+        ASSERT_EQ(dbcontroller.Get(make_key(ii)),
+                  ii % 5 == 0 ? Buffer() : make_val(ii, round))
+            << ii;
+      }
+    };
+    check(2);
+
+    // New writes have to be ordered after everything that was reopened.
+    for (int ii = 0; ii < 500; ++ii) {
+      dbcontroller.Put(make_key(ii), make_val(ii, 3));
+    }
+    for (int ii = 0; ii < 500; ii += 5) {
+      dbcontroller.Erase(make_key(ii));
+    }
+    this_thread::sleep_for(chrono::milliseconds(300));
+    check(3);
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, IngestExternalFile) {
+  const fs::path db_dir("ingest_dbc_test");
+  fs::remove_all(db_dir);
+
+  const auto make_key = [](const int ii) {
+    const string key = "key" + to_string(10000 + ii);
+    return Buffer(key.begin(), key.end());
+  };
+  const auto make_val = [](const int ii, const string& source) {
+    const string val = source + to_string(ii);
+    return Buffer(val.begin(), val.end());
+  };
+  const auto write_file = [&](const string& name, const int begin,
+                              const int end, const string& source) {
+    const fs::path path = fs::path(name);
+    fs::remove(path);
+    SSTableWriter writer(path);
+    for (int ii = begin; ii < end; ++ii) {
+      writer.Put(make_key(ii), make_val(ii, source));
+    }
+    writer.Finish();
+    return path;
+  };
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+    for (int ii = 0; ii < 100; ++ii) {
+      dbcontroller.Put(make_key(ii), make_val(ii, "put"));
+    }
+
+    // Keys nobody has written go in as they are.
+    const fs::path fresh = write_file("ingest_fresh", 1000, 2000, "fresh");
+    EXPECT_TRUE(dbcontroller.IngestExternalFile(fresh));
+    EXPECT_FALSE(fs::exists(fresh));
+    EXPECT_EQ(dbcontroller.Get(make_key(1500)), make_val(1500, "fresh"));
+
+    // Unflushed writes in the range have to reach the tables first.
+    const fs::path overlap = write_file("ingest_overlap", 50, 150, "bulk");
+    EXPECT_FALSE(dbcontroller.IngestExternalFile(overlap));
+    EXPECT_TRUE(fs::exists(overlap));
+    this_thread::sleep_for(chrono::milliseconds(2500));
+
+    // Now the file's keys replace the flushed ones, but not for a snapshot
+    // taken beforehand.
+    const Snapshot* snapshot = dbcontroller.GetSnapshot();
+    EXPECT_TRUE(dbcontroller.IngestExternalFile(overlap));
+    EXPECT_FALSE(fs::exists(overlap));
+    for (int ii = 0; ii < 150; ++ii) {
+      ASSERT_EQ(dbcontroller.Get(make_key(ii)),
+                make_val(ii, ii < 50 ? "put" : "bulk"))
+          << ii;
+    }
+    EXPECT_EQ(dbcontroller.Get(make_key(60), snapshot), make_val(60, "put"));
+    EXPECT_FALSE(dbcontroller.KeyExists(make_key(120), snapshot));
+    dbcontroller.ReleaseSnapshot(snapshot);
+
+    // Writes after the ingestion win over it.
+    dbcontroller.Put(make_key(70), make_val(70, "put"));
+    EXPECT_EQ(dbcontroller.Get(make_key(70)), make_val(70, "put"));
+
+    // Files not written for ingestion are refused.
+    const fs::path bogus("ingest_bogus");
+    fs::ofstream(bogus) << "not a table";
+    EXPECT_FALSE(dbcontroller.IngestExternalFile(bogus));
+    fs::remove(bogus);
+  }
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+    EXPECT_EQ(dbcontroller.Get(make_key(1999)), make_val(1999, "fresh"));
+    EXPECT_EQ(dbcontroller.Get(make_key(149)), make_val(149, "bulk"));
+    EXPECT_EQ(dbcontroller.Get(make_key(70)), make_val(70, "put"));
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, CreateCheckpoint) {
+  const fs::path db_dir("checkpoint_dbc_test");
+  const fs::path checkpoint_dir("checkpoint_dbc_test_copy");
+  fs::remove_all(db_dir);
+  fs::remove_all(checkpoint_dir);
+
+  FLAGS_background_task_min_gap_msecs = 50;
+  FLAGS_value_log_min_value_bytes = 100;
+
+  const auto make_key = [](const int ii) {
+    const string key = "key" + to_string(1000 + ii);
+    return Buffer(key.begin(), key.end());
+  };
+  const auto make_val = [](const int ii, const int round) {
+    // Every tenth value is big enough for the value log.
+    const string val = to_string(round) + ":" + to_string(ii) +
+                       string(ii % 10 == 0 ? 200 : 10, 'v');
+    return Buffer(val.begin(), val.end());
+  };
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    // Flushed to the tables and the value log.
+    for (int ii = 0; ii < 100; ++ii) {
+      dbcontroller.Put(make_key(ii), make_val(ii, 0));
+    }
+    this_thread::sleep_for(chrono::milliseconds(300));
+
+    // Only in the memtable and the write-ahead log. The tick is slowed down
+    // so that they stay there.
+    FLAGS_background_task_min_gap_msecs = 60 * 1000;
+    this_thread::sleep_for(chrono::milliseconds(100));
+    for (int ii = 50; ii < 150; ++ii) {
+      dbcontroller.Put(make_key(ii), make_val(ii, 1));
+    }
+
+    dbcontroller.CreateCheckpoint(checkpoint_dir);
+    int num_tables = 0;
+    for (const auto& entry : fs::directory_iterator(checkpoint_dir)) {
+      if (entry.path().extension() == ".diodb" ||
+          entry.path().extension() == ".vlog") {
+        EXPECT_EQ(fs::hard_link_count(entry.path()), 2) << entry.path();
+        num_tables += entry.path().extension() == ".diodb";
+      }
+    }
+    EXPECT_GT(num_tables, 0);
+
+    // Later writes don't reach the checkpoint, even those appended to the
+    // value log.
+    for (int ii = 0; ii < 150; ++ii) {
+      dbcontroller.Put(make_key(ii), make_val(ii, 2));
+    }
+  }
+
+  {
+    DBController dbcontroller(checkpoint_dir);
+    dbcontroller.Start();
+    for (int ii = 0; ii < 150; ++ii) {
+      ASSERT_EQ(dbcontroller.Get(make_key(ii)), make_val(ii, ii < 50 ? 0 : 1))
+          << ii;
+    }
+  }
+
+  fs::remove_all(db_dir);
+  fs::remove_all(checkpoint_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, CheckpointDuringFlushesAndGC) {
+  const fs::path db_dir("checkpoint_race_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 20;
+  FLAGS_memtable_flush_bytes = 4096;
+  FLAGS_level0_compaction_trigger = 2;
+  FLAGS_value_log_min_value_bytes = 100;
+  FLAGS_value_log_file_bytes = 16 * 1024;
+  FLAGS_value_log_gc_garbage_ratio = 0.25;
+
+  constexpr int kNumKeys = 100;
+  constexpr int kNumCheckpoints = 10;
+  const auto make_key = [](const int ii) {
+    const string key = "key" + to_string(1000 + ii);
+    return Buffer(key.begin(), key.end());
+  };
+  const auto make_val = [](const int ii, const int round) {
+    const string val =
+        to_string(round) + ":" + to_string(ii) + ":" + string(200, 'v');
+    return Buffer(val.begin(), val.end());
+  };
+  const auto checkpoint_dir = [](const int ii) {
+    return fs::path("checkpoint_race_dbc_test_copy" + to_string(ii));
+  };
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+    for (int ii = 0; ii < kNumKeys; ++ii) {
+      dbcontroller.Put(make_key(ii), make_val(ii, 0));
+    }
+
+    // Overwrites keep flushes, merges and garbage collection removing log
+    // files while the checkpoints are taken.
+    atomic<bool> done(false);
+    thread writer([&]() {
+      for (int round = 1; !done; ++round) {
+        for (int ii = 0; ii < kNumKeys; ++ii) {
+          dbcontroller.Put(make_key(ii), make_val(ii, round));
+        }
+      }
+    });
+    for (int ii = 0; ii < kNumCheckpoints; ++ii) {
+      fs::remove_all(checkpoint_dir(ii));
+      dbcontroller.CreateCheckpoint(checkpoint_dir(ii));
+      this_thread::sleep_for(chrono::milliseconds(50));
+    }
+    done = true;
+    writer.join();
+  }
+
+  // Each checkpoint holds a prefix of the writes: the keys before some point
+  // hold one round, and the rest the round before.
+  for (int ii = 0; ii < kNumCheckpoints; ++ii) {
+    {
+      DBController dbcontroller(checkpoint_dir(ii));
+      dbcontroller.Start();
+      vector<int> rounds;
+      for (int jj = 0; jj < kNumKeys; ++jj) {
+        const Buffer val = dbcontroller.Get(make_key(jj));
+        const string str(val.begin(), val.end());
+        const int round = stoi(str.substr(0, str.find(':')));
+        ASSERT_EQ(val, make_val(jj, round)) << jj;
+        rounds.push_back(round);
+      }
+      ASSERT_TRUE(is_sorted(rounds.rbegin(), rounds.rend()));
+      ASSERT_LE(rounds.front() - rounds.back(), 1);
+    }
+    fs::remove_all(checkpoint_dir(ii));
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, ValueLog) {
+  const fs::path db_dir("value_log_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 50;
+  FLAGS_memtable_flush_bytes = 4096;
+  FLAGS_level0_compaction_trigger = 2;
+  FLAGS_value_log_min_value_bytes = 100;
+  FLAGS_value_log_file_bytes = 16 * 1024;
+  FLAGS_value_log_gc_garbage_ratio = 0.4;
+
+  constexpr int kNumKeys = 200;
+  const auto make_key = [](const int ii) {
+    const string key = "key" + to_string(1000 + ii);
+    return Buffer(key.begin(), key.end());
+  };
+  const auto make_val = [](const int ii, const int round) {
+    const string val =
+        to_string(round) + ":" + to_string(ii) + ":" + string(500, 'v');
+    return Buffer(val.begin(), val.end());
+  };
+  const auto file_sizes = [&db_dir](const string& extension) {
+    map<string, uintmax_t> sizes;
+    for (const auto& entry : fs::directory_iterator(db_dir)) {
+      if (entry.path().extension() == extension) {
+        sizes[entry.path().filename().string()] = fs::file_size(entry.path());
+      }
+    }
+    return sizes;
+  };
+
+  // Every key holds its round 1 value if it's even and was overwritten, and
+  // its round 0 value otherwise.
+  const auto check_values = [&](DBController* dbcontroller,
+                                const bool overwritten) {
+    const auto expected = [&](const int ii) {
+      return make_val(ii, overwritten && ii % 2 == 0 ? 1 : 0);
+    };
+
+    vector<Buffer> keys;
+    for (int ii = 0; ii < kNumKeys; ++ii) {
+      ASSERT_EQ(dbcontroller->Get(make_key(ii)), expected(ii)) << ii;
+      ASSERT_EQ(dbcontroller->GetAsync(make_key(ii)).get(), expected(ii)) << ii;
+      keys.push_back(make_key(ii));
+    }
+    const vector<Buffer> values = dbcontroller->MultiGet(keys);
+    for (int ii = 0; ii < kNumKeys; ++ii) {
+      ASSERT_EQ(values[ii], expected(ii)) << ii;
+    }
+
+    auto it = dbcontroller->NewIterator();
+    int ii = 0;
+    for (it->SeekToFirst(); it->Valid(); it->Next(), ++ii) {
+      ASSERT_EQ(it->key(), make_key(ii));
+      ASSERT_EQ(it->value(), expected(ii)) << ii;
+    }
+    ASSERT_EQ(ii, kNumKeys);
+  };
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    for (int ii = 0; ii < kNumKeys; ++ii) {
+      dbcontroller.Put(make_key(ii), make_val(ii, 0));
+    }
+    this_thread::sleep_for(chrono::milliseconds(500));
+    check_values(&dbcontroller, false);
+
+    // The values went to the log, and the tables only hold references.
+    const auto table_sizes = file_sizes(".diodb");
+    const auto log_sizes = file_sizes(".vlog");
+    uintmax_t table_bytes = 0;
+    uintmax_t log_bytes = 0;
+    for (const auto& entry : table_sizes) {
+      table_bytes += entry.second;
+    }
+    for (const auto& entry : log_sizes) {
+      log_bytes += entry.second;
+    }
+    ASSERT_GT(log_sizes.size(), 1);
+    ASSERT_GE(log_bytes, kNumKeys * 500);
+    ASSERT_LT(table_bytes, log_bytes / 4);
+
+    // Overwriting half of the values leaves half of every log file written so
+    // far as garbage once merges drop the old references, and garbage
+    // collection moves the other half out of them.
+    for (int ii = 0; ii < kNumKeys; ii += 2) {
+      dbcontroller.Put(make_key(ii), make_val(ii, 1));
+    }
+    bool collected = false;
+    for (int attempt = 0; attempt < 50 && !collected; ++attempt) {
+      this_thread::sleep_for(chrono::milliseconds(100));
+      const auto sizes = file_sizes(".vlog");
+      collected = any_of(log_sizes.begin(), log_sizes.end(),
+                         [&sizes](const pair<const string, uintmax_t>& e) {
+                           return sizes.count(e.first) == 0;
+                         });
+    }
+    ASSERT_TRUE(collected);
+    check_values(&dbcontroller, true);
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, ValueLogGCWithSnapshot) {
+  const fs::path db_dir("value_log_snapshot_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 50;
+  FLAGS_memtable_flush_bytes = 4096;
+  FLAGS_level0_compaction_trigger = 2;
+  FLAGS_value_log_min_value_bytes = 100;
+  FLAGS_value_log_file_bytes = 16 * 1024;
+  FLAGS_value_log_gc_garbage_ratio = 2;
+
+  constexpr int kNumKeys = 300;
+  const auto make_key = [](const int ii) {
+    const string key = "key" + to_string(1000 + ii);
+    return Buffer(key.begin(), key.end());
+  };
+  const auto make_val = [](const int ii, const int round) {
+    const string val =
+        to_string(round) + ":" + to_string(ii) + ":" + string(500, 'v');
+    return Buffer(val.begin(), val.end());
+  };
+  const auto log_files = [&db_dir]() {
+    set<string> names;
+    for (const auto& entry : fs::directory_iterator(db_dir)) {
+      if (entry.path().extension() == ".vlog") {
+        names.insert(entry.path().filename().string());
+      }
+    }
+    return names;
+  };
+
+  // A third of the keys keep their round 0 value, a third are overwritten
+  // before the snapshot is taken, and a third after.
+  const auto expected = [&make_val](const int ii, const bool at_snapshot) {
+    const int round = ii % 3 == 2 && at_snapshot ? 0 : ii % 3;
+    return make_val(ii, round);
+  };
+  const auto check_values = [&](DBController* dbcontroller,
+                                const Snapshot* snapshot) {
+    vector<Buffer> keys;
+    for (int ii = 0; ii < kNumKeys; ++ii) {
+      ASSERT_EQ(dbcontroller->Get(make_key(ii), snapshot),
+                expected(ii, snapshot != nullptr))
+          << ii;
+      keys.push_back(make_key(ii));
+    }
+    const vector<Buffer> values = dbcontroller->MultiGet(keys, snapshot);
+    for (int ii = 0; ii < kNumKeys; ++ii) {
+      ASSERT_EQ(values[ii], expected(ii, snapshot != nullptr)) << ii;
+    }
+
+    auto it = dbcontroller->NewIterator(snapshot);
+    int ii = 0;
+    for (it->SeekToFirst(); it->Valid(); it->Next(), ++ii) {
+      ASSERT_EQ(it->key(), make_key(ii));
+      ASSERT_EQ(it->value(), expected(ii, snapshot != nullptr)) << ii;
+    }
+    ASSERT_EQ(ii, kNumKeys);
+  };
+
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    for (int ii = 0; ii < kNumKeys; ++ii) {
+      dbcontroller.Put(make_key(ii), make_val(ii, 0));
+    }
+    this_thread::sleep_for(chrono::milliseconds(500));
+    const set<string> round0_files = log_files();
+    ASSERT_GT(round0_files.size(), 1);
+
+    for (int ii = 1; ii < kNumKeys; ii += 3) {
+      dbcontroller.Put(make_key(ii), make_val(ii, 1));
+    }
+    this_thread::sleep_for(chrono::milliseconds(500));
+
+    // Garbage collection starts with the flush of the overwrites after the
+    // snapshot, which land all at once. It moves the values nothing has
+    // overwritten, but the ones only the snapshot still sees keep their files
+    // around. No merges run from here on, so anything moved would stay in
+    // the newest tables, where it could hide the overwrites.
+    FLAGS_level0_compaction_trigger = 100;
+    FLAGS_level0_slowdown_writes_trigger = 200;
+    FLAGS_level0_stop_writes_trigger = 300;
+    const Snapshot* snapshot = dbcontroller.GetSnapshot();
+    FLAGS_value_log_gc_garbage_ratio = 0.25;
+    WriteBatch batch;
+    for (int ii = 2; ii < kNumKeys; ii += 3) {
+      batch.Put(make_key(ii), make_val(ii, 2));
+    }
+    dbcontroller.Write(move(batch));
+    this_thread::sleep_for(chrono::milliseconds(1000));
+    check_values(&dbcontroller, nullptr);
+    check_values(&dbcontroller, snapshot);
+    const set<string> files = log_files();
+    for (const auto& name : round0_files) {
+      ASSERT_EQ(files.count(name), 1) << name;
+    }
+
+    // Releasing the snapshot lets the files go.
+    dbcontroller.ReleaseSnapshot(snapshot);
+    bool collected = false;
+    for (int attempt = 0; attempt < 50 && !collected; ++attempt) {
+      this_thread::sleep_for(chrono::milliseconds(100));
+      const set<string> remaining = log_files();
+      collected = any_of(round0_files.begin(), round0_files.end(),
+                         [&remaining](const string& name) {
+                           return remaining.count(name) == 0;
+                         });
+    }
+    ASSERT_TRUE(collected);
+    check_values(&dbcontroller, nullptr);
+  }
+
+  fs::remove_all(db_dir);
+}
+
+TEST_F(DBControllerIntegrationTest, ValueLogGarbageAfterReopen) {
+  const fs::path db_dir("value_log_reopen_dbc_test");
+  fs::remove_all(db_dir);
+
+  FLAGS_background_task_min_gap_msecs = 50;
+  FLAGS_memtable_flush_bytes = 4096;
+  FLAGS_level0_compaction_trigger = 2;
+  FLAGS_value_log_min_value_bytes = 100;
+  FLAGS_value_log_file_bytes = 16 * 1024;
+  FLAGS_value_log_gc_garbage_ratio = 2;
+
+  constexpr int kNumKeys = 200;
+  const auto make_key = [](const int ii) {
+    const string key = "key" + to_string(1000 + ii);
+    return Buffer(key.begin(), key.end());
+  };
+  const auto make_val = [](const int ii, const int round) {
+    const string val =
+        to_string(round) + ":" + to_string(ii) + ":" + string(500, 'v');
+    return Buffer(val.begin(), val.end());
+  };
+  const auto log_files = [&db_dir]() {
+    set<string> names;
+    for (const auto& entry : fs::directory_iterator(db_dir)) {
+      if (entry.path().extension() == ".vlog") {
+        names.insert(entry.path().filename().string());
+      }
+    }
+    return names;
+  };
+
+  // Overwriting half of the keys leaves garbage in the log files, but
+  // collection is off until the database is reopened.
+  set<string> round0_files;
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    for (int ii = 0; ii < kNumKeys; ++ii) {
+      dbcontroller.Put(make_key(ii), make_val(ii, 0));
+    }
+    this_thread::sleep_for(chrono::milliseconds(500));
+    round0_files = log_files();
+    ASSERT_GT(round0_files.size(), 1);
+
+    for (int ii = 0; ii < kNumKeys; ii += 2) {
+      dbcontroller.Put(make_key(ii), make_val(ii, 1));
+    }
+    this_thread::sleep_for(chrono::milliseconds(1000));
+  }
+
+  // The garbage is worked out from the tables on open, and collected without
+  // any further writes.
+  FLAGS_value_log_gc_garbage_ratio = 0.4;
+  {
+    DBController dbcontroller(db_dir);
+    dbcontroller.Start();
+
+    bool collected = false;
+    for (int attempt = 0; attempt < 50 && !collected; ++attempt) {
+      this_thread::sleep_for(chrono::milliseconds(100));
+      const set<string> remaining = log_files();
+      collected = any_of(round0_files.begin(), round0_files.end(),
+                         [&remaining](const string& name) {
+                           return remaining.count(name) == 0;
+                         });
+    }
+    ASSERT_TRUE(collected);
+    for (int ii = 0; ii < kNumKeys; ++ii) {
+      ASSERT_EQ(dbcontroller.Get(make_key(ii)),
+                make_val(ii, ii % 2 == 0 ? 1 : 0))
+          << ii;
+    }
+  }
+
+  fs::remove_all(db_dir);
+}
+
 }  // namespace test
 }  // namespace diodb
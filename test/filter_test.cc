@@ -0,0 +1,74 @@
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "src/bloom_filter.h"
+#include "src/prefix_extractor.h"
+
+using std::string;
+using std::vector;
+
+namespace diodb {
+namespace test {
+
+class FilterTest : public ::testing::Test {
+ protected:
+  Buffer S2Vec(const string& s) { return Buffer(s.begin(), s.end()); }
+};
+
+TEST_F(FilterTest, BloomFilterBasic) {
+  vector<uint64_t> hashes;
+  for (int ii = 0; ii < 1000; ++ii) {
+    hashes.push_back(BloomFilter::Hash(S2Vec("key" + std::to_string(ii))));
+  }
+  const BloomFilter filter(hashes, 10);
+
+  for (int ii = 0; ii < 1000; ++ii) {
+    ASSERT_TRUE(filter.MayContain(S2Vec("key" + std::to_string(ii))));
+  }
+
+  // About 1% false positives are expected at 10 bits per key.
+  int num_false_positives = 0;
+  for (int ii = 1000; ii < 11000; ++ii) {
+    num_false_positives += filter.MayContain(S2Vec("key" + std::to_string(ii)));
+  }
+  EXPECT_LT(num_false_positives, 300);
+}
+
+TEST_F(FilterTest, EmptyBloomFilter) {
+  // A filter that was never built may contain anything, while one built from
+  // no keys contains nothing.
+  EXPECT_TRUE(BloomFilter().MayContain(S2Vec("holy")));
+  EXPECT_FALSE(BloomFilter({}, 10).MayContain(S2Vec("holy")));
+}
+
+TEST_F(FilterTest, FixedPrefixExtractor) {
+  EXPECT_EQ(PrefixExtractor::Create(""), nullptr);
+
+  const auto extractor = PrefixExtractor::Create("fixed:4");
+  ASSERT_NE(extractor, nullptr);
+  EXPECT_EQ(extractor->Name(), "fixed:4");
+  EXPECT_FALSE(extractor->InDomain(S2Vec("abc")));
+  EXPECT_TRUE(extractor->InDomain(S2Vec("abcd")));
+  EXPECT_EQ(extractor->Transform(S2Vec("abcdef")), S2Vec("abcd"));
+}
+
+TEST_F(FilterTest, DelimiterPrefixExtractor) {
+  const auto extractor = PrefixExtractor::Create("delimiter:/");
+  ASSERT_NE(extractor, nullptr);
+  EXPECT_EQ(extractor->Name(), "delimiter:/");
+  EXPECT_FALSE(extractor->InDomain(S2Vec("tenant")));
+  EXPECT_TRUE(extractor->InDomain(S2Vec("tenant/")));
+  EXPECT_EQ(extractor->Transform(S2Vec("tenant/user/1")), S2Vec("tenant/"));
+}
+
+TEST_F(FilterTest, MalformedPrefixExtractor) {
+  EXPECT_DEATH(PrefixExtractor::Create("fixed"), "Malformed");
+  EXPECT_DEATH(PrefixExtractor::Create("fixed:x"), "Malformed");
+  EXPECT_DEATH(PrefixExtractor::Create("delimiter:ab"), "Malformed");
+  EXPECT_DEATH(PrefixExtractor::Create("suffix:3"), "Unknown");
+}
+
+}  // namespace test
+}  // namespace diodb
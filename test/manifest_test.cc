@@ -0,0 +1,103 @@
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include "gtest/gtest.h"
+
+#include "src/buffer.h"
+#include "src/manifest.h"
+
+using std::string;
+using std::vector;
+
+namespace fs = boost::filesystem;
+namespace diodb {
+namespace test {
+
+constexpr auto kLevel0 = Manifest::Level::kLevel0;
+constexpr auto kBase = Manifest::Level::kBase;
+
+class ManifestTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    db_dir_ = fs::path("manifest_test_dir");
+    fs::remove_all(db_dir_);
+  }
+  void TearDown() override { fs::remove_all(db_dir_); }
+
+  static Manifest::TableEntry Entry(const string& file_name,
+                                    const Manifest::Level level,
+                                    const string& smallest,
+                                    const string& largest) {
+    return Manifest::TableEntry{file_name, level,
+                                Buffer(smallest.begin(), smallest.end()),
+                                Buffer(largest.begin(), largest.end())};
+  }
+
+  static vector<string> FileNames(const vector<Manifest::TableEntry>& entries) {
+    vector<string> names;
+    for (const auto& entry : entries) {
+      names.push_back(entry.file_name);
+    }
+    return names;
+  }
+
+  fs::path db_dir_;
+};
+
+TEST_F(ManifestTest, ReplayEdits) {
+  {
+    Manifest manifest(db_dir_);
+
+    // Three flushes.
+    manifest.Apply({{}, {Entry("1.diodb", kLevel0, "a", "m")}});
+    manifest.Apply({{}, {Entry("2.diodb", kLevel0, "n", "z")}});
+    manifest.Apply({{}, {Entry("3.diodb", kLevel0, "c", "d")}});
+
+    // A move of the two oldest to the base.
+    manifest.Apply({{"1.diodb", "2.diodb"},
+                    {Entry("2.diodb", kBase, "n", "z"),
+                     Entry("1.diodb", kBase, "a", "m")}});
+
+    // A merge of the newest with the base table it overlaps.
+    manifest.Apply({{"3.diodb", "1.diodb"},
+                    {Entry("4.diodb", kBase, "a", "m")}});
+    manifest.Apply({{}, {Entry("5.diodb", kLevel0, "x", "y")}});
+    manifest.Apply({{}, {Entry("6.diodb", kLevel0, "b", "b")}});
+    EXPECT_EQ(manifest.num_edits_written(), 8);
+  }
+
+  Manifest manifest(db_dir_);
+  EXPECT_EQ(FileNames(manifest.level0()),
+            vector<string>({"6.diodb", "5.diodb"}));
+  EXPECT_EQ(FileNames(manifest.base()), vector<string>({"4.diodb", "2.diodb"}));
+  const auto base = manifest.base();
+  EXPECT_EQ(string(base[1].smallest_key.begin(), base[1].smallest_key.end()),
+            "n");
+  EXPECT_EQ(string(base[1].largest_key.begin(), base[1].largest_key.end()),
+            "z");
+
+  // Opening rewrote the log as a single edit.
+  EXPECT_EQ(manifest.num_edits_written(), 1);
+  EXPECT_FALSE(fs::exists(db_dir_ / "MANIFEST.tmp"));
+}
+
+TEST_F(ManifestTest, TornTailIsDiscarded) {
+  fs::path path;
+  {
+    Manifest manifest(db_dir_);
+    manifest.Apply({{}, {Entry("1.diodb", kLevel0, "a", "b")}});
+    manifest.Apply({{}, {Entry("2.diodb", kLevel0, "c", "d")}});
+    path = manifest.filepath();
+  }
+
+  // Chop the last edit in half.
+  fs::resize_file(path, fs::file_size(path) - 3);
+
+  Manifest manifest(db_dir_);
+  EXPECT_EQ(FileNames(manifest.level0()), vector<string>({"1.diodb"}));
+  EXPECT_TRUE(manifest.base().empty());
+}
+
+}  // namespace test
+}  // namespace diodb
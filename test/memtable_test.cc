@@ -84,5 +84,109 @@ TEST_F(MemtableTest, TestGetBasic) {
   EXPECT_EQ(memtable_.Get("key1"), S2Vec(""));
 }
 
+TEST_F(MemtableTest, TestVersions) {
+  memtable_.Put("key1", "val1", false, 1);
+  memtable_.Put("key1", "val2", false, 3);
+  memtable_.Erase(S2Vec("key1"), 5);
+  EXPECT_EQ(1, memtable_.num_valid_entries() + memtable_.num_delete_entries());
+  EXPECT_EQ(1, memtable_.num_delete_entries());
+  EXPECT_FALSE(memtable_.KeyExists("key1"));
+
+  Segment segment;
+  EXPECT_FALSE(memtable_.FindSegment(S2Vec("key1"), 0, &segment));
+  ASSERT_TRUE(memtable_.FindSegment(S2Vec("key1"), 2, &segment));
+  EXPECT_EQ(segment.val, S2Vec("val1"));
+  ASSERT_TRUE(memtable_.FindSegment(S2Vec("key1"), 4, &segment));
+  EXPECT_EQ(segment.val, S2Vec("val2"));
+  ASSERT_TRUE(memtable_.FindSegment(S2Vec("key1"), 5, &segment));
+  EXPECT_TRUE(segment.delete_entry);
+
+  // Inserting an older version doesn't change what's newest.
+  memtable_.Put("key1", "val0", false, 0);
+  EXPECT_FALSE(memtable_.KeyExists("key1"));
+}
+
+TEST_F(MemtableTest, TestDeleteRange) {
+  memtable_.Put("a", "a-1", false, 1);
+  memtable_.Put("b", "b-1", false, 1);
+  memtable_.Put("c", "c-1", false, 1);
+  EXPECT_TRUE(memtable_.DeleteRange(S2Vec("a"), S2Vec("c"), 2));
+  memtable_.Put("b", "b-3", false, 3);
+  EXPECT_EQ(memtable_.num_range_tombstones(), 1);
+
+  // The range covers its begin key but not its end key, and doesn't hide
+  // versions written after it.
+  EXPECT_FALSE(memtable_.KeyExists("a"));
+  EXPECT_EQ(memtable_.Get(S2Vec("b")), S2Vec("b-3"));
+  EXPECT_EQ(memtable_.Get(S2Vec("c")), S2Vec("c-1"));
+
+  // Reads from before the range delete still see the old versions.
+  Segment segment;
+  ASSERT_TRUE(memtable_.FindSegment(S2Vec("a"), 1, &segment));
+  EXPECT_EQ(segment.val, S2Vec("a-1"));
+  ASSERT_TRUE(memtable_.FindSegment(S2Vec("a"), 2, &segment));
+  EXPECT_TRUE(segment.delete_entry);
+  EXPECT_EQ(segment.seq, 2);
+
+  // Keys the memtable never held are deleted too, so that older tables are
+  // shadowed.
+  ASSERT_TRUE(memtable_.FindSegment(S2Vec("aa"), 2, &segment));
+  EXPECT_TRUE(segment.delete_entry);
+
+  const std::vector<Buffer> keys = {S2Vec("a"), S2Vec("aa"), S2Vec("b"),
+                                    S2Vec("c"), S2Vec("d")};
+  std::vector<ReadableTable::KeyLookup> lookups;
+  for (const auto& key : keys) {
+    lookups.emplace_back(&key);
+  }
+  memtable_.FindSegments(kMaxSequenceNumber, &lookups);
+  EXPECT_TRUE(lookups[0].found && lookups[0].segment.delete_entry);
+  EXPECT_TRUE(lookups[1].found && lookups[1].segment.delete_entry);
+  EXPECT_EQ(lookups[2].segment.val, S2Vec("b-3"));
+  EXPECT_EQ(lookups[3].segment.val, S2Vec("c-1"));
+  EXPECT_FALSE(lookups[4].found);
+
+  memtable_.Lock();
+  EXPECT_FALSE(memtable_.DeleteRange(S2Vec("x"), S2Vec("y"), 4));
+}
+
+TEST_F(MemtableTest, TestIterator) {
+  auto memtable = std::make_shared<Memtable>();
+  for (int ii = 0; ii < 300; ++ii) {
+    memtable->Put("key" + std::to_string(1000 + ii), "val", false, 1);
+  }
+  memtable->Erase(S2Vec("key1005"), 2);
+
+  MemtableIterator it(memtable);
+  it.SeekToFirst();
+  int num_segments = 0;
+  Segment last;
+  for (; it.Valid(); it.Next()) {
+    if (num_segments > 0) {
+      EXPECT_TRUE(last < it.segment());
+    }
+    last = it.segment();
+    ++num_segments;
+  }
+  EXPECT_EQ(num_segments, 301);
+
+  // The newest version of a key comes first.
+  it.Seek(S2Vec("key1005"));
+  ASSERT_TRUE(it.Valid());
+  EXPECT_TRUE(it.segment().delete_entry);
+  it.Next();
+  ASSERT_TRUE(it.Valid());
+  EXPECT_EQ(it.segment().key, S2Vec("key1005"));
+  EXPECT_EQ(it.segment().seq, 1);
+
+  // Writes past the current batch are picked up.
+  it.SeekToFirst();
+  memtable->Put("key1200x", "val", false, 3);
+  for (num_segments = 0; it.Valid(); it.Next()) {
+    ++num_segments;
+  }
+  EXPECT_EQ(num_segments, 302);
+}
+
 }  // namespace test
 }  // namespace diodb
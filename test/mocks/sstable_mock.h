@@ -9,11 +9,13 @@ namespace test {
 class MockSSTable : public SSTable {
  public:
   MockSSTable(const fs::path sstable_path) : SSTable(sstable_path) {}
-  MockSSTable(const fs::path& new_sstable_path, const Memtable& memtable)
-      : SSTable(new_sstable_path, memtable) {}
+  MockSSTable(const fs::path& new_sstable_path, const Memtable& memtable,
+              const std::vector<SequenceNumber>& snapshots = {})
+      : SSTable(new_sstable_path, memtable, snapshots) {}
   MockSSTable(const fs::path new_sstable_path,
-              const std::vector<SSTablePtr>& sstables)
-      : SSTable(new_sstable_path, sstables) {}
+              const std::vector<SSTablePtr>& sstables,
+              const std::vector<SequenceNumber>& snapshots = {})
+      : SSTable(new_sstable_path, sstables, snapshots) {}
   ~MockSSTable() {}
 
   MOCK_CONST_METHOD0(KeyIndexOffsetBytes, off_t());
@@ -0,0 +1,118 @@
+#include <chrono>
+#include <thread>
+
+#include <gflags/gflags.h>
+#include "gtest/gtest.h"
+
+#include "src/rate_limiter.h"
+
+DECLARE_uint64(background_io_bytes_per_sec);
+DECLARE_bool(background_io_rate_auto_tune);
+DECLARE_int32(background_io_refill_msecs);
+
+namespace diodb {
+namespace test {
+
+class RateLimiterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    FLAGS_background_io_bytes_per_sec = 0;
+    FLAGS_background_io_rate_auto_tune = false;
+    FLAGS_background_io_refill_msecs = 10;
+  }
+
+  static std::chrono::milliseconds ElapsedMsecs(
+      const std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+  }
+};
+
+TEST_F(RateLimiterTest, Unlimited) {
+  RateLimiter limiter;
+  const auto start = std::chrono::steady_clock::now();
+  limiter.Request(1ULL << 30, RateLimiter::Priority::kLow);
+  EXPECT_LT(ElapsedMsecs(start).count(), 100);
+  EXPECT_EQ(limiter.stats().bytes_through[1], 1ULL << 30);
+  EXPECT_EQ(limiter.stats().num_waits[1], 0);
+}
+
+TEST_F(RateLimiterTest, EnforcesRate) {
+  FLAGS_background_io_bytes_per_sec = 1024 * 1024;
+  RateLimiter limiter;
+
+  // The first refill's worth goes through right away, the rest at 1MiB/s.
+  const auto start = std::chrono::steady_clock::now();
+  for (int ii = 0; ii < 30; ++ii) {
+    limiter.Request(10 * 1024, RateLimiter::Priority::kLow);
+  }
+  const auto elapsed = ElapsedMsecs(start);
+  EXPECT_GE(elapsed.count(), 250);
+  EXPECT_LT(elapsed.count(), 1000);
+  EXPECT_EQ(limiter.stats().bytes_through[1], 300 * 1024);
+  EXPECT_GT(limiter.stats().num_waits[1], 0);
+
+  // A request bigger than a refill is split up rather than stuck.
+  limiter.Request(100 * 1024, RateLimiter::Priority::kHigh);
+  EXPECT_EQ(limiter.stats().bytes_through[0], 100 * 1024);
+
+  // Turning limiting off.
+  limiter.SetBytesPerSecond(0);
+  const auto unlimited_start = std::chrono::steady_clock::now();
+  limiter.Request(1ULL << 30, RateLimiter::Priority::kLow);
+  EXPECT_LT(ElapsedMsecs(unlimited_start).count(), 100);
+}
+
+TEST_F(RateLimiterTest, HighPriorityGoesFirst) {
+  FLAGS_background_io_bytes_per_sec = 1024 * 1024;
+  RateLimiter limiter;
+
+  // Both ask for the same amount at the same time, so the high priority
+  // requests should finish well ahead of the low priority ones.
+  std::chrono::milliseconds high_elapsed, low_elapsed;
+  const auto start = std::chrono::steady_clock::now();
+  const auto run = [&limiter, start](const RateLimiter::Priority priority,
+                                     std::chrono::milliseconds* elapsed) {
+    for (int ii = 0; ii < 20; ++ii) {
+      limiter.Request(10 * 1024, priority);
+    }
+    *elapsed = ElapsedMsecs(start);
+  };
+  std::thread low(run, RateLimiter::Priority::kLow, &low_elapsed);
+  std::thread high(run, RateLimiter::Priority::kHigh, &high_elapsed);
+  low.join();
+  high.join();
+
+  EXPECT_LT(high_elapsed, low_elapsed);
+  EXPECT_EQ(limiter.stats().bytes_through[0], 200 * 1024);
+  EXPECT_EQ(limiter.stats().bytes_through[1], 200 * 1024);
+}
+
+TEST_F(RateLimiterTest, AutoTune) {
+  const uint64_t max_rate = 10 * 1024 * 1024;
+  FLAGS_background_io_bytes_per_sec = max_rate;
+  FLAGS_background_io_rate_auto_tune = true;
+  FLAGS_background_io_refill_msecs = 1;
+  RateLimiter limiter;
+  EXPECT_EQ(limiter.bytes_per_second(), max_rate);
+
+  // A trickle of I/O never has to wait, so the rate comes down.
+  for (int ii = 0; ii < 400; ++ii) {
+    limiter.Request(1, RateLimiter::Priority::kLow);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  const uint64_t lowered = limiter.bytes_per_second();
+  EXPECT_LT(lowered, max_rate);
+  EXPECT_GE(lowered, max_rate / 20);
+
+  // A steady backlog brings it back up.
+  const auto start = std::chrono::steady_clock::now();
+  while (ElapsedMsecs(start).count() < 500) {
+    limiter.Request(64 * 1024, RateLimiter::Priority::kLow);
+  }
+  EXPECT_GT(limiter.bytes_per_second(), lowered);
+  EXPECT_LE(limiter.bytes_per_second(), max_rate);
+}
+
+}  // namespace test
+}  // namespace diodb
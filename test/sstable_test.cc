@@ -2,17 +2,38 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <algorithm>
+#include <fstream>
+#include <iterator>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <boost/filesystem.hpp>
 #include "gtest/gtest.h"
 
+#include "src/coding.h"
+#include "src/compaction_filter.h"
 #include "src/memtable.h"
+#include "src/merge_operator.h"
 #include "test/mocks/sstable_mock.h"
 
+DECLARE_uint64(direct_io_buffer_bytes);
+DECLARE_string(io_backend);
+DECLARE_int32(io_uring_write_buffers);
+DECLARE_uint64(io_uring_write_buffer_bytes);
+DECLARE_string(prefix_extractor);
+DECLARE_uint64(sstable_index_offset_bytes);
+DECLARE_uint64(sstable_multiget_coalesce_bytes);
+DECLARE_uint64(sstable_block_bytes);
+DECLARE_uint64(sstable_readahead_bytes);
+DECLARE_bool(sequential_reader_async_readahead);
+DECLARE_uint64(sequential_reader_readahead_bytes);
+DECLARE_bool(use_direct_io_for_flush_and_compaction);
+DECLARE_bool(use_direct_reads_for_compaction);
+
 using std::function;
 using std::pair;
 using std::string;
@@ -75,6 +96,9 @@ class SSTableTest : public ::testing::Test {
 
  private:
   vector<fs::path> files_to_clean_;
+
+  // Puts back the flags a test changes, however it ends.
+  gflags::FlagSaver flag_saver_;
 };
 
 TEST_F(SSTableTest, ValidExistingFileTest) {
@@ -291,6 +315,280 @@ TEST_F(SSTableTest, SSTableMergeDuplicates) {
   ASSERT_EQ(sstable.Get("3"), String2Vec("3-new"));
 }
 
+TEST_F(SSTableTest, SSTableMergeDropsDeletes) {
+  Memtable newer;
+  newer.Put("b", "b-new");
+  newer.Erase("c");
+  newer.Lock();
+  Memtable older;
+  older.Put("a", "a-old");
+  older.Put("c", "c-old");
+  older.Put("d", "d-old");
+  older.Lock();
+
+  vector<MockSSTable::SSTablePtr> ssts;
+  ssts.emplace_back(std::make_shared<SSTable>(
+      GetTempFilename("SSTableMergeDropsDeletes-0"), newer));
+  ssts.emplace_back(std::make_shared<SSTable>(
+      GetTempFilename("SSTableMergeDropsDeletes-1"), older));
+
+  MockSSTable sstable(GetTempFilename("SSTableMergeDropsDeletes-merged"), ssts);
+  CHECK(sstable.SanityCheck());
+
+  ASSERT_EQ(sstable.Get("a"), String2Vec("a-old"));
+  ASSERT_EQ(sstable.Get("b"), String2Vec("b-new"));
+  ASSERT_EQ(sstable.Get("d"), String2Vec("d-old"));
+
+  // The delete shadows the old value and is then dropped itself.
+  ASSERT_FALSE(sstable.DeletedKeyExists(String2Vec("c")).exists);
+}
+
+TEST_F(SSTableTest, SSTableSnapshotVersions) {
+  Memtable newer;
+  newer.Put("a", "a-5", false, 5);
+  newer.Erase(String2Vec("b"), 6);
+  newer.Put("c", "c-7", false, 7);
+  newer.Put("c", "c-4", false, 4);
+  newer.Lock();
+  Memtable older;
+  older.Put("a", "a-1", false, 1);
+  older.Put("b", "b-2", false, 2);
+  older.Put("c", "c-3", false, 3);
+  older.Lock();
+
+  // A snapshot at sequence number 3 needs the old versions of all three keys,
+  // but nothing needs c-4 once c-7 exists.
+  const vector<SequenceNumber> snapshots = {3};
+  vector<MockSSTable::SSTablePtr> ssts;
+  ssts.emplace_back(std::make_shared<SSTable>(
+      GetTempFilename("SSTableSnapshotVersions-0"), newer, snapshots));
+  ssts.emplace_back(std::make_shared<SSTable>(
+      GetTempFilename("SSTableSnapshotVersions-1"), older, snapshots));
+  MockSSTable sstable(GetTempFilename("SSTableSnapshotVersions-merged"), ssts,
+                      snapshots);
+  CHECK(sstable.SanityCheck());
+
+  Segment segment;
+  ASSERT_TRUE(sstable.FindSegment(String2Vec("a"), 3, &segment));
+  EXPECT_EQ(segment.val, String2Vec("a-1"));
+  ASSERT_TRUE(sstable.FindSegment(String2Vec("b"), 3, &segment));
+  EXPECT_EQ(segment.val, String2Vec("b-2"));
+  ASSERT_TRUE(sstable.FindSegment(String2Vec("c"), 3, &segment));
+  EXPECT_EQ(segment.val, String2Vec("c-3"));
+  ASSERT_TRUE(sstable.FindSegment(String2Vec("c"), 5, &segment));
+  EXPECT_EQ(segment.val, String2Vec("c-3"));
+
+  EXPECT_EQ(sstable.Get("a"), String2Vec("a-5"));
+  EXPECT_FALSE(sstable.KeyExists("b"));
+  EXPECT_EQ(sstable.Get("c"), String2Vec("c-7"));
+
+  // Without the snapshot only the newest versions survive, and the delete
+  // goes away along with what it shadowed.
+  MockSSTable compacted(GetTempFilename("SSTableSnapshotVersions-compacted"),
+                        ssts);
+  EXPECT_FALSE(compacted.FindSegment(String2Vec("a"), 3, &segment));
+  EXPECT_FALSE(compacted.DeletedKeyExists(String2Vec("b")).exists);
+  EXPECT_EQ(compacted.Get("c"), String2Vec("c-7"));
+}
+
+TEST_F(SSTableTest, SSTableRangeTombstones) {
+  // Overlapping tombstones are split into fragments that keep every sequence
+  // number covering them.
+  const RangeTombstoneList list(
+      {RangeTombstone(String2Vec("b"), String2Vec("f"), 4),
+       RangeTombstone(String2Vec("d"), String2Vec("h"), 6),
+       RangeTombstone(String2Vec("x"), String2Vec("x"), 9)});
+  EXPECT_EQ(list.MaxCoveringSeq(String2Vec("a"), kMaxSequenceNumber), 0);
+  EXPECT_EQ(list.MaxCoveringSeq(String2Vec("b"), kMaxSequenceNumber), 4);
+  EXPECT_EQ(list.MaxCoveringSeq(String2Vec("e"), kMaxSequenceNumber), 6);
+  EXPECT_EQ(list.MaxCoveringSeq(String2Vec("e"), 5), 4);
+  EXPECT_EQ(list.MaxCoveringSeq(String2Vec("e"), 3), 0);
+  EXPECT_EQ(list.MaxCoveringSeq(String2Vec("g"), kMaxSequenceNumber), 6);
+  EXPECT_EQ(list.MaxCoveringSeq(String2Vec("h"), kMaxSequenceNumber), 0);
+  EXPECT_EQ(list.MaxCoveringSeq(String2Vec("x"), kMaxSequenceNumber), 0);
+
+  Memtable older;
+  for (const string key : {"a", "b", "c", "d", "e"}) {
+    older.Put(key, key + "-1", false, 1);
+  }
+  older.Lock();
+  Memtable newer;
+  newer.Put("c", "c-3", false, 3);
+  EXPECT_TRUE(newer.DeleteRange(String2Vec("b"), String2Vec("e"), 2));
+  newer.Put("d", "d-5", false, 5);
+  EXPECT_TRUE(newer.DeleteRange(String2Vec("c"), String2Vec("d"), 4));
+  newer.Lock();
+
+  vector<MockSSTable::SSTablePtr> ssts;
+  ssts.emplace_back(std::make_shared<SSTable>(
+      GetTempFilename("SSTableRangeTombstones-0"), newer));
+  ssts.emplace_back(std::make_shared<SSTable>(
+      GetTempFilename("SSTableRangeTombstones-1"), older));
+
+  // The flushed table keeps the tombstones, and its key range covers them.
+  const SSTable& flushed = *ssts.front();
+  EXPECT_EQ(flushed.properties().range_tombstones.size(), 2);
+  EXPECT_EQ(flushed.properties().smallest_key, String2Vec("b"));
+  EXPECT_EQ(flushed.properties().largest_key, String2Vec("e"));
+  Segment segment;
+  ASSERT_TRUE(
+      flushed.FindSegment(String2Vec("b"), kMaxSequenceNumber, &segment));
+  EXPECT_TRUE(segment.delete_entry);
+  EXPECT_EQ(segment.seq, 2);
+
+  // c-3 is covered by the newer tombstone, and no snapshot needs it.
+  ASSERT_TRUE(flushed.FindSegment(String2Vec("c"), 3, &segment));
+  EXPECT_TRUE(segment.delete_entry);
+  EXPECT_EQ(segment.seq, 2);
+  ASSERT_TRUE(
+      flushed.FindSegment(String2Vec("c"), kMaxSequenceNumber, &segment));
+  EXPECT_TRUE(segment.delete_entry);
+  EXPECT_EQ(segment.seq, 4);
+  EXPECT_EQ(flushed.properties().num_entries, 1);
+  EXPECT_EQ(flushed.Get("d"), String2Vec("d-5"));
+  EXPECT_FALSE(
+      flushed.FindSegment(String2Vec("e"), kMaxSequenceNumber, &segment));
+
+  // Reopening the file brings the tombstones back.
+  MockSSTable reopened(ssts.front()->filepath());
+  EXPECT_EQ(reopened.properties().range_tombstones.size(), 2);
+  EXPECT_FALSE(reopened.KeyExists("b"));
+
+  const vector<Buffer> keys = {String2Vec("a"), String2Vec("b"),
+                               String2Vec("c"), String2Vec("d"),
+                               String2Vec("e")};
+  vector<ReadableTable::KeyLookup> lookups;
+  for (const auto& key : keys) {
+    lookups.emplace_back(&key);
+  }
+  for (const auto& sst : ssts) {
+    sst->FindSegments(kMaxSequenceNumber, &lookups);
+  }
+  EXPECT_EQ(lookups[0].segment.val, String2Vec("a-1"));
+  EXPECT_TRUE(lookups[1].segment.delete_entry);
+  EXPECT_TRUE(lookups[2].segment.delete_entry);
+  EXPECT_EQ(lookups[3].segment.val, String2Vec("d-5"));
+  EXPECT_EQ(lookups[4].segment.val, String2Vec("e-1"));
+
+  // A snapshot from before the tombstones keeps them and what they cover.
+  MockSSTable snapshotted(GetTempFilename("SSTableRangeTombstones-snapshot"),
+                          ssts, {1});
+  CHECK(snapshotted.SanityCheck());
+  EXPECT_EQ(snapshotted.properties().range_tombstones.size(), 2);
+  ASSERT_TRUE(snapshotted.FindSegment(String2Vec("b"), 1, &segment));
+  EXPECT_EQ(segment.val, String2Vec("b-1"));
+  EXPECT_FALSE(snapshotted.KeyExists("b"));
+
+  // Without snapshots the merge drops the covered versions and the tombstones
+  // with them.
+  MockSSTable merged(GetTempFilename("SSTableRangeTombstones-merged"), ssts);
+  CHECK(merged.SanityCheck());
+  EXPECT_TRUE(merged.properties().range_tombstones.empty());
+  EXPECT_EQ(merged.properties().num_entries, 3);
+  EXPECT_EQ(merged.Get("a"), String2Vec("a-1"));
+  EXPECT_FALSE(merged.DeletedKeyExists(String2Vec("b")).exists);
+  EXPECT_FALSE(merged.DeletedKeyExists(String2Vec("c")).exists);
+  EXPECT_EQ(merged.Get("d"), String2Vec("d-5"));
+  EXPECT_EQ(merged.Get("e"), String2Vec("e-1"));
+}
+
+// Removes keys starting with "drop" and upper-cases the values of keys
+// starting with "upper".
+class TestCompactionFilter : public CompactionFilter {
+ public:
+  Decision Filter(const Buffer& key, const Buffer& value,
+                  Buffer* new_value) const override {
+    const string k(key.begin(), key.end());
+    if (k.rfind("drop", 0) == 0) {
+      return Decision::kRemove;
+    }
+    if (k.rfind("upper", 0) == 0) {
+      for (const char c : value) {
+        new_value->push_back(toupper(c));
+      }
+      return Decision::kChangeValue;
+    }
+    return Decision::kKeep;
+  }
+
+  string Name() const override { return "test"; }
+};
+
+TEST_F(SSTableTest, SSTableCompactionFilter) {
+  Memtable older;
+  older.Put("drop-snapshotted", "b", false, 1);
+  older.Put("drop-old", "a", false, 2);
+  older.Put("keep", "c", false, 3);
+  older.Put("upper", "d", false, 4);
+  older.Lock();
+  Memtable newer;
+  newer.Put("drop-snapshotted", "e", false, 6);
+  newer.Put("drop-deleted", "f", true, 7);
+  newer.Lock();
+
+  vector<SSTable::SSTablePtr> ssts;
+  ssts.emplace_back(std::make_shared<SSTable>(
+      GetTempFilename("SSTableCompactionFilter-0"), newer));
+  ssts.emplace_back(std::make_shared<SSTable>(
+      GetTempFilename("SSTableCompactionFilter-1"), older));
+
+  // The version a snapshot sees is left alone, and the newer one is removed
+  // without exposing it.
+  const TestCompactionFilter filter;
+  SSTable merged(GetTempFilename("SSTableCompactionFilter-merged"), ssts, {1},
+                 nullptr /* rate_limiter */, nullptr /* build_pool */,
+                 &filter);
+  CHECK(merged.SanityCheck());
+  EXPECT_FALSE(merged.DeletedKeyExists(String2Vec("drop-old")).exists);
+  EXPECT_FALSE(merged.DeletedKeyExists(String2Vec("drop-deleted")).exists);
+  EXPECT_FALSE(merged.KeyExists("drop-snapshotted"));
+  Segment segment;
+  ASSERT_TRUE(merged.FindSegment(String2Vec("drop-snapshotted"), 1, &segment));
+  EXPECT_EQ(segment.val, String2Vec("b"));
+  EXPECT_EQ(merged.Get("keep"), String2Vec("c"));
+  EXPECT_EQ(merged.Get("upper"), String2Vec("D"));
+
+  // Values past their time to live are removed, and the rest are handed to the
+  // inner filter without their write time.
+  Memtable stamped;
+  const uint64_t now = TtlCompactionFilter::Now();
+  const auto put = [this, &stamped](const string& key, const string& val,
+                                    const uint64_t write_time,
+                                    const SequenceNumber seq) {
+    Buffer value = String2Vec(val);
+    TtlCompactionFilter::AppendWriteTime(write_time, &value);
+    stamped.Put(String2Vec(key), move(value), false, seq);
+  };
+  put("expired", "a", now - 100, 1);
+  put("fresh", "b", now, 2);
+  put("upper-fresh", "c", now, 3);
+  put("upper-expired", "d", now - 100, 4);
+  stamped.Lock();
+
+  const TtlCompactionFilter ttl_filter(
+      60, std::make_shared<TestCompactionFilter>());
+  EXPECT_EQ(ttl_filter.Name(), "ttl:60,test");
+  SSTable ttl_merged(
+      GetTempFilename("SSTableCompactionFilter-ttl"),
+      {std::make_shared<SSTable>(
+          GetTempFilename("SSTableCompactionFilter-stamped"), stamped)},
+      {}, nullptr /* rate_limiter */, nullptr /* build_pool */, &ttl_filter);
+  CHECK(ttl_merged.SanityCheck());
+  EXPECT_EQ(ttl_merged.properties().num_entries, 2);
+  EXPECT_FALSE(ttl_merged.KeyExists("expired"));
+  EXPECT_FALSE(ttl_merged.KeyExists("upper-expired"));
+
+  uint64_t write_time;
+  Buffer value = ttl_merged.Get("fresh");
+  ASSERT_TRUE(TtlCompactionFilter::StripWriteTime(&value, &write_time));
+  EXPECT_EQ(value, String2Vec("b"));
+  EXPECT_EQ(write_time, now);
+  value = ttl_merged.Get("upper-fresh");
+  ASSERT_TRUE(TtlCompactionFilter::StripWriteTime(&value, &write_time));
+  EXPECT_EQ(value, String2Vec("C"));
+  EXPECT_EQ(write_time, now);
+}
+
 TEST_F(SSTableTest, SSTableGetBasic) {
   Memtable memtable;
   memtable.Put("holy", "diver");
@@ -311,5 +609,598 @@ TEST_F(SSTableTest, SSTableGetBasic) {
   CHECK(sstable.SanityCheck());
 }
 
+TEST_F(SSTableTest, SSTableFindSegments) {
+  // Index every few segments so that the batch spans many index regions.
+  FLAGS_sstable_index_offset_bytes = 64;
+
+  Memtable memtable;
+  for (int ii = 0; ii < 500; ii += 2) {
+    const string key = "key" + std::to_string(1000 + ii);
+    memtable.Put(key, "new" + std::to_string(ii), false, 2);
+    memtable.Put(key, "old" + std::to_string(ii), false, 1);
+  }
+  memtable.Lock();
+  MockSSTable sstable(GetTempFilename("SSTableFindSegments"), memtable,
+                      vector<SequenceNumber>{1});
+
+  vector<Buffer> keys;
+  for (int ii = 0; ii < 500; ii += 7) {
+    keys.push_back(String2Vec("key" + std::to_string(1000 + ii)));
+  }
+  keys.push_back(String2Vec("zzz"));
+
+  // Coalesce everything, then nothing.
+  for (const uint64_t coalesce : {uint64_t(1) << 20, uint64_t(0)}) {
+    FLAGS_sstable_multiget_coalesce_bytes = coalesce;
+    for (const SequenceNumber seq : {SequenceNumber(1), kMaxSequenceNumber}) {
+      vector<ReadableTable::KeyLookup> lookups;
+      for (const auto& key : keys) {
+        lookups.emplace_back(&key);
+      }
+      // Pretend a newer table already served one of them.
+      lookups[2].found = true;
+      sstable.FindSegments(seq, &lookups);
+
+      for (size_t ii = 0; ii < keys.size(); ++ii) {
+        Segment segment;
+        const bool found = sstable.FindSegment(keys[ii], seq, &segment);
+        if (ii == 2) {
+          EXPECT_TRUE(lookups[ii].segment.key.empty());
+          continue;
+        }
+        ASSERT_EQ(lookups[ii].found, found) << Vec2String(keys[ii]);
+        if (found) {
+          EXPECT_EQ(lookups[ii].segment.val, segment.val);
+        }
+      }
+    }
+  }
+}
+
+TEST_F(SSTableTest, SSTablePrefixFilter) {
+  FLAGS_prefix_extractor = "delimiter:/";
+
+  Memtable memtable;
+  for (int tenant = 0; tenant < 100; tenant += 2) {
+    for (int user = 0; user < 10; ++user) {
+      memtable.Put("t" + std::to_string(100 + tenant) + "/u" +
+                       std::to_string(user),
+                   "val");
+    }
+  }
+  memtable.Lock();
+  MockSSTable sstable(GetTempFilename("SSTablePrefixFilter"), memtable);
+
+  // Outside the key range.
+  EXPECT_FALSE(sstable.MayContainPrefix(String2Vec("a")));
+  EXPECT_FALSE(sstable.MayContainPrefix(String2Vec("u")));
+  EXPECT_FALSE(sstable.KeyExists("t099/u1"));
+
+  // Not in the domain of the extractor, so only the key range applies.
+  EXPECT_TRUE(sstable.MayContainPrefix(String2Vec("t")));
+  EXPECT_TRUE(sstable.MayContainPrefix(String2Vec("t1")));
+
+  int num_false_positives = 0;
+  for (int tenant = 0; tenant < 100; ++tenant) {
+    const string prefix = "t" + std::to_string(100 + tenant) + "/";
+    const bool may_contain = sstable.MayContainPrefix(String2Vec(prefix));
+    const bool exists = sstable.KeyExists(prefix + "u1");
+    if (tenant % 2 == 0) {
+      ASSERT_TRUE(may_contain) << prefix;
+      ASSERT_TRUE(exists) << prefix;
+    } else {
+      ASSERT_FALSE(exists) << prefix;
+      num_false_positives += may_contain;
+    }
+  }
+  EXPECT_LT(num_false_positives, 5);
+}
+
+TEST_F(SSTableTest, SSTableProperties) {
+  Memtable memtable;
+  memtable.Put("b", "b-1", false, 1);
+  memtable.Put("b", "b-4", false, 4);
+  memtable.Put("c", "c-2", false, 2);
+  memtable.Erase(String2Vec("d"), 3);
+  memtable.Put("e", "e-5", false, 5);
+  memtable.Lock();
+
+  const fs::path filename = GetTempFilename("SSTableProperties");
+  {
+    MockSSTable sstable(filename, memtable, vector<SequenceNumber>{2});
+    const TableProperties& props = sstable.properties();
+    EXPECT_EQ(props.num_entries, 5);
+    EXPECT_EQ(props.num_valid_entries, 3);
+    EXPECT_EQ(props.num_delete_entries, 1);
+    EXPECT_EQ(props.max_sequence, 5);
+    EXPECT_EQ(props.smallest_key, String2Vec("b"));
+    EXPECT_EQ(props.largest_key, String2Vec("e"));
+    EXPECT_EQ(sstable.Size(), 3);
+  }
+
+  // The properties come back from the file, and the data is still readable.
+  MockSSTable sstable(filename);
+  const TableProperties& props = sstable.properties();
+  EXPECT_EQ(props.num_entries, 5);
+  EXPECT_EQ(props.num_valid_entries, 3);
+  EXPECT_EQ(props.num_delete_entries, 1);
+  EXPECT_EQ(props.max_sequence, 5);
+  EXPECT_EQ(props.smallest_key, String2Vec("b"));
+  EXPECT_EQ(props.largest_key, String2Vec("e"));
+  EXPECT_TRUE(sstable.SanityCheck());
+  EXPECT_EQ(sstable.Get("e"), String2Vec("e-5"));
+
+  // Keys outside the range are ruled out.
+  EXPECT_TRUE(props.Overlaps(String2Vec("a"), String2Vec("b")));
+  EXPECT_FALSE(props.Overlaps(String2Vec("ea"), String2Vec("z")));
+  EXPECT_FALSE(sstable.KeyExists("f"));
+}
+
+TEST_F(SSTableTest, SSTableWithoutProperties) {
+  // Tables written before the properties block existed are all segments.
+  const fs::path filename = GetTempFilename("SSTableWithoutProperties");
+  {
+    IOHandle iohandle(filename);
+    iohandle.SegmentWrite(Segment("a", "1", false, 1));
+    iohandle.SegmentWrite(Segment("b", "", true, 2));
+    iohandle.SegmentWrite(Segment("c", "3", false, 3));
+    iohandle.Flush();
+  }
+
+  MockSSTable sstable(filename);
+  const TableProperties& props = sstable.properties();
+  EXPECT_EQ(props.num_entries, 3);
+  EXPECT_EQ(props.num_valid_entries, 2);
+  EXPECT_EQ(props.num_delete_entries, 1);
+  EXPECT_EQ(props.smallest_key, String2Vec("a"));
+  EXPECT_EQ(props.largest_key, String2Vec("c"));
+  EXPECT_EQ(sstable.Get("c"), String2Vec("3"));
+  EXPECT_FALSE(sstable.KeyExists("b"));
+}
+
+TEST_F(SSTableTest, SSTableLazyIndex) {
+  FLAGS_prefix_extractor = "delimiter:/";
+  FLAGS_sstable_index_offset_bytes = 64;
+
+  Memtable memtable;
+  for (int ii = 0; ii < 1000; ++ii) {
+    memtable.Put("k" + std::to_string(10000 + ii) + "/x",
+                 "v" + std::to_string(ii));
+  }
+  memtable.Lock();
+  const fs::path filename = GetTempFilename("SSTableLazyIndex");
+  { MockSSTable written(filename, memtable); }
+
+  // The first lookups race to build the index, and all of them have to see
+  // it complete.
+  const auto sstable = std::make_shared<SSTable>(filename, true /* lazy */);
+  EXPECT_EQ(sstable->properties().num_valid_entries, 1000);
+  vector<std::thread> readers;
+  for (int tt = 0; tt < 4; ++tt) {
+    readers.emplace_back([this, &sstable, tt]() {
+      for (int ii = tt; ii < 1000; ii += 4) {
+        ASSERT_EQ(sstable->Get("k" + std::to_string(10000 + ii) + "/x"),
+                  String2Vec("v" + std::to_string(ii)));
+      }
+    });
+  }
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  EXPECT_FALSE(sstable->MayContainPrefix(String2Vec("k99999/")));
+  EXPECT_FALSE(sstable->KeyExists("k10000/y"));
+
+  SSTableIterator it(sstable);
+  it.Seek(String2Vec("k10500/x"));
+  ASSERT_TRUE(it.Valid());
+  EXPECT_EQ(it.segment().val, String2Vec("v500"));
+}
+
+TEST_F(SSTableTest, SSTableWriter) {
+  const fs::path filename = GetTempFilename("SSTableWriter");
+  {
+    SSTableWriter writer(filename);
+    for (int ii = 0; ii < 1000; ++ii) {
+      const Buffer key = String2Vec("k" + std::to_string(10000 + ii));
+      if (ii % 10 == 0) {
+        writer.Delete(key);
+      } else {
+        writer.Put(key, String2Vec("v" + std::to_string(ii)));
+      }
+    }
+    writer.Finish();
+    EXPECT_EQ(writer.properties().num_valid_entries, 900);
+  }
+
+  MockSSTable sstable(filename);
+  const TableProperties& props = sstable.properties();
+  EXPECT_EQ(props.num_entries, 1000);
+  EXPECT_EQ(props.num_delete_entries, 100);
+  EXPECT_EQ(props.max_sequence, 0);
+  EXPECT_EQ(props.smallest_key, String2Vec("k10000"));
+  EXPECT_EQ(props.largest_key, String2Vec("k10999"));
+  EXPECT_TRUE(sstable.SanityCheck());
+  EXPECT_EQ(sstable.Get("k10123"), String2Vec("v123"));
+  EXPECT_FALSE(sstable.KeyExists("k10120"));
+
+  // Keys have to come in order.
+  const string failure_regex = "ascending order";
+  ASSERT_DEATH(
+      {
+        SSTableWriter writer(GetTempFilename("SSTableWriterUnsorted"));
+        writer.Put(String2Vec("b"), String2Vec("1"));
+        writer.Put(String2Vec("a"), String2Vec("2"));
+      },
+      failure_regex);
+}
+
+TEST_F(SSTableTest, SSTableMergeOperands) {
+  Memtable older;
+  older.Put("deleted", "x", true /* del */, 1);
+  older.Put("list", "a", false, 2);
+  older.Put("snapshotted", "a", false, 3);
+  older.Put("tombstoned", "a", false, 4);
+  older.Lock();
+  Memtable newer;
+  EXPECT_TRUE(newer.Merge(String2Vec("deleted"), String2Vec("b"), 5));
+  EXPECT_TRUE(newer.Merge(String2Vec("list"), String2Vec("b"), 6));
+  EXPECT_TRUE(newer.Merge(String2Vec("list"), String2Vec("c"), 7));
+  EXPECT_TRUE(newer.Merge(String2Vec("new"), String2Vec("a"), 8));
+  EXPECT_TRUE(newer.Merge(String2Vec("snapshotted"), String2Vec("b"), 10));
+  EXPECT_TRUE(newer.Merge(String2Vec("snapshotted"), String2Vec("c"), 11));
+  EXPECT_TRUE(newer.DeleteRange(String2Vec("tombstoned"),
+                                String2Vec("tombstonee"), 12));
+  EXPECT_TRUE(newer.Merge(String2Vec("tombstoned"), String2Vec("b"), 13));
+  newer.Lock();
+
+  vector<SSTable::SSTablePtr> ssts;
+  ssts.emplace_back(std::make_shared<SSTable>(
+      GetTempFilename("SSTableMergeOperands-0"), newer));
+  ssts.emplace_back(std::make_shared<SSTable>(
+      GetTempFilename("SSTableMergeOperands-1"), older));
+
+  // Flushes keep the operands as they are.
+  Segment segment;
+  ASSERT_TRUE(ssts.front()->FindSegment(String2Vec("list"), kMaxSequenceNumber,
+                                        &segment));
+  EXPECT_TRUE(segment.merge_operand);
+  EXPECT_EQ(segment.val, String2Vec("c"));
+  EXPECT_EQ(segment.seq, 7);
+
+  // Merges fold the operands into values, except where a snapshot sees the
+  // older version.
+  const auto merge_operator = MergeOperator::Create("append:,");
+  SSTable merged(GetTempFilename("SSTableMergeOperands-merged"), ssts, {9},
+                 nullptr /* rate_limiter */, nullptr /* build_pool */,
+                 nullptr /* compaction_filter */, merge_operator.get());
+  CHECK(merged.SanityCheck());
+  const auto expect_value = [&](const string& key, const string& val,
+                                const SequenceNumber seq) {
+    Segment found;
+    ASSERT_TRUE(merged.FindSegment(String2Vec(key), kMaxSequenceNumber, &found))
+        << key;
+    EXPECT_FALSE(found.merge_operand) << key;
+    EXPECT_EQ(string(found.val.begin(), found.val.end()), val) << key;
+    EXPECT_EQ(found.seq, seq) << key;
+  };
+  expect_value("deleted", "b", 5);
+  expect_value("list", "a,b,c", 7);
+  expect_value("new", "a", 8);
+  expect_value("tombstoned", "b", 13);
+
+  ASSERT_TRUE(merged.FindSegment(String2Vec("snapshotted"), kMaxSequenceNumber,
+                                 &segment));
+  EXPECT_TRUE(segment.merge_operand);
+  EXPECT_EQ(segment.val, String2Vec("b,c"));
+  EXPECT_EQ(segment.seq, 11);
+  ASSERT_TRUE(merged.FindSegment(String2Vec("snapshotted"), 9, &segment));
+  EXPECT_FALSE(segment.merge_operand);
+  EXPECT_EQ(segment.val, String2Vec("a"));
+
+  // The operators that come with the database.
+  const auto add = MergeOperator::Create("uint64add");
+  Buffer one;
+  coding::PutFixed64(&one, 1);
+  Buffer two;
+  coding::PutFixed64(&two, 2);
+  const Buffer three = add->Merge(Buffer(), &one, two);
+  ASSERT_EQ(three.size(), sizeof(uint64_t));
+  EXPECT_EQ(coding::DecodeFixed64(three.data()), 3);
+  EXPECT_EQ(add->Merge(Buffer(), nullptr, two), two);
+  EXPECT_EQ(MergeOperator::Create(""), nullptr);
+}
+
+TEST_F(SSTableTest, SSTableIterator) {
+  // Use a read-ahead size smaller than some of the segments so that they have
+  // to be read whole.
+  FLAGS_sstable_readahead_bytes = 64;
+
+  Memtable memtable;
+  for (int ii = 0; ii < 100; ++ii) {
+    const string key = "key" + std::to_string(1000 + ii);
+    memtable.Put(key, string(ii, 'v'), false, 2);
+    memtable.Put(key, "old", false, 1);
+  }
+  memtable.Lock();
+  auto sst = std::make_shared<MockSSTable>(GetTempFilename("SSTableIterator"),
+                                           memtable, vector<SequenceNumber>{1});
+
+  SSTableIterator it(sst);
+  it.SeekToFirst();
+  for (int ii = 0; ii < 100; ++ii) {
+    const auto key = String2Vec("key" + std::to_string(1000 + ii));
+    ASSERT_TRUE(it.Valid());
+    EXPECT_EQ(it.segment().key, key);
+    EXPECT_EQ(it.segment().val, String2Vec(string(ii, 'v')));
+    EXPECT_EQ(it.segment().seq, 2);
+    it.Next();
+    ASSERT_TRUE(it.Valid());
+    EXPECT_EQ(it.segment().key, key);
+    EXPECT_EQ(it.segment().seq, 1);
+    it.Next();
+  }
+  EXPECT_FALSE(it.Valid());
+
+  it.Seek(String2Vec("key1050"));
+  ASSERT_TRUE(it.Valid());
+  EXPECT_EQ(it.segment().key, String2Vec("key1050"));
+  EXPECT_EQ(it.segment().seq, 2);
+
+  // Between two keys.
+  it.Seek(String2Vec("key10505"));
+  ASSERT_TRUE(it.Valid());
+  EXPECT_EQ(it.segment().key, String2Vec("key1051"));
+
+  it.Seek(String2Vec("key2"));
+  EXPECT_FALSE(it.Valid());
+}
+
+TEST_F(SSTableTest, SSTableIoUringBackend) {
+  FLAGS_sstable_index_offset_bytes = 64;
+
+  // Small buffers so that writes wrap around them many times.
+  FLAGS_io_uring_write_buffers = 2;
+  FLAGS_io_uring_write_buffer_bytes = 4096;
+
+  const auto make_memtable = [](const int begin, Memtable* memtable) {
+    for (int ii = begin; ii < 2000; ii += 2) {
+      const string key = "key" + std::to_string(10000 + ii);
+      memtable->Put(key, string(ii % 50, 'v'), ii % 11 == 0, ii + 1);
+    }
+    memtable->Lock();
+  };
+  const auto read_file = [](const fs::path& path) {
+    std::ifstream ifs(path.generic_string(), std::ios::binary);
+    return vector<char>(std::istreambuf_iterator<char>(ifs),
+                        std::istreambuf_iterator<char>());
+  };
+
+  // Build the same tables through both backends. Where io_uring is
+  // unavailable this falls back to stdio, and the files still have to match.
+  vector<vector<char>> contents;
+  vector<MockSSTable::SSTablePtr> merged;
+  for (const string backend : {"stdio", "io_uring"}) {
+    FLAGS_io_backend = backend;
+    Memtable older, newer;
+    make_memtable(0, &older);
+    make_memtable(1, &newer);
+    auto older_sst = std::make_shared<SSTable>(
+        GetTempFilename("SSTableIoUringOlder_" + backend), older);
+    auto newer_sst = std::make_shared<SSTable>(
+        GetTempFilename("SSTableIoUringNewer_" + backend), newer);
+    merged.push_back(std::make_shared<SSTable>(
+        GetTempFilename("SSTableIoUringMerged_" + backend),
+        vector<MockSSTable::SSTablePtr>{newer_sst, older_sst}));
+    contents.push_back(read_file(older_sst->filepath()));
+    contents.push_back(read_file(merged.back()->filepath()));
+  }
+  EXPECT_GT(contents[0].size(), 4 * 4096);
+  EXPECT_EQ(contents[0], contents[2]);
+  EXPECT_EQ(contents[1], contents[3]);
+
+  // Batched lookups through io_uring agree with single lookups.
+  vector<Buffer> keys;
+  for (int ii = 0; ii < 2100; ii += 13) {
+    keys.push_back(String2Vec("key" + std::to_string(10000 + ii)));
+  }
+  vector<ReadableTable::KeyLookup> lookups;
+  for (const auto& key : keys) {
+    lookups.emplace_back(&key);
+  }
+  merged.back()->FindSegments(kMaxSequenceNumber, &lookups);
+  for (size_t ii = 0; ii < keys.size(); ++ii) {
+    Segment segment;
+    ASSERT_EQ(lookups[ii].found,
+              merged[0]->FindSegment(keys[ii], kMaxSequenceNumber, &segment))
+        << Vec2String(keys[ii]);
+    if (lookups[ii].found) {
+      EXPECT_EQ(lookups[ii].segment.val, segment.val);
+      EXPECT_EQ(lookups[ii].segment.delete_entry, segment.delete_entry);
+    }
+  }
+}
+
+TEST_F(SSTableTest, SSTableDirectIO) {
+
+  // Buffers smaller than some of the segments, so that they have to be split
+  // up and stitched back together.
+  FLAGS_direct_io_buffer_bytes = 4096;
+  FLAGS_io_uring_write_buffer_bytes = 4096;
+  FLAGS_sequential_reader_readahead_bytes = 4096;
+
+  const auto make_memtable = [](const int begin, Memtable* memtable) {
+    for (int ii = begin; ii < 1000; ii += 2) {
+      const string key = "key" + std::to_string(10000 + ii);
+      memtable->Put(key, string(ii % 97 == 0 ? 6000 : ii % 50, 'v'),
+                    ii % 11 == 0, ii + 1);
+    }
+    memtable->Lock();
+  };
+  const auto read_file = [](const fs::path& path) {
+    std::ifstream ifs(path.generic_string(), std::ios::binary);
+    return vector<char>(std::istreambuf_iterator<char>(ifs),
+                        std::istreambuf_iterator<char>());
+  };
+
+  // Plain stdio first, then direct I/O with and without io_uring. The tables
+  // have to come out the same every time.
+  vector<vector<char>> flushed, merged;
+  int config = 0;
+  for (const string backend : {"stdio", "stdio", "io_uring"}) {
+    FLAGS_io_backend = backend;
+    FLAGS_use_direct_io_for_flush_and_compaction = config > 0;
+    FLAGS_use_direct_reads_for_compaction = config > 0;
+    const string suffix = std::to_string(config++);
+
+    Memtable older, newer;
+    make_memtable(0, &older);
+    make_memtable(1, &newer);
+    auto older_sst = std::make_shared<SSTable>(
+        GetTempFilename("SSTableDirectIOOlder" + suffix), older);
+    auto newer_sst = std::make_shared<SSTable>(
+        GetTempFilename("SSTableDirectIONewer" + suffix), newer);
+    auto merged_sst = std::make_shared<SSTable>(
+        GetTempFilename("SSTableDirectIOMerged" + suffix),
+        vector<MockSSTable::SSTablePtr>{newer_sst, older_sst});
+    flushed.push_back(read_file(older_sst->filepath()));
+    merged.push_back(read_file(merged_sst->filepath()));
+
+    // The index built through direct reads works.
+    EXPECT_EQ(merged_sst->Get(String2Vec("key10001")), String2Vec("v"));
+    EXPECT_EQ(merged_sst->Get(String2Vec("key10194")),
+              String2Vec(string(6000, 'v')));
+    EXPECT_TRUE(merged_sst->SanityCheck());
+  }
+  for (size_t ii = 1; ii < flushed.size(); ++ii) {
+    EXPECT_EQ(flushed[0], flushed[ii]);
+    EXPECT_EQ(merged[0], merged[ii]);
+  }
+}
+
+TEST_F(SSTableTest, SequentialReader) {
+  FLAGS_sequential_reader_readahead_bytes = 4096;
+
+  // Segments of every size up to a few blocks, so that some of them straddle
+  // two or more blocks.
+  const fs::path path = GetTempFilename("SequentialReader");
+  vector<Segment> expected;
+  {
+    IOHandle handle(path);
+    for (int ii = 0; ii < 300; ++ii) {
+      const string key = "key" + std::to_string(10000 + ii);
+      const string val(ii % 37 == 0 ? 9000 + ii : ii * 7 % 500, 'v');
+      expected.emplace_back(key, val, ii % 5 == 0, ii + 1);
+      handle.SegmentWrite(expected.back());
+    }
+    handle.Flush();
+  }
+  const uint64_t limit = fs::file_size(path);
+
+  for (const bool async : {false, true}) {
+    for (const bool direct : {false, true}) {
+      FLAGS_sequential_reader_async_readahead = async;
+      SequentialReader reader(path, limit, direct);
+      IOHandle handle(path);
+      Segment segment, parsed;
+      for (const auto& want : expected) {
+        ASSERT_EQ(reader.offset(), handle.Offset());
+        ASSERT_TRUE(reader.Next(&segment));
+        handle.ParseNext(&parsed);
+        EXPECT_EQ(segment.DebugString(), want.DebugString());
+        EXPECT_EQ(segment.DebugString(), parsed.DebugString());
+      }
+      EXPECT_EQ(reader.offset(), static_cast<int64_t>(limit));
+      EXPECT_FALSE(reader.Next(&segment));
+    }
+  }
+
+  // Scans stop at the limit, even mid-file.
+  const uint64_t half_limit = coding::EncodedSegmentSize(expected[0]) +
+                              coding::EncodedSegmentSize(expected[1]);
+  SequentialReader reader(path, half_limit);
+  Segment segment;
+  EXPECT_TRUE(reader.Next(&segment));
+  EXPECT_TRUE(reader.Next(&segment));
+  EXPECT_EQ(segment.DebugString(), expected[1].DebugString());
+  EXPECT_FALSE(reader.Next(&segment));
+}
+
+TEST_F(SSTableTest, SSTableParallelBuild) {
+  FLAGS_sstable_block_bytes = 512;
+
+  const auto make_memtable = [](const int begin, Memtable* memtable) {
+    for (int ii = begin; ii < 2000; ii += 2) {
+      const string key = "key" + std::to_string(10000 + ii);
+      memtable->Put(key, string(ii % 89 == 0 ? 3000 : ii % 40, 'v'),
+                    ii % 13 == 0, ii + 1);
+    }
+    memtable->Lock();
+  };
+  const auto read_file = [](const fs::path& path) {
+    std::ifstream ifs(path.generic_string(), std::ios::binary);
+    return vector<char>(std::istreambuf_iterator<char>(ifs),
+                        std::istreambuf_iterator<char>());
+  };
+
+  // Blocks encoded inline and on a pool have to come out the same.
+  util::Threadpool pool(3);
+  vector<vector<char>> flushed, merged;
+  vector<MockSSTable::SSTablePtr> merged_ssts;
+  for (util::Threadpool* build_pool : {static_cast<util::Threadpool*>(nullptr),
+                                       &pool}) {
+    const string suffix = build_pool ? "Pool" : "Inline";
+    Memtable older, newer;
+    make_memtable(0, &older);
+    make_memtable(1, &newer);
+    auto older_sst = std::make_shared<SSTable>(
+        GetTempFilename("SSTableParallelBuildOlder" + suffix), older,
+        vector<SequenceNumber>{}, nullptr, build_pool);
+    auto newer_sst = std::make_shared<SSTable>(
+        GetTempFilename("SSTableParallelBuildNewer" + suffix), newer,
+        vector<SequenceNumber>{}, nullptr, build_pool);
+    auto merged_sst = std::make_shared<SSTable>(
+        GetTempFilename("SSTableParallelBuildMerged" + suffix),
+        vector<MockSSTable::SSTablePtr>{newer_sst, older_sst},
+        vector<SequenceNumber>{}, nullptr, build_pool);
+    flushed.push_back(read_file(older_sst->filepath()));
+    merged.push_back(read_file(merged_sst->filepath()));
+
+    EXPECT_GT(older_sst->properties().block_checksums.size(), 10);
+    EXPECT_GT(merged_sst->properties().block_checksums.size(), 10);
+    EXPECT_TRUE(older_sst->SanityCheck());
+    EXPECT_TRUE(merged_sst->SanityCheck());
+    EXPECT_EQ(merged_sst->Get(String2Vec("key10001")), String2Vec("v"));
+    EXPECT_EQ(merged_sst->Get(String2Vec("key11780")),
+              String2Vec(string(3000, 'v')));
+    merged_ssts.push_back(merged_sst);
+  }
+  EXPECT_EQ(flushed[0], flushed[1]);
+  EXPECT_EQ(merged[0], merged[1]);
+
+  // The checksums survive a reopen, and catch a corrupted value.
+  const fs::path path = merged_ssts.back()->filepath();
+  const size_t num_blocks =
+      merged_ssts.back()->properties().block_checksums.size();
+  merged_ssts.clear();
+  {
+    SSTable reopened(path);
+    EXPECT_EQ(reopened.properties().block_checksums.size(), num_blocks);
+    EXPECT_TRUE(reopened.SanityCheck());
+  }
+  {
+    std::fstream file(path.generic_string(),
+                      std::ios::in | std::ios::out | std::ios::binary);
+    const string needle(30, 'v');
+    vector<char> contents = read_file(path);
+    const auto it = std::search(contents.begin(), contents.end(),
+                                needle.begin(), needle.end());
+    ASSERT_NE(it, contents.end());
+    file.seekp(it - contents.begin());
+    file.put('w');
+  }
+  SSTable corrupted(path);
+  EXPECT_FALSE(corrupted.SanityCheck());
+}
+
 }  // namespace test
 }  // namespace diodb
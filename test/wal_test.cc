@@ -0,0 +1,161 @@
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include "gtest/gtest.h"
+
+#include "src/buffer.h"
+#include "src/wal.h"
+
+using std::string;
+using std::vector;
+
+namespace fs = boost::filesystem;
+namespace diodb {
+namespace test {
+
+class WriteAheadLogTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    log_dir_ = fs::path("wal_test_dir");
+    fs::remove_all(log_dir_);
+  }
+  void TearDown() override { fs::remove_all(log_dir_); }
+
+  std::unique_ptr<WriteAheadLog> OpenLog() {
+    return std::make_unique<WriteAheadLog>(
+        log_dir_, WriteAheadLog::SyncMode::kBatch,
+        std::chrono::milliseconds(0));
+  }
+
+  // Replays the log directory and returns every segment, in order.
+  vector<Segment> ReplayAll() {
+    vector<Segment> replayed;
+    OpenLog()->Replay([&replayed](vector<Segment>&& segments) {
+      for (auto& segment : segments) {
+        replayed.emplace_back(std::move(segment));
+      }
+    });
+    return replayed;
+  }
+
+  fs::path log_dir_;
+};
+
+TEST_F(WriteAheadLogTest, ReplayRecords) {
+  {
+    auto wal = OpenLog();
+    wal->AddRecord({Segment("holy", "diver")});
+    wal->AddRecord({Segment("ride", "tiger"), Segment("holy", "", true)});
+    EXPECT_EQ(wal->num_records_written(), 2);
+    EXPECT_EQ(wal->num_syncs(), 2);
+  }
+
+  const auto replayed = ReplayAll();
+  ASSERT_EQ(replayed.size(), 3);
+  EXPECT_EQ(string(replayed[0].key.begin(), replayed[0].key.end()), "holy");
+  EXPECT_EQ(string(replayed[0].val.begin(), replayed[0].val.end()), "diver");
+  EXPECT_EQ(string(replayed[1].key.begin(), replayed[1].key.end()), "ride");
+  EXPECT_TRUE(replayed[2].delete_entry);
+}
+
+TEST_F(WriteAheadLogTest, TornTailIsDiscarded) {
+  fs::path log_path;
+  {
+    auto wal = OpenLog();
+    wal->AddRecord({Segment("a", "1")});
+    wal->AddRecord({Segment("b", "2")});
+    log_path = log_dir_ / (std::to_string(wal->active_log_number()) + ".wal");
+  }
+
+  // Chop the last record in half.
+  fs::resize_file(log_path, fs::file_size(log_path) - 3);
+
+  const auto replayed = ReplayAll();
+  ASSERT_EQ(replayed.size(), 1);
+  EXPECT_EQ(string(replayed[0].key.begin(), replayed[0].key.end()), "a");
+}
+
+TEST_F(WriteAheadLogTest, ReleaseRolledLogs) {
+  auto wal = OpenLog();
+  wal->AddRecord({Segment("a", "1")});
+  const uint64_t rolled = wal->Roll();
+  wal->AddRecord({Segment("b", "2")});
+  wal->ReleaseLogs(rolled);
+  wal.reset();
+
+  const auto replayed = ReplayAll();
+  ASSERT_EQ(replayed.size(), 1);
+  EXPECT_EQ(string(replayed[0].key.begin(), replayed[0].key.end()), "b");
+}
+
+TEST_F(WriteAheadLogTest, PeriodicSyncOfIdleTail) {
+  WriteAheadLog wal(log_dir_, WriteAheadLog::SyncMode::kPeriodic,
+                    std::chrono::milliseconds(50));
+
+  // The append comes too soon after the log was opened to be synced.
+  wal.AddRecord({Segment("a", "1")});
+  EXPECT_EQ(wal.num_syncs(), 0);
+  EXPECT_GT(wal.SyncIfDue().count(), 0);
+  EXPECT_EQ(wal.num_syncs(), 0);
+
+  // Nothing else is appended, so the tail is only synced by the timed check.
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  EXPECT_EQ(wal.SyncIfDue(), std::chrono::milliseconds(50));
+  EXPECT_EQ(wal.num_syncs(), 1);
+  wal.SyncIfDue();
+  EXPECT_EQ(wal.num_syncs(), 1);
+}
+
+TEST_F(WriteAheadLogTest, CorruptMiddleLogEndsReplay) {
+  fs::path middle_path;
+  {
+    auto wal = OpenLog();
+    wal->AddRecord({Segment("a", "1")});
+    wal->Roll();
+    middle_path =
+        log_dir_ / (std::to_string(wal->active_log_number()) + ".wal");
+    wal->AddRecord({Segment("b", "2")});
+    wal->AddRecord({Segment("c", "3")});
+    wal->Roll();
+    wal->AddRecord({Segment("d", "4")});
+  }
+
+  // Flip the last byte of the middle log, which leaves its second record
+  // with a bad checksum.
+  {
+    std::fstream file(middle_path.string(),
+                      std::ios::in | std::ios::out | std::ios::binary);
+    file.seekg(-1, std::ios::end);
+    const char c = file.get();
+    file.seekp(-1, std::ios::end);
+    file.put(c ^ 1);
+  }
+
+  // Nothing logged after the bad record is replayed, even from a later log.
+  {
+    auto wal = OpenLog();
+    vector<string> keys;
+    wal->Replay([&keys](vector<Segment>&& segments) {
+      for (const auto& segment : segments) {
+        keys.emplace_back(segment.key.begin(), segment.key.end());
+      }
+    });
+    EXPECT_EQ(keys, vector<string>({"a", "b"}));
+    wal->AddRecord({Segment("e", "5")});
+  }
+
+  // The discarded records are gone, so writes after the replay aren't cut
+  // off the next time.
+  const auto replayed = ReplayAll();
+  ASSERT_EQ(replayed.size(), 3);
+  EXPECT_EQ(string(replayed[0].key.begin(), replayed[0].key.end()), "a");
+  EXPECT_EQ(string(replayed[1].key.begin(), replayed[1].key.end()), "b");
+  EXPECT_EQ(string(replayed[2].key.begin(), replayed[2].key.end()), "e");
+}
+
+}  // namespace test
+}  // namespace diodb
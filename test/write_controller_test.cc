@@ -0,0 +1,92 @@
+#include <chrono>
+#include <thread>
+
+#include <gflags/gflags.h>
+#include "gtest/gtest.h"
+
+#include "src/write_controller.h"
+
+DECLARE_int32(level0_slowdown_writes_trigger);
+DECLARE_int32(level0_stop_writes_trigger);
+DECLARE_uint64(delayed_write_rate_bytes_per_sec);
+
+namespace diodb {
+namespace test {
+
+class WriteControllerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    FLAGS_level0_slowdown_writes_trigger = 8;
+    FLAGS_level0_stop_writes_trigger = 12;
+    FLAGS_delayed_write_rate_bytes_per_sec = 1024 * 1024;
+  }
+
+  WriteController::Pressure Level0Pressure(size_t num_files) {
+    WriteController::Pressure pressure;
+    pressure.num_level0_files = num_files;
+    return pressure;
+  }
+
+  WriteController controller_;
+};
+
+TEST_F(WriteControllerTest, States) {
+  EXPECT_EQ(controller_.state(), WriteController::State::kNormal);
+
+  controller_.Update(Level0Pressure(7));
+  EXPECT_EQ(controller_.state(), WriteController::State::kNormal);
+
+  controller_.Update(Level0Pressure(9));
+  EXPECT_EQ(controller_.state(), WriteController::State::kDelayed);
+
+  controller_.Update(Level0Pressure(12));
+  EXPECT_EQ(controller_.state(), WriteController::State::kStopped);
+
+  WriteController::Pressure pressure;
+  pressure.pending_flush_bytes = 1ULL << 40;
+  controller_.Update(pressure);
+  EXPECT_EQ(controller_.state(), WriteController::State::kStopped);
+}
+
+TEST_F(WriteControllerTest, DelayedWritesSleep) {
+  controller_.MaybeStall(1024);
+  EXPECT_EQ(controller_.stats().num_delays, 0);
+
+  controller_.Update(Level0Pressure(8));
+  const auto start = std::chrono::steady_clock::now();
+  controller_.MaybeStall(100 * 1024);
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+
+  // 100KiB at 1MiB/s.
+  EXPECT_GE(elapsed, std::chrono::milliseconds(90));
+  EXPECT_EQ(controller_.stats().num_delays, 1);
+  EXPECT_GT(controller_.stats().delay_micros, 0);
+}
+
+TEST_F(WriteControllerTest, StoppedWritesResume) {
+  controller_.Update(Level0Pressure(12));
+
+  std::thread relief([this]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    controller_.Update(Level0Pressure(0));
+  });
+  controller_.MaybeStall(1);
+  relief.join();
+
+  EXPECT_EQ(controller_.stats().num_stops, 1);
+  EXPECT_GT(controller_.stats().stop_micros, 0);
+  EXPECT_EQ(controller_.state(), WriteController::State::kNormal);
+}
+
+TEST_F(WriteControllerTest, Level0TriggersAboveCompactionTrigger) {
+  WriteController::CheckLevel0Triggers(4);
+  EXPECT_DEATH(WriteController::CheckLevel0Triggers(8),
+               "level0_slowdown_writes_trigger");
+
+  FLAGS_level0_slowdown_writes_trigger = 16;
+  EXPECT_DEATH(WriteController::CheckLevel0Triggers(12),
+               "level0_stop_writes_trigger");
+}
+
+}  // namespace test
+}  // namespace diodb